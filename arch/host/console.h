@@ -0,0 +1,33 @@
+// Copyright (c) 2026 Jan Brittenson
+// See LICENSE for details.
+
+#ifndef _CONSOLE_H_
+#define _CONSOLE_H_
+
+#include "arch/host/posix.h"
+
+// Console on a file descriptor.  Writes go straight out, so there is
+// never anything to drain.
+class Console {
+    int _fd;
+public:
+    Console(int fd) : _fd(fd) { }
+
+    // Write buffer
+    void Write(const uint8_t* data, uint len) { HostWrite(_fd, data, len); }
+
+    // Write string
+    void Write(const String& s) { Write(s.CStr(), s.Size()); }
+
+    // Write C string
+    void WriteCStr(const char* s) { Write((const uint8_t*)s, strlen(s)); }
+
+    // For use as trace output
+    void Apply(uint8_t c) { Write(&c, 1); }
+    void Apply(const uint8_t* buf, uint len) { Write(buf, len); }
+    void Apply(const String& s) { Write(s); }
+
+    void SyncDrain() { }
+};
+
+#endif // _CONSOLE_H_
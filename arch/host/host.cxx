@@ -0,0 +1,111 @@
+// Copyright (c) 2026 Jan Brittenson
+// See LICENSE for details.
+
+#include "core/enetkit.h"
+#include "core/thread.h"
+
+
+volatile uint32_t _host_primask = 1; // Reset masked, as startup.s leaves it
+volatile uint32_t _host_basepri;
+volatile uint32_t _host_handler;
+volatile uint32_t _host_pending;
+
+static HostContext* _boot;      // Context of the boot stack
+
+
+// True if an interrupt at IPL ipl can be taken now
+static bool Unmasked(uint ipl)
+{
+    return !_host_primask && !_host_handler && (!_host_basepri || ipl * 8 < _host_basepri);
+}
+
+
+// This is the NVIC and the PendSV handler in nvic_exc.s.  Handlers
+// run on the current thread's stack in place of the exception stack
+// frame.  A thread switched out here resumes here, still in handler
+// mode, so _host_handler is dropped only after the switch; a new
+// thread drops it in ThreadStart().  Called with SIGALRM coming in at
+// any point, and from the SIGALRM handler itself; either way nothing
+// is taken while a handler is running.
+void HostInterrupt()
+{
+    for (;;) {
+        if ((_host_pending & HOST_PEND_TIMER) && Unmasked(IPL_SYSTIMER)) {
+            ++_host_handler;
+            __sync_fetch_and_and(&_host_pending, ~HOST_PEND_TIMER);
+            SysTimer::Interrupt(NULL);
+            --_host_handler;
+        } else if ((_host_pending & HOST_PEND_CSW) && Unmasked(IPL_CSW)) {
+            ++_host_handler;
+            __sync_fetch_and_and(&_host_pending, ~HOST_PEND_CSW);
+
+            // Thread starts with its PcbPrimitive
+            Thread* prev = Thread::GetCurThread();
+            Thread::ContextSwitchHandler(NULL);
+            Thread* next = Thread::GetCurThread();
+
+            if (next != prev)
+                HostSwapContext(((PcbPrimitive*)prev)->ctx, ((PcbPrimitive*)next)->ctx);
+
+            --_host_handler;
+        } else {
+            break;
+        }
+    }
+}
+
+
+static void Alarm()
+{
+    __sync_fetch_and_or(&_host_pending, HOST_PEND_TIMER);
+    HostInterrupt();
+}
+
+
+// New thread, started by the context switch
+struct ThreadStart {
+    void* (*func)(void*);
+    void* arg;
+    void (*ret)();
+
+    static void Run(void* arg) {
+        const ThreadStart& ts = *(const ThreadStart*)arg;
+
+        // Return from PendSV
+        --_host_handler;
+
+        ts.func(ts.arg);
+        ts.ret();
+    }
+};
+
+
+void HostInitContext(PcbPrimitive& pcb, void* stack, uint size, void* (*func)(void*),
+                     void* arg, void (*ret)())
+{
+    // The start arguments go at the top, the context below them
+    const uintptr_t top = ((uintptr_t)stack + size - sizeof (ThreadStart)) & ~uintptr_t(15);
+
+    ThreadStart* ts = (ThreadStart*)top;
+    ts->func = func;
+    ts->arg = arg;
+    ts->ret = ret;
+
+    pcb.ctx = HostMakeContext(stack, top - (uintptr_t)stack, ThreadStart::Run, ts);
+}
+
+
+void HostStrap(PcbPrimitive& pcb)
+{
+    assert(_boot);
+    pcb.ctx = _boot;
+}
+
+
+void HostBoot(void* top, uint size, void (*entry)(void*))
+{
+    HostInitSignals(Alarm);
+
+    _boot = HostMakeContext((uint8_t*)top - size, size, entry, NULL);
+    HostSetContext(_boot);
+}
@@ -0,0 +1,168 @@
+// Copyright (c) 2026 Jan Brittenson
+// See LICENSE for details.
+
+#ifndef _HOST_H_
+#define _HOST_H_
+
+// For the assert in core/bits.h
+static inline bool InExceptionHandler();
+
+#include "core/bits.h"
+#include "arch/host/posix.h"
+
+// Runs enetcore as a single POSIX process, for tests and benchmarks.
+// Threads are contexts switched in user space.  The interrupt mask,
+// BASEPRI and handler mode of the Cortex-M are kept in variables, and
+// two interrupts are emulated: the scheduler timer, which is SIGALRM,
+// and PendSV, which switches threads.  One that comes in while it's
+// masked is left pending and taken when it's unmasked, as on the
+// NVIC.  Nothing else interrupts.
+
+enum {
+    HOST_STACK_MIN = 65536      // Least thread stack; signal frames and libc
+};
+
+// Pending interrupts
+enum {
+    HOST_PEND_TIMER = 1,
+    HOST_PEND_CSW = 2
+};
+
+extern volatile uint32_t _host_primask; // Interrupts masked
+extern volatile uint32_t _host_basepri; // As the register: IPL * 8, 0 for none
+extern volatile uint32_t _host_handler; // Handler nesting depth
+extern volatile uint32_t _host_pending; // HOST_PEND_*
+
+// Take pending interrupts, unless masked
+void HostInterrupt();
+
+[[__finline]] static inline void __barrier() {
+    asm volatile("" : : : "memory");
+}
+
+[[__finline]] static inline void __dsb() { __sync_synchronize(); }
+[[__finline]] static inline void __isb() { __barrier(); }
+[[__finline]] static inline void __dmb() { __sync_synchronize(); }
+
+// No sleeping: a thread switched back in would wait for the next
+// timer before it noticed.  The idle loop spins instead.
+static inline void WaitForInterrupt() {
+}
+
+static inline uint32_t DisableInterrupts() {
+    const uint32_t prev = _host_primask;
+    _host_primask = 1;
+    __barrier();
+    return prev;
+}
+
+static inline void RestoreInterrupts(uint prev) {
+    __barrier();
+    _host_primask = prev & 1;
+    if (!_host_primask && _host_pending)
+        HostInterrupt();
+}
+
+[[__finline]] static inline void EnableInterrupts() {
+    RestoreInterrupts(0);
+}
+
+// Set current IPL, returning previous
+static inline uint32_t SetIPL(uint32_t ipl) {
+    const uint32_t prev = _host_basepri;
+    _host_basepri = (ipl % 32) * 8;
+    __barrier();
+    if (_host_pending)
+        HostInterrupt();
+    return prev;
+}
+
+// Return current IPL
+static inline uint32_t GetIPL() {
+    return _host_basepri / 8;
+}
+
+// Test if interrupts are enabled
+static inline bool IntEnabled() {
+    return !_host_primask;
+}
+
+// True if in an exception handler
+static inline bool InExceptionHandler() {
+    return _host_handler != 0;
+}
+
+// Post PendSV
+static inline void PostContextSwitch() {
+    __sync_fetch_and_or(&_host_pending, HOST_PEND_CSW);
+    HostInterrupt();
+}
+
+// FP state is the host's own, switched with the rest of the context
+struct FPState {
+};
+
+static inline void StoreFP(FPState*) { }
+static inline void LoadFP(FPState*) { }
+
+// RAII reentrant version of interrupt masking
+class ScopedNoInt {
+    uint32_t _save;
+public:
+    ScopedNoInt() {
+        _save = DisableInterrupts();
+    }
+    ~ScopedNoInt() {
+        RestoreInterrupts(_save);
+    }
+    void Reacquire() {
+        DisableInterrupts();
+    }
+    void Lock() {
+        DisableInterrupts();
+    }
+    void Unlock() {
+        RestoreInterrupts(_save);
+    }
+};
+
+//// Thread support
+
+// Structure included by Thread to use to store context.  The context
+// itself is at the top of the thread's stack.
+struct PcbPrimitive {
+    HostContext* ctx;
+};
+
+// Set up a new thread's context to call func(arg), then ret
+void HostInitContext(PcbPrimitive& pcb, void* stack, uint size, void* (*func)(void*),
+                     void* arg, void (*ret)());
+
+// Hand the boot context over to the thread bootstrapped on it
+void HostStrap(PcbPrimitive& pcb);
+
+// Called by the project's startup in place of main().  Runs entry on
+// a stack of size bytes ending at top, with SIGALRM taken as the
+// timer interrupt.
+[[noreturn]] void HostBoot(void* top, uint size, void (*entry)(void*));
+
+// Return current SP, for various debug purposes
+#define GetSP(SP)                                                       \
+    ((SP) = __builtin_frame_address(0))
+
+// The boot stack becomes the main thread's.  Handlers run on the
+// stack of whichever thread they interrupt, so there's no separate
+// interrupt stack.
+#define StackStrap(INTR_TOS)                                            \
+    HostStrap(_curthread->_pcb)
+
+// Cache alignment expansion
+enum { CACHE_LINE_SIZE = 64 };
+
+// Host caches are coherent
+static inline void flush_dcache(const void*, uint32_t) { }
+static inline void invalidate_dcache(const void*, uint32_t) { }
+static inline void invalidate_icache() { }
+static inline void invalidate_dcache() { }
+
+#endif // _HOST_H_
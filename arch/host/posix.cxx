@@ -0,0 +1,191 @@
+// Copyright (c) 2026 Jan Brittenson
+// See LICENSE for details.
+
+// Host OS glue.  No enetcore headers here; see posix.h.
+
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+#include <ucontext.h>
+#include <unistd.h>
+#include <new>
+
+#include "arch/host/posix.h"
+
+
+struct HostContext {
+    ucontext_t uc;
+    void (*entry)(void*);
+    void* arg;
+};
+
+
+struct HostThread {
+    pthread_t tid;
+    void (*func)(void*);
+    void* arg;
+};
+
+
+uint64_t HostClock()
+{
+    static struct timespec start;
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    if (!start.tv_sec && !start.tv_nsec)
+        start = ts;
+
+    return uint64_t(ts.tv_sec - start.tv_sec) * 1000000000 + ts.tv_nsec - start.tv_nsec;
+}
+
+
+void HostSetAlarm(uint64_t usec)
+{
+    struct itimerval it;
+    memset(&it, 0, sizeof it);
+    it.it_value.tv_sec = usec / 1000000;
+    it.it_value.tv_usec = usec % 1000000;
+    setitimer(ITIMER_REAL, &it, NULL);
+}
+
+
+static void (*_alarm_func)();
+
+static void AlarmHandler(int)
+{
+    _alarm_func();
+}
+
+
+void HostInitSignals(void (*func)())
+{
+    _alarm_func = func;
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof sa);
+    sa.sa_handler = AlarmHandler;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGALRM, &sa, NULL);
+}
+
+
+void HostWrite(int fd, const void* buf, uint32_t len)
+{
+    const uint8_t* p = (const uint8_t*)buf;
+    while (len) {
+        const ssize_t n = write(fd, p, len);
+        if (n <= 0)
+            return;
+        p += n;
+        len -= n;
+    }
+}
+
+
+void HostExit(int status)
+{
+    _exit(status);
+}
+
+
+// makecontext() only passes ints, so the entry point and its
+// argument are left in the context
+static void Start(uint32_t hi, uint32_t lo)
+{
+    HostContext* ctx = (HostContext*)(((uintptr_t)hi << 32) | lo);
+    ctx->entry(ctx->arg);
+    abort();
+}
+
+
+HostContext* HostMakeContext(void* stack, uint32_t size, void (*entry)(void*), void* arg)
+{
+    const uintptr_t top = ((uintptr_t)stack + size - sizeof (HostContext)) & ~uintptr_t(15);
+    HostContext* ctx = new ((void*)top) HostContext;
+
+    getcontext(&ctx->uc);
+    ctx->uc.uc_stack.ss_sp = stack;
+    ctx->uc.uc_stack.ss_size = top - (uintptr_t)stack;
+    ctx->uc.uc_link = NULL;
+    ctx->entry = entry;
+    ctx->arg = arg;
+
+    // Start with SIGALRM open, whatever the creator had
+    sigemptyset(&ctx->uc.uc_sigmask);
+
+    makecontext(&ctx->uc, (void (*)())Start, 2, uint32_t((uintptr_t)ctx >> 32),
+                uint32_t((uintptr_t)ctx));
+    return ctx;
+}
+
+
+void HostSwapContext(HostContext* from, HostContext* to)
+{
+    swapcontext(&from->uc, &to->uc);
+}
+
+
+void HostSetContext(HostContext* ctx)
+{
+    setcontext(&ctx->uc);
+    abort();
+}
+
+
+static void* ThreadMain(void* arg)
+{
+    HostThread* t = (HostThread*)arg;
+    t->func(t->arg);
+    return NULL;
+}
+
+
+HostThread* HostStartThread(void (*func)(void*), void* arg)
+{
+    HostThread* t = (HostThread*)malloc(sizeof (HostThread));
+    if (!t)
+        return NULL;
+
+    t->func = func;
+    t->arg = arg;
+
+    // The new thread inherits the mask, so SIGALRM always lands on
+    // the one running the scheduler
+    sigset_t all, prev;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &prev);
+    const int err = pthread_create(&t->tid, NULL, ThreadMain, t);
+    pthread_sigmask(SIG_SETMASK, &prev, NULL);
+
+    if (err) {
+        free(t);
+        return NULL;
+    }
+    return t;
+}
+
+
+void HostYield()
+{
+    sched_yield();
+}
+
+
+void HostJoinThread(HostThread* t)
+{
+    sigset_t alrm, prev;
+    sigemptyset(&alrm);
+    sigaddset(&alrm, SIGALRM);
+    pthread_sigmask(SIG_BLOCK, &alrm, &prev);
+    pthread_join(t->tid, NULL);
+    pthread_sigmask(SIG_SETMASK, &prev, NULL);
+
+    free(t);
+}
@@ -0,0 +1,55 @@
+// Copyright (c) 2026 Jan Brittenson
+// See LICENSE for details.
+
+#ifndef __POSIX_H__
+#define __POSIX_H__
+
+#include <stdint.h>
+
+// Thin layer over the host OS.  posix.cxx is the only file that sees
+// the system headers, which clash with enetcore's own libc
+// replacements, so everything else goes through these.  Only plain
+// types cross over.
+
+struct HostContext;             // A ucontext_t and its entry point
+struct HostThread;              // An OS thread
+
+// Monotonic clock, in nsec since the first call
+uint64_t HostClock();
+
+// Raise SIGALRM in usec; 0 cancels
+void HostSetAlarm(uint64_t usec);
+
+// Call func from the SIGALRM handler
+void HostInitSignals(void (*func)());
+
+// Write len bytes to a file descriptor
+void HostWrite(int fd, const void* buf, uint32_t len);
+
+[[noreturn]] void HostExit(int status);
+
+// Set up a context to run entry(arg) on a stack.  The context is
+// kept at the top of the stack.
+HostContext* HostMakeContext(void* stack, uint32_t size, void (*entry)(void*), void* arg);
+
+// Save the current context in from and resume to
+void HostSwapContext(HostContext* from, HostContext* to);
+
+// Start running ctx, never to return
+[[noreturn]] void HostSetContext(HostContext* ctx);
+
+// Run func(arg) on an OS thread of its own, truly concurrent with
+// the rest of the process, for testing lock-free code.  It's outside
+// the scheduler and has every signal blocked, so it must stay clear
+// of the kernel: no locks, threads, allocation or console.
+HostThread* HostStartThread(void (*func)(void*), void* arg);
+
+// Let other OS threads run; for spinning on a host with fewer CPUs
+// than spinners
+void HostYield();
+
+// Wait for func to return, and reap the thread.  The timer is held
+// off meanwhile, so no other thread runs.
+void HostJoinThread(HostThread* t);
+
+#endif // __POSIX_H__
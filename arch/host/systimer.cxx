@@ -0,0 +1,20 @@
+// Copyright (c) 2026 Jan Brittenson
+// See LICENSE for details.
+
+#include "core/enetkit.h"
+#include "arch/host/systimer.h"
+
+
+void SysTimer::SetTimer(uint32_t usec) {
+    HostSetAlarm(usec);
+}
+
+
+void SysTimer::Interrupt(void*) {
+    Thread::TimerInterrupt();
+}
+
+
+uint64_t Clock::GetTime() {
+    return HostClock() / 1000 * TIMEBASE / 1000000;
+}
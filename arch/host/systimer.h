@@ -0,0 +1,31 @@
+// Copyright (c) 2026 Jan Brittenson
+// See LICENSE for details.
+
+#ifndef _SYSTIMER_H_
+#define _SYSTIMER_H_
+
+#include "arch/host/posix.h"
+
+// Scheduler timer.  One shot, as SysTick is used; it raises SIGALRM,
+// which HostInterrupt() takes as the timer interrupt.
+class SysTimer {
+public:
+    SysTimer() { }
+
+    static void Interrupt(void*);
+    void SetTimer(uint32_t usec);
+};
+
+
+// System clock, off the host's monotonic clock.  Starts at 0.
+class Clock {
+public:
+    Clock() { }
+
+    void Start() { HostClock(); }
+
+    // In TIMEBASE units
+    uint64_t GetTime();
+};
+
+#endif // _SYSTIMER_H_
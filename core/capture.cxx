@@ -0,0 +1,283 @@
+// Copyright (c) 2018-2021 Jan Brittenson
+// See LICENSE for details.
+
+#ifdef ENABLE_IP
+
+#include "core/enetkit.h"
+#include "core/capture.h"
+#include "core/ip.h"
+#include "core/udp.h"
+#include "core/pcap.h"
+#include "core/file.h"
+
+
+Capture _capture;
+
+Capture::Capture()
+	: _active(false),
+	  _ring(NULL),
+	  _slots(0),
+	  _slotsize(0),
+	  _snaplen(0),
+	  _first(0),
+	  _count(0),
+	  _filter(),
+	  _stats()
+{
+}
+
+
+bool Capture::Start(uint slots, uint snaplen)
+{
+	if (!slots || !snaplen || snaplen > 0xffff)
+		return false;
+
+	Mutex::Scoped L(_lock);
+
+	const uint slotsize = (sizeof (Slot) + snaplen + 3) & ~3;
+
+	if (!_ring || slots != _slots || slotsize != _slotsize) {
+		if (_ring)
+			xfree(_ring);
+
+		_ring = (uint8_t*)xmalloc(slots * slotsize);
+		_slots = slots;
+		_slotsize = slotsize;
+		_first = 0;
+		_count = 0;
+	}
+
+	_snaplen = snaplen;
+	_active = true;
+	return true;
+}
+
+
+void Capture::SetFilter(const Filter& filter)
+{
+	Mutex::Scoped L(_lock);
+	_filter = filter;
+}
+
+
+void Capture::Clear()
+{
+	Mutex::Scoped L(_lock);
+	_first = 0;
+	_count = 0;
+}
+
+
+bool Capture::Match(const IOBuffer* buf, Dir dir) const
+{
+	_lock.AssertLocked();
+
+	const Filter& f = _filter;
+
+	if (f.dir && !(f.dir & dir))
+		return false;
+
+	if (!f.ethertype && !f.proto && !f.port && !f.host)
+		return true;
+
+	// Headers are looked for in the first buffer only
+	const uint8_t* frame = *buf + 0;
+	const uint size = buf->Size();
+
+	if (size < 14)
+		return false;
+
+	const uint et = (frame[12] << 8) | frame[13];
+	if (f.ethertype && et != f.ethertype)
+		return false;
+
+	if (!f.proto && !f.port && !f.host)
+		return true;
+
+	if (et != ETHERTYPE_IP || size < 14 + sizeof (Iph))
+		return false;
+
+	const Iph& iph = *(const Iph*)(frame + 14);
+	if (f.proto && iph.proto != f.proto)
+		return false;
+
+	if (f.host && iph.source != f.host && iph.dest != f.host)
+		return false;
+
+	if (f.port) {
+		// Ports are only in the first fragment
+		if ((iph.proto != IPPROTO_UDP && iph.proto != IPPROTO_TCP) || iph.GetOffset())
+			return false;
+
+		const uint hlen = iph.GetHLen();
+		if (size < 14 + hlen + 4)
+			return false;
+
+		const uint8_t* th = frame + 14 + hlen;
+		const uint sport = (th[0] << 8) | th[1];
+		const uint dport = (th[2] << 8) | th[3];
+		if (sport != f.port && dport != f.port)
+			return false;
+	}
+
+	return true;
+}
+
+
+void Capture::Record(const IOBuffer* buf, Dir dir)
+{
+	Mutex::Scoped L(_lock);
+
+	if (!_active)
+		return;
+
+	if (!Match(buf, dir)) {
+		++_stats.filtered;
+		return;
+	}
+
+	if (_count == _slots) {
+		_first = (_first + 1) % _slots;
+		--_count;
+		++_stats.overwritten;
+	}
+
+	uint8_t* p = _ring + ((_first + _count) % _slots) * _slotsize;
+	Slot& slot = *(Slot*)p;
+
+	const uint len = buf->ChainSize();
+	slot.ts = Time::Now();
+	slot.len = len;
+	slot.incl = min(len, _snaplen);
+	slot.dir = dir;
+
+	uint8_t* dest = p + sizeof (Slot);
+	uint left = slot.incl;
+	for (const IOBuffer* b = buf; b && left; b = b->GetNext()) {
+		const uint n = min(b->Size(), left);
+		memcpy(dest, *b + 0, n);
+		dest += n;
+		left -= n;
+	}
+
+	++_count;
+	++_stats.captured;
+}
+
+
+bool Capture::Pop(Slot& slot, uint8_t* data, uint room)
+{
+	Mutex::Scoped L(_lock);
+
+	if (!_count)
+		return false;
+
+	const uint8_t* p = _ring + _first * _slotsize;
+	slot = *(const Slot*)p;
+	slot.incl = min<uint>(slot.incl, room);
+	memcpy(data, p + sizeof (Slot), slot.incl);
+
+	_first = (_first + 1) % _slots;
+	--_count;
+	return true;
+}
+
+
+bool Capture::Drain(PcapWriter& pcap)
+{
+	uint room;
+	uint num;
+	{
+		Mutex::Scoped L(_lock);
+		room = _snaplen;
+		num = _count;
+	}
+
+	// Frames are copied out one at a time, so the taps aren't held
+	// up while the file is written
+	uint8_t* data = (uint8_t*)xmalloc(room);
+	Slot slot;
+	while (num-- && Pop(slot, data, room))
+		pcap.Write(data, slot.incl, slot.ts, slot.len);
+
+	xfree(data);
+	return !pcap.GetErrors();
+}
+
+
+bool Capture::Save(File* file)
+{
+	PcapWriter pcap;
+	if (!pcap.Open(file, _snaplen))
+		return false;
+
+	const bool ok = Drain(pcap);
+	pcap.Close();
+	return ok;
+}
+
+
+// Collects what a PcapWriter writes and sends it on in datagrams of
+// up to CHUNK bytes.  Only writing is supported.
+class DatagramFile: public File {
+	enum { CHUNK = 1024 };
+
+	UdpCoreSocket* _sock;
+	NetAddr _dest;
+	uint8_t* _buf;
+	uint _len;
+	bool _ok;
+
+public:
+	DatagramFile(UdpCoreSocket* sock, const NetAddr& dest)
+		: _sock(sock), _dest(dest), _buf((uint8_t*)xmalloc(CHUNK)), _len(0), _ok(true) { }
+	~DatagramFile() { xfree(_buf); }
+
+	uint32_t GetSize() const { return 0; }
+	bool Seek(filepos_t) { return false; }
+	filepos_t Tell() const { return 0; }
+	uint Read(void*, uint) { return 0; }
+	uint Read(Deque<uint8_t>&, uint) { return 0; }
+	void Close() { }
+
+	uint Write(const void* data, uint numbytes) {
+		const uint8_t* src = (const uint8_t*)data;
+		for (uint left = numbytes; left; ) {
+			if (_len == CHUNK)
+				Flush();
+
+			const uint n = min<uint>(left, CHUNK - _len);
+			memcpy(_buf + _len, src, n);
+			_len += n;
+			src += n;
+			left -= n;
+		}
+		return numbytes;
+	}
+
+	// Send what has been collected.  Returns false if anything
+	// failed to go out.
+	bool Flush() {
+		if (_len && !_sock->SendTo(_buf, _len, _dest))
+			_ok = false;
+		_len = 0;
+		return _ok;
+	}
+};
+
+
+bool Capture::Send(UdpCoreSocket* sock, const NetAddr& dest)
+{
+	assert(sock);
+
+	DatagramFile out(sock, dest);
+	PcapWriter pcap;
+
+	pcap.Open(&out, _snaplen);
+	Drain(pcap);
+	pcap.Close();
+
+	return out.Flush();
+}
+
+#endif // ENABLE_IP
@@ -0,0 +1,136 @@
+// Copyright (c) 2018-2021 Jan Brittenson
+// See LICENSE for details.
+
+#ifndef __CAPTURE_H__
+#define __CAPTURE_H__
+
+#ifdef ENABLE_IP
+
+#include "core/network.h"
+#include "core/mutex.h"
+#include "core/time.h"
+#include "core/netaddr.h"
+
+
+class File;
+class PcapWriter;
+class UdpCoreSocket;
+
+// Tuning
+enum {
+	CAPTURE_SLOTS = 64,			// Frames kept by default
+	CAPTURE_SNAPLEN = 128		// Bytes kept per frame by default
+};
+
+// In-memory packet capture.  The network thread taps received frames
+// and the Ethernet drivers frames sent; frames passing the filter
+// are copied, truncated to the snap length and timestamped, into a
+// fixed ring of slots.  When the ring is full the oldest frame is
+// overwritten, so it always holds the most recent traffic.
+//
+// The ring can be written out as a pcap file, or streamed as one in
+// datagrams to e.g. "socat -u UDP-RECV:port - > cap.pcap".  Both
+// empty the ring as they go.
+//
+// When not started, a tap costs the test of one flag.
+class Capture {
+public:
+	enum Dir {
+		DIR_RX = 1,
+		DIR_TX = 2
+	};
+
+	// Frames to keep.  Fields are ANDed; 0 matches anything.
+	struct Filter {
+		uint16_t ethertype;		// ETHERTYPE_xxx
+		uint8_t proto;			// IPPROTO_xxx; IPv4 only
+		uint8_t dir;			// Mask of DIR_xxx
+		uint16_t port;			// UDP or TCP source or dest port, host order
+		in_addr_t host;			// IPv4 source or dest, network order
+	};
+
+	struct Stats {
+		uint32_t captured;		// Frames copied into the ring
+		uint32_t filtered;		// Frames the filter turned down
+		uint32_t overwritten;	// Frames lost to newer ones
+	};
+
+private:
+	// Each slot is a header followed by up to _snaplen bytes of frame
+	struct Slot {
+		Time ts;
+		uint16_t len;			// Frame length on the wire
+		uint16_t incl;			// Bytes kept
+		uint8_t dir;			// DIR_xxx
+	};
+
+	volatile bool _active;
+	mutable Mutex _lock;
+	uint8_t* _ring;
+	uint _slots;
+	uint _slotsize;
+	uint _snaplen;
+	uint _first;				// Oldest frame
+	uint _count;				// Frames in ring
+	Filter _filter;
+	Stats _stats;
+
+public:
+	Capture();
+
+	// Allocate a ring of slots frames of snaplen bytes each and
+	// start capturing into it.  Frames from an earlier ring of the
+	// same size are kept.
+	bool Start(uint slots = CAPTURE_SLOTS, uint snaplen = CAPTURE_SNAPLEN);
+
+	// Stop capturing; the ring keeps what it has
+	void Stop() { _active = false; }
+
+	[[__finline]] bool IsActive() const { return _active; }
+
+	// Set filter, replacing the previous one
+	void SetFilter(const Filter& filter);
+
+	// Drop all captured frames
+	void Clear();
+
+	// Record frame if capturing.  Head of buf must be at the
+	// destination MAC address.
+	[[__finline]] void Tap(const IOBuffer* buf, Dir dir) {
+		if (_active)
+			Record(buf, dir);
+	}
+
+	// Write captured frames, oldest first, to file as a pcap capture.
+	// Returns false on a write error.
+	bool Save(File* file);
+
+	// Stream captured frames, oldest first, to dest in pcap format.
+	// The stream starts with a pcap file header, so the datagrams
+	// concatenated make a capture file.  Returns false if a datagram
+	// couldn't be sent.
+	bool Send(UdpCoreSocket* sock, const NetAddr& dest);
+
+	Stats GetStats() const { Mutex::Scoped L(_lock); return _stats; }
+
+private:
+	void Record(const IOBuffer* buf, Dir dir);
+	bool Match(const IOBuffer* buf, Dir dir) const;
+
+	// Copy out and remove oldest frame, up to room bytes of it.
+	// Returns false if none.
+	bool Pop(Slot& slot, uint8_t* data, uint room);
+
+	// Write the frames captured so far to pcap, removing them.
+	// Frames captured while this is going on are left for next time.
+	bool Drain(PcapWriter& pcap);
+
+	Capture(const Capture&);
+	Capture& operator=(const Capture&);
+};
+
+extern Capture _capture;
+
+#endif // ENABLE_IP
+
+#endif // __CAPTURE_H__
@@ -28,6 +28,7 @@ public:
 	~Deque() { };
 
 	uint Headroom() const { return _v.Headroom() + _head; }
+	uint GetHead() const { return _head; }
 
 	void Compact() {
 		if (_head) {
@@ -9,6 +9,7 @@
 #include "core/udp.h"
 #include "core/util.h"
 #include "core/dns.h"
+#include "core/netstats.h"
 
 
 Dhcp _dhcp0(_eth0, _ip0, _dns0);
@@ -18,7 +19,14 @@ static const uint8_t dhcp_magic[] = { 0x63, 0x82, 0x53, 0x63 };
 Dhcp::Dhcp(Ethernet& netif, Ip& ip, Dns& dns) :
 	_netif(netif),
 	_ip(ip),
-	_dns(dns)
+	_dns(dns),
+	_lease_time(0),
+	_ifaddr(INADDR_ANY),
+	_ifmask(INADDR_ANY),
+	_ifgw(INADDR_ANY),
+	_store(NULL),
+	_saved(false),
+	_saved_crc(0)
 {
 }
 
@@ -27,12 +35,177 @@ void Dhcp::Reset()
 {
 	Mutex::Scoped L(_lock);
 
+	_backoff = 1;
+	_start = Time::Now();
+
+	if (LoadLease()) {
+		Reboot();
+		return;
+	}
+
+	_state = STATE_RESET;
+	SendDiscover();
+}
+
+
+void Dhcp::StartOver()
+{
+	_lock.AssertLocked();
+
+	Unconfigure();
+	ForgetLease();
+
 	_state = STATE_RESET;
 	_backoff = 1;
 	SendDiscover();
 }
 
 
+void Dhcp::Reboot()
+{
+	_lock.AssertLocked();
+
+	// Use the address while the server confirms it, and have anyone
+	// else using it speak up (RFC 5227)
+	Configure();
+	_ip.ProbeARP(_netif, _lease);
+	_probe_end = Time::Now() + Time::FromMsec(PROBE_WAIT);
+
+	const NetAddr addr(_lease, 0);
+	console("DHCP: using saved lease %a (%u ms)", &addr,
+			(uint)(Time::Now() - _start).GetMsec());
+
+	if (!_xid)
+		_xid = Util::Random<uint32_t>();
+
+	_state = STATE_REBOOT;
+	_offer_xid = _xid;
+	_first_request = Time::Now();
+	SendRequest();
+}
+
+
+void Dhcp::Configure()
+{
+	_lock.AssertLocked();
+
+	if (_lease != _ifaddr || _netmask != _ifmask || _gw != _ifgw) {
+		// Replaces the previous address and routes
+		_ip.AddInterface(_netif, _lease, _netmask);
+		if (_gw != INADDR_ANY)
+			_ip.AddDefaultRoute(_netif, _gw);
+
+		_ifaddr = _lease;
+		_ifmask = _netmask;
+		_ifgw = _gw;
+	}
+
+	_dns.SetDomain(_domain);
+	_dns.SetNS(_ns);
+}
+
+
+void Dhcp::Unconfigure()
+{
+	_lock.AssertLocked();
+
+	if (_ifaddr == INADDR_ANY)
+		return;
+
+	_ip.RemoveInterface(_netif);
+	_ifaddr = INADDR_ANY;
+	_ifmask = INADDR_ANY;
+	_ifgw = INADDR_ANY;
+	_probe_end = Time();
+}
+
+
+// * static
+uint32_t Dhcp::LeaseCrc(const SavedLease& sl)
+{
+	const uint32_t* words = (const uint32_t*)&sl;
+	const uint nwords = offsetof(SavedLease, crc) / sizeof (uint32_t);
+
+	// The hardware CRC counts words, the software one bytes
+#ifdef HAVE_HW_CRC
+	return Crc32::Checksum(words, nwords);
+#else
+	return Crc32::Checksum(words, nwords * sizeof (uint32_t));
+#endif
+}
+
+
+bool Dhcp::LoadLease()
+{
+	_lock.AssertLocked();
+
+	SavedLease sl;
+	if (!_store || !_store->Load(&sl, sizeof sl))
+		return false;
+
+	if (sl.magic != LEASE_MAGIC || LeaseCrc(sl) != sl.crc ||
+		memcmp(sl.mac, _netif.GetMacAddr(), sizeof sl.mac) || sl.addr == INADDR_ANY)
+		return false;
+
+	_lease = sl.addr;
+	_netmask = sl.netmask;
+	_gw = sl.gw;
+	_ns = sl.ns;
+	_server = sl.server;
+	_lease_time = sl.lease_time;
+	_domain = String(sl.domain, min<uint>(sl.domain_len, sizeof sl.domain));
+	_saved = true;
+	_saved_crc = sl.crc;
+	return true;
+}
+
+
+void Dhcp::SaveLease()
+{
+	_lock.AssertLocked();
+
+	if (!_store)
+		return;
+
+	SavedLease sl;
+	memset(&sl, 0, sizeof sl);
+	sl.magic = LEASE_MAGIC;
+	memcpy(sl.mac, _netif.GetMacAddr(), sizeof sl.mac);
+	sl.addr = _lease;
+	sl.netmask = _netmask;
+	sl.gw = _gw;
+	sl.ns = _ns;
+	sl.server = _server;
+	sl.lease_time = _lease_time;
+	sl.domain_len = min<uint>(_domain.Size(), sizeof sl.domain);
+	memcpy(sl.domain, _domain.CStr(), sl.domain_len);
+	sl.crc = LeaseCrc(sl);
+
+	// Renewals mostly leave it as it was; spare the EEPROM
+	if (_saved && sl.crc == _saved_crc)
+		return;
+
+	if (_store->Save(&sl, sizeof sl)) {
+		_saved = true;
+		_saved_crc = sl.crc;
+	}
+}
+
+
+void Dhcp::ForgetLease()
+{
+	_lock.AssertLocked();
+
+	if (!_store || !_saved)
+		return;
+
+	SavedLease sl;
+	memset(&sl, 0, sizeof sl);
+	if (_store->Save(&sl, sizeof sl))
+		_saved = false;
+}
+
+
 bool Dhcp::Receive(IOBuffer* buf)
 {
     //DMSG("DHCP: Receive");
@@ -68,6 +241,7 @@ bool Dhcp::Receive(IOBuffer* buf)
 				break;
 
 			DMSG("DHCP: Received DHCPOFFER");
+			NetStats::Inc(_netstats.dhcp.in_offers);
 
 			_server = server;
 			_lease = pkt->yiaddr;
@@ -78,23 +252,24 @@ bool Dhcp::Receive(IOBuffer* buf)
 			SendRequest();
 			break;
 
-		case STATE_REQUEST: {
+		case STATE_REQUEST:
+		case STATE_REBOOT: {
 			if (msg != DHCPACK) {
 				if (msg == DHCPNACK) {
 					DMSG("DHCP: Received DHCPNACK, resetting");
-					Reset();
+					NetStats::Inc(_netstats.dhcp.in_naks);
+					StartOver();
 				}
 				break;
 			}
 
 			DMSG("DHCP: Received DHCPACK");
+			NetStats::Inc(_netstats.dhcp.in_acks);
 
 			// Extract config info
-			const in_addr_t prev_lease = _lease;
-			const in_addr_t prev_mask = _netmask;
-			const in_addr_t prev_gw = _gw;
-
 			_lease = pkt->yiaddr;
+			if (server != INADDR_ANY)
+				_server = server;
 
 			buf->SetHead(_netif.GetPrealloc());
 			Extract(pkt->options, buf->Size() - offsetof(Packet, options));
@@ -107,19 +282,13 @@ bool Dhcp::Receive(IOBuffer* buf)
 			const NetAddr gw(_gw, 0);
 			const NetAddr dns(_ns, 0);
 			const uint expire = (_renew - Time::Now()).GetSec();
-			console("DHCP: addr %a/%a  gw %a", &addr, &mask, &gw);
+			console("DHCP: addr %a/%a  gw %a (%u ms)", &addr, &mask, &gw,
+					(uint)(Time::Now() - _start).GetMsec());
 			console("DHCP: name server %a, domain \"%S\"", &dns, &_domain);
 			DMSG("DHCP: ttl %u sec", expire);
 
-			if (_lease != prev_lease || _netmask != prev_mask || _gw != prev_gw) {
-				_ip.RemoveInterface(_netif);
-				//_ip.AddInterface(_netif, _lease, _netmask);
-				//_ip.AddDefaultRoute(_netif, _gw);
-			}
-
-			_dns.SetDomain(_domain);
-			_dns.SetNS(_ns);
-
+			Configure();
+			SaveLease();
 			break;
 		}
 		default:
@@ -135,13 +304,16 @@ Time Dhcp::GetServiceTime()
 {
 	Mutex::Scoped L(_lock);
 
+	const Time probe = _probe_end != Time() ? _probe_end : Time::InfTim;
+
 	switch (_state) {
 	case STATE_RESET:
 	case STATE_DISCOVER:
 	case STATE_REQUEST:
-		return _rexmit;
+	case STATE_REBOOT:
+		return min(_rexmit, probe);
 	case STATE_CONFIGURED:
-		return _renew;
+		return min(_renew, probe);
 	}
 
 	return Time::Now() + Time::FromSec(120);
@@ -159,7 +331,31 @@ Time Dhcp::Service()
         return GetServiceTime();
     }
 
+	// Anyone answering the probe for a saved address has it too
+	if (_probe_end != Time() && Time::Now() >= _probe_end) {
+		_probe_end = Time();
+		if (_ip.TakeConflict(_ifaddr)) {
+			const NetAddr addr(_ifaddr, 0);
+			console("DHCP: %a in use by another host", &addr);
+			StartOver();
+			return GetServiceTime();
+		}
+	}
+
 	switch (_state) {
+	case STATE_REBOOT:
+		if (_backoff < REBOOT_BACKOFF) {
+			SendRequest();
+			break;
+		}
+
+		// No server answering.  Keep using the address (RFC 2131
+		// 3.2) while looking for one.
+		_backoff = 1;
+		_state = STATE_DISCOVER;
+		SendDiscover();
+		break;
+
 	case STATE_CONFIGURED:
 		if (Time::Now() < _renew)
 			break;
@@ -167,6 +363,7 @@ Time Dhcp::Service()
 		// Request extension
 		_state = STATE_REQUEST;
 		_backoff = 1;
+		_first_request = Time::Now();
 
 		// fallthrough
 	case STATE_REQUEST:
@@ -205,7 +402,7 @@ void Dhcp::LinkRecovered()
 
 IOBuffer* Dhcp::AllocPacket()
 {
-	IOBuffer* buf = BufferPool::AllocTx();
+	IOBuffer* buf = BufferPool::AllocTx(_netif.GetPrealloc() + sizeof (Packet));
 	if (!buf) 
         return NULL;
 
@@ -265,6 +462,7 @@ void Dhcp::SendDiscover()
 
 	// Hand over packet to MAC
 	DMSG("DHCP: broadcasting DHCPDISCOVER");
+	NetStats::Inc(_netstats.dhcp.out_discovers);
 	_netif.Send(buf);
 
 	Backoff();					// Update rexmit timer
@@ -275,13 +473,15 @@ void Dhcp::SendRequest()
 {
 	_lock.AssertLocked();
 
+	// The server id goes last, to be left out in INIT-REBOOT
+	enum { REQ_IP = 9, SERVER = 25 };
 	static const uint8_t request[] = {
 		0x63, 0x82, 0x53, 0x63,
 		TAG_DHCP_MSGTYPE, 1, DHCPREQUEST,
-		TAG_DHCP_SERVER, 4, 0, 0, 0, 0,
 		TAG_DHCP_REQ_IP, 4, 0, 0, 0, 0,
 		TAG_DHCP_PARAM_REQ, 4, TAG_SUBNET, TAG_GW, TAG_NS, TAG_DOMAIN,
 		TAG_DHCP_MAX_SIZE, 2, 0x05, 0xdc,
+		TAG_DHCP_SERVER, 4, 0, 0, 0, 0,
 		TAG_END
 	};
 
@@ -292,21 +492,26 @@ void Dhcp::SendRequest()
 		return;
 	}
 
-	_state = STATE_REQUEST;
-
 	Packet* pkt = (Packet*)(*buf + 0);
 	pkt->xid = _offer_xid;
 	
 	memcpy(pkt->options, request, sizeof request);
-	memcpy(pkt->options + 9, &_server, 4);
-	memcpy(pkt->options + 15, &_lease, 4);
+	memcpy(pkt->options + REQ_IP, &_lease, 4);
 
-	buf->SetSize(offsetof(Packet, options) + sizeof request);
+	if (_state == STATE_REBOOT) {
+		pkt->options[SERVER - 2] = TAG_END;
+		buf->SetSize(offsetof(Packet, options) + SERVER - 1);
+	} else {
+		_state = STATE_REQUEST;
+		memcpy(pkt->options + SERVER, &_server, 4);
+		buf->SetSize(offsetof(Packet, options) + sizeof request);
+	}
 
 	FillHeader(buf);
 
 	// Hand over packet to ethernet
 	DMSG("DHCP: broadcasting DHCPREQUEST");
+	NetStats::Inc(_netstats.dhcp.out_requests);
 	_netif.Send(buf);
 
 	Backoff();					// Update rexmit timer
@@ -359,12 +564,12 @@ void Dhcp::Extract(const uint8_t* options, uint len)
 			break;
 		}
 		case TAG_END:
-			p = options + len;
-			break;
+			goto done;
 		case TAG_DHCP_LEASE: {
 			uint32_t secs;
 			memcpy(&secs, p, 4);
-			_renew = _first_request + Time::FromSec(Ntohl(secs));
+			_lease_time = Ntohl(secs);
+			_renew = _first_request + Time::FromSec(_lease_time);
 			break;
 		}
 		default: ;
@@ -373,7 +578,7 @@ void Dhcp::Extract(const uint8_t* options, uint len)
 	}
 done:
 	if (_netmask == INADDR_ANY)
-		_netmask = 0xffffff00;
+		_netmask = Htonl(0xffffff00);
 }
 
 
@@ -408,8 +613,7 @@ Dhcp::Type Dhcp::GetMsgType(IOBuffer* buf, in_addr_t& server)
 			got_type = true;
 			break;
 		case TAG_END:
-			p = options + len;
-			break;
+			return type;
 		default: ;
 		}
 		if (got_server && got_type) break;
@@ -11,6 +11,55 @@
 #include "core/ip.h"
 #include "core/udp.h"
 #include "core/dns.h"
+#include "core/file.h"
+
+
+// Non-volatile storage for the last DHCP lease, so the next boot can
+// ask for the same address right away.  The lease is validated when
+// loaded, so the storage needn't be initialized.
+class LeaseStore {
+public:
+	// Read len bytes.  Returns false if nothing could be read.
+	virtual bool Load(void* buf, uint len) = 0;
+
+	// Write len bytes.  Returns false on failure.
+	virtual bool Save(const void* buf, uint len) = 0;
+
+protected:
+	virtual ~LeaseStore() { }
+};
+
+
+// Lease kept at the start of an open file, e.g. on a FAT32 volume
+class FileLeaseStore: public LeaseStore {
+	File* _file;
+
+public:
+	FileLeaseStore(File* file) : _file(file) { }
+
+	bool Load(void* buf, uint len) {
+		return _file->Seek(0) && _file->Read(buf, len) == len;
+	}
+
+	bool Save(const void* buf, uint len) {
+		return _file->Seek(0) && _file->Write(buf, len) == len;
+	}
+};
+
+
+// Lease kept in EEPROM at addr, through a driver with Read(addr,
+// block, len) and Write(addr, block, len), such as LpcEeprom
+template <typename Eeprom>
+class EepromLeaseStore: public LeaseStore {
+	Eeprom& _eeprom;
+	uint16_t _addr;
+
+public:
+	EepromLeaseStore(Eeprom& eeprom, uint16_t addr) : _eeprom(eeprom), _addr(addr) { }
+
+	bool Load(void* buf, uint len) { _eeprom.Read(_addr, buf, len); return true; }
+	bool Save(const void* buf, uint len) { _eeprom.Write(_addr, buf, len); return true; }
+};
 
 
 struct Dhcp {
@@ -19,9 +68,40 @@ struct Dhcp {
 		STATE_RESET,		   // Initial state
 		STATE_DISCOVER,		   // Waiting for response to DHCPDISCOVER
 		STATE_REQUEST, // Received DHCPOFFER, sent back DHCPREQUEST, waiting for ACK
-		STATE_CONFIGURED // Got DHCPACK, now configured, on timer to renew
+		STATE_CONFIGURED, // Got DHCPACK, now configured, on timer to renew
+		STATE_REBOOT   // Using saved lease, sent DHCPREQUEST for it, waiting for ACK
 	};
 
+	// Lease as saved in a LeaseStore.  The CRC covers everything
+	// before it in whole words, since the hardware CRC units take
+	// nothing else; keep the fields padded out to a word.
+	struct SavedLease {
+		uint32_t magic;			// LEASE_MAGIC
+		uint8_t mac[6];			// Interface it was leased to
+		uint8_t domain_len;
+		uint8_t pad;
+		in_addr_t addr;
+		in_addr_t netmask;
+		in_addr_t gw;
+		in_addr_t ns;
+		in_addr_t server;
+		uint32_t lease_time;	// Seconds, as granted
+		uint8_t domain[64];
+		uint32_t crc;			// CRC32 of the above
+	};
+
+	static_assert(offsetof(SavedLease, crc) % sizeof (uint32_t) == 0);
+
+	enum { LEASE_MAGIC = 0x4c484344 };
+
+	// Retransmits of an INIT-REBOOT request before looking for
+	// another server, as a _backoff limit
+	enum { REBOOT_BACKOFF = 16 };
+
+	// Time to listen for replies to the ARP probe for a saved
+	// address, in msec
+	enum { PROBE_WAIT = 1000 };
+
 
 	Mutex _lock;
 
@@ -44,6 +124,14 @@ struct Dhcp {
 	in_addr_t _server;			// In STATE_OFFER, STATE_CONFIGURED, holds server id
 	uint32_t _offer_xid;		// XID in server's offer
 	Time _first_request;		// Time we sent first DHCPREQUEST - lease start time
+	uint32_t _lease_time;		// Lease granted, seconds
+	in_addr_t _ifaddr;			// Address, netmask and gateway the interface
+	in_addr_t _ifmask;			// is configured with; _ifaddr is INADDR_ANY
+	in_addr_t _ifgw;			// if it isn't
+	Time _probe_end;			// Check for an ARP conflict then, if set
+	LeaseStore* _store;			// Where the lease is saved, or NULL
+	bool _saved;				// _store holds a lease
+	uint32_t _saved_crc;		// If _saved: its CRC
 
 	// Ports
 	enum {
@@ -127,8 +215,18 @@ struct Dhcp {
 
 	Dhcp(Ethernet& netif, Ip& ip, Dns& dns);
 
+	// Keep the lease in store, and start from the lease found there
+	// on Reset().  Set this before starting the network thread.
+	void SetLeaseStore(LeaseStore* store) { _store = store; }
+
+	// CRC of a SavedLease, up to its crc
+	static uint32_t LeaseCrc(const SavedLease& sl);
+
 	// (Re)Initialize and start obtaining config.  Called on powerup and when
-	// the ethernet link is restored.
+	// the ethernet link is restored.  With a saved lease for this
+	// interface, the interface is configured with it at once and the
+	// address requested from the server (RFC 2131 INIT-REBOOT);
+	// otherwise it starts over with DHCPDISCOVER.
 	void Reset();
 
 	// Process incoming packet if DHCP.  DHCP packet buffers are
@@ -160,6 +258,28 @@ private:
 	// Update retransmit timer
 	void Backoff();
 
+	// Configure interface and DNS from the lease, if it changed
+	void Configure();
+
+	// Stop using the lease
+	void Unconfigure();
+
+	// Read lease from _store.  Returns false if there is no valid
+	// lease for this interface there.
+	bool LoadLease();
+
+	// Write lease to _store, unless it's already there
+	void SaveLease();
+
+	// Invalidate the lease in _store
+	void ForgetLease();
+
+	// Request the loaded lease while using it
+	void Reboot();
+
+	// Give up on the lease and the address, and start over
+	void StartOver();
+
 	// Extract config from DHCPACK
 	void Extract(const uint8_t* options, uint len);
 
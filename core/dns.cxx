@@ -12,10 +12,14 @@ Dns _dns0(_udp0);
 
 Dns::Dns(Udp& udp) :
 	_udp(udp),
-	_id(0),
+	_ns(INADDR_ANY),
 	_sock(NULL),
-	_state(STATE_IDLE)
+	_mru(NULL),
+	_lru(NULL),
+	_entries(0),
+	_reading(false)
 {
+	memset(&_stats, 0, sizeof _stats);
 }
 
 
@@ -23,10 +27,10 @@ void Dns::Init()
 {
 	Mutex::Scoped L(_lock);
 
-	_sock = _udp0.Create();
+	// Replies come back to the socket's anonymous port
+	_sock = _udp.Create();
 	assert(_sock);
 	_sock->SetEventMask(CoreSocket::EVENT_READABLE);
-	_sock->Bind(NetAddr(INADDR_ANY, DNS_PORT));
 }
 
 
@@ -42,184 +46,500 @@ void Dns::SetNS(in_addr_t ns)
 
 		assert(_sock);
 		_sock->Connect(NetAddr(ns, DNS_PORT));
-		_change.Signal();
+		_change.Broadcast();
 	}
 }
 
 
-bool Dns::GetAddrByName(const String& name, in_addr_t& addr)
+void Dns::SetDomain(const String& arg)
 {
-	Acquire();
+	Mutex::Scoped L(_lock);
+	_domain = arg;
+}
 
-	assert(_sock);
 
-	for (uint attempt = 0; attempt < MAX_ATTEMPTS; ++attempt) {
-		Deque<uchar> req;
+void Dns::Flush()
+{
+	Mutex::Scoped L(_lock);
 
-		DMSG("DNS: IN A query for %S", &name);
+	while (_mru)
+		Remove(_mru);
+}
 
-		// Generate fresh IN A query
-		Dnsh::CreateLookupQuery(req, name);
 
-		const Time deadline = Time::Now() + Time::FromSec(NS_TIMEOUT);
+uint Dns::GetAddrsByName(const String& name, in_addr_t* addrs, uint num)
+{
+	Mutex::Scoped L(_lock);
 
-		_sock->Send(req + 0, req.Size());
-		while (Time::Now() < deadline) {
-			if (!_sock->Wait(deadline - Time::Now())) break;
+	const String fqdn = Qualify(name);
+
+	// Find a cached answer, join an outstanding query for the same
+	// name, or start one once there's room
+	Query* q;
+	for (;;) {
+		Entry* e = Lookup(fqdn);
+		if (e) {
+			++_stats.hits;
+			if (!e->naddrs)
+				++_stats.neg_hits;
+			return Copy(e, addrs, num);
+		}
 
-			// Drain replies, reuse req
-			for (;;) {
-				req.Clear();
-				uint len = 512;
-				if (!_sock->Recv(req + req.Grow(len), len)) break;
+		if ((q = FindQuery(fqdn))) {
+			++_stats.coalesced;
+			break;
+		}
+
+		if (!_sock || _ns == INADDR_ANY)
+			return 0;
+
+		if (_queries.Size() < DNS_MAX_QUERIES) {
+			DMSG("DNS: IN A query for %S", &fqdn);
+
+			q = new Query;
+			q->name = fqdn;
+			q->id = NewId();
+			q->waiters = 0;
+			q->attempts = 0;
+			q->done = false;
+			memset(&q->answer, 0, sizeof q->answer);
+			_queries.PushBack(q);
 
-				uint rcode;
-				if (Dnsh::GetRRA1(req, addr, rcode)) {
-					Release();
-					NetAddr a(addr, 0);
-					DMSG("DNS: %S: result: %a", &name, &a);
-					return true;
-				}
-				DMSG("DNS: IN A query for %S failed: rcode=%u", &name, rcode);
+			++_stats.queries;
+			Transmit(q);
+			break;
+		}
+
+		_change.Wait(_lock);
+	}
+
+	++q->waiters;
+	while (!q->done) {
+		if (_reading)
+			_change.Wait(_lock);
+		else
+			Read();
+	}
+
+	const uint n = min<uint>(q->answer.naddrs, num);
+	memcpy(addrs, q->answer.addr, n * sizeof *addrs);
+
+	if (!--q->waiters) {
+		for (uint i = 0; i < _queries.Size(); ++i) {
+			if (_queries[i] == q) {
+				_queries.Erase(i);
+				break;
 			}
 		}
+		delete q;
+		_change.Broadcast();
 	}
 
-	Release();
-	return false;
+	return n;
 }
 
 
-void Dns::Acquire()
+String Dns::Qualify(const String& name) const
 {
-	Mutex::Scoped L(_lock);
-	while (_state != STATE_IDLE)
-		_change.Wait(_lock);
-	_state = STATE_RESOLVING;
+	String fqdn(name);
+
+	if (fqdn.FindFirst('.') == NOT_FOUND && !_domain.Empty()) {
+		fqdn += STR(".");
+		fqdn += _domain;
+	}
+
+	const uint len = fqdn.Size();
+	if (len && fqdn[len - 1] == '.')
+		return fqdn.Head(len - 1);
+
+	return fqdn;
 }
 
 
-void Dns::SetState(State new_state)
+Dns::Entry* Dns::Lookup(const String& fqdn)
 {
-	Mutex::Scoped L(_lock);
-	_state = new_state;
-	_change.Signal();
+	_lock.AssertLocked();
+
+	// The cache is small enough that a linear search beats hashing
+	for (Entry* e = _mru; e; e = e->next) {
+		if (!e->name.Equals(fqdn))
+			continue;
+
+		if (Time::Now() >= e->expire) {
+			Remove(e);
+			return NULL;
+		}
 
+		// Move to front
+		if (e != _mru) {
+			e->prev->next = e->next;
+			if (e->next)
+				e->next->prev = e->prev;
+			else
+				_lru = e->prev;
+
+			e->prev = NULL;
+			e->next = _mru;
+			_mru->prev = e;
+			_mru = e;
+		}
+		return e;
+	}
+
+	return NULL;
 }
 
-	
-void Dns::Release() { SetState(STATE_IDLE); }
+
+void Dns::Insert(const String& fqdn, const Dnsh::Answer& ans)
+{
+	_lock.AssertLocked();
+
+	const uint ttl = min<uint32_t>(ans.ttl, DNS_MAX_TTL);
+	if (!ttl)
+		return;
+
+	for (Entry* e = _mru; e; e = e->next) {
+		if (e->name.Equals(fqdn)) {
+			Remove(e);
+			break;
+		}
+	}
+
+	if (_entries >= DNS_CACHE_SIZE)
+		Remove(_lru);
+
+	Entry* e = new Entry;
+	e->name = fqdn;
+	e->expire = Time::Now() + Time::FromSec(ttl);
+	e->naddrs = ans.naddrs;
+	e->rotate = 0;
+	memcpy(e->addr, ans.addr, sizeof e->addr);
+
+	e->prev = NULL;
+	e->next = _mru;
+	if (_mru)
+		_mru->prev = e;
+	else
+		_lru = e;
+	_mru = e;
+	++_entries;
+}
+
+
+void Dns::Remove(Entry* e)
+{
+	if (e->prev)
+		e->prev->next = e->next;
+	else
+		_mru = e->next;
+
+	if (e->next)
+		e->next->prev = e->prev;
+	else
+		_lru = e->prev;
+
+	--_entries;
+	delete e;
+}
 
 
 // * static
-void Dnsh::CreateLookupQuery(Deque<uint8_t>& buf, const String& host)
+uint Dns::Copy(Entry* e, in_addr_t* addrs, uint num)
 {
-	String fqdn(host);
+	const uint n = min<uint>(e->naddrs, num);
+	for (uint i = 0; i < n; ++i)
+		addrs[i] = e->addr[(e->rotate + i) % e->naddrs];
 
-	if (fqdn.FindFirst('.') == NOT_FOUND) {
-		fqdn += STR(".");
-		fqdn += _dns0.GetDomain();
+	if (e->naddrs)
+		e->rotate = (e->rotate + 1) % e->naddrs;
+
+	return n;
+}
+
+
+Dns::Query* Dns::FindQuery(const String& fqdn)
+{
+	for (uint i = 0; i < _queries.Size(); ++i)
+		if (_queries[i]->name.Equals(fqdn))
+			return _queries[i];
+
+	return NULL;
+}
+
+
+// Random, and distinct from any outstanding query
+uint16_t Dns::NewId()
+{
+	for (;;) {
+		const uint16_t id = Util::Random<uint16_t>();
+
+		uint i;
+		for (i = 0; i < _queries.Size() && _queries[i]->id != id; ++i)
+			continue;
+
+		if (i == _queries.Size())
+			return id;
 	}
+}
 
-	Dnsh& dnsh = *(Dnsh*)(buf + buf.Grow(sizeof (Dnsh)));
 
-	memset(&dnsh, 0, sizeof dnsh);
+void Dns::Transmit(Query* q)
+{
+	Deque<uint8_t> req;
 
-	// dnsh.opcode = OPCODE_QUERY;
+	++q->attempts;
+	q->rexmit = Time::Now() + Time::FromSec(NS_TIMEOUT);
 
-	dnsh.id = Htons(_dns0.NextId());
-	dnsh.rd = true;
-	dnsh.qr = true;
-	dnsh.questions = Htons(1);
+	if (!Dnsh::CreateLookupQuery(req, q->id, q->name)) {
+		// Not a name; fail it right away
+		q->attempts = MAX_ATTEMPTS;
+		q->rexmit = Time::Now();
+		return;
+	}
+
+	_sock->Send(req + 0, req.Size());
+}
 
-	const uint query_len = 4 + fqdn.Size() + 1;
 
-	uint8_t* query = buf + buf.Grow(query_len);
+// Read replies on behalf of all waiting threads, until one arrives or
+// a query is due for retransmit.  Retransmits and times out queries.
+void Dns::Read()
+{
+	_lock.AssertLocked();
+	_reading = true;
+
+	Time now = Time::Now();
+	Time next = Time::InfTim;
+
+	for (uint i = 0; i < _queries.Size(); ++i) {
+		Query* q = _queries[i];
+		if (q->done)
+			continue;
+
+		if (now >= q->rexmit) {
+			if (q->attempts >= MAX_ATTEMPTS) {
+				DMSG("DNS: IN A query for %S timed out", &q->name);
+				++_stats.timeouts;
+				q->done = true;
+				continue;
+			}
+			Transmit(q);
+		}
+		next = min(next, q->rexmit);
+	}
+
+	if (next != Time::InfTim) {
+		_lock.Unlock();
+		_sock->Wait(next - now);
+		_lock.Lock();
+	}
 
-	uint pos = 0;				// Current char in fqdn
-	uint part_pos = 0;			// First char in fqdn part
-	uint part_query = 0;		// Current char in query part
-	uint query_pos = 0;			// Current pos in query
+	for (;;) {
+		uint len = sizeof _msg;
+		if (!_sock->Recv(_msg, len))
+			break;
+
+		if (len < sizeof (Dnsh))
+			continue;
+
+		const uint16_t id = Ntohs(((const Dnsh*)_msg)->id);
+
+		for (uint i = 0; i < _queries.Size(); ++i) {
+			Query* q = _queries[i];
+			if (q->id != id || q->done)
+				continue;
+
+			if (Dnsh::ParseReply(_msg, len, q->name, q->answer))
+				Complete(q);
+			break;
+		}
+	}
+
+	_reading = false;
+	_change.Broadcast();
+}
 
+
+void Dns::Complete(Query* q)
+{
+	const Dnsh::Answer& ans = q->answer;
+
+	switch (ans.rcode) {
+	case Dnsh::RCODE_NOERROR:
+	case Dnsh::RCODE_NXDOMAIN:
+		Insert(q->name, ans);
+		break;
+	default:
+		DMSG("DNS: IN A query for %S failed: rcode=%u", &q->name, ans.rcode);
+		q->answer.naddrs = 0;
+	}
+
+	if (ans.naddrs) {
+		NetAddr a(ans.addr[0], 0);
+		DMSG("DNS: %S: result: %a (%u)", &q->name, &a, ans.naddrs);
+	}
+
+	q->done = true;
+}
+
+
+// * static
+bool Dnsh::CreateLookupQuery(Deque<uint8_t>& buf, uint16_t id, const String& fqdn)
+{
 	const uint host_len = fqdn.Size();
+	if (!host_len || host_len > 253)
+		return false;
+
+	Dnsh& dnsh = *(Dnsh*)(buf + buf.Grow(sizeof (Dnsh)));
+
+	memset(&dnsh, 0, sizeof dnsh);
 
-	while (pos < host_len) {
-		if (fqdn[pos] == '.')  {
-			const uint part_len = pos - part_pos;
-			query[part_query] = part_len;
-			part_query += part_len + 1;
-			part_pos = ++pos;
-			++query_pos;
+	dnsh.id = Htons(id);
+	dnsh.flags = Htons(FLAG_RD);
+	dnsh.questions = Htons(1);
+
+	// Each label is preceded by its length, and the name ends with
+	// the empty root label
+	uint8_t* query = buf + buf.Grow(host_len + 2);
+
+	uint part = 0;				// Length byte of current label
+	for (uint pos = 0; pos <= host_len; ++pos) {
+		if (pos == host_len || fqdn[pos] == '.') {
+			const uint label = pos - part;
+			if (!label || label > 63)
+				return false;
+
+			query[part] = label;
+			part = pos + 1;
 		} else {
-			query[++query_pos] = fqdn[pos++];
+			query[pos + 1] = fqdn[pos];
 		}
 	}
-
-	// 0 for the root (single dot)
-	query[query_len-1] = 0;
+	query[host_len + 1] = 0;
 
 	const uint16_t type_class[2] = { Htons(TYPE_A), Htons(CLASS_IN) };
 
 	memcpy(buf + buf.Grow(4), type_class, 4);
+	return true;
 }
 
 
-// * static
-bool Dnsh::GetRRA1(const Deque<uint8_t>& dnspkt, in_addr_t& addr, uint& rcode)
+// Skip a possibly compressed name.  Returns the position after it, or
+// 0 if it runs past len.
+static uint SkipName(const uint8_t* msg, uint len, uint pos)
 {
-	rcode = 0;
+	while (pos < len) {
+		const uint label = msg[pos];
+		if (!label)
+			return pos + 1;
+
+		if ((label & 0xc0) == 0xc0)
+			return pos + 2 <= len ? pos + 2 : 0;
 
-	if (dnspkt.Size() < sizeof (Dnsh) + 4 + 10) return false;
+		pos += label + 1;
+	}
+
+	return 0;
+}
 
-	const Dnsh& dnsh = *(const Dnsh*)&dnspkt.Front();
 
-	rcode = dnsh.rcode;
+static uint8_t Lower(uint8_t c) { return c >= 'A' && c <= 'Z' ? c + 'a' - 'A' : c; }
 
-	if (Ntohs(dnsh.id) != _dns0.CurId() || dnsh.qr || dnsh.rcode || !dnsh.questions ||
-		!dnsh.rr_answers)
-		return false;
 
-	uint questions = 0;
-	// Skip past any question up front
-	// XXX we should really check it's OUR question...
-	for (uint q = 0; q < dnsh.questions && questions < dnspkt.Size(); ++q){
-		while (questions < dnspkt.Size() && dnspkt[questions])
-			++questions;
+// True if the uncompressed name at pos is fqdn, ignoring case
+static bool MatchName(const uint8_t* msg, uint len, uint pos, const String& fqdn)
+{
+	const uint8_t* name = fqdn.CStr();
+
+	while (pos < len) {
+		const uint label = msg[pos++];
+		if (!label)
+			return !*name;
 
-		if (dnspkt.Size() - questions < 4)
+		if (label > 63 || pos + label > len)
 			return false;
 
-		questions += 4;
+		for (uint i = 0; i < label; ++i, ++name)
+			if (!*name || Lower(msg[pos + i]) != Lower(*name))
+				return false;
+
+		pos += label;
+		if (*name == '.')
+			++name;
+		else if (*name)
+			return false;
 	}
 
-	if (dnspkt.Size() < sizeof (Dnsh) + questions + 1)
-		return false;
+	return false;
+}
+
 
-	const uint8_t* rr = dnspkt + sizeof (Dnsh) + questions; 
+static uint16_t Get16(const uint8_t* p) { return (p[0] << 8) | p[1]; }
+static uint32_t Get32(const uint8_t* p) { return (Get16(p) << 16) | Get16(p + 2); }
+
+
+// * static
+bool Dnsh::ParseReply(const uint8_t* msg, uint len, const String& fqdn, Answer& ans)
+{
+	if (len < sizeof (Dnsh))
+		return false;
 
-	uint len = &dnspkt.Back() - rr;
-	
-	while (len-- && *rr++) continue;
+	const uint flags = Get16(msg + 2);
+	const uint questions = Get16(msg + 4);
+	const uint answers = Get16(msg + 6);
+	const uint auth = Get16(msg + 8);
 
-	if (len < sizeof (DnsRdata)) return false;
+	if (!(flags & FLAG_QR) || (flags & FLAG_OPCODE) || questions != 1)
+		return false;
 
-	DnsRdata rd;
-	memcpy(&rd, rr, sizeof (DnsRdata));
-	rr += sizeof (DnsRdata);
-	len -= sizeof (DnsRdata);
-	
-	rd.cl = Ntohs(rd.cl);
-	rd.type = Ntohs(rd.type);
-	rd.length = Ntohs(rd.length);
-//	rd.ttl = Ntohl(rd.ttl);
+	// Must be our question
+	uint pos = sizeof (Dnsh);
+	if (!MatchName(msg, len, pos, fqdn))
+		return false;
 
-	if (rd.type != TYPE_A || rd.cl != CLASS_IN || rd.length != 4 ||
-		len < 4)
+	pos = SkipName(msg, len, pos);
+	if (!pos || pos + 4 > len || Get16(msg + pos) != TYPE_A || Get16(msg + pos + 2) != CLASS_IN)
 		return false;
-		
-	in_addr_t tmp;
-	memcpy(&tmp, rr, 4);
-	addr = Ntohl(tmp);
+	pos += 4;
+
+	ans.id = Get16(msg);
+	ans.rcode = flags & FLAG_RCODE;
+	ans.naddrs = 0;
+	ans.ttl = DNS_MAX_TTL;
+
+	// Collect A records, following any CNAMEs to them, then look for
+	// an SOA for the negative TTL.  Whatever doesn't fit is ignored.
+	uint32_t neg_ttl = DNS_NEG_TTL;
+
+	for (uint rr = 0; rr < answers + auth; ++rr) {
+		pos = SkipName(msg, len, pos);
+		if (!pos || pos + 10 > len)
+			break;
+
+		const uint type = Get16(msg + pos);
+		const uint cl = Get16(msg + pos + 2);
+		const uint32_t ttl = Get32(msg + pos + 4);
+		const uint rdlen = Get16(msg + pos + 8);
+		pos += 10;
+
+		if (pos + rdlen > len)
+			break;
+
+		if (rr < answers) {
+			if (type == TYPE_A && cl == CLASS_IN && rdlen == 4 && ans.naddrs < DNS_MAX_ADDRS) {
+				memcpy(&ans.addr[ans.naddrs++], msg + pos, 4);
+				ans.ttl = min(ans.ttl, ttl);
+			}
+		} else if (type == TYPE_SOA && rdlen >= 20) {
+			// RFC 2308: the lesser of the SOA TTL and its MINIMUM
+			neg_ttl = min(ttl, Get32(msg + pos + rdlen - 4));
+		}
+
+		pos += rdlen;
+	}
+
+	if (!ans.naddrs)
+		ans.ttl = ans.rcode == RCODE_NOERROR || ans.rcode == RCODE_NXDOMAIN ? neg_ttl : 0;
 
 	return true;
 }
@@ -7,72 +7,136 @@
 #include "core/network.h"
 #include "core/udp.h"
 
-enum { DNS_PORT = 123 };
+enum { DNS_PORT = 53 };
+
+// Tuning
+enum {
+    DNS_CACHE_SIZE = 16,        // Names cached, positive and negative
+    DNS_MAX_ADDRS = 4,          // A records kept per name
+    DNS_MAX_QUERIES = 4,        // Queries outstanding at once
+    DNS_NEG_TTL = 60,           // Negative TTL, sec, when the reply has no SOA
+    DNS_MAX_TTL = 86400,        // Cap on cached TTLs, sec
+    DNS_MSG_MAX = 512           // Max UDP message
+};
 
 // Base DNS header
 struct [[__novtable]] Dnsh {
     uint16_t id;
-    bool qr:1;                  // Query/response
-
-    enum { OPCODE_QUERY = 0 };
-
-    uint8_t opcode:4;
-    bool aa:1;                  // Authoritative
-    bool tc:1;                  // Truncated
-    bool rd:1;                  // Recursion desired
-    bool ra:1;                  // Recursion available (from server)
-    bool z:1;
-    bool ad:1;                  // Authenticated data
-    bool cd:1;                  // Checking disabled
-    uint8_t rcode:4;            // Return code
-
+    uint16_t flags;             // FLAG_xxx, opcode and rcode
     uint16_t questions;         // # of questions
     uint16_t rr_answers;        // RR answers
     uint16_t rr_auth;           // Authority RRs
     uint16_t rr_add;            // Additional RRs
 
-    // Common reply data.  NAME precedes this, and RDATA follows.
-    struct [[__novtable]] DnsRdata {
-        uint16_t type;
-        uint16_t cl;
-        uint32_t ttl;
-        uint16_t length;
+    enum {
+        FLAG_QR = 0x8000,       // Response
+        FLAG_OPCODE = 0x7800,
+        FLAG_AA = 0x0400,       // Authoritative
+        FLAG_TC = 0x0200,       // Truncated
+        FLAG_RD = 0x0100,       // Recursion desired
+        FLAG_RA = 0x0080,       // Recursion available (from server)
+        FLAG_RCODE = 0x000f
+    };
+
+    enum { OPCODE_QUERY = 0 };
+
+    enum {
+        RCODE_NOERROR = 0,
+        RCODE_FORMERR = 1,
+        RCODE_SERVFAIL = 2,
+        RCODE_NXDOMAIN = 3
     };
 
     enum {
         TYPE_A = 1,             // IPv4 addr
+        TYPE_CNAME = 5,
+        TYPE_SOA = 6,
         CLASS_IN = 1            // INET4
     };
-        
-    // Add forward A RR query for host to buf
-    // The buffer head should be at the first byte to fill in
-    static void CreateLookupQuery(Deque<uint8_t>& buf, const String& host);
 
-    // Retrieve first RR A record from reply
-    // On a DNS server failure, rcode contains the reason
-    static bool GetRRA1(const Deque<uint8_t>& dnspkt, in_addr_t& addr, uint& rcode);
+    // What a reply says about a name
+    struct Answer {
+        uint16_t id;
+        uint8_t rcode;
+        uint8_t naddrs;         // A records found
+        in_addr_t addr[DNS_MAX_ADDRS];
+        uint32_t ttl;           // Smallest TTL of the A records, or
+                                // negative TTL from the SOA if none
+    };
+
+    // Add forward A RR query for fqdn to buf.  Returns false if it
+    // isn't a valid name.
+    static bool CreateLookupQuery(Deque<uint8_t>& buf, uint16_t id, const String& fqdn);
 
+    // Parse reply to an A query for fqdn.  Returns false if it isn't
+    // one.  On a DNS server failure, rcode contains the reason.
+    static bool ParseReply(const uint8_t* msg, uint len, const String& fqdn, Answer& ans);
 };
 
-    
+
+// Stub resolver with a cache.  Any number of threads can resolve at
+// once; each name has at most one query outstanding, shared by all
+// threads asking for it, and replies are matched to queries by ID.
+// Whichever waiting thread finds nobody else reading the socket reads
+// it on behalf of all of them.
+//
+// Answers are cached for their TTL, and failures (no such name, no A
+// records) for the negative TTL in the SOA of the reply.  Timeouts
+// and server failures aren't cached.  The least recently used entry
+// is evicted when the cache is full.
 class Dns {
+public:
+    struct Stats {
+        uint32_t hits;          // Answered from cache
+        uint32_t neg_hits;      // ...of which negative
+        uint32_t queries;       // Queries sent, not counting retransmits
+        uint32_t coalesced;     // Lookups that joined an outstanding query
+        uint32_t timeouts;      // Queries that got no reply
+    };
+
+private:
+    // Cache entry, on a most recently used first list
+    struct Entry {
+        Entry* prev;
+        Entry* next;
+        String name;            // Fully qualified
+        Time expire;
+        in_addr_t addr[DNS_MAX_ADDRS];
+        uint8_t naddrs;         // 0 for a negative entry
+        uint8_t rotate;         // First address to hand out next
+    };
+
+    // Outstanding query
+    struct Query {
+        String name;            // Fully qualified
+        Time rexmit;            // Retransmit or give up at
+        uint16_t id;
+        uint16_t waiters;       // Threads waiting for the answer
+        uint8_t attempts;
+        bool done;
+        Dnsh::Answer answer;
+    };
+
     Udp& _udp;
-    uint16_t _id;               // ID counter
     in_addr_t _ns;              // Name server
     String _domain;
     UdpCoreSocket* _sock;       // NS socket
 
-    enum State {
-        STATE_IDLE,
-        STATE_RESOLVING
-    };
+    Entry* _mru;                // Cache, most recently used first
+    Entry* _lru;
+    uint _entries;
+
+    Vector<Query*> _queries;
+    bool _reading;              // A thread is reading _sock
 
-    uint8_t _state;
     mutable Mutex _lock;
-    CondVar _change;            // Signals state change
+    CondVar _change;            // Query done, or reader stepped down
+
+    uint8_t _msg[DNS_MSG_MAX];  // Receive buffer, for the reader
+    Stats _stats;
 
     enum { MAX_ATTEMPTS = 5 };
-    enum { NS_TIMEOUT = 5 };
+    enum { NS_TIMEOUT = 2 };
 
 public:
     Dns(Udp& udp);
@@ -87,25 +151,35 @@ public:
     [[__finline]] const String& GetDomain() { return _domain; }
 
     // Set search domain
-    [[__finline]] void SetDomain(const String& arg) {
-        _domain = arg;
-        _change.Broadcast();
+    void SetDomain(const String& arg);
+
+    // Name to addr lookups.  GetAddrsByName() fills in up to num
+    // addresses and returns the number filled in, 0 if there are
+    // none.  Cached addresses are handed out starting with a
+    // different one each time, to spread load over them.
+    uint GetAddrsByName(const String& name, in_addr_t* addrs, uint num);
+    bool GetAddrByName(const String& name, in_addr_t& addr) {
+        return GetAddrsByName(name, &addr, 1);
     }
 
-    // Name to addr lookup
-    bool GetAddrByName(const String& name, in_addr_t& addr);
+    // Drop all cached names
+    void Flush();
 
-    // ID management
-    // XXX This is currently naive, but in the future we should make
-    // it a random sequence.
-    uint16_t CurId() { return _id; }
-    uint16_t NextId() { return ++_id; }
+    Stats GetStats() const { Mutex::Scoped L(_lock); return _stats; }
 
-    // State management
-    void SetState(State new_state);
-    void Acquire();
-    void Release();
+private:
+    // These are called with _lock held
+    String Qualify(const String& name) const;
+    Entry* Lookup(const String& fqdn);
+    void Insert(const String& fqdn, const Dnsh::Answer& ans);
+    void Remove(Entry* e);
+    static uint Copy(Entry* e, in_addr_t* addrs, uint num);
 
+    Query* FindQuery(const String& fqdn);
+    uint16_t NewId();
+    void Transmit(Query* q);
+    void Read();
+    void Complete(Query* q);
 };
 
 extern Dns _dns0;
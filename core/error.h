@@ -13,7 +13,9 @@ enum {
 	ERR_BAD_OP = 5,				// Attempt to e.g. Accept on a UDP socket
 	ERR_ADDR_IN_USE = 6,
 	ERR_NOT_CONNECTED = 7,
-	ERR_DEST_UNREACH = 8
+	ERR_DEST_UNREACH = 8,
+	ERR_CONN_RESET = 9,			// Connection reset by peer
+	ERR_TIMED_OUT = 10			// Connection timed out
 };
 
 #endif // __ERROR_H__
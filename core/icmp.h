@@ -43,6 +43,7 @@ struct __novtable Icmph {
 	uint8_t type;
 	uint8_t code;
 	uint16_t sum;
+	uint16_t rest[2];			// Echo id and seq, next hop MTU, etc.
 	// Message-specific data (ICMP payload) follows
 
 	// Checksumming
@@ -61,8 +62,12 @@ struct __novtable Icmph {
 		return equal;
 	}
 		
-	// Get ICMP payload (IP header, usually)
+	// Get ICMP payload: for error messages the IP header and first
+	// 8 bytes of the offending datagram, for echo the data
 	uint8_t* GetEnclosed() { return (uint8_t*)this + sizeof (Icmph); }
+
+	// Next hop MTU, for ICMP_DF_SET (RFC 1191).  0 from older routers.
+	uint GetNextMtu() const { return Ntohs(rest[1]); }
 };
 
 // Magic cookies
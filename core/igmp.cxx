@@ -0,0 +1,342 @@
+// Copyright (c) 2018-2021 Jan Brittenson
+// See LICENSE for details.
+
+#ifdef ENABLE_IP
+
+#include "core/enetkit.h"
+#include "core/igmp.h"
+#include "core/ip.h"
+#include "core/util.h"
+#include "core/netstats.h"
+
+
+Igmp _igmp0(_eth0, _ip0);
+
+static const in_addr_t ALL_HOSTS = Htonl(0xe0000001);   // 224.0.0.1
+static const in_addr_t ALL_ROUTERS = Htonl(0xe0000002); // 224.0.0.2
+
+
+Igmp::Igmp(Ethernet& netif, Ip& ip)
+	: _netif(netif),
+	  _ip(ip),
+	  _v1_until()
+{
+	for (uint i = 0; i < IGMP_GROUPS; ++i) {
+		_group[i].addr = INADDR_ANY;
+		_group[i].due = Time::InfTim;
+	}
+}
+
+
+void Igmp::Initialize()
+{
+	Mutex::Scoped L(_lock);
+	UpdateFilter();
+}
+
+
+// * static
+void Igmp::GetGroupMac(in_addr_t group, uint8_t macaddr[6])
+{
+	// 01:00:5e followed by the low 23 bits of the group
+	const uint32_t addr = Ntohl(group);
+	macaddr[0] = 0x01;
+	macaddr[1] = 0x00;
+	macaddr[2] = 0x5e;
+	macaddr[3] = (addr >> 16) & 0x7f;
+	macaddr[4] = addr >> 8;
+	macaddr[5] = addr;
+}
+
+
+Igmp::Group* Igmp::Find(in_addr_t group)
+{
+	_lock.AssertLocked();
+
+	for (uint i = 0; i < IGMP_GROUPS; ++i)
+		if (_group[i].addr == group)
+			return &_group[i];
+
+	return NULL;
+}
+
+
+bool Igmp::IsMember(in_addr_t group) const
+{
+	if (group == ALL_HOSTS)
+		return true;
+
+	Mutex::Scoped L(_lock);
+	return Find(group) != NULL;
+}
+
+
+bool Igmp::AcceptMac(const uint8_t* macaddr) const
+{
+	uint8_t mac[6];
+
+	GetGroupMac(ALL_HOSTS, mac);
+	if (!memcmp(mac, macaddr, 6))
+		return true;
+
+	Mutex::Scoped L(_lock);
+
+	for (uint i = 0; i < IGMP_GROUPS; ++i) {
+		if (_group[i].addr != INADDR_ANY) {
+			GetGroupMac(_group[i].addr, mac);
+			if (!memcmp(mac, macaddr, 6))
+				return true;
+		}
+	}
+
+	return false;
+}
+
+
+void Igmp::UpdateFilter()
+{
+	_lock.AssertLocked();
+
+	uint8_t macs[(IGMP_GROUPS + 1) * 6];
+	uint num = 0;
+
+	GetGroupMac(ALL_HOSTS, macs);
+	++num;
+
+	for (uint i = 0; i < IGMP_GROUPS; ++i)
+		if (_group[i].addr != INADDR_ANY)
+			GetGroupMac(_group[i].addr, macs + 6 * num++);
+
+	_netif.SetMcastFilter(macs, num);
+}
+
+
+void Igmp::Schedule(Group& g, const Time& max)
+{
+	_lock.AssertLocked();
+
+	const uint msec = max.GetMsec();
+	const Time due = Time::Now() + Time::FromMsec(Util::Random<uint32_t>() % (msec + 1));
+
+	if (due < g.due) {
+		g.due = due;
+		_net_event.Set();
+	}
+}
+
+
+bool Igmp::Join(in_addr_t group)
+{
+	if (!IsMulticast(group))
+		return false;
+
+	if (group == ALL_HOSTS)
+		return true;
+
+	{
+		Mutex::Scoped L(_lock);
+
+		Group* g = Find(group);
+		if (g) {
+			++g->refs;
+			return true;
+		}
+
+		g = Find(INADDR_ANY);
+		if (!g)
+			return false;
+
+		g->addr = group;
+		g->refs = 1;
+		g->reporter = false;
+		g->reports = IGMP_UNSOLICITED;
+		g->due = Time::Now();
+		_net_event.Set();
+
+		UpdateFilter();
+	}
+
+	return true;
+}
+
+
+bool Igmp::Leave(in_addr_t group)
+{
+	if (!IsMulticast(group))
+		return false;
+
+	if (group == ALL_HOSTS)
+		return true;
+
+	bool leave;
+	{
+		Mutex::Scoped L(_lock);
+
+		Group* g = Find(group);
+		if (!g)
+			return false;
+
+		if (--g->refs)
+			return true;
+
+		// Only the last member to report tells the routers; a v1
+		// querier doesn't know about leaving
+		leave = g->reporter && Time::Now() >= _v1_until;
+
+		g->addr = INADDR_ANY;
+		g->due = Time::InfTim;
+
+		UpdateFilter();
+	}
+
+	if (leave)
+		Send(Igmph::IGMP_LEAVE, group, ALL_ROUTERS);
+
+	return true;
+}
+
+
+void Igmp::Receive(IOBuffer* packet)
+{
+	const Iph& iph = Ip::GetIph(packet);
+	const uint len = Ntohs(iph.len) - iph.GetHLen();
+	const Igmph& msg = *(const Igmph*)iph.GetTransport();
+
+	if (len < sizeof (Igmph) ||
+		(!packet->IsCsumVerified() && ipcksum((const uint16_t*)&msg, len) != 0xffff)) {
+		NetStats::Inc(_netstats.igmp.in_errors);
+		BufferPool::FreeBuffer(packet);
+		return;
+	}
+
+	const in_addr_t group = msg.group;
+	const Time now = Time::Now();
+
+	Mutex::Scoped L(_lock);
+
+	switch (msg.type) {
+	case Igmph::IGMP_QUERY: {
+		NetStats::Inc(_netstats.igmp.in_queries);
+
+		// A v1 query has no max response time; it's 10 s
+		Time max = Time::FromMsec(msg.maxresp * 100);
+		if (!msg.maxresp) {
+			_v1_until = now + Time::FromSec(IGMP_V1_TIMEOUT);
+			max = Time::FromSec(IGMP_REPORT_INTERVAL);
+		}
+
+		// General query, or for one group
+		for (uint i = 0; i < IGMP_GROUPS; ++i) {
+			Group& g = _group[i];
+			if (g.addr != INADDR_ANY && (group == INADDR_ANY || group == g.addr))
+				Schedule(g, max);
+		}
+		break;
+	}
+	case Igmph::IGMP_V1_REPORT:
+	case Igmph::IGMP_V2_REPORT: {
+		NetStats::Inc(_netstats.igmp.in_reports);
+
+		// Another member has reported; ours isn't needed
+		Group* g = group != INADDR_ANY ? Find(group) : NULL;
+		if (g) {
+			g->due = Time::InfTim;
+			g->reports = 0;
+			g->reporter = false;
+		}
+		break;
+	}
+	default: ;
+	}
+
+	BufferPool::FreeBuffer(packet);
+}
+
+
+Time Igmp::GetServiceTime() const
+{
+	Mutex::Scoped L(_lock);
+
+	Time next = Time::InfTim;
+	for (uint i = 0; i < IGMP_GROUPS; ++i)
+		next = min(next, _group[i].due);
+
+	return next;
+}
+
+
+Time Igmp::Service()
+{
+	// Reports are sent without holding the lock, so it's never held
+	// while taking Ip's
+	in_addr_t due[IGMP_GROUPS];
+	uint num = 0;
+	Igmph::Type type;
+	{
+		Mutex::Scoped L(_lock);
+
+		const Time now = Time::Now();
+		type = now < _v1_until ? Igmph::IGMP_V1_REPORT : Igmph::IGMP_V2_REPORT;
+
+		for (uint i = 0; i < IGMP_GROUPS; ++i) {
+			Group& g = _group[i];
+			if (g.addr != INADDR_ANY && g.due <= now) {
+				due[num++] = g.addr;
+				g.due = Time::InfTim;
+			}
+		}
+	}
+
+	for (uint i = 0; i < num; ++i) {
+		const bool sent = Send(type, due[i], due[i]);
+
+		Mutex::Scoped L(_lock);
+
+		Group* g = Find(due[i]);
+		if (!g)
+			continue;			// Left meanwhile
+
+		if (!sent) {
+			// No address yet, try again in a bit
+			g->due = Time::Now() + Time::FromSec(1);
+			continue;
+		}
+
+		g->reporter = true;
+		if (g->reports && --g->reports)
+			Schedule(*g, Time::FromSec(IGMP_REPORT_INTERVAL));
+	}
+
+	return GetServiceTime();
+}
+
+
+bool Igmp::Send(Igmph::Type type, in_addr_t group, in_addr_t dest)
+{
+	IOBuffer* buf = BufferPool::AllocTx(IP_HEADROOM + sizeof (Igmph));
+	if (!buf)
+		return false;
+
+	buf->SetHeadroom(IP_HEADROOM);
+	buf->SetSize(sizeof (Igmph));
+
+	Igmph& msg = *(Igmph*)(*buf + 0);
+	msg.type = type;
+	msg.maxresp = 0;
+	msg.sum = 0;
+	msg.group = group;
+	msg.sum = Htons(~ipcksum((const uint16_t*)&msg, sizeof msg));
+
+	Iph& iph = *(Iph*)buf->Prepend(sizeof (Iph));
+	iph.id = 0;					// Have Send() fill in header
+	iph.proto = IPPROTO_IGMP;
+	iph.source = INADDR_ANY;
+
+	if (!_ip.Send(buf, dest, DummyChecksummer()))
+		return false;
+
+	NetStats::Inc(type == Igmph::IGMP_LEAVE ? _netstats.igmp.out_leaves : _netstats.igmp.out_reports);
+	return true;
+}
+
+#endif // ENABLE_IP
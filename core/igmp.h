@@ -0,0 +1,125 @@
+// Copyright (c) 2018-2021 Jan Brittenson
+// See LICENSE for details.
+
+#ifndef __IGMP_H__
+#define __IGMP_H__
+
+#ifdef ENABLE_IP
+
+#include "core/mutex.h"
+#include "core/network.h"
+#include "core/time.h"
+#include "core/netaddr.h"
+
+
+class Ip;
+
+// IGMP message
+struct __novtable Igmph {
+	enum Type {
+		IGMP_QUERY = 0x11,
+		IGMP_V1_REPORT = 0x12,
+		IGMP_V2_REPORT = 0x16,
+		IGMP_LEAVE = 0x17
+	};
+
+	uint8_t type;
+	uint8_t maxresp;			// Max response time, in 1/10 s; 0 from v1 queriers
+	uint16_t sum;
+	in_addr_t group;
+};
+
+
+// Tuning
+enum {
+	IGMP_GROUPS = 8,			// Groups that can be joined, all-hosts aside
+	IGMP_UNSOLICITED = 2,		// Reports sent on joining
+	IGMP_REPORT_INTERVAL = 10,	// Max seconds between them
+	IGMP_V1_TIMEOUT = 400		// Seconds a v1 querier is remembered
+};
+
+
+// IGMPv2 host side (RFC 2236), and the table of groups joined on an
+// interface.  Groups are reference counted, so several sockets can be
+// in one.  The all-hosts group 224.0.0.1 is always joined and never
+// reported.
+//
+// The interface is given the MAC addresses of the groups to program
+// into its multicast filter.  A hash filter lets through some frames
+// for groups not joined, and a driver without one all of them, so
+// the network thread checks group frames against the table as well,
+// with AcceptMac().
+//
+// Messages are sent without the Router Alert option: the fixed link
+// header area has no room for IP options.
+class Igmp {
+	struct Group {
+		in_addr_t addr;			// INADDR_ANY if free
+		uint16_t refs;			// Times joined
+		uint8_t reports;		// Unsolicited reports still to send
+		bool reporter;			// Ours was the last report heard
+		Time due;				// Next report, or InfTim
+	};
+
+	mutable Mutex _lock;
+
+	Ethernet& _netif;
+	Ip& _ip;
+
+	Group _group[IGMP_GROUPS];
+	Time _v1_until;				// Until when a v1 querier is around
+
+public:
+	Igmp(Ethernet& netif, Ip& ip);
+
+	// Program the interface's filter with the all-hosts group
+	void Initialize();
+
+	// Join or leave group.  Returns false if group isn't a multicast
+	// address, the table is full, or on leaving, group wasn't joined.
+	bool Join(in_addr_t group);
+	bool Leave(in_addr_t group);
+
+	// True if group has been joined
+	bool IsMember(in_addr_t group) const;
+
+	// True if a frame to the group MAC address macaddr is for a group
+	// that has been joined
+	bool AcceptMac(const uint8_t* macaddr) const;
+
+	// Receive for IPPROTO_IGMP, with head at the IP header
+	void Receive(IOBuffer* packet);
+
+	// MAC address of group (RFC 1112)
+	static void GetGroupMac(in_addr_t group, uint8_t macaddr[6]);
+
+	// Get next service time
+	Time GetServiceTime() const;
+
+	// Send reports that are due.  Returns next service time.
+	Time Service();
+
+private:
+	Group* Find(in_addr_t group);
+	const Group* Find(in_addr_t group) const { return const_cast<Igmp*>(this)->Find(group); }
+
+	// Set group's report timer to a random time within max, unless
+	// already due sooner
+	void Schedule(Group& g, const Time& max);
+
+	// Give the interface the groups' MAC addresses
+	void UpdateFilter();
+
+	// Send message to dest.  Returns false if there was no route
+	// (no address yet) or no buffer.
+	bool Send(Igmph::Type type, in_addr_t group, in_addr_t dest);
+
+	Igmp(const Igmp&);
+	Igmp& operator=(const Igmp&);
+};
+
+extern Igmp _igmp0;
+
+#endif // ENABLE_IP
+
+#endif // __IGMP_H__
@@ -6,63 +6,297 @@
 #include "core/enetkit.h"
 #include "core/ip.h"
 #include "core/udp.h"
+#include "core/tcp.h"
+#include "core/igmp.h"
+#include "core/netstats.h"
 
 
-Ip _ip0(_udp0);
+Ip _ip0(_udp0, _tcp0, _igmp0);
 
-#if defined(__arm__)
-// Checksum: add to running checksum.
-uint16_t ipcksum(const uint16_t*__restrict block, uint len, uint32_t sum)
-{
-    asm volatile("and r2, %2, #1;"
-                 "mov %2, %2, lsr#1;"
-                 "1: subs %2, %2, #1;"
-                 "ldrhge r3, [%1], #2;"  // word
-                 "rev16 r3, r3;"         // in network byte order
-                 "addge %0, %0, r3;"
-                 "bne 1b;"
-                 "cmp r2, #0;"
-                 "beq 2f;"
-                 // odd trailing byte
-                 "ldrb r3, [%1];"
-                 "rev16 r3, r3;"   // in network byte order
-                 "add %0, r3;"
-                 // fold carries
-                 "ldr r3, =#0xffff;"
-                 "3: and %0, %0, r3;"
-                 "add %0, %0, r2;"
-                 "2: movs r2, %0, lsr#16;"
-                 "bne 3b;"
-                 : "+&r" (sum) : "r" (block), "r" (len) : "r2", "cc");
-    return sum;
-}
+// Unaligned access.  -ffreestanding turns memcpy() into a call; the
+// builtin of a constant size is a plain load or store.
+#define LOAD(DEST, P, N)  __builtin_memcpy((DEST), (P), (N))
+#define STORE(P, SRC, N)  __builtin_memcpy((P), (SRC), (N))
+
+
+// One's complement sum of a block in native byte order, 32 bits at a
+// time into a 64-bit accumulator so carries need no attention inside
+// the loop; on ARMv7-M each add becomes an adds/adc pair.  The sum is
+// byte order independent (RFC 1071 2(B)), so it's swapped once at the
+// end instead of per halfword.  Loads may be halfword aligned, which
+// Cortex-M handles for single word loads.
+static inline uint64_t ipsum(const uint8_t* p, uint len, uint64_t acc)
+{
+	uint32_t w[8];
+
+	for (; len >= sizeof w; len -= sizeof w, p += sizeof w) {
+		LOAD(w, p, sizeof w);
+		acc += (uint64_t)w[0] + w[1] + w[2] + w[3];
+		acc += (uint64_t)w[4] + w[5] + w[6] + w[7];
+	}
+
+	for (; len >= 4; len -= 4, p += 4) {
+		LOAD(w, p, 4);
+		acc += w[0];
+	}
+
+	if (len >= 2) {
+		uint16_t h;
+		LOAD(&h, p, 2);
+		acc += h;
+		p += 2;
+	}
+
+	if (len & 1) {
+		// Trailing byte is the high half of a network order halfword
+#if IS_LITTLE_ENDIAN
+		acc += *p;
 #else
+		acc += uint32_t(*p) << 8;
+#endif
+	}
+
+	return acc;
+}
+
+
+// Fold a native order sum to 16 bits, add host order running sum
+static inline uint16_t ipsum_fold(uint64_t acc, uint32_t sum)
+{
+	acc = (acc & 0xffffffff) + (acc >> 32);
+	acc = (acc & 0xffffffff) + (acc >> 32);
+	uint32_t s = (acc & 0xffff) + (acc >> 16);
+	s = (s & 0xffff) + (s >> 16);
+	s = (s & 0xffff) + (s >> 16);
+
+	s = Ntohs(s) + (sum & 0xffff) + (sum >> 16);
+	s = (s & 0xffff) + (s >> 16);
+	return (s & 0xffff) + (s >> 16);
+}
+
+
 // Checksum: add to running checksum.
 uint16_t ipcksum(const uint16_t* block, uint len, uint32_t sum)
 {
-	const bool unaligned = len & 1;
+	return ipsum_fold(ipsum((const uint8_t*)block, len, 0), sum);
+}
+
+
+uint16_t copy_and_csum(void* dest, const void* src, uint len, uint32_t sum)
+{
+	const uint8_t* s = (const uint8_t*)src;
+	uint8_t* d = (uint8_t*)dest;
+	uint64_t acc = 0;
+	uint32_t w[4];
+
+	for (uint n = len / sizeof w; n; --n) {
+		LOAD(w, s, sizeof w);
+		STORE(d, w, sizeof w);
+		acc += (uint64_t)w[0] + w[1] + w[2] + w[3];
+		s += sizeof w;
+		d += sizeof w;
+	}
+
+	// Tail
+	const uint rem = len % sizeof w;
+	memcpy(d, s, rem);
+	acc = ipsum(s, rem, acc);
 
-	len /= 2;
+	return ipsum_fold(acc, sum);
+}
 
-	while (len--)
-        sum += Ntohs(*block++);
+uint16_t ipcksum(const IOBuffer* buf, const uint8_t* start, uint32_t sum)
+{
+	for (const IOBuffer* b = buf; b; b = b->GetNext()) {
+		// Index rather than point past the end, for CHECK_BOUNDS
+		const uint off = b == buf ? start - (*b + 0) : 0;
+		if (off >= b->Size())
+			continue;
 
-	if (unaligned) 
-        sum += uint16_t(*(const uint8_t*)block) << 8;
+		const uint len = b->Size() - off;
+		assert((len & 1) == 0 || !b->GetNext());
 
-	while (sum > 0xffff)
-		sum = (sum & 0xffff) + (sum >> 16);
+		sum = ipcksum((const uint16_t*)(*b + off), len, sum);
+	}
 
 	return sum;
 }
-#endif
+
 
 void Ip::Initialize()
 {
 	_id = Util::Random<uint16_t>();
+	SetHostRouteLimit(HOSTRT_MAX);
+	SetRateLimit(LIMIT_ICMP, ICMP_RATE, ICMP_BURST);
+	SetRateLimit(LIMIT_ICMP_HOST, ICMP_HOST_RATE, ICMP_HOST_BURST);
+	SetRateLimit(LIMIT_ARP, ARP_RATE, ARP_BURST);
+
+	const BufferPool::ClassStats rx = BufferPool::GetStats(BufferPool::NUM_CLASSES - 1);
+	_reasm_max_bufs = min<uint>(IP_REASM_BUFS, rx.total / 2);
+}
+
+
+void Ip::SetHostRouteLimit(uint limit)
+{
+	Mutex::Scoped L(_lock);
+
+	_max_hosts = max<uint>(limit, 1);
+
+	// Power of two number of buckets, load factor at most 1
+	uint nbuckets = 2;
+	while (nbuckets < _max_hosts)
+		nbuckets *= 2;
+
+	Vector<Route*> hosts;
+	for (uint i = 0; i < _hosts.Size(); ++i)
+		for (Route* rt = _hosts[i]; rt; rt = rt->hnext)
+			hosts.PushBack(rt);
+
+	_hosts.Clear();
+	_hosts.Reserve(nbuckets);
+	_hosts.SetSize(nbuckets);
+	for (uint i = 0; i < nbuckets; ++i)
+		_hosts[i] = NULL;
+
+	for (uint i = 0; i < hosts.Size(); ++i) {
+		Route*& bucket = _hosts[HostHash(hosts[i]->dest)];
+		hosts[i]->hnext = bucket;
+		bucket = hosts[i];
+	}
+
+	while (_num_hosts > _max_hosts)
+		EvictHostRoute();
+}
+
+
+void Ip::SetRateLimit(Limit which, uint rate, uint burst)
+{
+	assert(which < NUM_LIMITS);
+
+	Mutex::Scoped L(_lock);
+
+	_limit[which].rate = min<uint>(rate, 0xffff);
+	_limit[which].burst = min<uint>(max<uint>(burst, 1), 0xffff);
+}
+
+
+// * static
+uint Ip::PrefixLen(in_addr_t netmask)
+{
+	const uint32_t hostmask = ~Ntohl(netmask);
+	return hostmask ? __builtin_clz(hostmask) : 32;
+}
+
+
+uint Ip::HostHash(in_addr_t host) const
+{
+	// Fibonacci hashing; the top bits are the best mixed
+	const uint shift = __builtin_clz(_hosts.Size()) + 1;
+	return (Ntohl(host) * 2654435761U) >> shift;
+}
+
+
+Ip::Route* Ip::FindHostRoute(in_addr_t host) const
+{
+	_lock.AssertLocked();
+
+	if (_hosts.Empty())  return NULL;
+
+	for (Route* rt = _hosts[HostHash(host)]; rt; rt = rt->hnext)
+		if (rt->dest == host)  return rt;
+
+	return NULL;
+}
+
+
+Ip::Route* Ip::Lookup(in_addr_t dest) const
+{
+	Route* rt = FindHostRoute(dest);
+	return rt ? rt : _nets.Lookup(Ntohl(dest));
+}
+
+
+void Ip::RemoveHostRoute(Route* rt)
+{
+	_lock.AssertLocked();
+	assert(rt->type == Route::TYPE_HOSTRT);
+
+	for (Route** rp = &_hosts[HostHash(rt->dest)]; *rp; rp = &(*rp)->hnext) {
+		if (*rp == rt) {
+			*rp = rt->hnext;
+			rt->hnext = NULL;
+			--_num_hosts;
+			return;
+		}
+	}
 }
 
 
+void Ip::EvictHostRoute()
+{
+	_lock.AssertLocked();
+
+	// The timer list is ordered by expiration, so the first resolved
+	// host route is the one closest to expiring anyway.  Only evict
+	// one that is still ARPing (and may have packets pending) as a
+	// last resort.
+	Route* victim = NULL;
+	for (uint i = 0; i < _timer.Size(); ++i) {
+		Route* rt = _timer[i];
+		if (rt->type == Route::TYPE_HOSTRT) {
+			if (rt->macvalid) {
+				victim = rt;
+				break;
+			}
+			if (!victim)  victim = rt;
+		}
+	}
+
+	for (uint i = 0; !victim && i < _hosts.Size(); ++i)
+		victim = _hosts[i];
+
+	if (victim) {
+		RemoveHostRoute(victim);
+		DiscardRoute(victim);
+	}
+}
+
+
+void Ip::DiscardRoute(Route* rt)
+{
+	_lock.AssertLocked();
+
+	_timer.Erase(rt);
+	DropPending(rt);
+	rt->invalid = true;
+	rt->Release();
+}
+
+
+bool Ip::InsertNetRoute(Route* rt)
+{
+	_lock.AssertLocked();
+
+	const uint32_t key = Ntohl(rt->dest);
+	const uint plen = PrefixLen(rt->netmask);
+
+	Route* prev = _nets.Insert(key, plen, rt);
+	if (prev) {
+		if (prev->type == Route::TYPE_IF && rt->type != Route::TYPE_IF) {
+			// Don't route an attached subnet via a router
+			_nets.Insert(key, plen, prev);
+			DiscardRoute(rt);
+			return false;
+		}
+		if (prev->type == Route::TYPE_IF) {
+			const uint pos = _ifroutes.Find(prev);
+			if (pos != NOT_FOUND)  _ifroutes.Erase(pos);
+		}
+		DiscardRoute(prev);
+	}
+	return true;
+}
+
 
 void Ip::AddInterface(Ethernet& nic, in_addr_t addr, in_addr_t mask) 
 {
@@ -71,7 +305,10 @@ void Ip::AddInterface(Ethernet& nic, in_addr_t addr, in_addr_t mask)
 	RemoveInterface(nic);
 	Route* rt = new Route(nic, Route::TYPE_IF, addr, mask);
 	rt->ifroute = rt;
-	_routes.PushFront(rt);
+	memcpy(rt->macaddr, nic.GetMacAddr(), 6);
+	rt->macvalid = true;
+	_ifroutes.PushBack(rt);
+	InsertNetRoute(rt);
 }
 
 
@@ -79,19 +316,35 @@ void Ip::RemoveInterface(Ethernet& nic)
 {
 	Mutex::Scoped L(_lock);
 
-	for (uint i = 0; i < _routes.Size(); ) {
-		Route* rt = _routes[i];
-		if (&rt->netif == &nic) {
-			rt->invalid = true;
-			rt->Release();
-			_routes.Erase(i);
-		} else {
+	for (uint i = 0; i < _ifroutes.Size(); ) {
+		if (&_ifroutes[i]->netif == &nic)
+			_ifroutes.Erase(i);
+		else
 			++i;
+	}
+
+	Vector<Route*> nets;
+	_nets.Collect(nets);
+	for (uint i = 0; i < nets.Size(); ++i) {
+		Route* rt = nets[i];
+		if (&rt->netif == &nic) {
+			_nets.Erase(Ntohl(rt->dest), PrefixLen(rt->netmask));
+			DiscardRoute(rt);
 		}
 	}
 
-	// Prune pending ARP
-	ReleasePendingARP();
+	for (uint i = 0; i < _hosts.Size(); ++i) {
+		for (Route** rp = &_hosts[i]; *rp; ) {
+			Route* rt = *rp;
+			if (&rt->netif == &nic) {
+				*rp = rt->hnext;
+				--_num_hosts;
+				DiscardRoute(rt);
+			} else {
+				rp = &rt->hnext;
+			}
+		}
+	}
 }
 
 
@@ -99,9 +352,8 @@ Ip::Route* Ip::FindIfRoute(Ethernet& netif)
 {
 	_lock.AssertLocked();
 
-	for (uint i = 0; i < _routes.Size(); ++i) {
-		Route* rt = _routes[i];
-		if (rt->type != Route::TYPE_IF) break;
+	for (uint i = 0; i < _ifroutes.Size(); ++i) {
+		Route* rt = _ifroutes[i];
 		if (&rt->netif == &netif)  return rt;
 	}
 
@@ -111,22 +363,7 @@ Ip::Route* Ip::FindIfRoute(Ethernet& netif)
 
 void Ip::AddDefaultRoute(Ethernet& nic, in_addr_t router)
 {
-	Mutex::Scoped L(_lock);
-
-	Route* netif = FindIfRoute(nic);
-	if (!netif) return;
-
-	// Insert immediately following last TYPE_IF
-	int pos;
-	for (pos = _routes.Size() - 1; pos >= 0; --pos) {
-		if (_routes[pos]->type == Route::TYPE_IF) {
-			Route* rt = new Route(nic, Route::TYPE_RT, 0, 0);
-			rt->nexthop = router;
-			rt->ifroute = netif;
-			_routes.Insert(pos + 1) = rt;
-			break;
-		}
-	}
+	AddNetRoute(nic, 0, 0, router);
 }
 
 
@@ -137,89 +374,108 @@ void Ip::AddNetRoute(Ethernet& nic, in_addr_t network, in_addr_t netmask, in_add
 	Route* netif = FindIfRoute(nic);
 	if (!netif) return;
 
-	// Insert immediately following last TYPE_RT
-	for (int pos = _routes.Size() - 1; pos >= 0; --pos) {
-		if (_routes[pos]->type == Route::TYPE_RT) {
-			Route* rt = new Route(nic, Route::TYPE_RT, network, netmask);
-			rt->nexthop = router;
-			rt->ifroute = netif;
-			_routes.Insert(pos + 1) = rt;
-			break;
-		}
-	}
+	Route* rt = new Route(nic, Route::TYPE_RT, network, netmask);
+	rt->nexthop = router;
+	rt->ifroute = netif;
+	InsertNetRoute(rt);
 }
 
 
 Ip::Route* Ip::AddHostRoute(in_addr_t host, Route* rt)
 {
 	_lock.AssertLocked();
-	assert(rt->type == Route::TYPE_IF);
+	assert(rt->type == Route::TYPE_IF || rt->type == Route::TYPE_RT);
+	assert(!_hosts.Empty());
+
+	if (_num_hosts >= _max_hosts)
+		EvictHostRoute();
 
 	Route *hostrt = new Route(rt->netif, Route::TYPE_HOSTRT, host);
-	hostrt->nexthop = host;
-	hostrt->macvalid = false;
-	hostrt->ifroute = rt;
-	_routes.PushBack(hostrt);
+	if (rt->type == Route::TYPE_IF) {
+		hostrt->nexthop = host;
+		hostrt->macvalid = false;
+		hostrt->ifroute = rt;
+	} else {
+		hostrt->nexthop = rt->nexthop;
+		memcpy(hostrt->macaddr, rt->macaddr, 6);
+		hostrt->macvalid = rt->macvalid;
+		hostrt->ifroute = rt->ifroute;
+		hostrt->pmtu = rt->pmtu;
+	}
+
+	Route*& bucket = _hosts[HostHash(host)];
+	hostrt->hnext = bucket;
+	bucket = hostrt;
+	++_num_hosts;
 
 	return hostrt;
 }
 
 
-void Ip::ReleasePendingARP()
+Ip::Route* Ip::AddGroupRoute(in_addr_t group)
 {
-	Mutex::Scoped L(_lock);
+	_lock.AssertLocked();
 
-	for (uint i = 0; i < _pending_arp.Size(); ) {
-		IOBuffer* packet = _pending_arp[i];
-		const in_addr_t dest = GetIph(packet).dest;
-		const bool is_icmp = GetIph(packet).proto == IPPROTO_ICMP;
-		bool remove_packet = false;
-
-		for (int n = _routes.Size() - 1; n >= 0; --n) {
-			Route* rt = _routes[n];
-			if (rt->dest == (dest & rt->netmask)) {
-				if (rt->macvalid) {
-					if (is_icmp) {
-						// Throttle ICMP
-						if (Time::Now() < rt->lasticmp + Time::FromSec(1)) {
-							BufferPool::FreeBuffer(packet);
-							remove_packet = true;
-							goto done;
-						}
-						rt->lasticmp = Time::Now();
-					}
-
-					FillMacHeader(packet, rt);
-					rt->netif.Send(packet);
-					remove_packet = true;
-				}
-				// remove_packet = false;
-				goto done;
-			}
-		}
+	if (_ifroutes.Empty())
+		return NULL;
 
-		// No route found for datagram - drop it
-		remove_packet = true;
+	Route* rt = AddHostRoute(group, _ifroutes[0]);
+	Igmp::GetGroupMac(group, rt->macaddr);
+	rt->macvalid = true;
+	SetRouteTimer(rt, HOSTRT_EXPIRE);
 
-	done:
-		if (remove_packet) {
-			if (i != _pending_arp.Size() -1)
-				_pending_arp[i] = _pending_arp.Back();
+	return rt;
+}
 
-			_pending_arp.PopBack();
-		} else
-			++i;
+
+void Ip::QueuePending(Route* rt, IOBuffer* packet)
+{
+	_lock.AssertLocked();
+
+	if (rt->npending == ARP_PENDING_MAX) {
+		// Drop oldest
+		NetStats::Inc(_netstats.arp.pending_drops);
+		BufferPool::FreeBuffer(rt->pending[0]);
+		memmove(rt->pending, rt->pending + 1, (ARP_PENDING_MAX - 1) * sizeof rt->pending[0]);
+		--rt->npending;
+	}
+
+	rt->pending[rt->npending++] = packet;
+}
+
+
+void Ip::ReleasePending(Route* rt)
+{
+	_lock.AssertLocked();
+	assert(rt->macvalid);
+
+	for (uint i = 0; i < rt->npending; ++i) {
+		rt->pending[i]->SetHead(rt->netif.GetPrealloc());
+		Transmit(rt, rt->pending[i]);
 	}
+	rt->npending = 0;
 }
 
 
+void Ip::DropPending(Route* rt)
+{
+	_lock.AssertLocked();
+
+	for (uint i = 0; i < rt->npending; ++i)
+		BufferPool::FreeBuffer(rt->pending[i]);
+	NetStats::Inc(_netstats.arp.pending_drops, rt->npending);
+	rt->npending = 0;
+}
+
 void Ip::FillMacHeader(IOBuffer* buf, Route* rt)
 {
-	buf->SetHead(0);
-	memcpy(*buf + 2, rt->macaddr, 6);
-	memcpy(*buf + 2 + 6, rt->netif.GetMacAddr(), 6);
+	// Prepend link header to IP header
+	buf->SetHead(rt->netif.GetPrealloc());
+	uint8_t* mac = buf->Prepend(rt->netif.GetPrealloc() - rt->netif.GetBufPad());
+	memcpy(mac, rt->macaddr, 6);
+	memcpy(mac + 6, rt->netif.GetMacAddr(), 6);
 	const uint16_t et = Htons(ETHERTYPE_IP);
-	memcpy(*buf + 2 + 6, &et, 2);
+	memcpy(mac + 12, &et, 2);
 }
 
 
@@ -227,115 +483,198 @@ void Ip::FillHeader(IOBuffer* buf, Route* rt, bool df)
 {
 	FillMacHeader(buf, rt);
 
-	// Fill in source addr
+	const Route* ifroute = rt->type == Route::TYPE_IF ? rt : rt->ifroute;
+	assert(ifroute);
+	assert(ifroute->type == Route::TYPE_IF);
+
 	Iph& iph = GetIph(buf);
-	if (true /* iph.source == INADDR_ANY */) {
-		const Route* ifroute = rt->type == Route::TYPE_IF ? rt : rt->ifroute;
-		assert(ifroute);
-		assert(ifroute->type == Route::TYPE_IF);
-		iph.source = ifroute->nexthop;
-	}
 
 	// id = 0 means header is not yet filled in
 	// Source, dest need to be filled in
-	if (!iph.id)  {
+	if (iph.id) {
+		// Already checksummed
+		if (iph.source != ifroute->nexthop)
+			iph.SetSource(ifroute->nexthop);
+	} else {
+		iph.source = ifroute->nexthop;
 		iph.id = ++_id;
 
 		iph.SetHLen(sizeof (Iph));
 		iph.tos = 0;
-		iph.off = df ? Iph::IPFLAG_DF : 0;
-		iph.ttl = 255;
+		iph.off = df ? Htons(Iph::IPFLAG_DF) : 0;
+		iph.ttl = IsMulticast(iph.dest) ? 1 : 255;
 
 		// Length and checksum
-		iph.len = Htons(*buf + buf->Size() - (uint8_t*)&iph);
-		iph.SetCsum();
+		iph.len = Htons(buf->ChainSize() - ((uint8_t*)&iph - (*buf + 0)));
+		if (rt->netif.GetOffload() & OFFLOAD_TX_IPCSUM)
+			iph.sum = 0;
+		else
+			iph.SetCsum();
+	}
+}
+
+
+void Ip::Transmit(Route* rt, IOBuffer* packet)
+{
+	_lock.AssertLocked();
+
+	if (packet->ChainSize() > rt->pmtu) {
+		Fragment(rt, packet);
+		return;
+	}
+
+	FillMacHeader(packet, rt);
+	rt->netif.Send(packet);
+}
+
+
+// Copy len bytes, starting offset bytes in, out of a buffer chain
+static void ChainCopy(uint8_t* dest, const IOBuffer* buf, uint offset, uint len)
+{
+	for (const IOBuffer* b = buf; len; b = b->GetNext()) {
+		assert(b);
+		if (offset >= b->Size()) {
+			offset -= b->Size();
+			continue;
+		}
+
+		const uint n = min(len, b->Size() - offset);
+		memcpy(dest, *b + offset, n);
+		dest += n;
+		len -= n;
+		offset = 0;
 	}
 }
 
 
+void Ip::Fragment(Route* rt, IOBuffer* packet)
+{
+	_lock.AssertLocked();
+
+	const Iph& iph = *(const Iph*)(*packet + 0);
+	const uint hlen = iph.GetHLen();
+	const uint total = packet->ChainSize() - hlen;
+
+	// All but the last fragment carry a multiple of 8 bytes
+	const uint maxlen = (rt->pmtu - hlen) & ~7;
+	const uint prealloc = rt->netif.GetPrealloc();
+
+	for (uint off = 0; off < total; off += maxlen) {
+		const uint len = min(maxlen, total - off);
+
+		IOBuffer* frag = BufferPool::AllocTx(prealloc + hlen + len);
+		if (!frag) {
+			NetStats::Inc(_netstats.ip.out_discards);
+			BufferPool::FreeBuffer(packet);
+			return;
+		}
+
+		frag->SetHeadroom(prealloc);
+		frag->SetSize(hlen + len);
+
+		Iph& fiph = *(Iph*)(*frag + 0);
+		memcpy(&fiph, &iph, hlen);
+		ChainCopy(*frag + hlen, packet, hlen + off, len);
+
+		fiph.len = Htons(hlen + len);
+		fiph.off = Htons(off / 8 | (off + len < total ? Iph::IPFLAG_MF : 0));
+		if (rt->netif.GetOffload() & OFFLOAD_TX_IPCSUM)
+			fiph.sum = 0;
+		else
+			fiph.SetCsum();
+
+		FillMacHeader(frag, rt);
+		rt->netif.Send(frag);
+		NetStats::Inc(_netstats.ip.frag_creates);
+	}
+
+	NetStats::Inc(_netstats.ip.frag_oks);
+	BufferPool::FreeBuffer(packet);
+}
+
+
 Ip::Route* Ip::Send(IOBuffer* buf, in_addr_t dest, const Checksummer& tcsum,
 					Ip::Route* prevrt, bool df)
 {
+	// A header that has already been filled in (buffer sent before)
+	// just needs its checksum adjusted
 	Iph& iph = GetIph(buf);
-	iph.dest = dest;
+	if (!iph.id)
+		iph.dest = dest;
+	else if (iph.dest != dest)
+		iph.SetDest(dest);
+
+	NetStats::Inc(_netstats.ip.out_requests);
 
 	Mutex::Scoped L(_lock);
 
-	if (prevrt) {
-		if (prevrt->invalid) {
-			prevrt->Release();
-		} else {
-#if 0
-			// Throttle back ICMP.  We throttle before adding to the ARP list as
-			// well as when we drain it after successful ARP.
-			// XXX we never get here...
-			if (iph.proto == IPPROTO_ICMP) {
-				if (Time::Now() < prevrt->lasticmp + Time::FromSec(1)) {
-					BufferPool::FreeBuffer(buf);
-					return prevrt;
-				}
-				prevrt->lasticmp = Time::Now();
-			}
-#endif
-			FillHeader(buf, prevrt, df);
-			buf->SetHead(prevrt->netif.GetPrealloc());
-			tcsum.Checksum(buf);
-
-			if (prevrt->macvalid) {
-				prevrt->netif.Send(buf);
-				return prevrt;
-			} 
-
-			// No ARP info yet.
-			_pending_arp.PushBack(buf);
-			return prevrt;
+	Route* rt = prevrt;
+	if (rt && rt->invalid) {
+		rt->Release();
+		rt = NULL;
+	}
+
+	// A host route added since the network route was cached, e.g. to
+	// hold a path MTU, takes over
+	if (rt && rt->type == Route::TYPE_RT) {
+		Route* hostrt = FindHostRoute(dest);
+		if (hostrt) {
+			rt->Release();
+			rt = hostrt;
 		}
 	}
 
-	const bool is_icmp = iph.proto == IPPROTO_ICMP;
+	if (!rt) {
+		rt = Lookup(dest);
 
-	for (int i = _routes.Size()-1; i >= 0; --i) {
-		Route* rt = _routes[i];
-		if (rt->dest == (dest & rt->netmask)) {
-			if (is_icmp) {
-				// Throttle ICMP
-				if (Time::Now() < rt->lasticmp + Time::FromSec(1)) {
-					BufferPool::FreeBuffer(buf);
-					return rt;
-				}
-				rt->lasticmp = Time::Now();
-			}
+		// First datagram to a group
+		if (IsMulticast(dest) && (!rt || rt->type != Route::TYPE_HOSTRT))
+			rt = AddGroupRoute(dest);
 
-			if (rt->macvalid) {
-				FillHeader(buf, rt, df);
-				buf->SetHead(rt->netif.GetPrealloc());
-				tcsum.Checksum(buf);
-
-				if (rt->type == Route::TYPE_IF) {
-					if (rt->dest == dest) {
-						rt->netif.Send(buf); // Loopback: ethernet driver will return it
-						return rt;
-					} else {
-						Route* hostrt = AddHostRoute(dest, rt);
-						_pending_arp.PushBack(buf);
-						RequestARP(hostrt);
-						return hostrt;
-					}
-				} else {
-					rt->netif.Send(buf);
-					return rt;
-				}
-			} else {
-				_pending_arp.PushBack(buf);
-				RequestARP(rt);
-				return rt;
-			}
+		if (!rt) {
+			NetStats::Inc(_netstats.ip.out_no_routes);
+			BufferPool::FreeBuffer(buf);
+			return NULL;
 		}
+
+		// On-link peer without a host route yet.  Sending to our own
+		// address goes straight out; the ethernet driver loops it back.
+		if (rt->type == Route::TYPE_IF && dest != rt->nexthop)
+			rt = AddHostRoute(dest, rt);
 	}
 
-	// No route
-	BufferPool::FreeBuffer(buf);
-	return NULL;
+	FillHeader(buf, rt, df);
+	buf->SetHead(rt->netif.GetPrealloc());
+
+	// The NIC can't sum a datagram it sees in pieces
+	const bool frag = buf->ChainSize() > rt->pmtu;
+	if (frag && df) {
+		NetStats::Inc(_netstats.ip.frag_fails);
+		BufferPool::FreeBuffer(buf);
+		return rt;
+	}
+
+	if (!frag && (rt->netif.GetOffload() & OFFLOAD_TX_CSUM)) {
+		++_csum_stats.tx_offload;
+	} else {
+		tcsum.Checksum(buf);
+		++_csum_stats.tx_sw;
+	}
+
+	if (rt->macvalid) {
+		if (frag)
+			Fragment(rt, buf);
+		else
+			rt->netif.Send(buf);
+		return rt;
+	}
+
+	// No ARP info yet
+	QueuePending(rt, buf);
+	if (!rt->arpcount)
+		RequestARP(rt);
+
+	return rt;
 }
 
 
@@ -347,71 +686,142 @@ void Ip::SatisfiedARP(Route* rt, const uint8_t* macaddr)
 	memcpy(rt->macaddr, macaddr, 6);
 	rt->macvalid = true;
 	rt->arpcount = 0;
-	ReleasePendingARP();
+	if (rt->npending)
+		ReleasePending(rt);
 }
 
 
+void Ip::ResolvedARP(in_addr_t addr, const uint8_t* macaddr)
+{
+	_lock.AssertLocked();
+
+	// Host routes: on-link peers, and remote hosts via a router.  The
+	// latter only exist to hold a path MTU and keep their own timer.
+	for (uint i = 0; i < _hosts.Size(); ++i) {
+		for (Route* rt = _hosts[i]; rt; rt = rt->hnext) {
+			if (rt->nexthop != addr)
+				continue;
+
+			if (rt->dest != addr && rt->macvalid)
+				memcpy(rt->macaddr, macaddr, 6);
+			else
+				SatisfiedARP(rt, macaddr);
+		}
+	}
+
+	// Routers
+	Vector<Route*> nets;
+	_nets.Collect(nets);
+	for (uint i = 0; i < nets.Size(); ++i) {
+		Route* rt = nets[i];
+		if (rt->type == Route::TYPE_RT && rt->nexthop == addr)
+			SatisfiedARP(rt, macaddr);
+	}
+}
+
 
 void Ip::Receive(IOBuffer* packet)
 {
 	Iph& iph = GetIph(packet);
+	const bool verified = packet->IsCsumVerified();
+
+	NetStats::Inc(_netstats.ip.in_receives);
 
-	if (_routes.Empty() || packet->Size() < (uint)16 + Ntohs(iph.len) ||
-		!iph.ValidateCsum()) {
+	if (iph.GetVersion() != 4 || iph.GetHLen() < sizeof (Iph) ||
+		Ntohs(iph.len) < iph.GetHLen() || packet->Size() < Ntohs(iph.len) ||
+		(!verified && !iph.ValidateCsum())) {
+		NetStats::Inc(_netstats.ip.in_hdr_errors);
 		BufferPool::FreeBuffer(packet);
 		return;
 	}
 
+	// Drop link layer padding
+	packet->SetSize(Ntohs(iph.len));
+
 	const in_addr_t dest = iph.dest;
 	const in_addr_t source = iph.source;
-	Route* hostrt = NULL;
 	Route* netif = NULL;
 
+	// Checked before taking the lock, as Igmp sends holding its own
+	const bool group = IsMulticast(dest);
+	if (group && !_igmp.IsMember(dest)) {
+		NetStats::Inc(_netstats.ip.in_addr_errors);
+		BufferPool::FreeBuffer(packet);
+		return;
+	}
+
 	{
 		Mutex::Scoped L(_lock);
 
-		for (int i = _routes.Size()-1; i >= 0; --i) {
-			Route* rt = _routes[i];
-			if (rt->dest == (dest & rt->netmask)) {
-				if (rt->type == Route::TYPE_HOSTRT) {
-					SatisfiedARP(rt, GetMacSource(packet)); // Glean ARP info
-					hostrt = rt;
-				} else if (rt->type == Route::TYPE_IF) {
-					netif = rt;
-					break;
-				}
-			}
+		if (group && !_ifroutes.Empty())
+			netif = _ifroutes[0];
+
+		for (uint i = 0; !netif && i < _ifroutes.Size(); ++i) {
+			Route* rt = _ifroutes[i];
+			if (rt->dest == (dest & rt->netmask))
+				netif = rt;
 		}
 
 		if (!netif) {
+			NetStats::Inc(_netstats.ip.in_addr_errors);
 			BufferPool::FreeBuffer(packet);
 			return;
 		}
 
-		if (!hostrt) {
+		if (verified)
+			++_csum_stats.rx_offload;
+		else
+			++_csum_stats.rx_sw;
+
+		// Glean ARP info from on-link peers we already talk to.  An
+		// entry that is resolved and current is left alone.
+		Route* hostrt = FindHostRoute(source);
+		if (hostrt && hostrt->nexthop == source &&
+			(!hostrt->macvalid ||
+			 hostrt->expire < Time::Now() + Time::FromSec(HOSTRT_EXPIRE / 2) ||
+			 memcmp(hostrt->macaddr, GetMacSource(packet), 6))) {
 			SatisfiedARP(hostrt, GetMacSource(packet));
 		}
+
+		if (iph.IsFragment()) {
+			NetStats::Inc(_netstats.ip.reasm_reqds);
+			if (!(packet = Reassemble(packet)))
+				return;
+		}
 	}
 
 	assert(netif);
 	const uint proto = GetIph(packet).proto;
 
+	// Only UDP takes a datagram in pieces
+	if (packet->GetNext() && proto != IPPROTO_UDP) {
+		NetStats::Inc(_netstats.ip.in_discards);
+		BufferPool::FreeBuffer(packet);
+		return;
+	}
+
 	// Skip past MAC header for transport
 	packet->SetHead(netif->netif.GetPrealloc());
 
 	switch (proto) {
 	case IPPROTO_ICMP:
+		NetStats::Inc(_netstats.ip.in_delivers);
 		IcmpReceive(packet);
 		break;
+	case IPPROTO_IGMP:
+		NetStats::Inc(_netstats.ip.in_delivers);
+		_igmp.Receive(packet);
+		break;
 	case IPPROTO_UDP:
+		NetStats::Inc(_netstats.ip.in_delivers);
 		_udp.Receive(packet);
 		break;
-#if 0
 	case IPPROTO_TCP:
-		Tcp::Receive(packet);
+		NetStats::Inc(_netstats.ip.in_delivers);
+		_tcp.Receive(packet);
 		break;
-#endif
 	default:
+		NetStats::Inc(_netstats.ip.in_unknown_protos);
 		IcmpSend(source, Icmph::ICMP_DEST_UNREACH, Icmph::ICMP_PROTO_UNREACH, packet);
 		BufferPool::FreeBuffer(packet);
 		return;
@@ -419,64 +829,343 @@ void Ip::Receive(IOBuffer* packet)
 }
 
 
+IOBuffer* Ip::Reassemble(IOBuffer* packet)
+{
+	_lock.AssertLocked();
+
+	Iph& iph = GetIph(packet);
+	const uint hlen = iph.GetHLen();
+	const uint off = iph.GetOffset();
+	const uint len = Ntohs(iph.len) - hlen;
+	const bool last = !(iph.GetFlags() & Iph::IPFLAG_MF);
+
+	// All but the last fragment carry a multiple of 8 bytes
+	if (!len || (!last && (len & 7)) || off + len > 0xffff - hlen) {
+		NetStats::Inc(_netstats.ip.reasm_fails);
+		BufferPool::FreeBuffer(packet);
+		return NULL;
+	}
+
+	// Find datagram, a free entry, and the oldest ones to evict
+	Reasm* r = NULL;
+	Reasm* slot = NULL;
+	Reasm* oldest = NULL;
+	Reasm* oldest_src = NULL;
+	uint nsrc = 0;
+
+	for (uint i = 0; i < IP_REASM_MAX; ++i) {
+		Reasm& e = _reasm[i];
+		if (!e.nfrags) {
+			if (!slot)  slot = &e;
+			continue;
+		}
+
+		if (e.id == iph.id && e.source == iph.source && e.dest == iph.dest &&
+			e.proto == iph.proto) {
+			r = &e;
+			continue;
+		}
+
+		if (!oldest || e.expire < oldest->expire)
+			oldest = &e;
+
+		if (e.source == iph.source) {
+			++nsrc;
+			if (!oldest_src || e.expire < oldest_src->expire)
+				oldest_src = &e;
+		}
+	}
+
+	if (!r) {
+		// A source over its share makes room itself, otherwise the
+		// oldest goes if the table is full
+		if (nsrc >= IP_REASM_PER_SOURCE) {
+			ReasmFree(*oldest_src);
+			slot = oldest_src;
+		} else if (!slot) {
+			ReasmFree(*oldest);
+			slot = oldest;
+		}
+
+		r = slot;
+		r->source = iph.source;
+		r->dest = iph.dest;
+		r->id = iph.id;
+		r->proto = iph.proto;
+		r->len = 0;
+		r->have = 0;
+		r->expire = Time::Now() + Time::FromSec(IP_REASM_TIMEOUT);
+	}
+
+	// Fragments don't get to use up the receive buffers.  Make room
+	// by evicting the oldest other datagram, or give up on this one.
+	if (_reasm_bufs >= _reasm_max_bufs) {
+		Reasm* victim = NULL;
+		for (uint i = 0; i < IP_REASM_MAX; ++i) {
+			Reasm& e = _reasm[i];
+			if (e.nfrags && &e != r && (!victim || e.expire < victim->expire))
+				victim = &e;
+		}
+
+		if (!victim) {
+			ReasmFree(*r);
+			BufferPool::FreeBuffer(packet);
+			return NULL;
+		}
+		ReasmFree(*victim);
+	}
+
+	uint pos = 0;
+	while (pos < r->nfrags && r->offset[pos] < off)
+		++pos;
+
+	// Retransmitted duplicate
+	if (pos < r->nfrags && r->offset[pos] == off && r->frag[pos]->Size() == len) {
+		BufferPool::FreeBuffer(packet);
+		return NULL;
+	}
+
+	// Overlaps and inconsistent lengths are treated as an attack on
+	// the datagram rather than resolved (cf. RFC 5722)
+	const uint end = off + len;
+	if ((pos > 0 && r->offset[pos-1] + r->frag[pos-1]->Size() > off) ||
+		(pos < r->nfrags && end > r->offset[pos]) ||
+		(r->len && (last || end > r->len)) ||
+		(last && pos < r->nfrags) ||
+		r->nfrags == IP_REASM_FRAGS) {
+		ReasmFree(*r);
+		BufferPool::FreeBuffer(packet);
+		return NULL;
+	}
+
+	// Hold with head at payload
+	packet->SetHead(packet->GetHead() + hlen);
+	packet->SetSize(len);
+
+	memmove(r->offset + pos + 1, r->offset + pos, (r->nfrags - pos) * sizeof r->offset[0]);
+	memmove(r->frag + pos + 1, r->frag + pos, (r->nfrags - pos) * sizeof r->frag[0]);
+	r->offset[pos] = off;
+	r->frag[pos] = packet;
+	++r->nfrags;
+	++_reasm_bufs;
+	r->have += len;
+	if (last)
+		r->len = end;
+
+	if (!r->len || r->have != r->len)
+		return NULL;
+
+	// Complete.  The first fragment's header becomes the datagram's.
+	IOBuffer* first = r->frag[0];
+	Iph& fiph = GetIph(first);
+	fiph.len = Htons(fiph.GetHLen() + r->len);
+	fiph.off = 0;
+	fiph.SetCsum();
+	first->SetCsumVerified(false);
+
+	// Gather into the first buffer as far as it goes, chain the rest
+	IOBuffer* tail = first;
+	for (uint i = 1; i < r->nfrags; ++i) {
+		IOBuffer* f = r->frag[i];
+		const uint size = first->Size();
+		if (tail == first && first->GetHead() + size + f->Size() <= first->GetReserve()) {
+			first->SetSize(size + f->Size());
+			memcpy(*first + size, *f + 0, f->Size());
+			BufferPool::FreeBuffer(f);
+		} else {
+			tail->SetNext(f);
+			tail = f;
+		}
+	}
+
+	_reasm_bufs -= r->nfrags;
+	r->nfrags = 0;
+
+	NetStats::Inc(_netstats.ip.reasm_oks);
+	return first;
+}
+
+
+void Ip::ReasmFree(Reasm& r)
+{
+	_lock.AssertLocked();
+
+	for (uint i = 0; i < r.nfrags; ++i)
+		BufferPool::FreeBuffer(r.frag[i]);
+
+	if (r.nfrags)
+		NetStats::Inc(_netstats.ip.reasm_fails);
+
+	_reasm_bufs -= r.nfrags;
+	r.nfrags = 0;
+}
+
+
+void Ip::ReasmService(const Time& now)
+{
+	_lock.AssertLocked();
+
+	for (uint i = 0; i < IP_REASM_MAX; ++i) {
+		Reasm& r = _reasm[i];
+		if (!r.nfrags || r.expire > now)
+			continue;
+
+		// Tell the sender if we have the first fragment (RFC 1122 3.3.2)
+		if (!r.offset[0]) {
+			GetIph(r.frag[0]);
+			IcmpSend(r.source, Icmph::ICMP_TTL_EXC, Icmph::ICMP_IN_REASS, r.frag[0]);
+		}
+
+		ReasmFree(r);
+	}
+}
+
+
+uint Ip::GetPathMtu(in_addr_t dest) const
+{
+	Mutex::Scoped L(_lock);
+
+	const Route* rt = Lookup(dest);
+	return rt ? rt->pmtu : IP_MTU;
+}
+
+
+void Ip::LearnPmtu(in_addr_t dest, uint mtu, uint len)
+{
+	// RFC 1191 plateaus, for routers that don't report the MTU
+	static const uint16_t plateau[] = {
+		32000, 17914, 8166, 4352, 2002, 1492, 1006, 508, 296, IP_MTU_MIN
+	};
+
+	if (!mtu) {
+		uint i = 0;
+		while (plateau[i] >= len && plateau[i] > IP_MTU_MIN)
+			++i;
+		mtu = plateau[i];
+	}
+
+	mtu = max<uint>(mtu, IP_MTU_MIN);
+
+	Mutex::Scoped L(_lock);
+
+	Route* rt = FindHostRoute(dest);
+	if (!rt) {
+		Route* base = _nets.Lookup(Ntohl(dest));
+		if (!base || mtu >= base->pmtu)
+			return;
+
+		rt = AddHostRoute(dest, base);
+		if (rt->macvalid)
+			SetRouteTimer(rt, PMTU_EXPIRE);
+	}
+
+	if (mtu < rt->pmtu)
+		rt->pmtu = mtu;
+}
+
+
 void Ip::ArpReceive(IOBuffer* packet)
 {
 	Mutex::Scoped L(_lock);
 
 	Arph& arp = GetArph(packet);
-	if (Htons(arp.fixed.op) == ARPOP_REQ) {
-		HandleARP(packet);
-		return;
-	}
 
-	if (Htons(arp.fixed.op) != ARPOP_REP) {
+	if (Ntohs(arp.fixed.macfmt) != ARPMAC_ETHER ||
+		Ntohs(arp.fixed.protofmt) != ETHERTYPE_IP ||
+		arp.fixed.maclen != 6 || arp.fixed.protolen != 4) {
+
+		// Nothing we can resolve
+		NetStats::Inc(_netstats.arp.in_errors);
 		BufferPool::FreeBuffer(packet);
 		return;
 	}
 
+	// Update existing entries for the sender, request or reply (RFC 826)
 	in_addr_t arp_addr;
 	memcpy(&arp_addr, arp.sip, 4);	// Not 32 bit aligned
-	const uint8_t* arp_macaddr = arp.sea;
-
-	for (int i = _routes.Size()-1; i >= 0; --i) {
-		Route* rt = _routes[i];
-		if (rt->dest == (arp_addr & rt->netmask)) {
-			memcpy(rt->macaddr, arp_macaddr, 6);
-			SetRouteTimer(rt, HOSTRT_EXPIRE);
-			ReleasePendingARP();
-			break;
-		}
+	ResolvedARP(arp_addr, arp.sea);
+
+	// Another host using one of our addresses
+	for (uint i = 0; i < _ifroutes.Size(); ++i) {
+		const Route* rt = _ifroutes[i];
+		if (rt->nexthop == arp_addr && memcmp(arp.sea, rt->netif.GetMacAddr(), 6))
+			_conflict = arp_addr;
+	}
+
+	if (Ntohs(arp.fixed.op) == ARPOP_REQ) {
+		NetStats::Inc(_netstats.arp.in_requests);
+		HandleARP(packet);
+		return;
 	}
+
+	NetStats::Inc(_netstats.arp.in_replies);
+	BufferPool::FreeBuffer(packet);
 }
 
 
 void Ip::RequestARP(Route* rt)
 {
 	_lock.AssertLocked();
-	if (_routes.Empty()) return; // Can't ARP without a configure i/f
 
 	if (rt->type == Route::TYPE_IF) return; // Don't ARP for a local interface!
 
-	int netif = -1;
-	for (uint i = 0; i < _routes.Size(); ++i) {
-		assert(_routes[i]->type == Route::TYPE_IF);
+	const Route* netif = rt->ifroute;
+	assert(netif);
 
-		if (&_routes[i]->netif == &rt->netif) {
-			netif = i;
-			break;
-		}
-	}
+	if (!ArpAllowed())
+		NetStats::Inc(_netstats.arp.out_throttled);
+	else if (!SendArpRequest(rt->netif, netif->nexthop, rt->nexthop))
+		return;
 
-	assert(netif != -1);
+	rt->macvalid = false;
 
-	IOBuffer* buf = BufferPool::AllocTx();
-	if (!buf) return;
+	++rt->arpcount;
+	SetRouteTimer(rt, 1);
+}
+
+
+bool Ip::ArpAllowed()
+{
+	_lock.AssertLocked();
+
+	return _arp_bucket.Allow(Time::Now(), _limit[LIMIT_ARP]);
+}
+
+
+void Ip::ProbeARP(Ethernet& nic, in_addr_t addr)
+{
+	Mutex::Scoped L(_lock);
+
+	SendArpRequest(nic, INADDR_ANY, addr);
+}
+
+
+bool Ip::TakeConflict(in_addr_t addr)
+{
+	Mutex::Scoped L(_lock);
+
+	if (addr == INADDR_ANY || _conflict != addr)
+		return false;
+
+	_conflict = INADDR_ANY;
+	return true;
+}
+
+
+bool Ip::SendArpRequest(Ethernet& nic, in_addr_t sip, in_addr_t dip)
+{
+	_lock.AssertLocked();
+
+	IOBuffer* buf = BufferPool::AllocTx(16 + sizeof (Arph));
+	if (!buf) return false;
 
+	buf->SetHead(0);
 	buf->SetSize(16 + sizeof (Arph));
-	memcpy(*buf + 2, _routes[netif]->macaddr, 6);
-	memcpy(*buf + 2 + 6, rt->netif.GetBcastAddr(), 6);
+	uint8_t* mac = GetMacDest(buf);
+	memcpy(mac, nic.GetBcastAddr(), 6);
+	memcpy(mac + 6, nic.GetMacAddr(), 6);
 	const uint16_t et = Htons(ETHERTYPE_ARP);
-	memcpy(*buf + 2 + 6 + 6, &et, 2);
+	memcpy(mac + 12, &et, 2);
 
 	Arph& arp = GetArph(buf);
 	arp.fixed.macfmt = Htons(ARPMAC_ETHER);
@@ -484,17 +1173,15 @@ void Ip::RequestARP(Route* rt)
 	arp.fixed.maclen = sizeof arp.dea;
 	arp.fixed.protolen = sizeof arp.dip;
 	arp.fixed.op = Htons(ARPOP_REQ);
-	memcpy(arp.sea, rt->netif.GetMacAddr(), 6);
-	memcpy(arp.sip, &_routes[netif]->nexthop, 4);
+	memcpy(arp.sea, nic.GetMacAddr(), 6);
+	memcpy(arp.sip, &sip, 4);
 	memset(arp.dea, 0, sizeof arp.dea);
-	memcpy(arp.dip, &rt->nexthop, 4);
-
-	rt->macvalid = false;
-
-	++rt->arpcount;
-	SetRouteTimer(rt, 1);
+	memcpy(arp.dip, &dip, 4);
 
-	rt->netif.Send(buf);
+	buf->SetHead(nic.GetBufPad());
+	nic.Send(buf);
+	NetStats::Inc(_netstats.arp.out_requests);
+	return true;
 }
 
 
@@ -502,75 +1189,84 @@ void Ip::HandleARP(IOBuffer* packet)
 {
 	_lock.AssertLocked();
 
-	packet->SetHead(2);         // XXX
 	Arph& arp = GetArph(packet);
 
-	if (packet->Size() < 16 + sizeof (Arph) ||
-		Ntohs(arp.fixed.macfmt) != ARPMAC_ETHER ||
-		Ntohs(arp.fixed.protofmt) != ETHERTYPE_IP ||
-		arp.fixed.maclen != 6 || arp.fixed.protolen != 4) {
-
-		// Nothing we can resolve
-		BufferPool::FreeBuffer(packet);
-		return;
-	}
-		
 	in_addr_t arp_addr;
 	memcpy(&arp_addr, arp.dip, 4);
-	const uint8_t* arp_macaddr = arp.dea;
 
-	for (uint i = 0; i < _routes.Size(); ++i) {
-		Route* rt = _routes[i];
-		if (rt->nexthop == arp_addr && rt->macvalid) {
+	for (uint i = 0; i < _ifroutes.Size(); ++i) {
+		Route* rt = _ifroutes[i];
+		if (rt->nexthop == arp_addr) {
+			// Turn request around
 			arp.fixed.op = Htons(ARPOP_REP);
-			memcpy(arp.sea, rt->macaddr, 6);
-			memcpy(arp.sip, &_routes[0]->nexthop, 4);
-			memcpy(arp.dea, arp_macaddr, 6);
-			memcpy(arp.dip, &arp_addr, 4);
+			memcpy(arp.dea, arp.sea, 6);
+			memcpy(arp.dip, arp.sip, 4);
+			memcpy(arp.sea, rt->netif.GetMacAddr(), 6);
+			memcpy(arp.sip, &arp_addr, 4);
+
+			uint8_t* mac = GetMacDest(packet);
+			memcpy(mac, arp.dea, 6);
+			memcpy(mac + 6, rt->netif.GetMacAddr(), 6);
+
+			packet->SetHead(rt->netif.GetBufPad());
 			rt->netif.Send(packet);
+			NetStats::Inc(_netstats.arp.out_replies);
 			return;
 		}
 	}
-}
 
+	BufferPool::FreeBuffer(packet);
+}
 
 void Ip::IcmpReceive(IOBuffer* packet)
 {
 	Iph& iph = GetIph(packet);
 	Icmph& icmph = *(Icmph*)iph.GetTransport();
+	const uint len = Ntohs(iph.len) - iph.GetHLen();
+
+	NetStats::Inc(_netstats.icmp.in_msgs);
+
+	if (len < sizeof (Icmph) ||
+		(!packet->IsCsumVerified() && ipcksum((const uint16_t*)&icmph, len) != 0xffff)) {
+		NetStats::Inc(_netstats.icmp.in_errors);
+		BufferPool::FreeBuffer(packet);
+		return;
+	}
 
 	const Icmph::Type type = (Icmph::Type)icmph.type;
 	const uint code = icmph.code;
+	const uint8_t* end = (const uint8_t*)&icmph + len;
 
 	switch (type) {
 	case Icmph::ICMP_ECHO_REQ:
-		IcmpSend(iph.dest, Icmph::ICMP_ECHO_REPLY, 0, packet);
+		NetStats::Inc(_netstats.icmp.in_echos);
+		IcmpEchoReply(iph.source, icmph, len);
 		break;
 	case Icmph::ICMP_DEST_UNREACH: {
+		NetStats::Inc(_netstats.icmp.in_dest_unreachs);
+
+		// Enclosed header and at least 8 bytes of what followed it
 		Iph& iph2 = *(Iph*)icmph.GetEnclosed();
 
-		if (icmph.GetEnclosed() + sizeof iph2 >= &packet->Back() ||
-			iph2.GetHLen() < 20 ||
-			icmph.GetEnclosed() + iph2.GetHLen() + sizeof (Udph) + 8 >= &packet->Back() ||
+		if (icmph.GetEnclosed() + sizeof iph2 > end ||
+			iph2.GetHLen() < sizeof iph2 ||
+			icmph.GetEnclosed() + iph2.GetHLen() + 8 > end ||
 			!iph2.ValidateCsum()) {
 			break;
 		}
 
 		if (code == Icmph::ICMP_DF_SET) {
-			// XXX Look up route
-			// rt->pmtu = Ntohs(((const uint16_t*)icmph.GetEnclosed())[1]);
+			LearnPmtu(iph2.dest, icmph.GetNextMtu(), Ntohs(iph2.len));
 		} else {
 			switch (iph2.proto) {
 			case IPPROTO_UDP:
 				_udp.IcmpError(type, code, iph.source, iph2.dest, iph2.source,
 							   *(Udph*)iph2.GetTransport());
 				break;
-#if 0
 			case IPPROTO_TCP:
 				_tcp.IcmpError(type, code, iph.source, iph2.dest, iph2.source,
 							   *(Tcph*)iph2.GetTransport());
 				break;
-#endif
 			}
 		}
 	}
@@ -581,29 +1277,92 @@ void Ip::IcmpReceive(IOBuffer* packet)
 }
 
 
+bool Ip::IcmpAllowed(in_addr_t dest)
+{
+	Mutex::Scoped L(_lock);
+
+	const Time now = Time::Now();
+
+	IcmpHost& host = _icmp_hosts[(Ntohl(dest) * 2654435761U) >> (32 - __builtin_ctz(ICMP_HOSTS))];
+	if (host.dest != dest) {
+		host.dest = dest;
+		host.bucket.Reset();
+	}
+
+	// Both must have a token before either is taken
+	if (!host.bucket.Ready(now, _limit[LIMIT_ICMP_HOST]) ||
+		!_icmp_bucket.Ready(now, _limit[LIMIT_ICMP])) {
+		NetStats::Inc(_netstats.icmp.out_throttled);
+		return false;
+	}
+
+	host.bucket.Take();
+	_icmp_bucket.Take();
+	return true;
+}
+
+
 void Ip::IcmpSend(in_addr_t dest, Icmph::Type type, uint code, IOBuffer* packet)
 {
-	IOBuffer* buf = BufferPool::AllocTx();
-	if (!buf) return;
+	// Never about a datagram to a group (RFC 1122 3.2.2)
+	if (IsMulticast(((const Iph*)(*packet + 0))->dest)) return;
 
-	buf->SetHead(2);            // XXX
+	if (!IcmpAllowed(dest)) return;
 
-	Iph& iph = *(Iph*)(*buf + 16);
-	Icmph& icmph = *(Icmph*)iph.GetTransport();
-	iph.proto = IPPROTO_ICMP;
-	iph.source = INADDR_ANY;
+	const uint want = IP_HEADROOM + sizeof (Icmph) + packet->Size();
+	IOBuffer* buf = BufferPool::AllocTx(min(want, BufferPool::GetMaxSize()));
+	if (!buf) return;
 
-	icmph.type = type;
-	icmph.code = code;
+	buf->SetHeadroom(IP_HEADROOM);
 
-	const uint bufspace = &buf->Back() - icmph.GetEnclosed();
+	const uint bufspace = buf->GetReserve() - IP_HEADROOM - sizeof (Icmph);
 	const uint toinclude = min(bufspace, packet->Size());
-	assert(toinclude >= sizeof (Iph) + 16);
+	assert(toinclude >= sizeof (Iph) + 8);
 
+	buf->SetSize(sizeof (Icmph) + toinclude);
+	Icmph& icmph = *(Icmph*)(*buf + 0);
+	icmph.type = type;
+	icmph.code = code;
+	icmph.rest[0] = icmph.rest[1] = 0;
 	memcpy(icmph.GetEnclosed(), &packet->Front(), toinclude);
-	buf->SetSize((uint8_t*)icmph.GetEnclosed() - &buf->Front() + toinclude);
 	icmph.SetCsum(sizeof icmph + toinclude);
 
+	Iph& iph = *(Iph*)buf->Prepend(sizeof (Iph));
+	iph.id = 0;					// Have Send() fill in header
+	iph.proto = IPPROTO_ICMP;
+	iph.source = INADDR_ANY;
+
+	NetStats::Inc(_netstats.icmp.out_msgs);
+	if (type == Icmph::ICMP_DEST_UNREACH)
+		NetStats::Inc(_netstats.icmp.out_dest_unreachs);
+
+	Ip::Send(buf, dest, DummyChecksummer());
+}
+
+void Ip::IcmpEchoReply(in_addr_t dest, const Icmph& req, uint len)
+{
+	if (!IcmpAllowed(dest)) return;
+
+	IOBuffer* buf = BufferPool::AllocTx(IP_HEADROOM + len);
+	if (!buf) return;
+
+	// Same id, sequence and data
+	buf->SetHeadroom(IP_HEADROOM);
+	buf->SetSize(len);
+	Icmph& icmph = *(Icmph*)(*buf + 0);
+	memcpy(&icmph, &req, len);
+	icmph.type = Icmph::ICMP_ECHO_REPLY;
+	icmph.code = 0;
+	icmph.SetCsum(len);
+
+	Iph& iph = *(Iph*)buf->Prepend(sizeof (Iph));
+	iph.id = 0;					// Have Send() fill in header
+	iph.proto = IPPROTO_ICMP;
+	iph.source = INADDR_ANY;
+
+	NetStats::Inc(_netstats.icmp.out_msgs);
+	NetStats::Inc(_netstats.icmp.out_echo_reps);
+
 	Ip::Send(buf, dest, DummyChecksummer());
 }
 
@@ -627,9 +1386,13 @@ Time Ip::GetServiceTime() const
 {
 	Mutex::Scoped L(_lock);
 
-	if (_timer.Empty())  return Time::Now() + Time::FromSec(120);
+	Time next = _timer.Empty() ? Time::Now() + Time::FromSec(120) : _timer.Front()->expire;
 
-	return _timer.Front()->expire;
+	for (uint i = 0; i < IP_REASM_MAX; ++i)
+		if (_reasm[i].nfrags)
+			next = min(next, _reasm[i].expire);
+
+	return next;
 }
 
 
@@ -638,22 +1401,24 @@ Time Ip::Service()
 	Mutex::Scoped L(_lock);
 
 	const Time now = Time::Now();
-	bool release_pending = false;
+
+	ReasmService(now);
 
 	while (!_timer.Empty() && _timer.Front()->expire <= now) {
 		Route* rt = _timer.Front();
 
 		if (rt->macvalid || rt->arpcount == ARP_LIMIT) {
 			// Route expired or reached max ARP.
+			if (!rt->macvalid)
+				NetStats::Inc(_netstats.arp.timeouts);
+
 			if (rt->type == Route::TYPE_HOSTRT) {
-				_timer.Erase(rt);
-				rt->invalid = true;
-				rt->Release();
-				// If the entry expired (macvalid), there can't be anything for it
-				// on the pending list.  Trigger a release if we failed to ARP.
-				// When releasing the pending list abandoned packets will be dropped.
-				release_pending |= !rt->macvalid;
+				// Anything still pending for it is dropped along with it
+				RemoveHostRoute(rt);
+				DiscardRoute(rt);
 			} else if (rt->type == Route::TYPE_RT) {
+				// Give up on what's pending, but keep trying the router
+				DropPending(rt);
 				rt->arpcount = 0;
 				RequestARP(rt);
 			} else {
@@ -664,8 +1429,6 @@ Time Ip::Service()
 		}
 	}
 
-	if (release_pending) ReleasePendingARP();
-
 	return GetServiceTime();
 }
 
@@ -675,7 +1438,11 @@ bool Ip::Route::Order(const void* ra, const void* rb)
 {
 	const Route& a = **(Route**)ra;
 	const Route& b = **(Route**)rb;
-	return a.expire > b.expire;
+
+	// Break ties so routes expiring at the same time are distinct
+	if (a.expire != b.expire)
+		return a.expire > b.expire;
+	return &a > &b;
 }
 
 #endif
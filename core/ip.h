@@ -5,17 +5,52 @@
 #define __IP_H__
 
 #include "core/mutex.h"
+#include "core/prefixtrie.h"
+#include "core/ratelimit.h"
 
 
 // Checksum
 uint16_t ipcksum(const uint16_t* block, uint len, uint32_t sum = 0);
 
+// Checksum a buffer chain from start (in the first buffer) to the end
+// of the chain.  All fragments but the last must contribute an even
+// number of bytes.
+uint16_t ipcksum(const IOBuffer* buf, const uint8_t* start, uint32_t sum = 0);
+
+// Copy len bytes and return their checksum, added to sum, in one pass
+uint16_t copy_and_csum(void* dest, const void* src, uint len, uint32_t sum = 0);
+
+// Incremental update (RFC 1624, eqn. 3): given a checksum field and
+// the old and new value of a halfword it covers, all in network byte
+// order, return the new checksum field.
+inline uint16_t ipcksum_update(uint16_t csum, uint16_t oldval, uint16_t newval)
+{
+	uint32_t sum = uint16_t(~Ntohs(csum)) + uint16_t(~Ntohs(oldval)) + Ntohs(newval);
+	sum = (sum & 0xffff) + (sum >> 16);
+	sum = (sum & 0xffff) + (sum >> 16);
+	return Htons(~sum);
+}
+
+// Same, for a 32-bit field such as an address
+inline uint16_t ipcksum_update32(uint16_t csum, uint32_t oldval, uint32_t newval)
+{
+	csum = ipcksum_update(csum, oldval, newval);
+	return ipcksum_update(csum, oldval >> 16, newval >> 16);
+}
+
+// True for a multicast (class D) address
+inline bool IsMulticast(in_addr_t addr)
+{
+	return (Ntohl(addr) >> 28) == 0xe;
+}
+
 #include "core/icmp.h"
 
 
 // IP protocols of interest
 enum IpProto {
 	IPPROTO_ICMP =1,
+	IPPROTO_IGMP = 2,
 	IPPROTO_TCP = 6,
 	IPPROTO_UDP = 17
 };
@@ -79,11 +114,16 @@ struct __novtable Iph {
 		hl_v = 0x40 | ((hlen/4) & 0xf);
 	}
 
-	uint GetOffset() const { return (off/8) & 0x1fff; } // NBO
-	uint GetFlags() const { return off & 7; }
+	// Fragment offset in bytes, and IPFLAG_xxx
+	uint GetOffset() const { return (Ntohs(off) & 0x1fff) * 8; }
+	uint GetFlags() const { return Ntohs(off) & (IPFLAG_DF | IPFLAG_MF); }
+
+	// True for a fragment of a larger datagram
+	bool IsFragment() const { return off & Htons(IPFLAG_MF | 0x1fff); }
 
 	// Get transport header
 	uint8_t* GetTransport() { return (uint8_t*)this + GetHLen(); }
+	const uint8_t* GetTransport() const { return (const uint8_t*)this + GetHLen(); }
 
 	// Set checksum
 	void SetCsum() {
@@ -95,19 +135,61 @@ struct __novtable Iph {
 
 	// Get pseudo header checksum, for UDP/TCP.
 	// Returns value in host byte order, as an unfolder 32-bit intermediate.
+	// Addresses are summed as 16-bit words so the intermediate can't
+	// overflow, and the length is that of the transport segment.
 	uint32_t SumPH() const {
-		return Ntohl(source) + Ntohl(dest) + proto + Ntohs(len);
+		const uint32_t s = Ntohl(source);
+		const uint32_t d = Ntohl(dest);
+		return (s >> 16) + (s & 0xffff) + (d >> 16) + (d & 0xffff) +
+			proto + Ntohs(len) - GetHLen();
+	}
+
+	// Summing a header including its checksum yields 0xffff
+	bool ValidateCsum() const {
+		return ipcksum((const uint16_t*)this, GetHLen()) == 0xffff;
+	}
+
+	// Change fields in a header with a valid checksum, updating the
+	// checksum incrementally
+	void SetTtl(uint8_t newttl) {
+		const uint16_t prev = Htons(ttl << 8 | proto);
+		ttl = newttl;
+		UpdateCsum(prev, Htons(ttl << 8 | proto));
+	}
+
+	void SetId(uint16_t newid) {
+		UpdateCsum(exch(id, newid), newid);
 	}
 
-	bool ValidateCsum() {
-		const int16_t tmp = exch<uint16_t>(sum, 0);
-		const bool equal = tmp == Htons(~ipcksum((const uint16_t*)this, GetHLen()));
-		sum = tmp;
-		return equal;
+	void SetSource(in_addr_t addr) { UpdateCsum32(exch(source, addr), addr); }
+	void SetDest(in_addr_t addr) { UpdateCsum32(exch(dest, addr), addr); }
+
+private:
+	void UpdateCsum(uint16_t oldval, uint16_t newval) {
+		sum = ipcksum_update(sum, oldval, newval);
+		if (!sum)
+			--sum;
+	}
+
+	void UpdateCsum32(uint32_t oldval, uint32_t newval) {
+		sum = ipcksum_update32(sum, oldval, newval);
+		if (!sum)
+			--sum;
 	}
 };
 
 
+// Headroom a transport reserves in front of its own header: link
+// header (including alignment pad) and a basic IP header.
+enum { IP_HEADROOM = 16 + sizeof (Iph) };
+
+// MTU, in bytes of IP datagram
+enum {
+	IP_MTU = 1500,				// Ethernet
+	IP_MTU_MIN = 68				// Smallest path MTU we accept (RFC 791)
+};
+
+
 // Checksummer interface.  Calculates transport checksum.
 class Checksummer {
 public:
@@ -162,89 +244,82 @@ public:
 //
 // In the future we may wish to set expire to the DHCP timer for an interface.
 // If an interface has multiple addresses then it has multiple routing entries.
-// All interfaces are at the start of the table.
-// All network routes follow.
-// All route hosts then follow last.
-// Lookups are *last to first*.  First match is used.
-
+//
+// Interface and network routes are kept in a path compressed trie
+// keyed by prefix, host routes in a hash table keyed by destination.
+// A lookup first tries the host table, then takes the longest prefix
+// match from the trie.  Both are independent of the number of peers.
+//
 // send_ip(socket, packet):
-//   DEST=packet.dest
-//   for each ROUTE in table.reverse():
-//      if ROUTE.dest = DEST & ROUTE.mask :
-//        if ROUTE.macvalid:
-//          packet.mac_dest = route.macaddr
-//          if ROUTE.type = TYPE_RT:
-//            ROUTE=new Route(TYPE_HOSTRT, packet.dest))
-//            routes.pushback(ROUTE)
-//            pending_arp.pushback(packet)
-//            send_arp(ROUTE.nexthop)
-//          else: if ROUTE.type = TYPE_IF:
-//            loopback(packet)
-//          else:
-//            netif.send(packet)
-//        else:
-//          pending_arp.pushback(packet)
-//          send_arp(ROUTE.nexthop)
-//   else:
+//   ROUTE=hosts.find(DEST) or nets.longest_match(DEST)
+//   if ROUTE=null :
 //     packet.discard()
 //     socket.error(NO_ROUTE_TO_HOST)
+//   if ROUTE.type = TYPE_IF and DEST != ROUTE.nexthop :
+//     ROUTE=new Route(TYPE_HOSTRT, DEST)       // on-link peer
+//     hosts.insert(ROUTE)                      // evicts oldest if full
+//   if ROUTE.macvalid :
+//     netif.send(packet)
+//   else:
+//     ROUTE.pending.pushback(packet)           // drops oldest if full
+//     send_arp(ROUTE.nexthop)
 //
 // receive_ip(packet):
-//   DEST=packet.dest
-//   SOURCE=packet.source
-//   HOSTRT=
-//   NETIF=
-//   for each ROUTE(TYPE_IF) in table.reverse():
-//     if ROUTE.dest = DEST & ROUTE.mask:
-//       if ROUTE.type = TYPE_HOSTRT:
-//         ROUTE.expire.reset()
-//         ROUTE.macaddr = packet.mac_source
-//         HOSTRT=ROUTE
-//         release_pending()
-//       else: if ROUTE.type = TYPE_IF:
-//         NETIF=ROUTE
-//         break
-//
-//  if NETIF=null :
-//     icmp_error(packet, NO_ROUTE_TO_HOST)
+//   if no interface subnet matches packet.dest :
 //     packet.discard()
-//     return
-//
-//  if HOSTRT=null :
-//    HOSTRT=new Route(TYPE_HOSTRT, packet.dest)
-//    HOSTRT.macaddr = packet.mac_source
-//    HOSTRT.expire.reset()
-//    routes.pushback(HOSTRT)
-//    release_pending()
-//
-// IPPROTO=packet.proto
-// IPPROTO.receive(packet)
+//   HOSTRT=hosts.find(packet.source)
+//   if HOSTRT and HOSTRT.nexthop = packet.source and HOSTRT is stale :
+//     HOSTRT.macaddr = packet.mac_source       // glean
+//     HOSTRT.expire.reset()
+//   IPPROTO.receive(packet)
 //
 // receive_arp_reply(packet):
-// ARP_HOST=packet.host_arp_is_for
-// ARP_MACADDR=packet.macaddr_for_host
-// for ROUTE in table.reverse():
-//   if ROUTE.dest = ARP_HOST & ROUTE.mask:
-//     ROUTE.macaddr = ARP_MACADDR
+//   for ROUTE in hosts + nets where ROUTE.nexthop = packet.sender :
+//     ROUTE.macaddr = packet.sender_mac
 //     ROUTE.expire.reset()
-// release_pending()
+//     ROUTE.pending.send_all()
 //
-// release_pending:
-//   for PACKET in pending_arp:
-//     DEST=PACKET.dest
-//     FOUND=false
-//     for ROUTE in table.reverse():
-//       if ROUTE.dest & ROUTE.mask = DEST & ROUTE.mask:
-//         FOUND=true
-//         if ROUTE.macvalid:
-//             PACKET.mac_dest = ROUTE.macaddr
-//             netif.send(PACKET)
-//             break ROUTE
-//     if FOUND:
-//       pending_arp.remove(PACKET)
+// Packets waiting for ARP are held on the Route they were sent on and
+// dropped along with it when it is removed or ARP gives up.
+//
+// Every route has a path MTU; datagrams larger than it are fragmented
+// on the way out.  An ICMP "fragmentation needed" lowers it for the
+// destination, adding a host route via the router if there isn't one
+// (RFC 1191).  Those expire after PMTU_EXPIRE so increases are found.
+//
+// Datagrams to a multicast group go out the first interface, with
+// TTL 1, to the group's MAC address (RFC 1112) on a host route that
+// needs no ARP.  Datagrams to a group are only taken in if the group
+// has been joined, see Igmp.
 
 enum { HOSTRT_EXPIRE = 120 };
+enum { HOSTRT_MAX = 64 };		// Default host route cap, see SetHostRouteLimit()
 enum { ARP_LIMIT = 5 };			// Number of times we try to ARP
+enum { ARP_PENDING_MAX = 4 };	// Packets held per route while ARPing
+enum { PMTU_EXPIRE = 600 };		// Lifetime of a learned path MTU, in seconds
+
+// Reassembly limits.  Buffers held are further limited to half the
+// receive buffer class, so fragments can't starve the driver.
+enum {
+	IP_REASM_MAX = 4,			// Datagrams being reassembled
+	IP_REASM_PER_SOURCE = 2,	// ... from any one source
+	IP_REASM_FRAGS = 8,			// Fragments per datagram
+	IP_REASM_BUFS = 12,			// Fragments held in all
+	IP_REASM_TIMEOUT = 15		// Seconds to wait for missing fragments
+};
+
+// Default limits, in packets per second and burst, on what we send
+// on our own account: ICMP errors and echo replies, and ARP requests.
+// Checked before a buffer is allocated.  See SetRateLimit().
+enum {
+	ICMP_RATE = 50,
+	ICMP_BURST = 10,
+	ICMP_HOST_RATE = 2,			// ICMP to any one destination
+	ICMP_HOST_BURST = 4,
+	ICMP_HOSTS = 16,			// Destinations tracked, power of two
+	ARP_RATE = 20,
+	ARP_BURST = 10
+};
 
 class Ip {
 
@@ -269,9 +344,12 @@ public:
 		uint8_t refcount;
 
 		Route* ifroute;			// Points back to TYPE_IF Route for netif
+		Route* hnext;			// Host route hash chain
+
+		uint16_t pmtu;			// Path MTU
 
-		Time lasticmp;			// Last time we sent an ICMP message
-		uint16_t pmtu;
+		IOBuffer* pending[ARP_PENDING_MAX]; // Waiting for ARP, oldest first
+		uint8_t npending;
 
 		bool macvalid:1;		// Mac addr is valid
 		bool invalid:1;			// Route has been removed from table
@@ -286,10 +364,13 @@ public:
 			nexthop = addr;
 			type = t;
 			memset(macaddr, 0, sizeof macaddr);
+			arpcount = 0;
 			macvalid = false;
 			invalid = false;
 			ifroute = NULL;
-			pmtu = 1520;
+			hnext = NULL;
+			pmtu = IP_MTU;
+			npending = 0;
 		}
 
 		void Retain() {
@@ -312,20 +393,77 @@ public:
 		// Ordering for rexmit list.  True if *ra > *rb
 		static bool Order(const void* ra, const void* rb);
 	};
+
+	// Checksum counters, in packets
+	struct CsumStats {
+		uint32_t tx_sw;			// Summed in software on send
+		uint32_t tx_offload;	// Left to the NIC
+		uint32_t rx_sw;			// Verified in software
+		uint32_t rx_offload;	// Verified by the NIC
+	};
+
+	// Rate limits, see SetRateLimit()
+	enum Limit {
+		LIMIT_ICMP,				// ICMP sent, all told
+		LIMIT_ICMP_HOST,		// ICMP sent to one destination
+		LIMIT_ARP,				// ARP requests sent
+		NUM_LIMITS
+	};
+
 private:
+	// Datagram being reassembled.  Fragments are held sorted by
+	// offset, with head at their payload.  Free when nfrags is 0.
+	struct Reasm {
+		in_addr_t source;
+		in_addr_t dest;
+		uint16_t id;
+		uint8_t proto;
+		uint8_t nfrags;
+		uint16_t len;			// Payload length, once last fragment is in
+		uint16_t have;			// Payload bytes received
+		Time expire;
+		uint16_t offset[IP_REASM_FRAGS];
+		IOBuffer* frag[IP_REASM_FRAGS];
+	};
+
+	// Per destination ICMP bucket.  The table is direct mapped; a
+	// destination hashing to a slot in use takes it over.
+	struct IcmpHost {
+		in_addr_t dest;
+		TokenBucket bucket;
+	};
 
 	mutable Mutex _lock;
 
 	class Udp& _udp;					// UDP
-
-	Vector<Route*> _routes;
-	Vector<IOBuffer*> _pending_arp;
+	class Tcp& _tcp;					// TCP
+	class Igmp& _igmp;					// Groups joined
+
+	Vector<Route*> _ifroutes;	// Interfaces
+	PrefixTrie<Route> _nets;	// Interface and network routes
+	Vector<Route*> _hosts;		// Host route hash buckets, chained by hnext
+	uint _num_hosts;
+	uint _max_hosts;
 	Set<Route*, Route::Order> _timer; // Route timer list
 
 	uint16_t _id;				// ID counter
+	in_addr_t _conflict;		// Our address claimed by another host
+
+	CsumStats _csum_stats;
+
+	Reasm _reasm[IP_REASM_MAX];
+	uint _reasm_bufs;			// Fragments held
+	uint _reasm_max_bufs;
+
+	RateLimit _limit[NUM_LIMITS];
+	TokenBucket _icmp_bucket;
+	TokenBucket _arp_bucket;
+	IcmpHost _icmp_hosts[ICMP_HOSTS];
 
 public:
-	Ip(Udp& udp) : _udp(udp) { }
+	Ip(Udp& udp, Tcp& tcp, Igmp& igmp)
+		: _udp(udp), _tcp(tcp), _igmp(igmp), _num_hosts(0), _max_hosts(0), _conflict(INADDR_ANY), _csum_stats(),
+		  _reasm(), _reasm_bufs(0), _reasm_max_bufs(0), _icmp_hosts() { }
 
 	void Initialize();
 	
@@ -336,14 +474,24 @@ public:
 	void AddDefaultRoute(Ethernet& nic, in_addr_t router);
 	void AddNetRoute(Ethernet& nic, in_addr_t network, in_addr_t netmask, in_addr_t router);
 
-	// Go through pending ARP queue
-	void ReleasePendingARP();
+	// Set max number of host routes (on-link peers).  When full, the
+	// one closest to expiring is evicted to make room.
+	void SetHostRouteLimit(uint limit);
+
+	// Set a rate limit, in packets per second and burst.  A rate of 0
+	// lifts it.  What's over the limit is dropped and counted in
+	// icmp.out_throttled or arp.out_throttled; an ARP request not
+	// sent still counts as an attempt, so resolution gives up as
+	// usual.
+	void SetRateLimit(Limit which, uint rate, uint burst);
 
-	// Get IP header from IOBuffer
+	// Get IP header from IOBuffer.  Frames have a fixed 16 byte link
+	// header area (see Ethernet::GetPrealloc()) and this leaves the
+	// buffer head at the IP header.
 	static Iph& GetIph(IOBuffer* buf) {
-		buf->SetHead(2);        // XXX
-		assert_bounds(buf->Size() >= 16 + sizeof (Iph));
-		return *(Iph*)(*buf + 16);
+		buf->SetHead(16);
+		assert_bounds(buf->Size() >= sizeof (Iph));
+		return *(Iph*)(*buf + 0);
 	}
 
 	// Set destination Mac address
@@ -392,19 +540,38 @@ public:
 	// selecting an interface.  It's always treated as if it were
 	// INADDR_ANY.
 	//
+	// Datagrams larger than the path MTU are fragmented, unless df is
+	// set in which case they're dropped; size them by GetPathMtu().
+	//
 	// df indicates whether the don't-fragment flag should be set (for PMTU)
 	Route* Send(IOBuffer* buf, in_addr_t dest, const Checksummer& tcsum,
 				Route* rt = NULL, bool df = false);
 
-	// Receive for ETHERTYPE_IP
+	// Receive for ETHERTYPE_IP.  Fragments are reassembled first.
+	// A reassembled datagram that doesn't fit in one buffer is passed
+	// on as a chain, which only UDP accepts.
 	void Receive(IOBuffer* packet);
 
+	// Largest datagram, IP header included, that goes to dest
+	// unfragmented
+	uint GetPathMtu(in_addr_t dest) const;
+
 	// Receive for ETHERTYPE_ARP
 	void ArpReceive(IOBuffer* packet);
+
+	// Send an ARP probe for addr on nic (RFC 5227): a request from
+	// address 0, which a host already using addr will answer
+	void ProbeARP(Ethernet& nic, in_addr_t addr);
+
+	// True, once, if another host has claimed addr, one of our
+	// interface addresses, in ARP since the last call
+	bool TakeConflict(in_addr_t addr);
 	
 	// Return header ID
 	uint16_t GetId() { return ++_id; }
 
+	const CsumStats& GetCsumStats() const { return _csum_stats; }
+
 	// Send ICMP message
 	void IcmpSend(in_addr_t dest, Icmph::Type type, uint code, IOBuffer* packet);
 
@@ -418,25 +585,58 @@ private:
 	// Find the Route entry for a network interface
 	Route* FindIfRoute(Ethernet& netif);
 
-	// Derive a host route derived from another entry (TYPE_IF)
+	// Derive a host route from another entry: an on-link peer from
+	// a TYPE_IF, or a remote host via the router of a TYPE_RT
 	Route* AddHostRoute(in_addr_t host, Route* base);
 
-	// Get ARP header from IOBuffer
+	// Host route for a multicast group: the group's MAC address on
+	// the first interface.  NULL if there's no interface.
+	Route* AddGroupRoute(in_addr_t group);
+
+	// Route lookup: host route if any, otherwise longest prefix match
+	Route* Lookup(in_addr_t dest) const;
+	Route* FindHostRoute(in_addr_t host) const;
+
+	// Host route hash table maintenance
+	uint HostHash(in_addr_t host) const;
+	void RemoveHostRoute(Route* rt);
+	void EvictHostRoute();
+
+	// Add TYPE_IF or TYPE_RT entry to the prefix trie.  Interface
+	// routes take precedence over network routes for the same prefix.
+	bool InsertNetRoute(Route* rt);
+
+	// Take a route out of service and drop the table's reference
+	void DiscardRoute(Route* rt);
+
+	// Prefix length of a contiguous netmask
+	static uint PrefixLen(in_addr_t netmask);
+
+	// Get ARP header from IOBuffer.  Leaves head at ARP header.
 	Arph& GetArph(IOBuffer* buf) {
-		buf->SetHead(2);  // XXX
-		assert_bounds(buf->Size() >= 16 + sizeof (Arph));
-		return *(Arph*)(*buf + 16);
+		buf->SetHead(16);
+		assert_bounds(buf->Size() >= sizeof (Arph));
+		return *(Arph*)(*buf + 0);
 	}
 
 	// Resolve MAC addr for Route entry
 	void RequestARP(Route* rt);
 
+	// Take a token for an ICMP message to dest, or an ARP request.
+	// False if over the limit.
+	bool IcmpAllowed(in_addr_t dest);
+	bool ArpAllowed();
+
+	// Broadcast ARP request for dip on nic, from sip.  Returns false
+	// if out of buffers.
+	bool SendArpRequest(Ethernet& nic, in_addr_t sip, in_addr_t dip);
+
 	// Handle incoming ARP request
 	void HandleARP(IOBuffer* buf);
 
-	// Get source/dest mac address from frame
-	uint8_t* GetMacSource(IOBuffer* buf) { return *buf + 2 + 6; }
-	uint8_t* GetMacDest(IOBuffer* buf) { return *buf + 2; }
+	// Get source/dest mac address from frame, regardless of head
+	uint8_t* GetMacDest(IOBuffer* buf) { return *buf + 0 - buf->GetHead() + 2; }
+	uint8_t* GetMacSource(IOBuffer* buf) { return GetMacDest(buf) + 6; }
 	
 	// Fill in datagram with MAC header
 	void FillMacHeader(IOBuffer* packet, Route* rt);
@@ -444,14 +644,40 @@ private:
 	// Fill in datagram with IP header
 	void FillHeader(IOBuffer* packet, Route* rt, bool df);
 
+	// Send datagram with head at IP header on a resolved route,
+	// fragmenting it to the route's PMTU if needed
+	void Transmit(Route* rt, IOBuffer* packet);
+	void Fragment(Route* rt, IOBuffer* packet);
+
+	// Add fragment to its datagram.  Returns the datagram once
+	// complete, with head at the IP header, otherwise NULL.
+	IOBuffer* Reassemble(IOBuffer* packet);
+	void ReasmFree(Reasm& r);
+	void ReasmService(const Time& now);
+
+	// Lower PMTU to dest on ICMP "fragmentation needed".  mtu is the
+	// next hop MTU the router reported, or 0; len the length of the
+	// datagram it refused.
+	void LearnPmtu(in_addr_t dest, uint mtu, uint len);
+
 	// ICMP receiver
 	void IcmpReceive(IOBuffer* packet);
+	void IcmpEchoReply(in_addr_t dest, const Icmph& req, uint len);
 
 	// Reset Route timer
 	void SetRouteTimer(Route* rt, uint secs);
 
+	// Hold packet on route until ARP completes, send when it does, or
+	// drop when it doesn't
+	void QueuePending(Route* rt, IOBuffer* packet);
+	void ReleasePending(Route* rt);
+	void DropPending(Route* rt);
+
 	// Fill in ARP info
 	void SatisfiedARP(Route* rt, const uint8_t* macaddr);
+
+	// ARP reply: fill in all routes with addr as next hop
+	void ResolvedARP(in_addr_t addr, const uint8_t* macaddr);
 };
 
 extern Ip _ip0;
@@ -168,10 +168,12 @@ void* findmblk(void* ptr)
 const MemStats& xmemstats() { return memstats; }
 
 // Explicitly emit these for gcc, it needs them sometimes for struct
-// copies and initialization.
+// copies and initialization.  Elsewhere platform.cxx has memset.
+#ifdef __arm__
 #undef memset
 void* memset(void* b, int c, size_t n) {
     return xmemset(b, c, n);
 }
+#endif
     
 extern inline void* memcpy(void*, const void*, size_t);
@@ -35,7 +35,9 @@ const MemStats& xmemstats();
 
 inline void* operator new(size_t size) { return xmalloc(size); }
 inline void operator delete(void *ptr) { xfree(ptr); }
-inline void operator delete(void *ptr, uint) { xfree(ptr); }
+inline void operator delete(void *ptr, size_t) { xfree(ptr); }
+inline void* operator new[](size_t size) { return xmalloc(size); }
+inline void operator delete[](void *ptr) { xfree(ptr); }
 
 //  libc replacements
 
@@ -17,6 +17,7 @@ bool Mutex::TryLock() const
 		
 	_tid = Thread::GetCurThread();
 	++_count;
+	Thread::MutexAcquired(*this);
 	return true;
 }
 
@@ -27,16 +28,14 @@ void Mutex::Lock() const
 
     ScopedNoInt G;
 
-	while (_count && _tid != Thread::GetCurThread()) {
-		++_waiters;
-		Thread::WaitFor(this);
-		assert(_waiters);
-		--_waiters;
-	}
+	while (_count && _tid != Thread::GetCurThread())
+		Thread::WaitForMutex(*this);
 
 	assert((!_tid && !_count) || (_count && _tid == Thread::GetCurThread()));
-	_tid = Thread::GetCurThread();
-	++_count;
+	if (!_count++) {
+		_tid = Thread::GetCurThread();
+		Thread::MutexAcquired(*this);
+	}
 }
 
 
@@ -46,11 +45,38 @@ void Mutex::Unlock() const
 
 	AssertLocked();
 
-	if (!--_count)
-        _tid = 0;
+    ScopedNoInt G;
+
+	if (--_count)
+		return;
 
-	if (_waiters)
-        Thread::WakeSingle(this);
+	// Drop any priority lent by waiters before handing over, so the
+	// top one gets to run now if it outranks us
+	Thread::MutexReleased(*this);
+	_tid = 0;
+
+	if (!_waiters.Empty())
+        Thread::WakeSingle(_waiters);
+}
+
+
+void SecondLock::Lock() volatile const
+{
+	_lock1.AssertLocked();
+	_lock2.Lock();
+}
+
+
+void SecondLock::Unlock() volatile const
+{
+	_lock2.Unlock();
+}
+
+
+void SecondLock::AssertLocked() volatile const
+{
+	_lock1.AssertLocked();
+	_lock2.AssertLocked();
 }
 
 
@@ -58,18 +84,13 @@ void CondVar::Wait(Mutex& m)
 {
 	m.AssertLocked();
 
-	++_count;
-
 	// Temporarily release mutex regardless of recursion depth
 	const uint count = exch<uint16_t>(m._count, 1);
 	m.Unlock();
 
-	Thread::WaitFor(this);
+	Thread::WaitFor(_waiters);
 
 	m.Lock();
-	assert(_count);
-	--_count;
-
 	m._count = count;
 }
 
@@ -78,17 +99,13 @@ void CondVar::Wait(Mutex& m, const Time& delay)
 {
 	m.AssertLocked();
 
-	++_count;
-
 	// Temporarily release mutex regardless of recursion depth
 	const uint count = exch<uint16_t>(m._count, 1);
 	m.Unlock();
 
-	Thread::WaitFor(this, Time::Now() + delay);
+	Thread::WaitFor(_waiters, Time::Now() + delay);
 
 	m.Lock();
-	assert(_count);
-	--_count;
 	m._count = count;
 }
 
@@ -103,11 +120,11 @@ void EventObject::Set(uint8_t new_state)
     }
 
     if (new_state && new_state != prev_state) {
-		if (_count) {
+		if (!_waiters.Empty()) {
 			if (_mode == SELF_RESET)
-				Thread::WakeSingle(this);
+				Thread::WakeSingle(_waiters);
 			else
-				Thread::WakeAll(this);
+				Thread::WakeAll(_waiters);
 		}
 	}
 }
@@ -117,12 +134,8 @@ void EventObject::Wait()
 {
     ScopedNoInt G;
 
-	while (!_state) {
-		++_count;
-		Thread::WaitFor(this);
-		assert(_count);
-		--_count;
-	}
+	while (!_state)
+		Thread::WaitFor(_waiters);
 	if (_mode == SELF_RESET)
         _state = 0;
 }
@@ -134,15 +147,8 @@ bool EventObject::Wait(Time delay)
 
     ScopedNoInt G;
 
-	while (!_state && Time::Now() < deadline) {
-		++_count;
-
-		Thread::WaitFor(this, deadline);
-
-		assert(_count);
-
-		--_count;
-	}
+	while (!_state && Time::Now() < deadline)
+		Thread::WaitFor(_waiters, deadline);
 	const bool retval = _state != 0;
 
 	if (_mode == SELF_RESET)
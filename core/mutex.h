@@ -18,18 +18,23 @@ private:
 };
 
 
+// Recursive mutex.  A thread waiting for it lends its priority to
+// the owner until it's unlocked, so a lower priority owner can't be
+// held off by threads in between.
 class Mutex {
 protected:
 	friend class CondVar;
 	friend class SecondLock;
+	friend class Thread;
 
 	mutable ThreadId _tid;
 	mutable uint16_t _count;
-	mutable uint16_t _waiters;
+	mutable WaitQueue _waiters;
+	mutable const Mutex* _nextheld;	// Next held by _tid
 
 public:
 	Mutex() :
-		_tid(0), _count(0), _waiters(0)
+		_tid(0), _count(0), _nextheld(NULL)
 	{ }
 
 	~Mutex() {  }
@@ -79,15 +84,15 @@ private:
 
 
 class CondVar {
-	uint16_t _count;
+	WaitQueue _waiters;
 public:
-	CondVar() : _count(0) {  }
+	CondVar() {  }
 	~CondVar() {  }
 
 	void Wait(Mutex& m, const Time& delay);
 	void Wait(Mutex& m);
-	void Signal() { if (_count) Thread::WakeSingle(this); }
-	void Broadcast() { if (_count) Thread::WakeAll(this); }
+	void Signal() { if (!_waiters.Empty()) Thread::WakeSingle(_waiters); }
+	void Broadcast() { if (!_waiters.Empty()) Thread::WakeAll(_waiters); }
 private:
 	// These make no sense
 	CondVar(const CondVar&);
@@ -102,10 +107,10 @@ public:
 private:
 	uint8_t _state;
 	uint8_t _mode;
-	uint16_t _count;			// Number of waiters
+	WaitQueue _waiters;
 public:
 	EventObject(uint8_t state = 0, Mode mode = SELF_RESET) :
-		_state(state), _mode(mode), _count(0) {
+		_state(state), _mode(mode) {
 	}
 
 	~EventObject() { }
@@ -0,0 +1,115 @@
+// Copyright (c) 2018-2021 Jan Brittenson
+// See LICENSE for details.
+
+#ifdef ENABLE_IP
+
+#include "core/enetkit.h"
+#include "core/netstats.h"
+#include "core/util.h"
+#include <stddef.h>
+
+
+NetStats::Counters _netstats;
+
+namespace NetStats {
+
+// Counter names, in the order they're printed
+#define LINK(f)  { "eth0." #f, offsetof(Snapshot, link.f) }
+#define CTR(l,f) { #l "." #f, offsetof(Snapshot, counters.l.f) }
+
+static const struct {
+	const char* name;
+	uint16_t offset;
+} _names[] = {
+	LINK(rx_packets), LINK(rx_bytes), LINK(rx_errors), LINK(rx_overrun),
+	LINK(rx_filtered), LINK(rx_unknown), LINK(rx_interrupts), LINK(tx_packets),
+	LINK(tx_bytes), LINK(tx_errors), LINK(tx_underrun),
+
+	CTR(ip, in_receives), CTR(ip, in_hdr_errors), CTR(ip, in_addr_errors),
+	CTR(ip, in_unknown_protos), CTR(ip, in_discards), CTR(ip, in_delivers),
+	CTR(ip, out_requests), CTR(ip, out_no_routes), CTR(ip, out_discards),
+	CTR(ip, reasm_reqds), CTR(ip, reasm_oks), CTR(ip, reasm_fails),
+	CTR(ip, frag_oks), CTR(ip, frag_fails), CTR(ip, frag_creates),
+
+	CTR(icmp, in_msgs), CTR(icmp, in_errors), CTR(icmp, in_dest_unreachs),
+	CTR(icmp, in_echos), CTR(icmp, out_msgs), CTR(icmp, out_dest_unreachs),
+	CTR(icmp, out_echo_reps), CTR(icmp, out_throttled),
+
+	CTR(udp, in_datagrams), CTR(udp, no_ports), CTR(udp, in_errors),
+	CTR(udp, out_datagrams), CTR(udp, out_errors),
+
+	CTR(tcp, active_opens), CTR(tcp, passive_opens), CTR(tcp, attempt_fails),
+	CTR(tcp, estab_resets), CTR(tcp, in_segs), CTR(tcp, in_errs), CTR(tcp, out_segs),
+	CTR(tcp, retrans_segs), CTR(tcp, fast_retrans), CTR(tcp, timeouts),
+	CTR(tcp, out_rsts),
+
+	CTR(arp, in_requests), CTR(arp, in_replies), CTR(arp, in_errors),
+	CTR(arp, out_requests), CTR(arp, out_replies), CTR(arp, timeouts),
+	CTR(arp, pending_drops), CTR(arp, out_throttled),
+
+	CTR(dhcp, out_discovers), CTR(dhcp, out_requests), CTR(dhcp, in_offers),
+	CTR(dhcp, in_acks), CTR(dhcp, in_naks),
+
+	CTR(igmp, in_queries), CTR(igmp, in_reports), CTR(igmp, in_errors),
+	CTR(igmp, out_reports), CTR(igmp, out_leaves)
+};
+
+#undef LINK
+#undef CTR
+
+
+static uint32_t Get(const Snapshot& snap, uint i)
+{
+	return *(const uint32_t*)((const uint8_t*)&snap + _names[i].offset);
+}
+
+
+void GetSnapshot(Snapshot& snap)
+{
+	// Word sized loads, each atomic by itself
+	const NetStats::Link& link = _eth0.GetStats();
+	for (uint i = 0; i < sizeof link / sizeof (uint32_t); ++i)
+		((uint32_t*)&snap.link)[i] = __atomic_load_n((const uint32_t*)&link + i, __ATOMIC_RELAXED);
+
+	for (uint i = 0; i < sizeof _netstats / sizeof (uint32_t); ++i)
+		((uint32_t*)&snap.counters)[i] =
+			__atomic_load_n((const uint32_t*)&_netstats + i, __ATOMIC_RELAXED);
+
+	for (uint cls = 0; cls < BufferPool::NUM_CLASSES; ++cls)
+		snap.pool[cls] = BufferPool::GetStats(cls);
+}
+
+
+void Format(Vector<uchar>& dest, const Snapshot& snap)
+{
+	for (uint i = 0; i < sizeof _names / sizeof _names[0]; ++i)
+		Util::AppendFmt(dest, STR("%s %u\n"), _names[i].name, Get(snap, i));
+
+	for (uint cls = 0; cls < BufferPool::NUM_CLASSES; ++cls) {
+		const BufferPool::ClassStats& s = snap.pool[cls];
+		Util::AppendFmt(dest, STR("pool%u.size %u\npool%u.total %u\npool%u.inuse %u\n"
+								  "pool%u.high %u\npool%u.spilled %u\npool%u.failed %u\n"),
+						cls, s.size, cls, s.total, cls, s.inuse,
+						cls, s.high, cls, s.spilled, cls, s.failed);
+	}
+}
+
+
+void Dump()
+{
+	Snapshot snap;
+	GetSnapshot(snap);
+
+	for (uint i = 0; i < sizeof _names / sizeof _names[0]; ++i)
+		console("%s %u", _names[i].name, Get(snap, i));
+
+	for (uint cls = 0; cls < BufferPool::NUM_CLASSES; ++cls) {
+		const BufferPool::ClassStats& s = snap.pool[cls];
+		console("pool%u: size %u total %u inuse %u high %u spilled %u failed %u",
+				cls, s.size, s.total, s.inuse, s.high, s.spilled, s.failed);
+	}
+}
+
+} // namespace NetStats
+
+#endif // ENABLE_IP
@@ -0,0 +1,152 @@
+// Copyright (c) 2018-2021 Jan Brittenson
+// See LICENSE for details.
+
+#ifndef __NETSTATS_H__
+#define __NETSTATS_H__
+
+#ifdef ENABLE_IP
+
+#include <stdint.h>
+#include "core/network.h"
+#include "core/vector.h"
+
+// Network counters, by layer.  Names follow the MIB-II (RFC 1213)
+// counters where there is one.  Counters only ever increase and wrap
+// at 2^32.
+//
+// Each is bumped where the event happens, from whatever thread or
+// interrupt handler that is, without taking a lock: Inc() is a
+// relaxed atomic add.  A snapshot is therefore a set of individually
+// consistent counters, not one instant across all of them.
+namespace NetStats {
+
+	// Per interface, kept by the driver.  rx_filtered and rx_unknown
+	// are filled in by the network thread as it hands frames up.
+	struct Link {
+		uint32_t rx_packets;
+		uint32_t rx_bytes;
+		uint32_t rx_errors;			// Bad frames (CRC, length, alignment)
+		uint32_t rx_overrun;		// Frames lost for lack of buffers
+		uint32_t rx_filtered;		// Not for our MAC address or a group joined
+		uint32_t rx_unknown;		// Unknown ethertype
+		uint32_t rx_interrupts;		// RX interrupts that woke the network thread
+		uint32_t tx_packets;
+		uint32_t tx_bytes;
+		uint32_t tx_errors;			// Frames refused or failed
+		uint32_t tx_underrun;
+	};
+
+	struct Ipv4 {
+		uint32_t in_receives;		// Datagrams from the link, incl. errors
+		uint32_t in_hdr_errors;		// Bad version, length or checksum
+		uint32_t in_addr_errors;	// Not for any of our interfaces
+		uint32_t in_unknown_protos;
+		uint32_t in_discards;		// Good, but dropped anyway
+		uint32_t in_delivers;		// Handed to ICMP, UDP or TCP
+		uint32_t out_requests;		// Datagrams from transports
+		uint32_t out_no_routes;
+		uint32_t out_discards;		// Good, but dropped anyway
+		uint32_t reasm_reqds;		// Fragments received
+		uint32_t reasm_oks;			// Datagrams reassembled
+		uint32_t reasm_fails;		// Datagrams given up on
+		uint32_t frag_oks;			// Datagrams fragmented
+		uint32_t frag_fails;		// Too large, but DF set
+		uint32_t frag_creates;		// Fragments sent
+	};
+
+	struct Icmp {
+		uint32_t in_msgs;
+		uint32_t in_errors;			// Bad length or checksum
+		uint32_t in_dest_unreachs;
+		uint32_t in_echos;
+		uint32_t out_msgs;
+		uint32_t out_dest_unreachs;
+		uint32_t out_echo_reps;
+		uint32_t out_throttled;		// Dropped by the rate limit
+	};
+
+	struct Udp {
+		uint32_t in_datagrams;		// Delivered to a socket
+		uint32_t no_ports;			// No socket for the port
+		uint32_t in_errors;			// Bad length or checksum
+		uint32_t out_datagrams;
+		uint32_t out_errors;		// No route or no buffers
+	};
+
+	struct Tcp {
+		uint32_t active_opens;		// Connect()
+		uint32_t passive_opens;		// SYNs taken by a listen socket
+		uint32_t attempt_fails;		// Reset or timed out while opening
+		uint32_t estab_resets;		// Reset or timed out once established
+		uint32_t in_segs;			// Incl. errors
+		uint32_t in_errs;			// Bad length or checksum
+		uint32_t out_segs;			// Excl. retransmits
+		uint32_t retrans_segs;		// Segments with data, SYN or FIN sent before
+		uint32_t fast_retrans;		// Fast retransmits, on three duplicate ACKs
+		uint32_t timeouts;			// Retransmit timer expiries
+		uint32_t out_rsts;
+	};
+
+	struct Arp {
+		uint32_t in_requests;
+		uint32_t in_replies;
+		uint32_t in_errors;			// Not Ethernet/IPv4
+		uint32_t out_requests;
+		uint32_t out_replies;
+		uint32_t timeouts;			// Resolutions given up on
+		uint32_t pending_drops;		// Packets dropped awaiting resolution
+		uint32_t out_throttled;		// Requests dropped by the rate limit
+	};
+
+	struct Dhcp {
+		uint32_t out_discovers;
+		uint32_t out_requests;
+		uint32_t in_offers;
+		uint32_t in_acks;
+		uint32_t in_naks;
+	};
+
+	struct Igmp {
+		uint32_t in_queries;
+		uint32_t in_reports;		// From other members
+		uint32_t in_errors;			// Bad length or checksum
+		uint32_t out_reports;
+		uint32_t out_leaves;
+	};
+
+	struct Counters {
+		Ipv4 ip;
+		Icmp icmp;
+		Udp udp;
+		Tcp tcp;
+		Arp arp;
+		Dhcp dhcp;
+		Igmp igmp;
+	};
+
+	// Everything, copied out at once
+	struct Snapshot {
+		Link link;					// eth0
+		Counters counters;
+		BufferPool::ClassStats pool[BufferPool::NUM_CLASSES];
+	};
+
+	[[__finline]] inline void Inc(uint32_t& counter, uint32_t n = 1) {
+		__atomic_fetch_add(&counter, n, __ATOMIC_RELAXED);
+	}
+
+	void GetSnapshot(Snapshot& snap);
+
+	// Append snap to dest as text, one "layer.counter value" line per
+	// counter.  Suitable for sending as is in a datagram.
+	void Format(Vector<uchar>& dest, const Snapshot& snap);
+
+	// Print a snapshot on the console
+	void Dump();
+}
+
+extern NetStats::Counters _netstats;
+
+#endif // ENABLE_IP
+
+#endif // __NETSTATS_H__
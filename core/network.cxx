@@ -7,76 +7,357 @@
 #include "core/network.h"
 #include "core/ip.h"
 #include "core/dhcp.h"
+#include "core/igmp.h"
+#include "core/tcp.h"
+#include "core/netstats.h"
+#include "core/capture.h"
 
 
 EventObject _net_event;
+uint _net_rx_poll_hold = NET_RX_POLL_HOLD;
+Thread* _net_thread;
 
 namespace BufferPool {
 
-static Vector<IOBuffer*> _pool;
-
-void Initialize(uint num, uint size)
+// Class layout: buffer size (0 for the driver's), share of buffer
+// memory in sixteenths, and buffers held back from AllocTx()
+static const struct {
+	uint16_t size;
+	uint8_t share;
+	uint8_t reserve;
+} _layout[NUM_CLASSES] = {
+	{ CLASS_SMALL_SIZE, 1, 0 },
+	{ CLASS_MEDIUM_SIZE, 3, 0 },
+	{ 0, 12, TX_MIN_POOL }
+};
+
+struct Class {
+	Vector<IOBuffer*> pool;
+	uint reserve;
+	ClassStats stats;
+};
+
+// The network thread's own free buffers; see CACHE_MAX
+struct Cache {
+	IOBuffer* buf[CACHE_MAX];
+	uint num;
+	uint max;
+};
+
+static Class _class[NUM_CLASSES];
+static Cache _cache[NUM_CLASSES];
+
+
+void Initialize(uint mem, uint maxsize)
 {
     Thread::IPL G(IPL_NETWORK);
 
-	_pool.Reserve(num);
-	for (uint i = 0; i < num; ++i) {
-		IOBuffer* buf = AllocNetworkBuffer();
-        uint8_t* mem = AllocNetworkData(size, 4);
-		buf->SetMem(mem, size);
-		buf->SetSize(size);
-		buf->SetAutoCompact(false);
-		buf->SetAutoResize(false); // Trap on attempts to grow buffer
-		_pool.PushBack(buf);
+	assert(maxsize > CLASS_MEDIUM_SIZE);
+
+	uint left = mem;
+	for (uint cls = 0; cls < NUM_CLASSES; ++cls) {
+		Class& c = _class[cls];
+		const uint size = _layout[cls].size ? _layout[cls].size : maxsize;
+		const uint bytes = cls == NUM_CLASSES - 1 ? left : mem * _layout[cls].share / 16;
+		const uint num = bytes / Util::Align(size, 4U);
+
+		c.reserve = _layout[cls].reserve;
+		c.stats.size = size;
+		c.stats.total = num;
+
+		c.pool.Reserve(num);
+		for (uint i = 0; i < num; ++i) {
+			IOBuffer* buf = AllocNetworkBuffer();
+			uint8_t* data = AllocNetworkData(size, 4);
+			buf->SetMem(data, size);
+			buf->SetSize(size);
+			buf->SetAutoCompact(false);
+			buf->SetAutoResize(false); // Trap on attempts to grow buffer
+			c.pool.PushBack(buf);
+		}
+		left -= num * Util::Align(size, 4U);
+
+		_cache[cls].num = 0;
+		_cache[cls].max = min<uint>(CACHE_MAX, num / 8);
 	}
+
+	assert(_class[NUM_CLASSES-1].stats.total > TX_MIN_POOL);
 }
 
 
-static IOBuffer* Alloc()
+uint GetMaxSize()
 {
-	if (_pool.Empty())
-        return NULL;
+	return _class[NUM_CLASSES-1].stats.size;
+}
+
+
+// True on the network thread, but not in an interrupt handler that
+// runs on top of it
+static bool UseCache()
+{
+	return Thread::GetCurThread() == _net_thread && !InExceptionHandler();
+}
+
+
+// Classes differ in size, so capacity identifies the class
+static uint ClassOf(const IOBuffer* buf)
+{
+	uint cls = 0;
+	while (cls < NUM_CLASSES - 1 && _class[cls].stats.size != buf->GetReserve())
+		++cls;
+
+	assert(_class[cls].stats.size == buf->GetReserve());
+	return cls;
+}
 
-	IOBuffer* buf = _pool.Back();
-	_pool.PopBack();
+
+// Hand out buf.  The network thread counts its own without the IPL,
+// so inuse is updated atomically.
+static IOBuffer* Prepare(Class& c, IOBuffer* buf)
+{
+	const uint16_t inuse = __atomic_add_fetch(&c.stats.inuse, 1, __ATOMIC_RELAXED);
+	if (inuse > c.stats.high)
+		c.stats.high = inuse;
 
 	buf->SetHead(0);
 	buf->SetTail(buf->GetReserve());
+	buf->Recycle();
 
 	return buf;
 }
 
 
+// Called at IPL_NETWORK
+static IOBuffer* Alloc(Class& c)
+{
+	if (c.pool.Empty()) {
+		++c.stats.failed;
+        return NULL;
+	}
+
+	IOBuffer* buf = c.pool.Back();
+	c.pool.PopBack();
+
+	return Prepare(c, buf);
+}
+
+
+// On the network thread
+static IOBuffer* AllocCached(uint cls)
+{
+	Cache& k = _cache[cls];
+	assert(k.num);
+
+	return Prepare(_class[cls], k.buf[--k.num]);
+}
+
+
+// Called at IPL_NETWORK.  Fill the cache of class cls halfway from
+// the pool, leaving keep buffers there.
+static void Refill(uint cls, uint keep)
+{
+	Class& c = _class[cls];
+	Cache& k = _cache[cls];
+
+	while (k.num < k.max / 2 && c.pool.Size() > keep) {
+		k.buf[k.num++] = c.pool.Back();
+		c.pool.PopBack();
+	}
+}
+
+
+// Called at IPL_NETWORK.  Empty the cache of class cls halfway into
+// the pool.
+static void Flush(uint cls)
+{
+	Class& c = _class[cls];
+	Cache& k = _cache[cls];
+
+	while (k.num > k.max / 2)
+		c.pool.PushBack(k.buf[--k.num]);
+}
+
+
 IOBuffer* AllocRx()
 {
+	const uint cls = NUM_CLASSES - 1;
+
+	if (UseCache()) {
+		if (!_cache[cls].num) {
+			Thread::IPL G(IPL_NETWORK);
+
+			Refill(cls, 0);
+			if (!_cache[cls].num)
+				return Alloc(_class[cls]);
+		}
+		return AllocCached(cls);
+	}
+
+    Thread::IPL G(IPL_NETWORK);
+
+	return Alloc(_class[cls]);
+}
+
+
+uint AllocRx(IOBuffer** bufs, uint num)
+{
+	const uint cls = NUM_CLASSES - 1;
+
+	uint n = 0;
+	if (UseCache()) {
+		while (n < num && _cache[cls].num)
+			bufs[n++] = AllocCached(cls);
+		if (n == num)
+			return n;
+	}
+
     Thread::IPL G(IPL_NETWORK);
 
-	return Alloc();
+	Class& c = _class[cls];
+	for (; n < num && (bufs[n] = Alloc(c)); ++n)
+		;
+
+	return n;
 }
 
 
-IOBuffer* AllocTx()
+IOBuffer* AllocTx(uint size)
 {
+	uint cls = 0;
+	while (cls < NUM_CLASSES && _class[cls].stats.size < size)
+		++cls;
+
+	if (cls == NUM_CLASSES)
+		return NULL;
+
+	// A class with a reserve is left to the pool, which keeps it
+	const bool cache = UseCache() && !_class[cls].reserve;
+	if (cache && _cache[cls].num)
+		return AllocCached(cls);
+
     Thread::IPL G(IPL_NETWORK);
 
-	if (_pool.Size() <= TX_MIN_POOL)
-        return NULL;
+	// Fall back on larger classes when the best fit has run dry
+	Class& fit = _class[cls];
+	for (; cls < NUM_CLASSES; ++cls) {
+		Class& c = _class[cls];
+		if (c.pool.Size() > c.reserve) {
+			if (&c != &fit)
+				++fit.stats.spilled;
+			else if (cache)
+				Refill(cls, c.reserve + 1);
+			return Alloc(c);
+		}
+	}
+
+	++fit.stats.failed;
+	return NULL;
+}
+
+
+// Called at IPL_NETWORK
+static void Free(IOBuffer* buf)
+{
+	while (buf) {
+		// Anything past a buffer that is still referenced belongs to
+		// the other reference holder(s)
+		if (!buf->Release())
+			break;
+
+		IOBuffer* next = buf->GetNext();
+		buf->SetNext(NULL);
+
+		Class& c = _class[ClassOf(buf)];
+		assert(c.stats.inuse);
+		__atomic_sub_fetch(&c.stats.inuse, 1, __ATOMIC_RELAXED);
+		c.pool.PushBack(buf);
+
+		buf = next;
+	}
+}
+
+
+// On the network thread: Free() into the cache, emptying it halfway
+// into the pool when full
+static void FreeCached(IOBuffer* buf)
+{
+	while (buf) {
+		if (!buf->Release())
+			break;
 
-	return Alloc();
+		IOBuffer* next = buf->GetNext();
+		buf->SetNext(NULL);
+
+		const uint cls = ClassOf(buf);
+		Class& c = _class[cls];
+		Cache& k = _cache[cls];
+		assert(c.stats.inuse);
+		__atomic_sub_fetch(&c.stats.inuse, 1, __ATOMIC_RELAXED);
+
+		if (k.num == k.max) {
+			Thread::IPL G(IPL_NETWORK);
+
+			Flush(cls);
+			if (!k.max)
+				c.pool.PushBack(buf);
+		}
+		if (k.max)
+			k.buf[k.num++] = buf;
+
+		buf = next;
+	}
 }
 
 
 void FreeBuffer(IOBuffer* buf)
 {
+	if (UseCache()) {
+		FreeCached(buf);
+		return;
+	}
+
+    Thread::IPL G(IPL_NETWORK);
+
+	Free(buf);
+}
+
+
+void FreeBuffers(IOBuffer* const* bufs, uint num)
+{
+	if (UseCache()) {
+		for (uint i = 0; i < num; ++i)
+			FreeCached(bufs[i]);
+		return;
+	}
+
+    Thread::IPL G(IPL_NETWORK);
+
+	for (uint i = 0; i < num; ++i)
+		Free(bufs[i]);
+}
+
+
+ClassStats GetStats(uint cls)
+{
+	assert_bounds(cls < NUM_CLASSES);
+
     Thread::IPL G(IPL_NETWORK);
 
-	_pool.PushBack(buf);
+	return _class[cls].stats;
 }
 
 
 } // namespace BufferPool
 
 
+// Atomic, as the network thread drops references without the IPL
+void IOBuffer::Retain()
+{
+	assert(_refcount < 255);
+	__atomic_add_fetch(&_refcount, 1, __ATOMIC_RELAXED);
+}
+
+
 // XXX move this stuff to IP
 
 const Vector<InterfaceInfo*>& GetNetworkInterfaces()
@@ -109,6 +390,21 @@ bool GetIfMacAddr(const String& interface, uint8_t macaddr[6])
 bool GetMacAddr(uint8_t macaddr[6]) { return GetIfMacAddr(STR("eth0"), macaddr); }
 
 
+uint EtherMcastHash(const uint8_t macaddr[6])
+{
+	// CRC-32 as the MAC computes it over the frame: bits in wire
+	// order, least significant first, and not complemented
+	uint32_t crc = ~0;
+	for (uint i = 0; i < 6; ++i) {
+		uint8_t byte = macaddr[i];
+		for (uint bit = 0; bit < 8; ++bit, byte >>= 1)
+			crc = (crc << 1) ^ (((crc >> 31) ^ byte) & 1 ? 0x04c11db7 : 0);
+	}
+
+	return (crc >> 23) & 0x3f;
+}
+
+
 #ifdef SOFT_PHY_ADDR
 static uint16_t _mac0;          // First 2 bytes
 static uint32_t _mac1;          // Last 4 bytes
@@ -128,29 +424,61 @@ void InitEthernet() {
 #endif
 }
 
+// Receive works like Linux NAPI.  The driver's RX interrupt turns
+// itself off as it wakes the thread, which takes up to NET_RX_BUDGET
+// frames per pass, seeing to timers in between, until the ring is
+// empty.  Only then is the interrupt turned back on.  After a pass
+// that used the whole budget the thread also keeps polling every
+// NET_RX_POLL_MSEC, since under load the next frames are likely close
+// behind.  How many quiet passes it holds out for follows the load:
+// twice as many after each busy pass, up to _net_rx_poll_hold, and
+// half as many after a hold that ran out.  A polled pass that finds
+// frames starts the hold over.  The driver's rx_interrupts against
+// rx_packets shows how well it's working; see tests/pollbench.cxx.
 void* NetThread(void*)
 {
     Thread::SetPriority(NET_THREAD_PRIORITY);
+	_net_thread = Thread::GetCurThread();
 
-	BufferPool::Initialize(NumNetworkBuffers(_eth0.GetBufSize()), _eth0.GetBufSize());
+	BufferPool::Initialize(NetworkDataSize(), _eth0.GetBufSize());
 
     InitEthernet();
 
 	_ip0.Initialize();
+	_igmp0.Initialize();
 	_dhcp0.Reset();
     _dns0.Init();
 
 	Time dhcp_next = _dhcp0.GetServiceTime();
 	Time ip_next = _ip0.GetServiceTime();
+	Time tcp_next = _tcp0.GetServiceTime();
+	Time igmp_next = _igmp0.GetServiceTime();
 	bool link = _eth0.GetLinkStatus();
     console("eth0: link %s", link ? "up" : "down");
 
+	bool rx_more = false;		// Frames left in the ring
+	uint rx_hold = 0;			// Polled passes left before rearming RX interrupt
+	uint rx_hold_len = 1;		// Passes to hold for, adapted to the load
+
 	for (;;) {
 		Time now = Time::Now();
-		Time next = min(dhcp_next, ip_next);
+		// TCP and IGMP timers may be armed from other threads, IP
+		// timers while receiving, and DHCP's by a Reset() from
+		// whatever saw the link come back
+		dhcp_next = _dhcp0.GetServiceTime();
+		tcp_next = _tcp0.GetServiceTime();
+		ip_next = _ip0.GetServiceTime();
+		igmp_next = _igmp0.GetServiceTime();
+
+		Time next = min(min(min(dhcp_next, ip_next), tcp_next), igmp_next);
 		if (!link)
             next = min(next, now + Time::FromMsec(250));
 
+		if (rx_more)
+			next = now;
+		else if (rx_hold)
+			next = min(next, now + Time::FromMsec(NET_RX_POLL_MSEC));
+
 		if (now < next)
 			_net_event.Wait(next - now);
 
@@ -165,13 +493,28 @@ void* NetThread(void*)
 
 		IOBuffer* packet;
 		uint16_t et;
-		while ((packet = _eth0.Receive(et))) {
-#ifdef SOFT_PHY_ADDR
+		uint nrx = 0;
+		while (nrx < NET_RX_BUDGET && (packet = _eth0.Receive(et))) {
+            ++nrx;
+            _capture.Tap(packet, Capture::DIR_RX);
+
             const uint16_t mac0 = *(uint16_t*)(*packet + 0);
             const uint32_t mac1 = *(uint32_t*)(*packet + 2);
-            if ((mac0 == 0xffff && mac1 == 0xffffffff) || 
-                (mac0 == _mac0 && mac1 == _mac1)) {
+            bool accept;
+            if (mac0 == 0xffff && mac1 == 0xffffffff)
+                accept = true;
+            else if ((*packet)[0] & 1)
+                // The MAC's multicast filter, if it has one, is a
+                // hash and lets through groups we're not in
+                accept = _igmp0.AcceptMac(*packet + 0);
+            else
+#ifdef SOFT_PHY_ADDR
+                accept = mac0 == _mac0 && mac1 == _mac1;
+#else
+                accept = true;
 #endif
+
+            if (accept) {
                 // Note: the receive functions take ownership of the
                 // packet and free it if needed
                 switch (et) {
@@ -183,12 +526,34 @@ void* NetThread(void*)
                     _ip0.ArpReceive(packet);
                     break;
                 default: ;
+                    NetStats::Inc(_eth0.GetStats().rx_unknown);
                     BufferPool::FreeBuffer(packet);
                     break;
                 }
-#ifdef SOFT_PHY_ADDR
+            } else {
+                NetStats::Inc(_eth0.GetStats().rx_filtered);
+                BufferPool::FreeBuffer(packet);
             }
-#endif
+		}
+
+		_eth0.RestockRx();
+		_eth0.ReclaimTx();
+
+		const bool held = rx_hold;
+		if (nrx == NET_RX_BUDGET) {
+			rx_more = true;
+			rx_hold_len = min(max(rx_hold_len * 2, 1U), _net_rx_poll_hold);
+			rx_hold = rx_hold_len;
+		} else if (rx_hold && nrx) {
+			rx_more = false;
+			rx_hold = rx_hold_len;
+		} else if (rx_hold && --rx_hold) {
+			rx_more = false;
+		} else {
+			// Rearm on the last polled pass, as nothing polls after it
+			if (held && rx_hold_len > 1)
+				rx_hold_len /= 2;
+			rx_more = !_eth0.EnableRxInterrupt();
 		}
 
 		now = Time::Now();
@@ -198,6 +563,12 @@ void* NetThread(void*)
         
 		if (now >= ip_next)
             ip_next = _ip0.Service();
+
+		if (now >= tcp_next)
+            tcp_next = _tcp0.Service();
+
+		if (now >= igmp_next)
+            igmp_next = _igmp0.Service();
 	}
 	// Notreached
 	return NULL;
@@ -8,42 +8,170 @@
 
 #include <stdint.h>
 #include "core/pstring.h"
-#include "core/compiler.h"
+#include "compiler.h"
 #include "core/deque.h"
 #include "core/netaddr.h"
 #include "core/mutex.h"
 
-typedef Deque<uint8_t> IOBuffer;
+// Network buffer.  A Deque over a pool buffer; transports reserve
+// headroom and each layer prepends its header in place.  Buffers can
+// be chained for gather transmit, typically a header buffer followed
+// by a payload buffer.  A buffer can also be referenced from several
+// chains at once, e.g. one payload sent to several destinations; a
+// shared buffer must then be the tail of each chain.
+//
+// References and chains are released by BufferPool::FreeBuffer().
+class IOBuffer: public Deque<uint8_t> {
+	IOBuffer* _next;			// Next fragment in chain
+	uint8_t _refcount;
+	bool _csum_verified;		// Received with checksums verified by NIC
+
+public:
+	IOBuffer() : _next(NULL), _refcount(1), _csum_verified(false) { }
+
+	// Empty the buffer, leaving room for headroom bytes of headers
+	void SetHeadroom(uint headroom) { SetHead(headroom); SetTail(headroom); }
+
+	// Prepend len bytes from the headroom and return the new start
+	uint8_t* Prepend(uint len) {
+		assert_bounds(GetHead() >= len);
+		return &Insert(0, len);
+	}
+
+	IOBuffer* GetNext() const { return _next; }
+	void SetNext(IOBuffer* next) { _next = next; }
+
+	// Append fragment at end of chain
+	void Chain(IOBuffer* frag) {
+		IOBuffer* b = this;
+		while (b->_next)
+			b = b->_next;
+		b->_next = frag;
+	}
+
+	// Number of bytes in chain, starting at this buffer's head
+	uint ChainSize() const {
+		uint size = 0;
+		for (const IOBuffer* b = this; b; b = b->_next)
+			size += b->Size();
+		return size;
+	}
+
+	// Add a reference
+	void Retain();
+
+	// True if this is the only reference
+	bool IsExclusive() const { return _refcount == 1; }
+
+	// Drop a reference, returns true if it was the last.  For
+	// BufferPool use only.
+	bool Release() {
+		assert(_refcount);
+		return !__atomic_sub_fetch(&_refcount, 1, __ATOMIC_ACQ_REL);
+	}
+
+	// Set by a driver with OFFLOAD_RX_CSUM on a received frame whose
+	// IP header and TCP/UDP/ICMP checksums were found to be good.
+	void SetCsumVerified(bool flag) { _csum_verified = flag; }
+	bool IsCsumVerified() const { return _csum_verified; }
+
+	// Reset chain, refcount and flags when handed out by BufferPool
+	void Recycle() { _next = NULL; _refcount = 1; _csum_verified = false; }
+};
 
 // These are implemented elsewhere
 IOBuffer* AllocNetworkBuffer();
 uint8_t* AllocNetworkData(uint size, uint alignment);
-uint NumNetworkBuffers(uint size);
+uint NetworkDataSize();
 
 extern EventObject _net_event; // Event object for network thread
+
+// Receive tuning for the network thread.  The RX interrupt is off
+// while the thread polls; see NetThread().
+enum {
+	NET_RX_BUDGET = 16,			// Frames taken per pass before timers are seen to
+	NET_RX_POLL_HOLD = 8,		// Most quiet passes polled after a busy one
+	NET_RX_POLL_MSEC = 1		// Time between polled passes
+};
+
+// Polled passes are held for at most this many, NET_RX_POLL_HOLD
+// unless changed; 0 turns polling off.  For benchmarks.
+extern uint _net_rx_poll_hold;
+
+// The network thread, once started.  BufferPool keeps a cache for it.
 extern Thread* _net_thread;
 
 void* NetThread(void*);
 
 
 namespace BufferPool {
-	// Indicates how many buffers are always reserved for AllocRx()
+	// Size classes, smallest first.  The last class is sized by the
+	// driver (Ethernet::GetBufSize()) and is the only one receive
+	// buffers come from; the smaller ones keep ARP, ACKs, resets and
+	// short datagrams from tying up full frame buffers.
+	enum {
+		NUM_CLASSES = 3,
+		CLASS_SMALL_SIZE = 128,
+		CLASS_MEDIUM_SIZE = 512
+	};
+
+	// Indicates how many buffers of the largest class are always
+	// reserved for AllocRx()
 	enum { TX_MIN_POOL = 4 };
 
-	// Initialize pool with num buffer each of a specific size.
-	void Initialize(uint num, uint size);
-
-	// Allocate tx/rx buffer.  These return buffers from the same
-	// pool, except the Tx variant always leaves TX_MIN_POOL behind.
-	// This is to avoid using up the entire pool for transmits pending
-	// receive (e.g. IP pending an ARP reply) and then have no
-	// buffers left for the receive.  This is an issue when the
-	// buffer pool is small.
-	IOBuffer* AllocTx();
+	// The network thread allocates and frees most buffers.  It keeps
+	// up to CACHE_MAX free buffers of each class for itself, but no
+	// more than an eighth of the class, and allocates and frees
+	// those without raising the IPL.  The cache is refilled from the
+	// pool, and emptied back into it, half at a time, under one IPL.
+	// AllocTx() for a class with a reserve goes to the pool, which
+	// keeps it.  Other threads and interrupt handlers always use the
+	// pool, and can come up short while the cache still holds buffers.
+	enum { CACHE_MAX = 16 };
+
+	// Per class statistics
+	struct ClassStats {
+		uint16_t size;			// Buffer size
+		uint16_t total;			// Buffers in class
+		uint16_t inuse;			// Currently allocated, not in the pool or cache
+		uint16_t high;			// High water mark of inuse
+		uint32_t spilled;		// Tx requests served from a larger class
+		uint32_t failed;		// Requests that could not be served at all
+	};
+
+	// Initialize pool from mem bytes of buffer memory, split between
+	// the size classes.  maxsize is the size of the largest class.
+	void Initialize(uint mem, uint maxsize);
+
+	// Size of largest class
+	uint GetMaxSize();
+
+	// Allocate tx buffer of at least size bytes, from the smallest
+	// class that fits and still has buffers to spare.  Each class
+	// keeps a reserve that AllocTx() never touches, for the largest
+	// class TX_MIN_POOL.  This is to avoid using up the entire pool
+	// for transmits pending receive (e.g. IP pending an ARP reply)
+	// and then have no buffers left for the receive.  This is an
+	// issue when the buffer pool is small.  Returns NULL if size
+	// exceeds GetMaxSize().
+	IOBuffer* AllocTx(uint size);
+
+	// Allocate rx buffer from the largest class
 	IOBuffer* AllocRx();
 
-	// Return buffer to pool
+	// Allocate up to num receive buffers at once.  Returns the
+	// number allocated.
+	uint AllocRx(IOBuffer** bufs, uint num);
+
+	// Drop a reference to buffer.  When it was the last, return the
+	// buffer to its class and do the same for the rest of its chain.
 	void FreeBuffer(IOBuffer* buf);
+
+	// FreeBuffer() for num buffers at once
+	void FreeBuffers(IOBuffer* const* bufs, uint num);
+
+	// Get statistics for class cls, 0 being the smallest
+	ClassStats GetStats(uint cls);
 }
 
 
@@ -53,6 +181,22 @@ enum EtherType {
 };
 
 
+// Index of a MAC address in a 64 bit multicast hash filter: bits
+// 28:23 of the Ethernet CRC of the address.  For drivers'
+// SetMcastFilter().
+uint EtherMcastHash(const uint8_t macaddr[6]);
+
+
+// Checksum offload capabilities, as returned by Ethernet::GetOffload().
+// With TX offload the stack leaves checksum fields zero for the NIC
+// to fill in.
+enum {
+	OFFLOAD_TX_IPCSUM = 1,		// Inserts IP header checksum
+	OFFLOAD_TX_CSUM = 2,		// Inserts TCP/UDP/ICMP checksum
+	OFFLOAD_RX_CSUM = 4			// Verifies checksums, see IOBuffer::SetCsumVerified()
+};
+
+
 struct InterfaceInfo {
 	String _name;			// e.g. "en0"
 	NetAddr _addr;			// Configured address (port == 0)
@@ -0,0 +1,88 @@
+// Copyright (c) 2018-2021 Jan Brittenson
+// See LICENSE for details.
+
+#ifdef ENABLE_IP
+
+#include "core/enetkit.h"
+#include "core/network.h"
+#include "core/pcap.h"
+
+
+bool PcapWriter::Open(File* file, uint snaplen)
+{
+	assert(file);
+
+	FileHeader fh;
+	fh.magic = PCAP_MAGIC;
+	fh.version_major = PCAP_VERSION_MAJOR;
+	fh.version_minor = PCAP_VERSION_MINOR;
+	fh.thiszone = 0;
+	fh.sigfigs = 0;
+	fh.snaplen = snaplen;
+	fh.network = LINKTYPE_ETHERNET;
+
+	if (file->Write(&fh, sizeof fh) != sizeof fh)
+		return false;
+
+	_file = file;
+	_snaplen = snaplen;
+	_frames = 0;
+	_errors = 0;
+	return true;
+}
+
+
+void PcapWriter::WriteRecord(uint len, uint incl, const Time& ts)
+{
+	const int64_t usec = ts.GetUsec();
+
+	RecordHeader rh;
+	rh.ts_sec = usec / 1000000;
+	rh.ts_usec = usec % 1000000;
+	rh.incl_len = incl;
+	rh.orig_len = len;
+
+	if (_file->Write(&rh, sizeof rh) != sizeof rh)
+		++_errors;
+}
+
+
+void PcapWriter::Write(const uint8_t* frame, uint len, const Time& ts, uint orig_len)
+{
+	if (!_file)
+		return;
+
+	const uint incl = min(len, _snaplen);
+	WriteRecord(max(len, orig_len), incl, ts);
+
+	if (_file->Write(frame, incl) != incl)
+		++_errors;
+
+	++_frames;
+}
+
+
+void PcapWriter::Write(const IOBuffer* buf, const Time& ts)
+{
+	if (!_file)
+		return;
+
+	const uint len = buf->ChainSize();
+	uint incl = min(len, _snaplen);
+	WriteRecord(len, incl, ts);
+
+	for (const IOBuffer* b = buf; b && incl; b = b->GetNext()) {
+		const uint n = min(b->Size(), incl);
+		if (!n)
+			continue;
+
+		if (_file->Write(*b + 0, n) != n)
+			++_errors;
+
+		incl -= n;
+	}
+
+	++_frames;
+}
+
+#endif // ENABLE_IP
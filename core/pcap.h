@@ -0,0 +1,80 @@
+// Copyright (c) 2018-2021 Jan Brittenson
+// See LICENSE for details.
+
+#ifndef __PCAP_H__
+#define __PCAP_H__
+
+#include "core/file.h"
+#include "core/time.h"
+
+
+class IOBuffer;
+
+// Writes Ethernet frames to a file in classic libpcap format, for
+// reading with Wireshark or tcpdump.  Records are written in host
+// byte order with microsecond timestamps; readers use the magic
+// number to tell.  The writer doesn't own the file.
+class PcapWriter {
+	File* _file;
+	uint _snaplen;				// Max bytes saved per frame
+	uint32_t _frames;			// Frames written
+	uint32_t _errors;			// Failed writes
+
+	enum {
+		PCAP_MAGIC = 0xa1b2c3d4,
+		PCAP_VERSION_MAJOR = 2,
+		PCAP_VERSION_MINOR = 4,
+		LINKTYPE_ETHERNET = 1
+	};
+
+	struct FileHeader {
+		uint32_t magic;
+		uint16_t version_major;
+		uint16_t version_minor;
+		int32_t thiszone;		// GMT offset, always 0
+		uint32_t sigfigs;		// Always 0
+		uint32_t snaplen;
+		uint32_t network;		// LINKTYPE_xxx
+	};
+
+	struct RecordHeader {
+		uint32_t ts_sec;
+		uint32_t ts_usec;
+		uint32_t incl_len;		// Bytes saved
+		uint32_t orig_len;		// Frame length on the wire
+	};
+
+public:
+	enum { SNAPLEN_DEFAULT = 1514 };
+
+	PcapWriter() : _file(NULL), _snaplen(0), _frames(0), _errors(0) { }
+
+	// Start a capture on file, writing the file header.  Returns
+	// false if the header couldn't be written.
+	bool Open(File* file, uint snaplen = SNAPLEN_DEFAULT);
+
+	// Stop writing; leaves the file open
+	void Close() { _file = NULL; }
+
+	bool IsOpen() const { return _file; }
+
+	// Write frame data, truncated to the snap length.  orig_len is
+	// the length of the frame on the wire when frame only holds the
+	// start of it, 0 if it holds all of it.
+	void Write(const uint8_t* frame, uint len, const Time& ts, uint orig_len = 0);
+
+	// Write the frame in a buffer chain, starting at the head of buf
+	// (which should be the destination MAC address)
+	void Write(const IOBuffer* buf, const Time& ts);
+
+	uint32_t GetFrames() const { return _frames; }
+	uint32_t GetErrors() const { return _errors; }
+
+private:
+	void WriteRecord(uint len, uint incl, const Time& ts);
+
+	PcapWriter(const PcapWriter&);
+	PcapWriter& operator=(const PcapWriter&);
+};
+
+#endif // __PCAP_H__
@@ -489,6 +489,8 @@ int __aeabi_atexit (void *object, void (*destructor) (void *), void *dso_handle)
 
 }
 
+// A hosted build has these from its C runtime
+#ifdef __arm__
 int __cxa_atexit(void (*func) (void*), void* arg, void* dso_handle)
 {
 	return 0;
@@ -504,3 +506,4 @@ int __aeabi_atexit (void *object, void (*destructor) (void *), void *dso_handle)
 int __cxa_pure_virtual() { abort(); return 0; }
 
 void*   __dso_handle = (void*) &__dso_handle;
+#endif
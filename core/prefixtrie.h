@@ -0,0 +1,182 @@
+// Copyright (c) 2018-2021 Jan Brittenson
+// See LICENSE for details.
+
+#ifndef __PREFIXTRIE_H__
+#define __PREFIXTRIE_H__
+
+#include "core/vector.h"
+
+
+// Path compressed binary trie over 32-bit prefixes, for longest prefix
+// match.  Keys are in host byte order.  Internal nodes exist only
+// where two prefixes diverge, so a lookup visits at most one node per
+// distinct prefix length on the path.  Values are not owned.
+
+template <typename T> class PrefixTrie {
+	struct Node {
+		uint32_t key;			// Prefix, bits past plen are zero
+		uint8_t plen;			// Prefix length
+		T* value;				// NULL for internal node
+		Node* child[2];
+
+		Node(uint32_t k, uint l, T* v) : key(k), plen(l), value(v) {
+			child[0] = child[1] = NULL;
+		}
+	};
+
+	Node* _root;
+	uint _count;
+
+	typedef PrefixTrie<T> Self;
+
+	static uint32_t Mask(uint plen) { return plen ? ~0U << (32 - plen) : 0; }
+	static uint Bit(uint32_t key, uint pos) { return (key >> (31 - pos)) & 1; }
+
+	// Number of leading bits in common, up to limit
+	static uint Common(uint32_t a, uint32_t b, uint limit) {
+		const uint32_t x = a ^ b;
+		return min<uint>(x ? __builtin_clz(x) : 32, limit);
+	}
+
+	// Remove a valueless node with fewer than two children
+	static void Collapse(Node** np) {
+		Node* n = *np;
+		if (!n || n->value || (n->child[0] && n->child[1]))
+			return;
+
+		*np = n->child[0] ? n->child[0] : n->child[1];
+		delete n;
+	}
+
+	static void Free(Node* n) {
+		if (!n) return;
+		Free(n->child[0]);
+		Free(n->child[1]);
+		delete n;
+	}
+
+	static void Collect(const Node* n, Vector<T*>& v) {
+		if (!n) return;
+		if (n->value)
+			v.PushBack(n->value);
+		Collect(n->child[0], v);
+		Collect(n->child[1], v);
+	}
+
+public:
+	PrefixTrie() : _root(NULL), _count(0) { }
+	~PrefixTrie() { Free(_root); }
+
+	uint Size() const { return _count; }
+	bool Empty() const { return !_count; }
+
+	// Insert value for prefix.  Returns the value previously stored
+	// for the same prefix, or NULL.
+	T* Insert(uint32_t key, uint plen, T* value) {
+		assert(plen <= 32);
+		assert(value);
+
+		key &= Mask(plen);
+
+		Node** np = &_root;
+		for (;;) {
+			Node* n = *np;
+			if (!n) {
+				*np = new Node(key, plen, value);
+				++_count;
+				return NULL;
+			}
+
+			const uint common = Common(key, n->key, min<uint>(plen, n->plen));
+
+			if (common == n->plen && common == plen) {
+				T* prev = n->value;
+				n->value = value;
+				if (!prev)  ++_count;
+				return prev;
+			}
+
+			if (common == n->plen) {
+				np = &n->child[Bit(key, n->plen)];
+				continue;
+			}
+
+			Node* m = new Node(key, plen, value);
+			++_count;
+
+			if (common == plen) {
+				// New prefix covers n
+				m->child[Bit(n->key, plen)] = n;
+				*np = m;
+			} else {
+				// Diverge below common prefix
+				Node* split = new Node(key & Mask(common), common, NULL);
+				split->child[Bit(key, common)] = m;
+				split->child[Bit(n->key, common)] = n;
+				*np = split;
+			}
+			return NULL;
+		}
+	}
+
+	// Remove prefix.  Returns the value removed, or NULL.
+	T* Erase(uint32_t key, uint plen) {
+		key &= Mask(plen);
+
+		Node** parent = NULL;
+		Node** np = &_root;
+		Node* n;
+
+		while ((n = *np)) {
+			if (n->plen > plen || (key & Mask(n->plen)) != n->key)
+				return NULL;
+
+			if (n->plen == plen)
+				break;
+
+			parent = np;
+			np = &n->child[Bit(key, n->plen)];
+		}
+
+		if (!n || !n->value)
+			return NULL;
+
+		T* value = exch<T*>(n->value, NULL);
+		--_count;
+
+		Collapse(np);
+		if (parent)
+			Collapse(parent);
+
+		return value;
+	}
+
+	// Longest prefix match, or NULL if nothing matches
+	T* Lookup(uint32_t addr) const {
+		T* best = NULL;
+
+		for (const Node* n = _root; n; ) {
+			if ((addr & Mask(n->plen)) != n->key)
+				break;
+
+			if (n->value)
+				best = n->value;
+
+			if (n->plen == 32)
+				break;
+
+			n = n->child[Bit(addr, n->plen)];
+		}
+
+		return best;
+	}
+
+	// Append all values to v
+	void Collect(Vector<T*>& v) const { Collect(_root, v); }
+
+private:
+	PrefixTrie(const Self&);
+	Self& operator=(const Self&);
+};
+
+#endif // __PREFIXTRIE_H__
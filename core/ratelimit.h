@@ -0,0 +1,70 @@
+// Copyright (c) 2018-2021 Jan Brittenson
+// See LICENSE for details.
+
+#ifndef __RATELIMIT_H__
+#define __RATELIMIT_H__
+
+#include "core/time.h"
+
+
+// Rate and burst of a token bucket.  A rate of 0 means no limit.
+struct RateLimit {
+	uint16_t rate;				// Tokens per second
+	uint16_t burst;				// Max tokens saved up
+};
+
+
+// Token bucket.  Credit accrues at the rate of the RateLimit passed
+// in, up to its burst, and each event allowed takes one token.  The
+// limit is kept by the caller so many buckets can share one.  A new
+// bucket starts out full.
+//
+// Credit is kept in millionths of a token so it accrues exactly at
+// the microsecond resolution of Time.  It needs 64 bits: a full
+// bucket of 0xffff tokens is 2^36 of them.
+class TokenBucket {
+	enum { SCALE = 1000000 };
+
+	Time _last;					// When credit was last added
+	uint64_t _credit;
+
+public:
+	TokenBucket() : _last(), _credit(0) { }
+
+	// Start over, full
+	void Reset() { _last = Time(); _credit = 0; }
+
+	// Add credit for the time since last call, and return whether
+	// there is a token to take
+	bool Ready(const Time& now, const RateLimit& limit) {
+		if (!limit.rate)
+			return true;
+
+		// A clock stepped back just adds nothing
+		// Any wait longer than cap usec fills it at any rate, and
+		// capping the wait first keeps usec * rate from overflowing
+		// after a long idle spell.  A bucket never used is filled
+		// the same way, or one made at boot would start out empty.
+		const uint64_t cap = (uint64_t)limit.burst * SCALE;
+		const uint64_t usec = _last == Time() ? cap :
+			_last < now ? min<uint64_t>((now - _last).GetUsec(), cap) : 0;
+		_credit = min<uint64_t>(_credit + usec * limit.rate, cap);
+		_last = now;
+		return _credit >= SCALE;
+	}
+
+	void Take() {
+		if (_credit >= SCALE)
+			_credit -= SCALE;
+	}
+
+	// Ready() and Take() in one
+	bool Allow(const Time& now, const RateLimit& limit) {
+		if (!Ready(now, limit))
+			return false;
+		Take();
+		return true;
+	}
+};
+
+#endif // __RATELIMIT_H__
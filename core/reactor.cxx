@@ -0,0 +1,217 @@
+// Copyright (c) 2018-2021 Jan Brittenson
+// See LICENSE for details.
+
+#include "core/enetkit.h"
+#include "core/reactor.h"
+
+
+ReactorSource::~ReactorSource()
+{
+	if (_reactor)
+		_reactor->Remove(this);
+}
+
+
+void ReactorSource::Notify(uint events)
+{
+	Reactor* r;
+	{
+		ScopedNoInt G;
+		r = _reactor;
+		events &= _rmask;
+	}
+
+	if (r && events)
+		r->Post(this, events);
+}
+
+
+void ReactorEvent::Set(uint events)
+{
+	{
+		ScopedNoInt G;
+		_event |= events;
+	}
+	Notify(events);
+}
+
+
+void ReactorEvent::Reset()
+{
+	ScopedNoInt G;
+	_event = 0;
+}
+
+
+Reactor::~Reactor()
+{
+	ScopedNoInt G;
+
+	while (_watched) {
+		ReactorSource* s = _watched;
+		_watched = s->_wnext;
+		s->_reactor = NULL;
+		s->_rnext = s->_wnext = s->_wprev = NULL;
+		s->_rmask = 0;
+		s->_rpending = 0;
+	}
+	_head = _tail = NULL;
+}
+
+
+bool Reactor::Add(ReactorSource* source, uint mask, void* cookie)
+{
+	{
+		ScopedNoInt G;
+
+		if (source->_reactor)
+			return source->_reactor == this;
+
+		source->_reactor = this;
+		source->_cookie = cookie;
+		source->_rmask = mask;
+
+		source->_wprev = NULL;
+		source->_wnext = _watched;
+		if (_watched)
+			_watched->_wprev = source;
+		_watched = source;
+	}
+
+	// Report what's already there; edges before this were missed
+	const uint events = source->GetEvent() & mask;
+	if (events)
+		Post(source, events);
+
+	return true;
+}
+
+
+void Reactor::Modify(ReactorSource* source, uint mask)
+{
+	ScopedNoInt G;
+
+	assert(source->_reactor == this);
+	source->_rmask = mask;
+
+	if (source->_rpending & mask)
+		source->_rpending &= mask;
+	else
+		Unlink(source);
+}
+
+
+void Reactor::Remove(ReactorSource* source)
+{
+	ScopedNoInt G;
+
+	if (source->_reactor != this)
+		return;
+
+	Unlink(source);
+
+	if (source->_wprev)
+		source->_wprev->_wnext = source->_wnext;
+	else
+		_watched = source->_wnext;
+	if (source->_wnext)
+		source->_wnext->_wprev = source->_wprev;
+	source->_wnext = source->_wprev = NULL;
+
+	source->_reactor = NULL;
+	source->_rmask = 0;
+}
+
+
+void Reactor::Post(ReactorSource* source, uint events)
+{
+	{
+		ScopedNoInt G;
+
+		// Removed while notifying
+		if (source->_reactor != this)
+			return;
+
+		const bool queued = source->_rpending;
+		source->_rpending |= events;
+		if (queued)
+			return;
+
+		source->_rnext = NULL;
+		if (_tail)
+			_tail->_rnext = source;
+		else
+			_head = source;
+		_tail = source;
+	}
+
+	_event.Set();
+}
+
+
+// Called with interrupts disabled.  Takes source off ready list, if
+// it's on it.
+void Reactor::Unlink(ReactorSource* source)
+{
+	if (!source->_rpending)
+		return;
+
+	ReactorSource* prev = NULL;
+	for (ReactorSource* s = _head; s; prev = s, s = s->_rnext) {
+		if (s == source) {
+			if (prev)
+				prev->_rnext = s->_rnext;
+			else
+				_head = s->_rnext;
+			if (_tail == s)
+				_tail = prev;
+			break;
+		}
+	}
+
+	source->_rnext = NULL;
+	source->_rpending = 0;
+}
+
+
+uint Reactor::Collect(Ready* ready, uint num)
+{
+	ScopedNoInt G;
+
+	uint n;
+	for (n = 0; n < num && _head; ++n) {
+		ReactorSource* s = _head;
+		_head = s->_rnext;
+		if (!_head)
+			_tail = NULL;
+
+		ready[n].source = s;
+		ready[n].cookie = s->_cookie;
+		ready[n].events = s->_rpending;
+
+		s->_rnext = NULL;
+		s->_rpending = 0;
+	}
+
+	return n;
+}
+
+
+uint Reactor::Wait(Ready* ready, uint num, const Time& deadline)
+{
+	for (;;) {
+		const uint n = Collect(ready, num);
+		if (n)
+			return n;
+
+		if (deadline == Time::InfTim) {
+			_event.Wait();
+		} else {
+			const Time now = Time::Now();
+			if (now >= deadline)
+				return 0;
+
+			_event.Wait(deadline - now);
+		}
+	}
+}
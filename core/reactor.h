@@ -0,0 +1,109 @@
+// Copyright (c) 2018-2021 Jan Brittenson
+// See LICENSE for details.
+
+#ifndef __REACTOR_H__
+#define __REACTOR_H__
+
+#include "core/mutex.h"
+
+
+class Reactor;
+
+// Something a Reactor can watch.  A source reports events with
+// Notify(); those in its interest mask queue it on its reactor's
+// ready list unless it's already there, in which case they're merged
+// into the events it will be reported with.  Delivery is edge
+// triggered, like CoreSocket events.
+class ReactorSource {
+	friend class Reactor;
+
+	Reactor* _reactor;			// Reactor watching this, or NULL
+	ReactorSource* _rnext;		// Ready list link
+	ReactorSource* _wnext;		// Watched list links
+	ReactorSource* _wprev;
+	void* _cookie;				// Handle returned with events
+	uint16_t _rmask;			// Events of interest
+	uint16_t _rpending;			// Events not yet delivered; queued if non-zero
+
+public:
+	ReactorSource() : _reactor(NULL), _rnext(NULL), _wnext(NULL), _wprev(NULL), _cookie(NULL),
+					  _rmask(0), _rpending(0) { }
+	virtual ~ReactorSource();
+
+	// Current event state, reported for a source that is already
+	// ready when added to a reactor
+	virtual uint GetEvent() = 0;
+
+protected:
+	void Notify(uint events);
+
+private:
+	ReactorSource(const ReactorSource&);
+	ReactorSource& operator=(const ReactorSource&);
+};
+
+
+// Source for events that don't come from a socket, e.g. a request
+// posted by another thread.  Set() reports events, GetEvent() returns
+// those reported since the last Reset().
+class ReactorEvent: public ReactorSource {
+	uint16_t _event;
+public:
+	ReactorEvent() : _event(0) { }
+
+	void Set(uint events = 1);
+	void Reset();
+	uint GetEvent() { return _event; }
+};
+
+
+// Multiplexed wait over many sources with one EventObject.  One
+// thread calls Wait(); sources may notify from any thread.  Work is
+// proportional to the number of ready sources, not the number
+// registered.  Sources still watched when a Reactor is destroyed are
+// let go of, as if removed.
+class Reactor {
+	friend class ReactorSource;
+
+	EventObject _event;
+	ReactorSource* _head;		// Ready list
+	ReactorSource* _tail;
+	ReactorSource* _watched;	// Every source added
+
+public:
+	struct Ready {
+		ReactorSource* source;
+		void* cookie;
+		uint events;			// Events since last reported
+	};
+
+	Reactor() : _head(NULL), _tail(NULL), _watched(NULL) { }
+	~Reactor();
+
+	// Watch source for events in mask.  Returns false if it's
+	// already watched by another reactor.  Events the source already
+	// has are reported by the next Wait().
+	bool Add(ReactorSource* source, uint mask, void* cookie = NULL);
+
+	// Change interest mask
+	void Modify(ReactorSource* source, uint mask);
+
+	// Stop watching source; drops any undelivered events
+	void Remove(ReactorSource* source);
+
+	// Wait for ready sources until deadline (Time::InfTim to wait
+	// indefinitely).  Fills in up to num entries and returns the
+	// number filled in, 0 on timeout.  Sources beyond num stay
+	// queued for the next call.
+	uint Wait(Ready* ready, uint num, const Time& deadline = Time::InfTim);
+
+private:
+	void Post(ReactorSource* source, uint events);
+	void Unlink(ReactorSource* source);
+	uint Collect(Ready* ready, uint num);
+
+	Reactor(const Reactor&);
+	Reactor& operator=(const Reactor&);
+};
+
+#endif // __REACTOR_H__
@@ -5,12 +5,15 @@
 #define __SOCKET_H__
 
 #include "core/mutex.h"
+#include "core/reactor.h"
 
 
 // Socket interface.  Sockets are always non-blocking by design.
-// Event delivery is edge triggered.
+// Event delivery is edge triggered.  Events in the event mask signal
+// the socket's own EventObject; a socket can also be added to a
+// Reactor, to wait on many sockets from one thread.
 
-class CoreSocket: public EventObject {
+class CoreSocket: public EventObject, public ReactorSource {
 	uint16_t _evmask;			// Events that signal EO
 	uint16_t _event;			// Current events
 	uint8_t _error;				// Last socket error
@@ -49,6 +52,7 @@ public:
 	bool SetEventMask(uint mask) { _evmask = mask; return true; }
 	void AddEvent(uint event) {
 		_event |= event; if (event & _evmask)  EventObject::Set();
+		Notify(event);
 	}
 	void ClearEvent(uint event) { _event &= ~event; }
 	void SetError(uint e) { _error = e; }
@@ -0,0 +1,101 @@
+// Copyright (c) 2018-2021 Jan Brittenson
+// See LICENSE for details.
+
+#ifndef __SPSCRING_H__
+#define __SPSCRING_H__
+
+
+// Lock-free single producer, single consumer ring.  One context (e.g.
+// an interrupt handler) may push while another (e.g. a thread) pops,
+// without either raising IPL.  Same API family as Ring<>, except
+// pushes and pops report how much they did instead of asserting on a
+// full or empty ring.
+//
+// N must be a power of two; all N slots are usable.  _head and _tail
+// run freely and are masked on access.  The producer owns _tail and
+// publishes it with release ordering after writing the slots; the
+// consumer owns _head and publishes it the same way after reading
+// them.  Each side reads the other's index with acquire ordering.
+
+template <int N, typename T, typename size_type = uint>
+class SpscRing {
+    static_assert(N > 0 && (N & (N - 1)) == 0, "SpscRing size must be a power of two");
+
+    size_type _head;            // Next to pop; written by consumer only
+    size_type _tail;            // Next to push; written by producer only
+    T _v[N];
+
+    typedef SpscRing<N, T, size_type>  Self;
+
+    static size_type Load(const size_type& idx) { return __atomic_load_n(&idx, __ATOMIC_ACQUIRE); }
+    static void Store(size_type& idx, size_type val) { __atomic_store_n(&idx, val, __ATOMIC_RELEASE); }
+
+public:
+    SpscRing() : _head(0), _tail(0) { }
+
+    // Either side.  Exact when called by one of them, a snapshot
+    // otherwise.
+    [[__optimize]] size_type Size() const { return Load(_tail) - Load(_head); }
+    [[__optimize]] size_type Headroom() const { return N - Size(); }
+    [[__optimize]] bool Empty() const { return Load(_tail) == Load(_head); }
+
+    //// Producer side
+
+    [[__optimize]] bool PushBack(const T& arg) {
+        const size_type tail = _tail;
+        if (tail - Load(_head) == N)
+            return false;
+
+        _v[tail & (N - 1)] = arg;
+        Store(_tail, tail + 1);
+        return true;
+    }
+
+    // Push up to len items; returns number pushed
+    [[__optimize]] size_type PushBack(const T* arg, size_type len) {
+        const size_type tail = _tail;
+        const size_type n = min<size_type>(len, N - (tail - Load(_head)));
+
+        for (size_type i = 0; i < n; ++i)
+            _v[(tail + i) & (N - 1)] = arg[i];
+
+        Store(_tail, tail + n);
+        return n;
+    }
+
+    //// Consumer side
+
+    [[__optimize]] bool PopFront(T& arg) {
+        const size_type head = _head;
+        if (head == Load(_tail))
+            return false;
+
+        arg = _v[head & (N - 1)];
+        Store(_head, head + 1);
+        return true;
+    }
+
+    // Pop up to len items; returns number popped
+    [[__optimize]] size_type PopFront(T* arg, size_type len) {
+        const size_type head = _head;
+        const size_type n = min<size_type>(len, Load(_tail) - head);
+
+        for (size_type i = 0; i < n; ++i)
+            arg[i] = _v[(head + i) & (N - 1)];
+
+        Store(_head, head + n);
+        return n;
+    }
+
+    // Peek at next item.  Ring must not be empty.
+    [[__optimize]] const T& Front() const {
+        assert_bounds(!Empty());
+        return _v[_head & (N - 1)];
+    }
+
+private:
+    SpscRing(const Self&);
+    Self& operator=(const Self&);
+};
+
+#endif // __SPSCRING_H__
@@ -0,0 +1,1361 @@
+// Copyright (c) 2018-2021 Jan Brittenson
+// See LICENSE for details.
+
+#ifdef ENABLE_IP
+
+#include "core/enetcore.h"
+#include "core/tcp.h"
+#include "core/ip.h"
+#include "core/netstats.h"
+
+
+Tcp _tcp0(_ip0);
+
+
+// Sequence space comparisons
+static inline bool SeqLT(uint32_t a, uint32_t b) { return (int32_t)(a - b) < 0; }
+static inline bool SeqLEQ(uint32_t a, uint32_t b) { return (int32_t)(a - b) <= 0; }
+static inline bool SeqGT(uint32_t a, uint32_t b) { return (int32_t)(a - b) > 0; }
+static inline bool SeqGEQ(uint32_t a, uint32_t b) { return (int32_t)(a - b) >= 0; }
+
+
+// CUBIC parameters.  beta is in 1/1024ths.  C = 0.4 is folded into
+// the constants below, with time in msec:
+//   K = cbrt((W_max - cwnd) / C)     -> cbrt((W_max - cwnd) * 2.5e9) msec
+//   W(t) = C * (t - K)^3 + W_max     -> (t - K)^3 * 4 / 1e10 segments
+// The Reno-friendly increment 3(1-beta)/(1+beta) = 0.53 is also in
+// 1/1024ths.
+enum {
+	CUBIC_BETA = 717,
+	CUBIC_ALPHA = 542
+};
+
+static const uint64_t CUBIC_K_SCALE = 2500000000ULL;
+static const int64_t CUBIC_W_DIV = 10000000000LL;
+
+
+// Integer cube root
+static uint32_t icbrt(uint64_t x)
+{
+	uint64_t y = 0;
+
+	for (int s = 63; s >= 0; s -= 3) {
+		y <<= 1;
+		const uint64_t b = 3 * y * (y + 1) + 1;
+		if ((x >> s) >= b) {
+			x -= b << s;
+			++y;
+		}
+	}
+
+	return y;
+}
+
+
+TcpCoreSocket* Tcp::Create()
+{
+	TcpCoreSocket* s = new TcpCoreSocket();
+
+	Mutex::Scoped L(_lock);
+	_sockets.PushBack(s);
+
+	return s;
+}
+
+
+uint16_t Tcp::AllocPort()
+{
+	Mutex::Scoped L(_lock);
+
+	for (;;) {
+		if (!++_portnum)
+			_portnum = 32768;
+
+		const uint16_t port = Htons(_portnum);
+
+		uint i;
+		for (i = 0; i < _sockets.Size(); ++i)
+			if (_sockets[i]->_id.sport == port)
+				break;
+
+		if (i == _sockets.Size())
+			return port;
+	}
+}
+
+
+void Tcp::Receive(IOBuffer* buf)
+{
+	Iph& iph = *(Iph*)(*buf + 0);
+	Tcph& tcph = *(Tcph*)iph.GetTransport();
+	const uint len = Ntohs(iph.len) - iph.GetHLen();
+
+	NetStats::Inc(_netstats.tcp.in_segs);
+
+	if (len < sizeof (Tcph) || tcph.GetHLen() < sizeof (Tcph) || tcph.GetHLen() > len ||
+		(!buf->IsCsumVerified() && !tcph.ValidateCsum(iph, len))) {
+		NetStats::Inc(_netstats.tcp.in_errs);
+		BufferPool::FreeBuffer(buf);
+		return;
+	}
+
+	Tuple t;
+
+	// A connected socket, or else a listening one
+	t.daddr = iph.source;
+	t.sport = tcph.dport;
+	t.dport = tcph.sport;
+
+	TcpCoreSocket* s;
+
+	_lock.Lock();
+	if (!_socklist.Demux(t, s)) {
+		_lock.Unlock();
+		SendReset(iph, tcph, len);
+		BufferPool::FreeBuffer(buf);
+		return;
+	}
+	_lock.Unlock();
+
+	assert(s);
+
+	// Sockets are only deleted by Service(), which runs on this thread,
+	// so s remains valid after the table lock is dropped.
+	{
+		Mutex::Scoped L(s->_lock);
+		s->Input(iph, tcph, len - tcph.GetHLen());
+	}
+
+	BufferPool::FreeBuffer(buf);
+}
+
+
+void Tcp::SendReset(Iph& iph, Tcph& tcph, uint seglen)
+{
+	if (tcph.flags & Tcph::FLAG_RST)
+		return;
+
+	IOBuffer* buf = BufferPool::AllocTx(IP_HEADROOM + sizeof (Tcph));
+	if (!buf)
+		return;
+
+	buf->SetHeadroom(IP_HEADROOM + sizeof (Tcph));
+
+	Tcph& rst = *(Tcph*)buf->Prepend(sizeof (Tcph));
+	rst.sport = tcph.dport;
+	rst.dport = tcph.sport;
+	rst.SetHLen(sizeof (Tcph));
+	rst.win = 0;
+	rst.urp = 0;
+
+	if (tcph.flags & Tcph::FLAG_ACK) {
+		rst.seq = tcph.ack;
+		rst.ack = 0;
+		rst.flags = Tcph::FLAG_RST;
+	} else {
+		uint32_t ack = Ntohl(tcph.seq) + seglen - tcph.GetHLen();
+		if (tcph.flags & Tcph::FLAG_SYN)  ++ack;
+		if (tcph.flags & Tcph::FLAG_FIN)  ++ack;
+
+		rst.seq = 0;
+		rst.ack = Htonl(ack);
+		rst.flags = Tcph::FLAG_RST | Tcph::FLAG_ACK;
+	}
+
+	Iph& iph2 = *(Iph*)buf->Prepend(sizeof (Iph));
+	iph2.id = 0;
+	iph2.SetHLen(sizeof (Iph));
+	iph2.proto = IPPROTO_TCP;
+	iph2.source = INADDR_ANY;
+
+	NetStats::Inc(_netstats.tcp.out_segs);
+	NetStats::Inc(_netstats.tcp.out_rsts);
+	_ip.Send(buf, iph.source, *this);
+}
+
+
+void Tcp::Register(TcpCoreSocket* s)
+{
+	Mutex::Scoped L(_lock);
+	_socklist.Insert(s->_id, s);
+}
+
+
+void Tcp::Deregister(TcpCoreSocket* s)
+{
+	Mutex::Scoped L(_lock);
+
+	TcpCoreSocket* tmp;
+	if (_socklist.Find(s->_id, tmp) && tmp == s)
+		_socklist.Erase(s->_id);
+}
+
+
+void Tcp::Remove(TcpCoreSocket* s)
+{
+	Mutex::Scoped L(_lock);
+
+	for (uint i = 0; i < _sockets.Size(); ) {
+		TcpCoreSocket* s2 = _sockets[i];
+		if (s2 == s) {
+			_sockets.Erase(i);
+			continue;
+		}
+
+		// Orphan half-open connections of a listener going away
+		if (s2->_listener == s)
+			s2->_listener = NULL;
+
+		++i;
+	}
+}
+
+
+TcpCoreSocket* Tcp::Find(const Tuple& t)
+{
+	Mutex::Scoped L(_lock);
+
+	TcpCoreSocket* s;
+
+	if (_socklist.Find(t, s))
+		return s;
+
+	return NULL;
+}
+
+
+void Tcp::Checksum(IOBuffer* buf) const
+{
+	Iph& iph = *(Iph*)(*buf + 0);
+	Tcph& tcph = *(Tcph*)iph.GetTransport();
+	tcph.SetCsum(iph, Ntohs(iph.len) - iph.GetHLen());
+}
+
+
+void Tcp::IcmpError(Icmph::Type type, uint code, in_addr_t sender, in_addr_t dest,
+					in_addr_t source, const Tcph& tcph)
+{
+	Tuple t;
+
+	t.daddr = dest;
+	t.sport = tcph.sport;
+	t.dport = tcph.dport;
+
+	TcpCoreSocket* s = Find(t);
+	if (!s)
+		return;
+
+	Mutex::Scoped L(s->_lock);
+
+	// Unreachables are hard errors only while connecting (RFC 1122 4.2.3.9)
+	if (s->_state == TcpCoreSocket::STATE_SYN_SENT) {
+		s->Reset(ERR_DEST_UNREACH);
+	} else {
+		s->SetError(ERR_DEST_UNREACH);
+		s->AddEvent(CoreSocket::EVENT_ERROR);
+	}
+}
+
+
+void Tcp::ArmTimer(const Time& t)
+{
+	Mutex::Scoped L(_lock);
+
+	if (t < _next) {
+		_next = t;
+		_net_event.Set();
+	}
+}
+
+
+Time Tcp::Service()
+{
+	const Time now = Time::Now();
+
+	// Work on a snapshot so the table lock isn't held across socket
+	// locks; sockets may arm timers (and take the table lock) while
+	// being serviced.
+	Vector<TcpCoreSocket*> sockets;
+	{
+		Mutex::Scoped L(_lock);
+		sockets = _sockets;
+		_next = Time::InfTim;
+	}
+
+	Time next = Time::InfTim;
+
+	for (uint i = 0; i < sockets.Size(); ++i) {
+		TcpCoreSocket* s = sockets[i];
+		bool dead;
+		{
+			Mutex::Scoped L(s->_lock);
+			next = min(next, s->Timer(now));
+			dead = s->_state == TcpCoreSocket::STATE_CLOSED && s->_user_closed && !s->_listener;
+		}
+
+		if (dead)
+			delete s;
+	}
+
+	Mutex::Scoped L(_lock);
+	_next = min(_next, next);
+	return _next;
+}
+
+
+TcpCoreSocket::TcpCoreSocket() :
+	_cached_route(NULL),
+	_listener(NULL),
+	_backlog(0),
+	_halfopen(0),
+	_state(STATE_CLOSED),
+	_iss(0), _snd_una(0), _snd_nxt(0), _snd_max(0), _snd_wl1(0), _snd_wl2(0),
+	_snd_wnd(0),
+	_rcv_nxt(0), _rcv_high(0), _rcv_adv(0),
+	_mss(TCP_MSS_DEFAULT),
+	_cwnd(TCP_INIT_CWND), _ssthresh(~0U), _cwnd_cnt(0), _w_max(0), _w_est(0),
+	_cubic_k(0), _epoch(Time::InfTim), _recover(0), _dupacks(0),
+	_srtt(0), _rttvar(0), _rto(TCP_RTO_INIT * 1000), _rtt_seq(0),
+	_rexmit_timer(Time::InfTim), _delack_timer(Time::InfTim),
+	_timewait_timer(Time::InfTim), _rexmit_count(0)
+{
+	_timing = false;
+	_in_recovery = false;
+	_fin_rcvd = false;
+	_ack_now = false;
+	_delack_seg = false;
+	_rcv_hole = false;
+	_user_closed = false;
+}
+
+
+TcpCoreSocket::~TcpCoreSocket()
+{
+	if (_cached_route)
+		_cached_route->Release();
+
+	_tcp0.Deregister(this);
+	_tcp0.Remove(this);
+}
+
+
+bool TcpCoreSocket::Bind(const NetAddr& arg)
+{
+	if (_state != STATE_CLOSED) {
+		SetError(ERR_BAD_OP);
+		return false;
+	}
+
+	Tuple t;
+	t.sport = arg.GetPort() ? Htons(arg.GetPort()) : _tcp0.AllocPort();
+	if (_tcp0.Find(t)) {
+		SetError(ERR_ADDR_IN_USE);
+		return false;
+	}
+
+	// Can't hold lock across _tcp0 calls, or we'll deadlock with
+	// network thread
+	_tcp0.Deregister(this);
+	{
+		Mutex::Scoped L(_lock);
+		_id = t;
+	}
+	_tcp0.Register(this);
+	return true;
+}
+
+
+bool TcpCoreSocket::Listen(uint backlog)
+{
+	if (!_id.sport && !Bind(NetAddr(INADDR_ANY, 0)))
+		return false;
+
+	Mutex::Scoped L(_lock);
+
+	if (_state != STATE_CLOSED) {
+		SetError(ERR_BAD_OP);
+		return false;
+	}
+
+	_backlog = min<uint>(max<uint>(backlog, 1), 255);
+	_state = STATE_LISTEN;
+	return true;
+}
+
+
+CoreSocket* TcpCoreSocket::Accept(NetAddr& from)
+{
+	TcpCoreSocket* s;
+	{
+		Mutex::Scoped L(_lock);
+
+		if (_state != STATE_LISTEN) {
+			SetError(ERR_BAD_OP);
+			return NULL;
+		}
+
+		if (_acceptq.Empty()) {
+			SetError(ERR_NO_DATA);
+			return NULL;
+		}
+
+		s = _acceptq.Front();
+		_acceptq.PopFront();
+
+		if (_acceptq.Empty())
+			ClearEvent(EVENT_READABLE);
+	}
+
+	// The connection is now the caller's
+	Mutex::Scoped L(s->_lock);
+	s->_listener = NULL;
+	s->_user_closed = false;
+	from = NetAddr(s->_id.daddr, Ntohs(s->_id.dport));
+	return s;
+}
+
+
+bool TcpCoreSocket::Connect(const NetAddr& dest)
+{
+	if (_state != STATE_CLOSED) {
+		SetError(ERR_BAD_OP);
+		return false;
+	}
+
+	Tuple t(_id);
+	if (!t.sport)
+		t.sport = _tcp0.AllocPort();
+
+	t.daddr = dest.GetAddr4();
+	t.dport = Htons(dest.GetPort());
+	if (_tcp0.Find(t)) {
+		SetError(ERR_ADDR_IN_USE);
+		return false;
+	}
+
+	_tcp0.Deregister(this);
+	{
+		Mutex::Scoped L(_lock);
+		_id = t;
+	}
+	_tcp0.Register(this);
+
+	Mutex::Scoped L(_lock);
+
+	_iss = Util::Random<uint32_t>();
+	_snd_una = _snd_nxt = _snd_max = _iss;
+	_state = STATE_SYN_SENT;
+	NetStats::Inc(_netstats.tcp.active_opens);
+
+	_timing = true;
+	_rtt_seq = _iss;
+	_rtt_start = Time::Now();
+
+	SendSegment(_iss, 0, Tcph::FLAG_SYN);
+	_snd_nxt = _snd_max = _iss + 1;
+	SetRexmitTimer();
+
+	return true;
+}
+
+
+bool TcpCoreSocket::GetSockAddr(NetAddr& addr)
+{
+	addr = NetAddr(_id.saddr, Ntohs(_id.sport));
+	return true;
+}
+
+
+bool TcpCoreSocket::GetPeerAddr(NetAddr& addr)
+{
+	if (_state < STATE_SYN_SENT) {
+		SetError(ERR_NOT_CONNECTED);
+		return false;
+	}
+
+	addr = NetAddr(_id.daddr, Ntohs(_id.dport));
+	return true;
+}
+
+
+uint TcpCoreSocket::GetRecvAvail()
+{
+	Mutex::Scoped L(_lock);
+	return _recvq.Size();
+}
+
+
+uint TcpCoreSocket::GetSendSpace()
+{
+	Mutex::Scoped L(_lock);
+
+	if (_state != STATE_ESTABLISHED && _state != STATE_CLOSE_WAIT)
+		return 0;
+
+	return TCP_SEND_BUFFER - _sendq.Size();
+}
+
+
+bool TcpCoreSocket::Send(const void* data, uint len)
+{
+	Mutex::Scoped L(_lock);
+
+	if (_state != STATE_ESTABLISHED && _state != STATE_CLOSE_WAIT) {
+		SetError(ERR_NOT_CONNECTED);
+		return false;
+	}
+
+	if (len > TCP_SEND_BUFFER - _sendq.Size()) {
+		ClearEvent(EVENT_WRITEABLE);
+		SetError(ERR_NO_SPACE);
+		return false;
+	}
+
+	_sendq.PushBack((const uint8_t*)data, len);
+
+	if (_sendq.Size() == TCP_SEND_BUFFER)
+		ClearEvent(EVENT_WRITEABLE);
+
+	Output();
+	return true;
+}
+
+
+bool TcpCoreSocket::Recv(void* data, uint& len)
+{
+	Mutex::Scoped L(_lock);
+
+	if (_recvq.Empty()) {
+		if (_fin_rcvd) {
+			// EOF
+			len = 0;
+			return true;
+		}
+
+		ClearEvent(EVENT_READABLE);
+		SetError(ERR_NO_DATA);
+		return false;
+	}
+
+	len = min<uint>(len, _recvq.Size());
+	memcpy(data, _recvq + 0, len);
+	_recvq.Erase(0, len);
+
+	if (_recvq.Empty() && !_fin_rcvd)
+		ClearEvent(EVENT_READABLE);
+
+	// Send a window update once the window has opened up
+	// significantly (RFC 1122 4.2.3.3 receiver SWS avoidance)
+	if (_state == STATE_ESTABLISHED || _state == STATE_FIN_WAIT_1 ||
+		_state == STATE_FIN_WAIT_2) {
+
+		const uint thresh = min<uint>(2 * _mss, TCP_RECV_BUFFER / 2);
+		if (RecvWindow() >= _rcv_adv + thresh) {
+			_ack_now = true;
+			Output();
+		}
+	}
+
+	return true;
+}
+
+
+bool TcpCoreSocket::Shutdown(int dir)
+{
+	Mutex::Scoped L(_lock);
+
+	// 0 = receive, 1 = send, 2 = both
+	if (dir != 1)
+		_recvq.Clear();
+
+	if (dir != 0) {
+		switch (_state) {
+		case STATE_SYN_RCVD:
+		case STATE_ESTABLISHED:
+			_state = STATE_FIN_WAIT_1;
+			Output();
+			break;
+		case STATE_CLOSE_WAIT:
+			_state = STATE_LAST_ACK;
+			Output();
+			break;
+		default: ;
+		}
+	}
+
+	return true;
+}
+
+
+bool TcpCoreSocket::Close()
+{
+	Deque<TcpCoreSocket*> pending;
+
+	{
+		Mutex::Scoped L(_lock);
+
+		_user_closed = true;
+		_recvq.Clear();
+
+		switch (_state) {
+		case STATE_LISTEN:
+			while (!_acceptq.Empty()) {
+				pending.PushBack(_acceptq.Front());
+				_acceptq.PopFront();
+			}
+			// fallthrough
+		case STATE_CLOSED:
+		case STATE_SYN_SENT:
+			_state = STATE_CLOSED;
+			_rexmit_timer = Time::InfTim;
+			_tcp0.ArmTimer(Time::Now());
+			break;
+		case STATE_SYN_RCVD:
+		case STATE_ESTABLISHED:
+			_state = STATE_FIN_WAIT_1;
+			Output();
+			break;
+		case STATE_CLOSE_WAIT:
+			_state = STATE_LAST_ACK;
+			Output();
+			break;
+		default: ;
+		}
+	}
+
+	// Close connections nobody accepted.  Done outside our lock since
+	// the network thread locks child then listener.
+	while (!pending.Empty()) {
+		TcpCoreSocket* s = pending.Front();
+		pending.PopFront();
+		{
+			Mutex::Scoped L(s->_lock);
+			s->_listener = NULL;
+		}
+		s->Close();
+	}
+
+	return true;
+}
+
+
+uint16_t TcpCoreSocket::RecvWindow() const
+{
+	return min<uint>(TCP_RECV_BUFFER - _recvq.Size(), TCP_MAX_WINDOW);
+}
+
+
+void TcpCoreSocket::SetRexmitTimer()
+{
+	_rexmit_timer = Time::Now() + Time::FromUsec(_rto);
+	_tcp0.ArmTimer(_rexmit_timer);
+}
+
+
+bool TcpCoreSocket::SendSegment(uint32_t seq, uint len, uint8_t flags)
+{
+	const uint hlen = sizeof (Tcph) + ((flags & Tcph::FLAG_SYN) ? 4 : 0);
+
+	IOBuffer* buf = BufferPool::AllocTx(IP_HEADROOM + hlen + len);
+	if (!buf)
+		return false;
+
+	buf->SetHeadroom(IP_HEADROOM + hlen);
+	if (len)
+		buf->PushBack(_sendq + (seq - _snd_una), len);
+
+	Tcph& tcph = *(Tcph*)buf->Prepend(hlen);
+
+	if (flags & Tcph::FLAG_SYN) {
+		uint8_t* opt = tcph.GetOptions();
+		opt[0] = Tcph::OPT_MSS;
+		opt[1] = 4;
+		opt[2] = TCP_MSS_LOCAL >> 8;
+		opt[3] = TCP_MSS_LOCAL & 0xff;
+	}
+
+	tcph.sport = _id.sport;
+	tcph.dport = _id.dport;
+	tcph.seq = Htonl(seq);
+	tcph.ack = (flags & Tcph::FLAG_ACK) ? Htonl(_rcv_nxt) : 0;
+	tcph.SetHLen(hlen);
+	tcph.flags = flags;
+	// ACKs sent while there's a hole keep the window they advertised,
+	// or the sender wouldn't count them as duplicates (RFC 5681 2)
+	if (!_rcv_hole || RecvWindow() < _rcv_adv)
+		_rcv_adv = RecvWindow();
+	tcph.win = Htons(_rcv_adv);
+	tcph.urp = 0;
+
+	Iph& iph = *(Iph*)buf->Prepend(sizeof (Iph));
+	iph.id = 0;					// Have Ip fill in header
+	iph.SetHLen(sizeof (Iph));
+	iph.proto = IPPROTO_TCP;
+	iph.source = INADDR_ANY;
+
+	// Anything below _snd_max that takes up sequence space has been
+	// sent before
+	if ((len || (flags & (Tcph::FLAG_SYN | Tcph::FLAG_FIN))) && SeqLT(seq, _snd_max))
+		NetStats::Inc(_netstats.tcp.retrans_segs);
+	else
+		NetStats::Inc(_netstats.tcp.out_segs);
+
+	Ip::Route* r = _ip0.Send(buf, _id.daddr, _tcp0, _cached_route);
+	if (r != _cached_route) {
+		if (r) r->Retain();
+		_cached_route = r;
+	}
+
+	if (!r) {
+		SetError(ERR_NO_ROUTE);
+		return false;
+	}
+
+	if (flags & Tcph::FLAG_ACK) {
+		_ack_now = false;
+		_delack_seg = false;
+		_delack_timer = Time::InfTim;
+	}
+
+	return true;
+}
+
+
+void TcpCoreSocket::Output()
+{
+	switch (_state) {
+	case STATE_CLOSED:
+	case STATE_LISTEN:
+	case STATE_SYN_SENT:
+	case STATE_SYN_RCVD:
+		return;
+	default: ;
+	}
+
+	for (;;) {
+		const uint32_t off = _snd_nxt - _snd_una;
+		const uint avail = _sendq.Size() > off ? _sendq.Size() - off : 0;
+		const uint32_t wnd = min<uint32_t>(_cwnd * _mss, _snd_wnd);
+		const uint usable = wnd > off ? wnd - off : 0;
+		const uint len = min<uint>(min<uint>(avail, usable), _mss);
+		const bool fin = FinPending() && off + len == _sendq.Size();
+
+		if (!len && !fin)
+			break;
+
+		uint8_t flags = Tcph::FLAG_ACK;
+		if (len && len == avail)  flags |= Tcph::FLAG_PSH;
+		if (fin)  flags |= Tcph::FLAG_FIN;
+
+		// Out of buffers: the retransmit timer will get things going again
+		if (!SendSegment(_snd_nxt, len, flags))
+			break;
+
+		// Only time new data (Karn's algorithm)
+		if (!_timing && SeqGEQ(_snd_nxt, _snd_max)) {
+			_timing = true;
+			_rtt_seq = _snd_nxt;
+			_rtt_start = Time::Now();
+		}
+
+		_snd_nxt += len + fin;
+		if (SeqGT(_snd_nxt, _snd_max))
+			_snd_max = _snd_nxt;
+
+		if (_rexmit_timer == Time::InfTim)
+			SetRexmitTimer();
+	}
+
+	if (_ack_now)
+		SendSegment(_snd_nxt, 0, Tcph::FLAG_ACK);
+
+	// Keep the timer running to probe a zero window
+	if (!_sendq.Empty() && _rexmit_timer == Time::InfTim)
+		SetRexmitTimer();
+}
+
+
+void TcpCoreSocket::Retransmit()
+{
+	const uint len = min<uint>(_mss, _sendq.Size());
+	const bool fin = FinPending() && len == _sendq.Size() && SeqGT(_snd_max, _snd_una + len);
+
+	SendSegment(_snd_una, len, Tcph::FLAG_ACK | (fin ? Tcph::FLAG_FIN : 0));
+	_timing = false;
+}
+
+
+void TcpCoreSocket::ParseOptions(Tcph& tcph)
+{
+	const uint8_t* opt = tcph.GetOptions();
+	const uint8_t* end = tcph.GetPayload();
+
+	_mss = TCP_MSS_DEFAULT;
+
+	while (opt < end && *opt != Tcph::OPT_EOL) {
+		if (*opt == Tcph::OPT_NOP) {
+			++opt;
+			continue;
+		}
+
+		if (opt + 1 >= end || opt[1] < 2 || opt + opt[1] > end)
+			break;
+
+		if (opt[0] == Tcph::OPT_MSS && opt[1] == 4)
+			_mss = min<uint>((opt[2] << 8) | opt[3], TCP_MSS_LOCAL);
+
+		opt += opt[1];
+	}
+
+	if (!_mss)
+		_mss = TCP_MSS_DEFAULT;
+}
+
+
+void TcpCoreSocket::InputListen(Iph& iph, Tcph& tcph)
+{
+	// Half-open connections count against the backlog too, or a SYN
+	// flood would allocate a socket per SYN.  Past it SYNs are
+	// dropped, and the peer will retransmit.
+	if (_acceptq.Size() + _halfopen >= _backlog)
+		return;
+
+	++_halfopen;
+	NetStats::Inc(_netstats.tcp.passive_opens);
+
+	TcpCoreSocket* s = _tcp0.Create();
+
+	s->_id = _id;
+	s->_id.daddr = iph.source;
+	s->_id.dport = tcph.sport;
+	s->_listener = this;
+	s->_user_closed = true;		// Stack owned until accepted
+
+	Mutex::Scoped L(s->_lock);
+
+	_tcp0.Register(s);
+
+	const uint32_t seq = Ntohl(tcph.seq);
+
+	s->_state = STATE_SYN_RCVD;
+	s->_rcv_nxt = seq + 1;
+	s->_iss = Util::Random<uint32_t>();
+	s->_snd_una = s->_snd_nxt = s->_snd_max = s->_iss;
+	s->_snd_wnd = Ntohs(tcph.win);
+	s->_snd_wl1 = seq;
+	s->_snd_wl2 = s->_iss;
+	s->ParseOptions(tcph);
+
+	s->_timing = true;
+	s->_rtt_seq = s->_iss;
+	s->_rtt_start = Time::Now();
+
+	s->SendSegment(s->_iss, 0, Tcph::FLAG_SYN | Tcph::FLAG_ACK);
+	s->_snd_nxt = s->_snd_max = s->_iss + 1;
+	s->SetRexmitTimer();
+}
+
+
+void TcpCoreSocket::Input(Iph& iph, Tcph& tcph, uint len)
+{
+	const uint32_t seq = Ntohl(tcph.seq);
+	const uint32_t ack = Ntohl(tcph.ack);
+	const uint flags = tcph.flags;
+
+	switch (_state) {
+	case STATE_CLOSED:
+		_tcp0.SendReset(iph, tcph, len + tcph.GetHLen());
+		return;
+
+	case STATE_LISTEN:
+		if (flags & Tcph::FLAG_RST)
+			return;
+
+		if (flags & Tcph::FLAG_ACK) {
+			_tcp0.SendReset(iph, tcph, len + tcph.GetHLen());
+			return;
+		}
+
+		if (flags & Tcph::FLAG_SYN)
+			InputListen(iph, tcph);
+		return;
+
+	case STATE_SYN_SENT:
+		if ((flags & Tcph::FLAG_ACK) && ack != _iss + 1) {
+			_tcp0.SendReset(iph, tcph, len + tcph.GetHLen());
+			return;
+		}
+
+		if (flags & Tcph::FLAG_RST) {
+			if (flags & Tcph::FLAG_ACK)
+				Reset(ERR_CONN_REFUSED);
+			return;
+		}
+
+		if (!(flags & Tcph::FLAG_SYN))
+			return;
+
+		_rcv_nxt = seq + 1;
+		_snd_wnd = Ntohs(tcph.win);
+		_snd_wl1 = seq;
+		_snd_wl2 = ack;
+		ParseOptions(tcph);
+
+		if (flags & Tcph::FLAG_ACK) {
+			_snd_una = ack;
+			if (_timing && !_rexmit_count)
+				UpdateRtt((Time::Now() - _rtt_start).GetUsec());
+
+			_timing = false;
+			_rexmit_timer = Time::InfTim;
+			_rexmit_count = 0;
+			_state = STATE_ESTABLISHED;
+			AddEvent(EVENT_CONNECT | EVENT_WRITEABLE);
+
+			_ack_now = true;
+			Output();
+		} else {
+			// Simultaneous open
+			_state = STATE_SYN_RCVD;
+			SendSegment(_iss, 0, Tcph::FLAG_SYN | Tcph::FLAG_ACK);
+		}
+		return;
+
+	default: ;
+	}
+
+	// Segment acceptability (RFC 793 p. 69)
+	const uint wnd = RecvWindow();
+	bool acceptable;
+	if (!len)
+		acceptable = wnd ? SeqGEQ(seq, _rcv_nxt) && SeqLT(seq, _rcv_nxt + wnd) : seq == _rcv_nxt;
+	else
+		acceptable = wnd && ((SeqGEQ(seq, _rcv_nxt) && SeqLT(seq, _rcv_nxt + wnd)) ||
+							 (SeqGEQ(seq + len - 1, _rcv_nxt) &&
+							  SeqLT(seq + len - 1, _rcv_nxt + wnd)));
+
+	if (!acceptable) {
+		if (!(flags & Tcph::FLAG_RST)) {
+			_ack_now = true;
+			Output();
+		}
+		return;
+	}
+
+	if (flags & Tcph::FLAG_RST) {
+		// In-window but inexact resets get a challenge ACK (RFC 5961)
+		if (seq == _rcv_nxt) {
+			Reset(_state == STATE_SYN_RCVD ? ERR_CONN_REFUSED : ERR_CONN_RESET);
+		} else {
+			_ack_now = true;
+			Output();
+		}
+		return;
+	}
+
+	if (flags & Tcph::FLAG_SYN) {
+		_ack_now = true;
+		Output();
+		return;
+	}
+
+	if (!(flags & Tcph::FLAG_ACK))
+		return;
+
+	if (_state == STATE_SYN_RCVD) {
+		if (SeqLEQ(ack, _snd_una) || SeqGT(ack, _snd_max)) {
+			_tcp0.SendReset(iph, tcph, len + tcph.GetHLen());
+			return;
+		}
+
+		_state = STATE_ESTABLISHED;
+		_snd_wnd = Ntohs(tcph.win);
+		_snd_wl1 = seq;
+		_snd_wl2 = ack;
+		AddEvent(EVENT_CONNECT | EVENT_WRITEABLE);
+
+		if (_user_closed) {
+			// Passive open: hand it to the listener, unless it's gone
+			if (!_listener) {
+				_tcp0.SendReset(iph, tcph, len + tcph.GetHLen());
+				Reset(ERR_CONN_RESET);
+				return;
+			}
+
+			Mutex::Scoped L(_listener->_lock);
+			--_listener->_halfopen;
+			_listener->_acceptq.PushBack(this);
+			_listener->AddEvent(EVENT_READABLE);
+		}
+	}
+
+	if (!ProcessAck(tcph, len))
+		return;
+
+	// Segment text
+	if (len && (_state == STATE_ESTABLISHED || _state == STATE_FIN_WAIT_1 ||
+				_state == STATE_FIN_WAIT_2)) {
+
+		if (seq == _rcv_nxt) {
+			const uint n = min<uint>(len, wnd);
+			_recvq.PushBack(tcph.GetPayload(), n);
+			_rcv_nxt += n;
+			AddEvent(EVENT_READABLE);
+
+			// Filling a hole is ACKed at once (RFC 5681 4.2), so each
+			// retransmit in fast recovery draws the next one
+			const bool filled = _rcv_hole;
+			if (_rcv_hole && SeqGEQ(_rcv_nxt, _rcv_high))
+				_rcv_hole = false;
+
+			// ACK every other full-sized segment, otherwise delay
+			if (filled || n < len || _delack_seg || len < _mss) {
+				_ack_now = true;
+			} else {
+				_delack_seg = true;
+				if (_delack_timer == Time::InfTim) {
+					_delack_timer = Time::Now() + Time::FromMsec(TCP_DELACK);
+					_tcp0.ArmTimer(_delack_timer);
+				}
+			}
+		} else if (SeqLT(seq, _rcv_nxt) && SeqGT(seq + len, _rcv_nxt)) {
+			// Partial retransmit of data we already have
+			const uint skip = _rcv_nxt - seq;
+			const uint n = min<uint>(len - skip, wnd);
+			_recvq.PushBack(tcph.GetPayload() + skip, n);
+			_rcv_nxt += n;
+			AddEvent(EVENT_READABLE);
+			_ack_now = true;
+		} else {
+			// Out of order or duplicate: immediate (dup) ACK drives the
+			// sender's fast retransmit.  Out-of-order data is dropped.
+			if (SeqGT(seq, _rcv_nxt) && (!_rcv_hole || SeqGT(seq + len, _rcv_high))) {
+				_rcv_high = seq + len;
+				_rcv_hole = true;
+			}
+			_ack_now = true;
+		}
+	}
+
+	if (flags & Tcph::FLAG_FIN) {
+		if (!_fin_rcvd && seq + len == _rcv_nxt) {
+			_fin_rcvd = true;
+			++_rcv_nxt;
+			AddEvent(EVENT_READABLE | EVENT_CLOSE);
+
+			switch (_state) {
+			case STATE_ESTABLISHED:
+				_state = STATE_CLOSE_WAIT;
+				break;
+			case STATE_FIN_WAIT_1:
+				_state = STATE_CLOSING;
+				break;
+			case STATE_FIN_WAIT_2:
+				EnterTimeWait();
+				break;
+			default: ;
+			}
+		} else if (_state == STATE_TIME_WAIT) {
+			// Retransmitted FIN: our ACK was lost
+			EnterTimeWait();
+		}
+
+		_ack_now = true;
+	}
+
+	Output();
+}
+
+
+bool TcpCoreSocket::ProcessAck(const Tcph& tcph, uint len)
+{
+	const uint32_t seq = Ntohl(tcph.seq);
+	const uint32_t ack = Ntohl(tcph.ack);
+	const uint16_t win = Ntohs(tcph.win);
+
+	if (SeqGT(ack, _snd_max)) {
+		// Acks something not yet sent
+		_ack_now = true;
+		Output();
+		return false;
+	}
+
+	if (SeqLEQ(ack, _snd_una)) {
+		// Duplicate ACK (RFC 5681 definition)
+		if (ack == _snd_una && !len && win == _snd_wnd && InFlight() &&
+			!(tcph.flags & Tcph::FLAG_FIN)) {
+
+			if (++_dupacks == 3 && !_in_recovery) {
+				// Fast retransmit
+				NetStats::Inc(_netstats.tcp.fast_retrans);
+				_recover = _snd_max;
+				_in_recovery = true;
+				CongLoss(false);
+				Retransmit();
+				_cwnd = _ssthresh + 3;
+			} else if (_dupacks > 3 && _in_recovery) {
+				// Inflate window for each segment that has left the network
+				++_cwnd;
+			}
+		}
+	} else {
+		uint acked = ack - _snd_una;
+
+		// Our SYN and FIN each occupy a sequence number, the SYN the
+		// one before the queued data and the FIN the one past it
+		const uint syn = _snd_una == _iss;
+		const bool fin_acked = FinPending() && SeqGT(ack, _snd_una + syn + _sendq.Size());
+
+		_sendq.Erase(0, min<uint>(acked - syn, _sendq.Size()));
+		_snd_una = ack;
+		if (SeqLT(_snd_nxt, _snd_una))
+			_snd_nxt = _snd_una;
+
+		if (_timing && SeqGT(ack, _rtt_seq)) {
+			_timing = false;
+			UpdateRtt((Time::Now() - _rtt_start).GetUsec());
+		}
+
+		_rexmit_count = 0;
+
+		if (_in_recovery) {
+			if (SeqGEQ(ack, _recover)) {
+				// Full ACK: deflate and leave recovery
+				_in_recovery = false;
+				_cwnd = _ssthresh;
+			} else {
+				// Partial ACK: next hole is at snd_una
+				Retransmit();
+				const uint segs = acked / _mss;
+				_cwnd = _cwnd > segs + 1 ? _cwnd - segs + 1 : 1;
+			}
+		} else {
+			CongAck(acked);
+		}
+
+		_dupacks = 0;
+
+		if (_snd_una == _snd_max)
+			_rexmit_timer = Time::InfTim;
+		else
+			SetRexmitTimer();
+
+		if ((_state == STATE_ESTABLISHED || _state == STATE_CLOSE_WAIT) &&
+			_sendq.Size() < TCP_SEND_BUFFER) {
+			AddEvent(EVENT_WRITEABLE);
+		}
+
+		if (fin_acked) {
+			switch (_state) {
+			case STATE_FIN_WAIT_1:
+				_state = STATE_FIN_WAIT_2;
+				break;
+			case STATE_CLOSING:
+				EnterTimeWait();
+				break;
+			case STATE_LAST_ACK:
+				_state = STATE_CLOSED;
+				_rexmit_timer = Time::InfTim;
+				_tcp0.ArmTimer(Time::Now());
+				return false;
+			default: ;
+			}
+		}
+	}
+
+	// Window update (RFC 793 p. 72)
+	if (SeqLT(_snd_wl1, seq) || (_snd_wl1 == seq && SeqLEQ(_snd_wl2, ack))) {
+		_snd_wnd = win;
+		_snd_wl1 = seq;
+		_snd_wl2 = ack;
+	}
+
+	return true;
+}
+
+
+void TcpCoreSocket::UpdateRtt(uint32_t r)
+{
+	r = max<uint32_t>(r, 1);
+
+	if (!_srtt) {
+		_srtt = r;
+		_rttvar = r / 2;
+	} else {
+		const uint32_t delta = r > _srtt ? r - _srtt : _srtt - r;
+		_rttvar = (3 * _rttvar + delta) / 4;
+		_srtt = (7 * _srtt + r) / 8;
+	}
+
+	_rto = _srtt + max<uint32_t>(4 * _rttvar, 1000);
+	_rto = min<uint32_t>(max<uint32_t>(_rto, TCP_RTO_MIN * 1000), TCP_RTO_MAX * 1000);
+}
+
+
+void TcpCoreSocket::CongAck(uint acked)
+{
+	// Nothing to gain from growing past what the peer can take
+	if (_cwnd * _mss >= 2 * TCP_MAX_WINDOW)
+		return;
+
+	// Appropriate byte counting (RFC 3465), L = 2
+	const uint segs = min<uint>(max<uint>(acked / _mss, 1), 2);
+
+	if (_cwnd < _ssthresh) {
+		_cwnd += segs;
+		return;
+	}
+
+	const Time now = Time::Now();
+
+	if (_epoch == Time::InfTim) {
+		_epoch = now;
+		_cwnd_cnt = 0;
+		_w_est = _cwnd << 10;
+
+		if (_cwnd < _w_max) {
+			_cubic_k = icbrt((uint64_t)(_w_max - _cwnd) * CUBIC_K_SCALE);
+		} else {
+			_cubic_k = 0;
+			_w_max = _cwnd;
+		}
+	}
+
+	// Evaluate W one RTT ahead, as the window takes that long to have effect
+	const int64_t t = (now - _epoch).GetMsec() + _srtt / 1000;
+	const int64_t d = t - (int64_t)_cubic_k;
+	int64_t target = (int64_t)_w_max + d * d * d * 4 / CUBIC_W_DIV;
+	if (target < 1)
+		target = 1;
+
+	// Don't fall behind standard TCP
+	_w_est += segs * CUBIC_ALPHA / _cwnd;
+	if ((int64_t)(_w_est >> 10) > target)
+		target = _w_est >> 10;
+
+	// Grow by at most 1.5x per RTT
+	uint32_t cnt = target > _cwnd ? _cwnd / (uint32_t)(target - _cwnd) : 100 * _cwnd;
+	cnt = max<uint32_t>(cnt, 2);
+
+	_cwnd_cnt += segs;
+	if (_cwnd_cnt >= cnt) {
+		_cwnd_cnt = 0;
+		++_cwnd;
+	}
+}
+
+
+void TcpCoreSocket::CongLoss(bool timeout)
+{
+	// Fast convergence: release bandwidth to newer flows
+	if (_cwnd < _w_max)
+		_w_max = _cwnd * (1024 + CUBIC_BETA) / 2048;
+	else
+		_w_max = _cwnd;
+
+	_ssthresh = max<uint32_t>(_cwnd * CUBIC_BETA / 1024, 2);
+	_cwnd_cnt = 0;
+	_epoch = Time::InfTim;
+
+	if (timeout) {
+		_cwnd = 1;
+		_in_recovery = false;
+		_dupacks = 0;
+	} else {
+		_cwnd = _ssthresh;
+	}
+}
+
+
+Time TcpCoreSocket::Timer(const Time& now)
+{
+	if (_delack_timer <= now) {
+		_delack_timer = Time::InfTim;
+		_ack_now = true;
+		Output();
+	}
+
+	if (_rexmit_timer <= now) {
+		NetStats::Inc(_netstats.tcp.timeouts);
+
+		if (++_rexmit_count > TCP_MAX_REXMIT) {
+			Reset(ERR_TIMED_OUT);
+		} else {
+			_rto = min<uint32_t>(_rto * 2, TCP_RTO_MAX * 1000);
+			_timing = false;
+
+			switch (_state) {
+			case STATE_SYN_SENT:
+				SendSegment(_iss, 0, Tcph::FLAG_SYN);
+				break;
+			case STATE_SYN_RCVD:
+				SendSegment(_iss, 0, Tcph::FLAG_SYN | Tcph::FLAG_ACK);
+				break;
+			default:
+				if (!_snd_wnd && _snd_una == _snd_max && !_sendq.Empty()) {
+					// Zero window probe; not a congestion signal
+					SendSegment(_snd_una, 1, Tcph::FLAG_ACK);
+					_snd_nxt = _snd_max = _snd_una + 1;
+				} else {
+					// Go back N from snd_una with cwnd = 1
+					CongLoss(true);
+					_snd_nxt = _snd_una;
+					Output();
+				}
+			}
+
+			SetRexmitTimer();
+		}
+	}
+
+	if (_timewait_timer <= now) {
+		_timewait_timer = Time::InfTim;
+		_state = STATE_CLOSED;
+	}
+
+	return min(_delack_timer, min(_rexmit_timer, _timewait_timer));
+}
+
+
+void TcpCoreSocket::Reset(uint error)
+{
+	// Half-open passive connections die with the reset
+	if (_state == STATE_SYN_RCVD && _user_closed && _listener) {
+		Mutex::Scoped L(_listener->_lock);
+		--_listener->_halfopen;
+		_listener = NULL;
+	}
+
+	switch (_state) {
+	case STATE_SYN_SENT:
+	case STATE_SYN_RCVD:
+		NetStats::Inc(_netstats.tcp.attempt_fails);
+		break;
+	case STATE_ESTABLISHED:
+	case STATE_CLOSE_WAIT:
+		NetStats::Inc(_netstats.tcp.estab_resets);
+		break;
+	default: ;
+	}
+
+	_state = STATE_CLOSED;
+	_sendq.Clear();
+	_rexmit_timer = Time::InfTim;
+	_delack_timer = Time::InfTim;
+	_timewait_timer = Time::InfTim;
+
+	SetError(error);
+	AddEvent(EVENT_ERROR | EVENT_CLOSE);
+	_tcp0.ArmTimer(Time::Now());
+}
+
+
+void TcpCoreSocket::EnterTimeWait()
+{
+	_state = STATE_TIME_WAIT;
+	_rexmit_timer = Time::InfTim;
+	_timewait_timer = Time::Now() + Time::FromSec(TCP_TIME_WAIT);
+	_tcp0.ArmTimer(_timewait_timer);
+}
+
+#endif // ENABLE_IP
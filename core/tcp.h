@@ -0,0 +1,288 @@
+// Copyright (c) 2018-2021 Jan Brittenson
+// See LICENSE for details.
+
+#ifndef __TCP_H__
+#define __TCP_H__
+
+#include "core/ip.h"
+#include "core/netaddr.h"
+#include "core/ipconn.h"
+#include "core/socket.h"
+#include "core/tuplemap.h"
+
+
+// Tuning.  Buffer sizes are per socket, in bytes, and grow as used.
+// They bound the window: fast retransmit needs three duplicate ACKs,
+// so four or more full segments must be able to be in flight.
+enum {
+	TCP_SEND_BUFFER = 16384,
+	TCP_RECV_BUFFER = 16384,
+	TCP_MSS_DEFAULT = 536,		// RFC 1122 default when peer sends no MSS option
+	TCP_INIT_CWND = 10,			// Initial congestion window, in segments (RFC 6928)
+	TCP_RTO_INIT = 1000,		// Initial RTO, msec (RFC 6298)
+	TCP_RTO_MIN = 200,			// Lower RTO clamp, msec
+	TCP_RTO_MAX = 60000,		// Upper RTO clamp, msec
+	TCP_DELACK = 40,			// Delayed ACK timeout, msec
+	TCP_MAX_REXMIT = 12,		// Retransmits before connection is dropped
+	TCP_TIME_WAIT = 30,			// 2MSL, in seconds
+	TCP_MSS_LOCAL = 1460,		// MSS we advertise (Ethernet MTU less headers)
+	TCP_MAX_WINDOW = 65535		// No window scaling
+};
+
+static_assert(TCP_SEND_BUFFER >= 4 * TCP_MSS_LOCAL && TCP_RECV_BUFFER >= 4 * TCP_MSS_LOCAL);
+
+
+struct __novtable Tcph {
+	enum Flags {
+		FLAG_FIN = 1,
+		FLAG_SYN = 2,
+		FLAG_RST = 4,
+		FLAG_PSH = 8,
+		FLAG_ACK = 16,
+		FLAG_URG = 32
+	};
+
+	enum Option {
+		OPT_EOL = 0,
+		OPT_NOP = 1,
+		OPT_MSS = 2
+	};
+
+	uint16_t sport;				// Source port
+	uint16_t dport;				// Dest port
+	uint32_t seq;				// Sequence number
+	uint32_t ack;				// Acknowledgement number
+	uint8_t off;				// Data offset (upper nibble)
+	uint8_t flags;				// FLAG_xxx
+	uint16_t win;				// Receive window
+	mutable uint16_t sum;		// Checksum
+	uint16_t urp;				// Urgent pointer
+
+	uint GetHLen() const { return (off >> 4) * 4; }
+	void SetHLen(uint hlen) {
+		assert_bounds(hlen >= 20 && hlen <= 15*4);
+		assert_bounds((hlen & 3) == 0);
+		off = (hlen / 4) << 4;
+	}
+
+	// len is the length of the TCP segment, header included
+	uint16_t CSum(const Iph& iph, uint len) const {
+		const uint16_t tmp = exch<uint16_t>(sum, 0);
+		const uint16_t csum = ~ipcksum((const uint16_t*)this, len, iph.SumPH());
+		sum = tmp;
+		return Htons(csum);
+	}
+
+	void SetCsum(const Iph& iph, uint len) { sum = CSum(iph, len); }
+
+	bool ValidateCsum(const Iph& iph, uint len) const {
+		return ipcksum((const uint16_t*)this, len, iph.SumPH()) == 0xffff;
+	}
+
+	uint8_t* GetOptions() { return (uint8_t*)this + sizeof (Tcph); }
+	uint8_t* GetPayload() { return (uint8_t*)this + GetHLen(); }
+};
+
+
+// TCP connection.  Sockets are non-blocking like all CoreSockets;
+// Send() either queues all of its data or fails with ERR_NO_SPACE, so
+// callers doing bulk transfers should size writes by GetSendSpace().
+//
+// Once Close() has been called the socket is owned by the stack,
+// which deletes it when the connection has been fully shut down.
+// The caller must not touch it after that.
+class TcpCoreSocket: public CoreSocket {
+	friend class Tcp;
+public:
+	enum State {
+		STATE_CLOSED,
+		STATE_LISTEN,
+		STATE_SYN_SENT,
+		STATE_SYN_RCVD,
+		STATE_ESTABLISHED,
+		STATE_FIN_WAIT_1,
+		STATE_FIN_WAIT_2,
+		STATE_CLOSE_WAIT,
+		STATE_CLOSING,
+		STATE_LAST_ACK,
+		STATE_TIME_WAIT
+	};
+
+protected:
+	Mutex _lock;
+
+	// Socket identifier
+	Tuple _id;
+
+	// Last route used
+	Ip::Route* _cached_route;
+
+	// Stream buffers.  _sendq holds all bytes from _snd_una onwards,
+	// i.e. both unacknowledged and not yet sent data.
+	Deque<uint8_t> _sendq;
+	Deque<uint8_t> _recvq;
+
+	// Listen socket: established connections waiting for Accept
+	Deque<TcpCoreSocket*> _acceptq;
+	TcpCoreSocket* _listener;	// Listen socket for half-open passive conn
+	uint8_t _backlog;
+	uint8_t _halfopen;			// Listen socket: children in SYN_RCVD
+
+	uint8_t _state;				// STATE_xxx
+
+	// Send sequence space
+	uint32_t _iss;				// Initial send sequence
+	uint32_t _snd_una;			// Oldest unacknowledged
+	uint32_t _snd_nxt;			// Next to send
+	uint32_t _snd_max;			// Highest sent (snd_nxt is rewound on RTO)
+	uint32_t _snd_wl1;			// Seq of last window update
+	uint32_t _snd_wl2;			// Ack of last window update
+	uint16_t _snd_wnd;			// Peer receive window
+
+	// Receive sequence space
+	uint32_t _rcv_nxt;			// Next expected
+	uint32_t _rcv_high;			// End of furthest out-of-order segment, if _rcv_hole
+	uint16_t _rcv_adv;			// Window last advertised
+
+	uint16_t _mss;				// Effective send MSS
+
+	// Congestion control, windows in segments.  CUBIC per RFC 8312,
+	// with NewReno (RFC 6582) style fast recovery.
+	uint32_t _cwnd;
+	uint32_t _ssthresh;
+	uint32_t _cwnd_cnt;			// ACKs counted toward next cwnd increase
+	uint32_t _w_max;			// Window before last reduction
+	uint32_t _w_est;			// Reno-friendly window estimate, 1/1024 segments
+	uint32_t _cubic_k;			// Time to reach _w_max, msec
+	Time _epoch;				// Start of current congestion avoidance epoch
+	uint32_t _recover;			// snd_max at start of fast recovery
+	uint8_t _dupacks;
+
+	// RTT estimation (RFC 6298), in usec
+	uint32_t _srtt;
+	uint32_t _rttvar;
+	uint32_t _rto;
+	uint32_t _rtt_seq;			// Sequence being timed
+	Time _rtt_start;			// When it was sent
+
+	// Timers; Time::InfTim when not armed
+	Time _rexmit_timer;
+	Time _delack_timer;
+	Time _timewait_timer;
+	uint8_t _rexmit_count;
+
+	// Flags
+	bool _timing:1;				// Timing _rtt_seq
+	bool _in_recovery:1;		// In fast recovery
+	bool _fin_rcvd:1;			// Peer closed its half
+	bool _ack_now:1;			// Send ACK on next output
+	bool _delack_seg:1;			// One full segment received but not ACKed
+	bool _rcv_hole:1;			// Data past _rcv_nxt seen and dropped
+	bool _user_closed:1;		// Close() called, stack owns the socket
+
+	TcpCoreSocket();
+public:
+	~TcpCoreSocket();
+
+	bool Listen(uint backlog);
+	CoreSocket* Accept(NetAddr& from);
+	bool Bind(const NetAddr& arg);
+	bool Connect(const NetAddr& dest);
+	bool GetSockAddr(NetAddr& addr);
+	bool GetPeerAddr(NetAddr& addr);
+	uint GetRecvAvail();
+	uint GetSendSpace();
+	bool Send(const void* data, uint len);
+	bool Recv(void* data, uint& len);
+	bool Shutdown(int dir);
+	bool Close();
+
+	State GetState() const { return (State)_state; }
+
+private:
+	// These are called with _lock held
+	void Input(Iph& iph, Tcph& tcph, uint len);
+	void InputListen(Iph& iph, Tcph& tcph);
+	bool ProcessAck(const Tcph& tcph, uint seglen);
+	void Output();
+	bool SendSegment(uint32_t seq, uint len, uint8_t flags);
+	void Retransmit();
+	void ParseOptions(Tcph& tcph);
+	Time Timer(const Time& now);
+	void Reset(uint error);
+	void EnterTimeWait();
+
+	// Congestion control hooks
+	void CongAck(uint acked);
+	void CongLoss(bool timeout);
+
+	void UpdateRtt(uint32_t usec);
+	void SetRexmitTimer();
+	uint16_t RecvWindow() const;
+	uint32_t InFlight() const { return _snd_max - _snd_una; }
+
+	// True in states where our FIN has been queued but not yet acked
+	bool FinPending() const {
+		return _state == STATE_FIN_WAIT_1 || _state == STATE_CLOSING || _state == STATE_LAST_ACK;
+	}
+};
+
+
+class Tcp: public Checksummer {
+	friend class TcpCoreSocket;
+
+	mutable Mutex _lock;
+	Ip& _ip;
+
+	// Demux, by tuple.  Listen sockets have daddr and dport set to 0.
+	TupleMap<TcpCoreSocket*> _socklist;
+
+	// All sockets, for the timer scan
+	Vector<TcpCoreSocket*> _sockets;
+
+	Time _next;					// Next service time
+	uint16_t _portnum;
+
+public:
+	Tcp(Ip& ip) : _ip(ip), _next(Time::InfTim), _portnum(32768) { }
+
+	// Create TCP socket
+	TcpCoreSocket* Create();
+	void Receive(IOBuffer* buf);
+
+	void Checksum(IOBuffer* buf) const; // * implements Checksummer::Checksum
+
+	void IcmpError(Icmph::Type type, uint code,
+				   in_addr_t sender, // Sender of ICMP message (e.g., router)
+				   in_addr_t dest,	 // Destination datagram was for
+				   in_addr_t source, // Datagram sender (i.e., ourselves)
+				   const Tcph& tcph); // Start of original packet
+
+	// Get next service time
+	Time GetServiceTime() const { Mutex::Scoped L(_lock); return _next; }
+
+	// Service entry - returns next service time
+	Time Service();
+
+protected:
+	void Deregister(TcpCoreSocket* s);
+	void Register(TcpCoreSocket* s);
+	TcpCoreSocket* Find(const Tuple& t);
+
+	// Take socket off the timer scan
+	void Remove(TcpCoreSocket* s);
+	uint16_t AllocPort();
+
+	// Note a socket timer; wakes the network thread if it's earlier
+	// than the current service time.
+	void ArmTimer(const Time& t);
+
+	// Send a RST in response to a segment that has no connection
+	void SendReset(Iph& iph, Tcph& tcph, uint seglen);
+};
+
+
+extern Tcp _tcp0;
+
+
+#endif // __TCP_H__
@@ -4,6 +4,7 @@
 #include "core/enetkit.h"
 #include "core/thread.h"
 #include "core/platform.h"
+#include "core/mutex.h"
 
 
 // THUMB is 1 to force Thumb
@@ -20,10 +21,23 @@ bool Thread::_bootstrapped;
 
 Vector<Thread*> Thread::_runq;
 
+Thread* Thread::_ready[NUM_PRIO];
+uint32_t Thread::_readybits[NUM_PRIO / 32];
+uint32_t Thread::_readymap;
+WaitQueue Thread::_waitqs[NUM_WAITQ];
+Vector<Thread*> Thread::_timedq;
+
+Thread::PiStats Thread::_pistats;
+
+#ifdef ENABLE_SCHEDSTATS
+Time Thread::_idle;
+Time Thread::_idlestart;
+bool Thread::_idling;
+#endif
+
 extern SysTimer _systimer;
 
 Time Thread::_qend;
-uint Thread::_rr;
 
 uint Thread::_ipl_count;
 bool Thread::_pend_csw;
@@ -33,9 +47,19 @@ Thread::Thread() :
     _state(State::SLEEP),
     _prio(THREAD_DEFAULT_PRIORITY),
     _waitob(NULL),
+    _waitq(NULL),
     _waittime(0),
     _stack(NULL),
-    _estack(NULL) { 
+    _estack(NULL),
+    _next(NULL),
+    _prev(NULL),
+    _tpos(0),
+    _baseprio(THREAD_DEFAULT_PRIORITY),
+    _lockwait(NULL),
+    _held(NULL) { 
+#ifdef ENABLE_SCHEDSTATS
+    memset(&_stats, 0, sizeof _stats);
+#endif
 }
 
 
@@ -52,6 +76,9 @@ Thread* Thread::Create(const char* name, Start func, void* arg, uint stack_size)
 
     // Add to scheduler
     _runq.PushBack(t);
+    if (_timedq.GetReserve() < _runq.Size())
+        _timedq.Reserve(_runq.Size() + 8);
+    ReadyInsert(t);
 
     // Maybe run it
     ContextSwitch();
@@ -63,11 +90,17 @@ Thread* Thread::Create(const char* name, Start func, void* arg, uint stack_size)
 void Thread::Construct(Thread* t, Start func, void* arg, uint stack_size) {
     assert(!IntEnabled());
 
+#ifndef __arm__
+    // Host threads need room for signal frames and libc as well
+    stack_size = max<uint>(stack_size, HOST_STACK_MIN);
+#endif
+
     t->_stack = AllocThreadStack(stack_size);
     t->_estack = (uint8_t*)t->_stack + stack_size;
 
     t->_state = State::RUN;
 
+#ifdef __arm__
     uint32_t *sp = (uint32_t*)t->_estack;
 
     // Push two zeros for GDB to detect end of frame list
@@ -93,11 +126,19 @@ void Thread::Construct(Thread* t, Start func, void* arg, uint stack_size) {
     *--sp = 0;                      // R4 = 0
 
     t->_pcb.psp = (uintptr_t)sp;
+#else
+    HostInitContext(t->_pcb, t->_stack, stack_size, func, arg, Reap);
+#endif
 }
 
 
 void Thread::Reap() {
     for (;;) {
+        ScopedNoInt G;
+
+        if (_curthread->_state == State::RUN)
+            ReadyRemove(_curthread);
+
         _curthread->_state = State::STOP;
 
         WakeAll(_curthread); // Wake all threads waiting for us
@@ -113,6 +154,19 @@ Thread::~Thread()
 
     assert(_curthread != this); // Thread can't destroy itself
 
+    switch (_state) {
+    case State::RUN:
+        ReadyRemove(this);
+        break;
+    case State::TWAIT:
+    case State::WAIT:
+        // Off its queues
+        MakeRunnable(this);
+        ReadyRemove(this);
+        break;
+    default: ;
+    }
+
     const uint pos = _runq.Find(this);
     if (pos != NOT_FOUND)
         _runq.Erase(pos);
@@ -128,13 +182,15 @@ void Thread::Bootstrap()
     assert(!_ipl_count);
 
     _runq.Reserve(8);
+    _timedq.Reserve(8);
 
     SetCurThread(AllocThreadContext());
 
     _curthread->_name = "main";
     _curthread->_state = State::RUN;
-
-    _rr = 0;
+#ifdef ENABLE_SCHEDSTATS
+    _curthread->_runstart = Time::Now();
+#endif
 
     _qend = Time::Now() + Time::FromUsec(RRQUANTUM);
 
@@ -166,6 +222,7 @@ void Thread::Bootstrap()
 
     // Add to scheduler
     _runq.PushBack(_curthread);
+    ReadyInsert(_curthread);
 
     _main_thread = _curthread;
 }
@@ -176,8 +233,13 @@ void Thread::SetPriority(uint8_t new_prio)
     assert(_curthread);
 
     ScopedNoInt G;
-    
-    _curthread->_prio = new_prio;
+
+    _curthread->_baseprio = new_prio;
+
+    // Go to the back of the ready list even if unchanged
+    ReadyRemove(_curthread);
+    _curthread->_prio = InheritedPriority(_curthread);
+    ReadyInsert(_curthread);
 
     ContextSwitch();
 
@@ -185,84 +247,361 @@ void Thread::SetPriority(uint8_t new_prio)
 }
 
 
+uint8_t Thread::InheritedPriority(const Thread* t)
+{
+    uint8_t prio = t->_baseprio;
+
+    for (const Mutex* m = t->_held; m; m = m->_nextheld) {
+        const Thread* top = m->_waiters._head;
+        if (top && top->_prio > prio)
+            prio = top->_prio;
+    }
+
+    return prio;
+}
+
+
+void Thread::Reprioritize(Thread* t, uint8_t prio)
+{
+    assert(!IntEnabled());
+
+    if (t->_prio == prio)
+        return;
+
+    switch (t->_state) {
+    case State::RUN:
+        // A runnable thread changing priority hasn't yielded, so it
+        // goes first at its new level rather than after the threads
+        // already there
+        ReadyRemove(t);
+        t->_prio = prio;
+        ReadyInsert(t, true);
+        break;
+    case State::WAIT:
+    case State::TWAIT:
+        if (t->_waitq) {
+            WaitQueue& q = *t->_waitq;
+            ListRemove(q._head, t);
+            t->_prio = prio;
+            QueueInsert(q, t);
+            break;
+        }
+        // fallthru
+    default:
+        t->_prio = prio;
+    }
+}
+
+
+void Thread::WaitForMutex(const Mutex& m)
+{
+    AssertNotInterrupt();
+
+    ScopedNoInt G;
+
+    Thread* self = _curthread;
+    self->_lockwait = &m;
+
+    // Lend our priority down the chain of owners.  The chain ends
+    // at an owner that isn't waiting for a mutex, or one already at
+    // our priority, which a deadlock back to us also is.
+    uint boosted = 0;
+    for (const Mutex* x = &m; x && x->_tid; x = x->_tid->_lockwait) {
+        Thread* owner = x->_tid;
+        if (owner->_prio >= self->_prio)
+            break;
+
+        Reprioritize(owner, self->_prio);
+        ++boosted;
+    }
+
+    if (boosted) {
+        ++_pistats.boosts;
+        if (boosted > 1)
+            ++_pistats.chained;
+    }
+
+    Block(State::WAIT, &m._waiters, &m._waiters, Time::InfTim);
+
+    Idle();
+
+    self->_lockwait = NULL;
+}
+
+
+void Thread::MutexAcquired(const Mutex& m)
+{
+    assert(!IntEnabled());
+    assert(m._tid == _curthread);
+
+    // Static initializers lock before Bootstrap() makes a thread
+    if (!_curthread)
+        return;
+
+    m._nextheld = _curthread->_held;
+    _curthread->_held = &m;
+
+    // Others may still be waiting, if some thread got in ahead of
+    // the one woken
+    const Thread* top = m._waiters._head;
+    if (top && top->_prio > _curthread->_prio)
+        Reprioritize(_curthread, top->_prio);
+}
+
+
+void Thread::MutexReleased(const Mutex& m)
+{
+    assert(!IntEnabled());
+
+    if (!_curthread)
+        return;
+
+    for (const Mutex** p = &_curthread->_held; *p; p = &(*p)->_nextheld) {
+        if (*p == &m) {
+            *p = m._nextheld;
+            break;
+        }
+    }
+    m._nextheld = NULL;
+
+    Reprioritize(_curthread, InheritedPriority(_curthread));
+}
+
+
 void Thread::EnableFP() {
     if (!_curthread->_fpstate)
         _curthread->_fpstate = (FPState*)xmalloc(sizeof (FPState));
 }
 
-void Thread::Rotate(bool in_csw)
+void Thread::ListInsert(Thread*& head, Thread* t)
 {
-    // If we already have a pending context switch, ignore
-    if (!in_csw && _pend_csw)
-        return;
+    if (!head) {
+        t->_next = t->_prev = t;
+        head = t;
+    } else {
+        // Insert at the tail, just before the head
+        t->_next = head;
+        t->_prev = head->_prev;
+        head->_prev->_next = t;
+        head->_prev = t;
+    }
+}
 
-    const Time now = Time::Now();
 
-    // Make a pass through runq, collecting the parameters we'll need
+void Thread::ListRemove(Thread*& head, Thread* t)
+{
+    if (t->_next == t) {
+        assert(head == t);
+        head = NULL;
+    } else {
+        t->_prev->_next = t->_next;
+        t->_next->_prev = t->_prev;
+        if (head == t)
+            head = t->_next;
+    }
+    t->_next = t->_prev = NULL;
+}
 
-    Thread* wake = NULL;        // Next thread due on timed wait
-    Thread* top = NULL;         // Thread with highest priority
-    uint numrun = 0;            // Number of running threads with prio equal to current's
-    Thread* firstrun = NULL;    // First other thread with prio equal to current
-    Thread* nextrun = NULL;     // Next other thread with prio equal to current
-    bool seencur = false;       // Set to true when we've encountered current thread
-    
-    for (uint i = 0; i < _runq.Size(); ++i) {
-        Thread* t = _runq[i];
 
-        if (t == _curthread)
-            seencur = true;
+void Thread::ReadyInsert(Thread* t, bool front)
+{
+    const uint prio = t->_prio;
 
-        switch (t->_state) {
-        case State::TWAIT:
-            if (t->_waittime > now) {
-                if (!wake || t->_waittime < wake->_waittime)
-                    wake = t;
-                break;
-            }
-            t->_state = State::RUN;
-
-            // fallthru
-        case State::RUN:
-            if (!top || t->_prio > top->_prio)
-                top = t;
-
-            if (t->_prio == _curthread->_prio) {
-                if (t != _curthread) {
-                    if (seencur) {
-                        if (!nextrun)
-                            nextrun = t;
-                    } else {
-                        if (!firstrun)
-                            firstrun = t;
-                    }
-                }
-                ++numrun;
-            }
+    if (!_ready[prio]) {
+        _readybits[prio / 32] |= 1 << (prio % 32);
+        _readymap |= 1 << (prio / 32);
+    }
+    ListInsert(_ready[prio], t);
+
+    // The tail is just before the head
+    if (front)
+        _ready[prio] = t;
+}
+
+
+void Thread::ReadyRemove(Thread* t)
+{
+    const uint prio = t->_prio;
+
+    ListRemove(_ready[prio], t);
+    if (!_ready[prio]) {
+        _readybits[prio / 32] &= ~(1 << (prio % 32));
+        if (!_readybits[prio / 32])
+            _readymap &= ~(1 << (prio / 32));
+    }
+}
+
+
+void Thread::TimedUp(uint pos)
+{
+    Thread* t = _timedq[pos];
+
+    while (pos) {
+        const uint parent = (pos - 1) / 2;
+        if (_timedq[parent]->_waittime <= t->_waittime)
             break;
-        default: ;
-        }
+
+        TimedSet(pos, _timedq[parent]);
+        pos = parent;
+    }
+    TimedSet(pos, t);
+}
+
+
+void Thread::TimedDown(uint pos)
+{
+    Thread* t = _timedq[pos];
+    const uint size = _timedq.Size();
+
+    for (;;) {
+        uint child = pos * 2 + 1;
+        if (child >= size)
+            break;
+
+        if (child + 1 < size && _timedq[child + 1]->_waittime < _timedq[child]->_waittime)
+            ++child;
+
+        if (t->_waittime <= _timedq[child]->_waittime)
+            break;
+
+        TimedSet(pos, _timedq[child]);
+        pos = child;
+    }
+    TimedSet(pos, t);
+}
+
+
+void Thread::TimedInsert(Thread* t)
+{
+    // Room is reserved for every thread, so this never allocates
+    assert(_timedq.Headroom());
+
+    _timedq.PushBack(t);
+    TimedUp(_timedq.Size() - 1);
+}
+
+
+void Thread::TimedRemove(Thread* t)
+{
+    const uint pos = t->_tpos;
+    assert(_timedq[pos] == t);
+
+    Thread* last = _timedq.Back();
+    _timedq.PopBack();
+
+    if (last != t) {
+        // Move the last one into the hole and restore heap order
+        // either way
+        TimedSet(pos, last);
+        if (pos && last->_waittime < _timedq[(pos - 1) / 2]->_waittime)
+            TimedUp(pos);
+        else
+            TimedDown(pos);
+    }
+}
+
+
+void Thread::QueueInsert(WaitQueue& q, Thread* t)
+{
+    // Go back from the tail past those of lower priority
+    Thread* head = q._head;
+    if (!head || t->_prio > head->_prio) {
+        ListInsert(q._head, t);
+        q._head = t;
+        return;
+    }
+
+    Thread* after = head->_prev;
+    while (after->_prio < t->_prio)
+        after = after->_prev;
+
+    t->_prev = after;
+    t->_next = after->_next;
+    after->_next->_prev = t;
+    after->_next = t;
+}
+
+
+void Thread::MakeRunnable(Thread* t)
+{
+    assert(t->_state == State::WAIT || t->_state == State::TWAIT);
+
+    if (t->_state == State::TWAIT)
+        TimedRemove(t);
+
+    if (t->_waitq) {
+        ListRemove(t->_waitq->_head, t);
+        t->_waitq = NULL;
     }
 
+#ifdef ENABLE_SCHEDSTATS
+    // A timed wait was due at its deadline, however late noticed
+    const Time now = Time::Now();
+    t->_woken = t->_state == State::TWAIT && t->_waittime < now ? t->_waittime : now;
+#endif
+
+    t->_state = State::RUN;
+    ReadyInsert(t);
+}
+
+
+void Thread::Block(State state, WaitQueue* q, const void* ob, const Time& until)
+{
+    assert(!IntEnabled());
+    assert(_curthread->_state == State::RUN);
+
+    ReadyRemove(_curthread);
+
+    _curthread->_state = state;
+    _curthread->_waitob = ob;
+    _curthread->_waittime = until;
+
+    _curthread->_waitq = q;
+    if (q)
+        QueueInsert(*q, _curthread);
+
+    if (state == State::TWAIT)
+        TimedInsert(_curthread);
+}
+
+
+void Thread::Rotate(bool in_csw)
+{
+    // If we already have a pending context switch, ignore
+    if (!in_csw && _pend_csw)
+        return;
+
+    // Called from PendSV with interrupts enabled; keep wakes out
+    // while the lists change
+    ScopedNoInt G;
+
+    const Time now = Time::Now();
+
+    // Timed waits that are due become runnable
+    while (!_timedq.Empty() && _timedq.Front()->_waittime <= now)
+        MakeRunnable(_timedq.Front());
+
     Thread* next = _curthread;
-    Time next_timer = wake ? wake->_waittime : now + Time::FromSec(10); // 10sec is a gratuitous upper bound
-
-    // If there's a thread with a prio higher than current, switch to it
-    if (top->_prio > _curthread->_prio) {
-        next = top;
-    } else if (numrun > 1 && now >= _qend) {
-        // If there's nothing running with higher prio and there are multiple threads
-        // running with current prio, round-robin when the quantum is over.
-
-        assert(nextrun || firstrun);
-        next = nextrun ? nextrun : firstrun;
-        assert(next != _curthread);
-
-        _qend = now + Time::FromUsec(RRQUANTUM);
-    } else if (_curthread->_state != State::RUN) {
-        // Current thread is blocked, so just pick first runnable, if any
-        if (top)
-            next = top;
+    Time next_timer = !_timedq.Empty() ? _timedq.Front()->_waittime : now + Time::FromSec(10); // 10sec is a gratuitous upper bound
+
+    if (_readymap) {
+        const uint top = TopPriority();
+
+        if (top > _curthread->_prio || _curthread->_state != State::RUN) {
+            // If there's a thread with a prio higher than current,
+            // switch to it.  If current is blocked, pick the first
+            // of the top priority.
+            next = _ready[top];
+        } else if (_curthread->_next != _curthread && now >= _qend) {
+            // If there's nothing running with higher prio and there
+            // are multiple threads running with current prio,
+            // round-robin when the quantum is over.  Moving the list
+            // head along keeps the order.
+            next = _curthread->_next;
+            _ready[_curthread->_prio] = next;
+
+            _qend = now + Time::FromUsec(RRQUANTUM);
+        }
     }
 
     if (_qend > now)
@@ -279,6 +618,9 @@ void Thread::Rotate(bool in_csw)
                 LoadFP(next->_fpstate);
                 _fpthread = next;
             }
+#ifdef ENABLE_SCHEDSTATS
+            Account(_curthread, next, now);
+#endif
             SetCurThread(next);
         } else {
             if (!_ipl_count) {
@@ -290,29 +632,46 @@ void Thread::Rotate(bool in_csw)
     } 
 }
 
-void Thread::WakeAll(const void* ob)
+bool Thread::Wake(WaitQueue& q, const void* ob, bool all)
 {
-    ScopedNoInt G;
+    assert(!IntEnabled());
 
     bool cx = false;
-    for (uint i = 0; i < _runq.Size(); ++i) {
-        Thread* t = _runq[i];
-        
-        switch (t->_state) {
-        case State::WAIT:
-        case State::TWAIT:
-            if (t->_waitob == ob)  {
-                t->_state = State::RUN;
+    for (Thread* t = q._head; t; ) {
+        // The last on the queue links back to the head, whichever
+        // thread that is by now
+        Thread* const n = t->_next != q._head ? t->_next : NULL;
 
-                if (t->_prio > _curthread->_prio)
-                    cx = true;
-            }
-            break;
-        default: ;
+        if (t->_waitob == ob) {
+            MakeRunnable(t);
+
+            if (t->_prio > _curthread->_prio || _curthread->_state != State::RUN)
+                cx = true;
+
+            if (!all)
+                break;
         }
+        t = n;
     }
 
-    if (cx)
+    return cx;
+}
+
+
+void Thread::WakeAll(const void* ob)
+{
+    ScopedNoInt G;
+
+    if (Wake(GetWaitQueue(ob), ob, true))
+        ContextSwitch();
+}
+
+
+void Thread::WakeAll(WaitQueue& q)
+{
+    ScopedNoInt G;
+
+    if (Wake(q, &q, true))
         ContextSwitch();
 }
 
@@ -321,26 +680,17 @@ void Thread::WakeSingle(const void* ob)
 {
     ScopedNoInt G;
 
-    Thread* top = NULL;
-    for (uint i = 0; i < _runq.Size(); ++i) {
-        Thread* t = _runq[i];
-        
-        switch (t->_state) {
-        case State::WAIT:
-        case State::TWAIT:
-            if (t->_waitob == ob && (!top || t->_prio > top->_prio))
-                top = t;
-            break;
-        default: ;
-        }
-    }
-    
-    if (top) {
-        top->_state = State::RUN;
+    if (Wake(GetWaitQueue(ob), ob, false))
+        ContextSwitch();
+}
 
-        if (top->_prio > _curthread->_prio || (_curthread->_state != State::RUN))
-            ContextSwitch();
-    }
+
+void Thread::WakeSingle(WaitQueue& q)
+{
+    ScopedNoInt G;
+
+    if (Wake(q, &q, false))
+        ContextSwitch();
 }
 
 
@@ -356,14 +706,35 @@ void Thread::Idle()  {
         if (_pend_csw)
             ContextSwitch();
 
+#ifdef ENABLE_SCHEDSTATS
+        _idlestart = Time::Now();
+        _idling = true;
+#endif
+
         EnableInterrupts();
         WaitForInterrupt();
         DisableInterrupts();
 
+#ifdef ENABLE_SCHEDSTATS
+        if (_idling) {
+            // Not switched away meanwhile.  The time was idle, not
+            // this thread's to be charged for.
+            const Time now = Time::Now();
+            _idle += now - _idlestart;
+            _curthread->_runstart += now - _idlestart;
+            _idling = false;
+        }
+#endif
+
         _ipl_count = prev_count;
         SetIPL(prev_ipl);
     }
 
+#ifdef ENABLE_SCHEDSTATS
+    // Woken without a switch, since nothing else ran
+    NoteRun(_curthread, Time::Now());
+#endif
+
     _curthread->ValidateStack();
 }
 
@@ -374,8 +745,19 @@ void Thread::WaitFor(const void* ob)
 
     ScopedNoInt G;
 
-    _curthread->_state = State::WAIT;
-    _curthread->_waitob = ob;
+    Block(State::WAIT, &GetWaitQueue(ob), ob, Time::InfTim);
+
+    Idle();
+}
+
+
+void Thread::WaitFor(WaitQueue& q)
+{
+    AssertNotInterrupt();
+
+    ScopedNoInt G;
+
+    Block(State::WAIT, &q, &q, Time::InfTim);
 
     Idle();
 }
@@ -390,9 +772,22 @@ void Thread::WaitFor(const void* ob, Time until)
 
     ScopedNoInt G;
 
-    _curthread->_state = State::TWAIT;
-    _curthread->_waitob = ob;
-    _curthread->_waittime = until;
+    Block(State::TWAIT, &GetWaitQueue(ob), ob, until);
+
+    Idle();
+}
+
+
+void Thread::WaitFor(WaitQueue& q, Time until)
+{
+    AssertNotInterrupt();
+
+    if (until <= Time::Now())
+        return;
+
+    ScopedNoInt G;
+
+    Block(State::TWAIT, &q, &q, until);
 
     Idle();
 }
@@ -405,9 +800,7 @@ void Thread::Sleep(Time until)
     while (Time::Now() < until) {
         ScopedNoInt G;
 
-        _curthread->_state = State::TWAIT;
-        _curthread->_waitob = NULL;
-        _curthread->_waittime = until;
+        Block(State::TWAIT, NULL, NULL, until);
 
         Idle();
     }
@@ -450,6 +843,107 @@ void Thread::Exception(Thread::ExType ex)
 }
 
 
+#ifdef ENABLE_SCHEDSTATS
+void Thread::NoteRun(Thread* t, const Time& now)
+{
+    if (t->_woken == Time())
+        return;
+
+    const uint32_t usec = now > t->_woken ? min<uint64_t>((now - t->_woken).GetUsec(), ~0U) : 0;
+    t->_woken = Time();
+
+    t->_stats.maxlatency = max(t->_stats.maxlatency, usec);
+
+    // Buckets go up by powers of 4 from 16 usec
+    const uint bucket = usec < 16 ? 0 : min<uint>((31 - __builtin_clz(usec)) / 2 - 1, LATENCY_BUCKETS - 1);
+    ++t->_stats.latency[bucket];
+}
+
+
+void Thread::Account(Thread* prev, Thread* next, const Time& now)
+{
+    // Switched away from the middle of Idle(); the run ended when
+    // the idle period began
+    Time end = now;
+    if (_idling) {
+        _idle += now - _idlestart;
+        end = _idlestart;
+        _idling = false;
+    }
+
+    if (end > prev->_runstart)
+        prev->_stats.runtime += (end - prev->_runstart).GetUsec();
+
+    if (prev->_state == State::RUN)
+        ++prev->_stats.involuntary;
+    else
+        ++prev->_stats.voluntary;
+
+    next->_runstart = now;
+    NoteRun(next, now);
+}
+
+
+uint Thread::GetSnapshot(ThreadStats* dest, uint max, uint64_t& idle)
+{
+    ScopedNoInt G;
+
+    const Time now = Time::Now();
+
+    uint num = 0;
+    for (uint i = 0; i < _runq.Size() && num < max; ++i) {
+        const Thread* t = _runq[i];
+        ThreadStats& ts = dest[num++];
+
+        ts.name = t->_name;
+        switch (t->_state) {
+        case State::RUN:   ts.state = 'R'; break;
+        case State::WAIT:  ts.state = 'W'; break;
+        case State::TWAIT: ts.state = t->_waitob ? 'T' : 'S'; break;
+        case State::SLEEP: ts.state = 'S'; break;
+        default:           ts.state = 'X';
+        }
+        ts.prio = t->_prio;
+        ts.baseprio = t->_baseprio;
+        ts.stats = t->_stats;
+
+        // Include the run in progress
+        if (t == _curthread && now > t->_runstart)
+            ts.stats.runtime += (now - t->_runstart).GetUsec();
+    }
+
+    idle = _idle.GetUsec();
+    return num;
+}
+
+
+void Thread::Dump()
+{
+    // A few spare in case threads are created meanwhile
+    const uint room = _runq.Size() + 4;
+    ThreadStats* ts = new ThreadStats[room];
+
+    uint64_t idle;
+    const uint num = GetSnapshot(ts, room, idle);
+
+    console("idle %u msec; pi boosts %u, chained %u", uint(idle / 1000),
+            _pistats.boosts, _pistats.chained);
+
+    for (uint i = 0; i < num; ++i) {
+        const Stats& s = ts[i].stats;
+        console("%s: %c prio %u/%u cpu %u msec, switches %u vol %u invol, latency max %u usec, "
+                "<16 %u <64 %u <256 %u <1k %u <4k %u <16k %u <64k %u more %u",
+                ts[i].name, ts[i].state, ts[i].prio, ts[i].baseprio, uint(s.runtime / 1000),
+                s.voluntary, s.involuntary, s.maxlatency,
+                s.latency[0], s.latency[1], s.latency[2], s.latency[3],
+                s.latency[4], s.latency[5], s.latency[6], s.latency[7]);
+    }
+
+    delete[] ts;
+}
+#endif
+
+
 void Thread::ContextSwitchHandler(void*) {
     Rotate(true);
 }
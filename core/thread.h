@@ -10,10 +10,34 @@
 
 typedef class Thread* ThreadId;
 
+class Mutex;
+
 // These are implemented by board specific code to manage memory layout
 uint8_t* AllocThreadStack(uint size);
 Thread* AllocThreadContext();
 
+
+// Threads waiting on an object, highest priority first and in order
+// of arrival within a priority.  Synchronization objects embed one,
+// so waking the first waiter takes O(1) and waking all of them
+// O(waiters).  Only Thread touches the list, with interrupts off.
+class WaitQueue {
+    friend class Thread;
+
+    Thread* _head;              // Circular, or NULL
+
+public:
+    WaitQueue() : _head(NULL) { }
+    ~WaitQueue() { assert(!_head); }
+
+    bool Empty() const { return !_head; }
+
+private:
+    WaitQueue(const WaitQueue&);
+    WaitQueue& operator=(const WaitQueue&);
+};
+
+
 class Thread {
 public:
     typedef void* (*Start)(void*);
@@ -28,10 +52,37 @@ private:
     // True if main thread has bootstrapped
     static bool _bootstrapped;
 
-    // Run queue - because of the small number of threads we keep only a single table
+    // All threads, for housekeeping.  No longer the run queue, but
+    // debuggers with RTOS awareness find the threads by this name.
     static Vector<Thread*> _runq;
 
-    static uint _rr;    // Round robin index
+    // Runnable threads are kept on a circular list per priority, and
+    // a two-level bitmap of the non-empty lists finds the top priority
+    // with two CLZs.  Waiting threads are on the WaitQueue of what
+    // they wait for, timed waits on the timed queue as well.  The
+    // timed queue is a binary min-heap on _waittime, so arming and
+    // cancelling a deadline take O(log n) and the next one is at its
+    // front.  A scheduling decision only looks at list heads, however
+    // many threads there are.
+    enum { NUM_PRIO = 256 };
+
+    static Thread* _ready[NUM_PRIO];            // Ready lists, by priority
+    static uint32_t _readybits[NUM_PRIO / 32];  // Bit set if ready list non-empty
+    static uint32_t _readymap;                  // Bit n set if _readybits[n] non-zero
+
+    // Threads waiting for an arbitrary object, as with WaitFor(this),
+    // are queued on one of a small table of queues hashed on the
+    // object.  A wake only looks at that queue, and since it is in
+    // priority order the first match is the one to wake.
+    enum { NUM_WAITQ = 32 };
+
+    static WaitQueue _waitqs[NUM_WAITQ];
+
+    static WaitQueue& GetWaitQueue(const void* ob) {
+        return _waitqs[uint32_t((uintptr_t)ob * 0x9e3779b1U) >> 27];
+    }
+    static Vector<Thread*> _timedq;             // In TWAIT, heap on _waittime
+
     static Time _qend;  // End of current quantum
 
     enum { RRQUANTUM = 20*1024 }; // Round robin quantum, in usec
@@ -55,11 +106,83 @@ private:
     // End of fixed offsets.
 
     const void* _waitob;        // Object thread is blocked on, if any
+    WaitQueue* _waitq;          // Queue it waits on, if any
     Time _waittime;             // Absolute wake time when in STATE_TWAIT
 
     void* _stack;               // Beginning of stack memory block (low address)
     void* _estack;              // End of stack (high address - first address past the stack)
 
+    Thread* _next;              // Ready list or wait queue links
+    Thread* _prev;
+    uint _tpos;                 // Index on timed queue, when in TWAIT
+
+    // Priority inheritance.  _prio is the effective priority: the
+    // higher of _baseprio and that of the top waiter on any mutex
+    // held.
+    uint8_t _baseprio;          // As set with SetPriority()
+    const Mutex* _lockwait;     // Mutex blocked on, if any
+    const Mutex* _held;         // Mutexes held, most recent first
+
+public:
+    // Priority inheritance counters
+    struct PiStats {
+        uint boosts;            // Lock waits that raised the owner's priority
+        uint chained;           // Of those, ones that also raised an owner
+                                // the owner was blocked on
+    };
+
+#ifdef ENABLE_SCHEDSTATS
+    // Scheduler accounting, kept per thread on each context switch
+    // when ENABLE_SCHEDSTATS is defined.  Latency is from being made
+    // runnable, or from the deadline of a timed wait, to running.
+    enum { LATENCY_BUCKETS = 8 };
+
+    struct Stats {
+        uint64_t runtime;       // Usec run, idle aside
+        uint32_t voluntary;     // Switched out blocked or stopped
+        uint32_t involuntary;   // Switched out runnable: preempted or round robin
+        uint32_t maxlatency;    // Usec, wake to run
+        uint32_t latency[LATENCY_BUCKETS]; // Wakes with latency under 16,
+                                // 64, 256 usec and so on, the last one over
+    };
+
+    // One thread, copied out
+    struct ThreadStats {
+        const char* name;
+        char state;             // R(un), W(ait), T(imed wait), S(leep) or X (stopped)
+        uint8_t prio;           // Effective
+        uint8_t baseprio;
+        Stats stats;
+    };
+
+    // Copy out up to max threads into dest, and the time spent idle
+    // in usec.  Returns the number of threads copied.  Two snapshots
+    // a while apart give CPU use over the time between them, like top.
+    static uint GetSnapshot(ThreadStats* dest, uint max, uint64_t& idle);
+
+    // Print all threads on the console
+    static void Dump();
+#endif
+
+private:
+    static PiStats _pistats;
+
+#ifdef ENABLE_SCHEDSTATS
+    Stats _stats;
+    Time _runstart;             // When switched in last
+    Time _woken;                // When made runnable, if it hasn't run since
+
+    static Time _idle;          // Total time idle
+    static Time _idlestart;     // When current idle period began
+    static bool _idling;        // In WaitForInterrupt() in Idle()
+
+    // Charge prev for its run, which ends now, and start next's
+    static void Account(Thread* prev, Thread* next, const Time& now);
+
+    // Record wake to run latency, if t was woken
+    static void NoteRun(Thread* t, const Time& now);
+#endif
+
 protected:
     friend class IPL;
 
@@ -92,18 +215,36 @@ public:
     // Enable FP use for thread
     static void EnableFP();
 
-    // Change thread priority
+    // Change thread priority.  While it holds a mutex a higher
+    // priority thread waits for, it keeps running at that priority.
     static void SetPriority(uint8_t new_prio);
 
+    static const PiStats& GetPiStats() { return _pistats; }
+
+    // For Mutex: block current thread until m is unlocked, lending
+    // its priority to the owner, and the owner's owner if the owner
+    // in turn is waiting for a mutex, and so on
+    static void WaitForMutex(const Mutex& m);
+
+    // For Mutex: current thread has acquired or released m.  On
+    // release it drops back to the priority it would have without
+    // m.  Call with interrupts disabled.
+    static void MutexAcquired(const Mutex& m);
+    static void MutexReleased(const Mutex& m);
+
     // Wake all threads, if any, waiting for an object.
     static void WakeAll(const void* ob);
+    static void WakeAll(WaitQueue& q);
 
     // Wake highest priority thread, if any, waiting for an object
     static void WakeSingle(const void* ob);
+    static void WakeSingle(WaitQueue& q);
 
-    // Wait for an object.
+    // Wait for an object, or on a queue
     static void WaitFor(const void* ob);
     static void WaitFor(const void* ob, Time until); // until = absolute time
+    static void WaitFor(WaitQueue& q);
+    static void WaitFor(WaitQueue& q, Time until);
 
     // Sleep
     static void Delay(uint usec);
@@ -171,8 +312,10 @@ public:
         
         ~IPL() {
             SetIPL(_save);
-            if (!__atomic_dec(&Thread::_ipl_count) && Thread::_pend_csw)
+            if (!__atomic_dec(&Thread::_ipl_count) && Thread::_pend_csw) {
+                ScopedNoInt G;
                 ContextSwitch();
+            }
         }
 
     private:
@@ -187,6 +330,51 @@ private:
     // where threads go to die
     static void Reap();
 
+    // List primitives; head is the first thread, or NULL
+    static void ListInsert(Thread*& head, Thread* t);
+    static void ListRemove(Thread*& head, Thread* t);
+
+    // Ready list and bitmap maintenance.  Threads go at the tail of
+    // their list, or at the head if front is set.
+    static void ReadyInsert(Thread* t, bool front = false);
+    static void ReadyRemove(Thread* t);
+
+    // Highest priority with a runnable thread.  There must be one.
+    static uint TopPriority() {
+        const uint word = 31 - __builtin_clz(_readymap);
+        return word * 32 + 31 - __builtin_clz(_readybits[word]);
+    }
+
+    // Timed queue heap maintenance
+    static void TimedInsert(Thread* t);
+    static void TimedRemove(Thread* t);
+    static void TimedSet(uint pos, Thread* t) { _timedq[pos] = t; t->_tpos = pos; }
+    static void TimedUp(uint pos);
+    static void TimedDown(uint pos);
+
+    // Insert in priority order, after others of the same priority
+    static void QueueInsert(WaitQueue& q, Thread* t);
+
+    // Make a thread in WAIT or TWAIT runnable
+    static void MakeRunnable(Thread* t);
+
+    // Take current thread off its ready list and block it, on q if
+    // not NULL
+    static void Block(State state, WaitQueue* q, const void* ob, const Time& until);
+
+    // Change a thread's effective priority, keeping its place on
+    // its ready list or wait queue right
+    static void Reprioritize(Thread* t, uint8_t prio);
+
+    // Base priority raised to that of the top waiter on any mutex
+    // the thread holds
+    static uint8_t InheritedPriority(const Thread* t);
+
+    // Wake the first or all threads on q waiting for ob; threads
+    // waiting on an embedded queue wait for the queue itself.
+    // Returns true if current should yield to one of them.
+    static bool Wake(WaitQueue& q, const void* ob, bool all);
+
     // Wrapper to change current thread. Guarantees PCB ptr stays in sync.
     static void SetCurThread(Thread* t) {
         assert(!IntEnabled() || InExceptionHandler());
@@ -217,7 +405,7 @@ public:
     static_assert(offsetof(Thread, _name) == sizeof(void*));
     static_assert(offsetof(Thread, _state) == sizeof(void*)*2);
     static_assert(offsetof(Thread, _prio) == sizeof(void*)*2 + 1);
-    static_assert(offsetof(Thread, _fpstate) == sizeof(void*)*2 + 4);
+    static_assert(offsetof(Thread, _fpstate) == sizeof(void*)*3);
 }
 
 extern Thread* _main_thread;
@@ -0,0 +1,176 @@
+// Copyright (c) 2018-2021 Jan Brittenson
+// See LICENSE for details.
+
+#ifndef __TUPLEMAP_H__
+#define __TUPLEMAP_H__
+
+#include "core/ipconn.h"
+
+
+// Socket demux table: open addressing with linear probing over a flat
+// array of slots, each holding the key, the value and the key's hash.
+// Nothing is allocated except when the table grows, and nothing
+// disables interrupts; callers lock as they see fit.  A key usually
+// sits in the first slot probed, and the stored hash rules out most
+// other slots without comparing tuples.
+//
+// Deletion shifts later entries of the probe run back, so there are
+// no tombstones and lookups never slow down with churn.
+//
+// Demux() does the connected-then-wildcard lookup transports do per
+// segment or datagram, skipping the connected probe while no
+// connected tuples (with a remote address) are in the table.
+
+template <typename V> class TupleMap {
+	struct Slot {
+		Tuple key;
+		V value;
+		uint32_t hash;			// 0 if free
+	};
+
+	Slot* _slot;
+	uint _mask;					// Slots - 1
+	uint _count;
+	uint _connected;			// Keys with a remote address
+
+	enum {
+		MIN_SLOTS = 16			// Power of two
+	};
+
+	typedef TupleMap<V> Self;
+
+	// Never 0, which marks a free slot.  Wildcard keys differ only in
+	// sport, so every bit of it has to reach the low bits that pick
+	// the slot: the MurmurHash3 finalizer does that.
+	static uint32_t Hash(const Tuple& t) {
+		uint32_t h = t.daddr * 0x9e3779b1U + t.saddr;
+		h ^= ((uint32_t)t.sport << 16 | t.dport) * 0x85ebca6bU;
+		h ^= h >> 16;
+		h *= 0x85ebca6bU;
+		h ^= h >> 13;
+		h *= 0xc2b2ae35U;
+		h ^= h >> 16;
+		return h ? h : 1;
+	}
+
+	// Slot holding key, or NULL
+	Slot* Probe(const Tuple& key, uint32_t hash) const {
+		for (uint i = hash & _mask; ; i = (i + 1) & _mask) {
+			Slot& s = _slot[i];
+			if (!s.hash)
+				return NULL;
+			if (s.hash == hash && s.key == key)
+				return &s;
+		}
+	}
+
+	// Place key in the first free slot of its run; there must be one
+	void Place(const Tuple& key, const V& value, uint32_t hash) {
+		uint i = hash & _mask;
+		while (_slot[i].hash)
+			i = (i + 1) & _mask;
+
+		_slot[i].key = key;
+		_slot[i].value = value;
+		_slot[i].hash = hash;
+	}
+
+	void Grow() {
+		Slot* old = _slot;
+		const uint size = _mask + 1;
+
+		_slot = new Slot[size * 2];
+		_mask = size * 2 - 1;
+		for (uint i = 0; i <= _mask; ++i)
+			_slot[i].hash = 0;
+
+		for (uint i = 0; i < size; ++i)
+			if (old[i].hash)
+				Place(old[i].key, old[i].value, old[i].hash);
+
+		delete[] old;
+	}
+
+public:
+	TupleMap() : _slot(new Slot[MIN_SLOTS]), _mask(MIN_SLOTS - 1), _count(0), _connected(0) {
+		for (uint i = 0; i <= _mask; ++i)
+			_slot[i].hash = 0;
+	}
+
+	~TupleMap() { delete[] _slot; }
+
+	uint Size() const { return _count; }
+
+	bool Find(const Tuple& key, V& value) const {
+		const Slot* s = Probe(key, Hash(key));
+		if (!s)
+			return false;
+
+		value = s->value;
+		return true;
+	}
+
+	// Look up key, then the wildcard key with its remote address and
+	// port cleared
+	bool Demux(const Tuple& key, V& value) const {
+		if (_connected && Find(key, value))
+			return true;
+
+		Tuple wild(key);
+		wild.daddr = 0;
+		wild.dport = 0;
+		return Find(wild, value);
+	}
+
+	// Insert or replace.  Returns true if the key was added.
+	bool Insert(const Tuple& key, const V& value) {
+		const uint32_t hash = Hash(key);
+
+		Slot* s = Probe(key, hash);
+		if (s) {
+			s->value = value;
+			return false;
+		}
+
+		// Keep load at or below 3/4
+		if ((_count + 1) * 4 > (_mask + 1) * 3)
+			Grow();
+
+		Place(key, value, hash);
+		++_count;
+		if (key.daddr)
+			++_connected;
+
+		return true;
+	}
+
+	bool Erase(const Tuple& key) {
+		Slot* s = Probe(key, Hash(key));
+		if (!s)
+			return false;
+
+		--_count;
+		if (key.daddr)
+			--_connected;
+
+		// Shift back entries further down the run that may move up
+		// to the hole without passing their home slot
+		uint hole = s - _slot;
+		for (uint i = (hole + 1) & _mask; _slot[i].hash; i = (i + 1) & _mask) {
+			const uint home = _slot[i].hash & _mask;
+			if (((i - home) & _mask) >= ((i - hole) & _mask)) {
+				_slot[hole] = _slot[i];
+				hole = i;
+			}
+		}
+
+		_slot[hole].hash = 0;
+		return true;
+	}
+
+private:
+	TupleMap(const Self&);
+	Self& operator=(const Self&);
+};
+
+#endif // __TUPLEMAP_H__
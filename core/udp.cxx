@@ -6,6 +6,8 @@
 #include "core/enetcore.h"
 #include "core/udp.h"
 #include "core/ip.h"
+#include "core/igmp.h"
+#include "core/netstats.h"
 
 
 Udp _udp0(_ip0);
@@ -38,9 +40,21 @@ void Udp::Receive(IOBuffer* buf)
 	Iph& iph = *(Iph*)(*buf + 0);
 	Udph& udph = *(Udph*)iph.GetTransport();
 
+	// The checksum covers what udph.len says is there, so it's
+	// checked last.  A reassembled datagram may come as a chain.
+	const uint len = Ntohs(iph.len) - iph.GetHLen();
+	if (len < sizeof (Udph) || Ntohs(udph.len) < sizeof (Udph) || Ntohs(udph.len) > len ||
+		(!buf->IsCsumVerified() &&
+		 !(buf->GetNext() ? !udph.sum || ipcksum(buf, (const uint8_t*)&udph, iph.SumPH()) == 0xffff
+		   : udph.ValidateCsum(iph)))) {
+		NetStats::Inc(_netstats.udp.in_errors);
+		BufferPool::FreeBuffer(buf);
+		return;
+	}
+
 	Tuple t;
 
-	// First try finding a connected socket
+	// A connected socket, or else a non-connected one
 	t.daddr = iph.source;
 	t.sport = udph.dport;
 	t.dport = udph.sport;
@@ -48,23 +62,20 @@ void Udp::Receive(IOBuffer* buf)
 	UdpCoreSocket* s;
 
 	_lock.Lock();
-	if (!_socklist.Find(t, s)) {
-		// Then try non-connected
-		t.daddr = INADDR_ANY;
-		t.dport = 0;
-
-		if (!_socklist.Find(t, s)) {
-			_lock.Unlock();
-			_ip.IcmpSend(iph.source, Icmph::ICMP_DEST_UNREACH, Icmph::ICMP_PORT_UNREACH,
-						 buf);
-			BufferPool::FreeBuffer(buf);
-			return;
-		}
+	if (!_socklist.Demux(t, s)) {
+		_lock.Unlock();
+		NetStats::Inc(_netstats.udp.no_ports);
+		_ip.IcmpSend(iph.source, Icmph::ICMP_DEST_UNREACH, Icmph::ICMP_PORT_UNREACH,
+					 buf);
+		BufferPool::FreeBuffer(buf);
+		return;
 	}
 	_lock.Unlock();
 
 	assert(s);
 
+	NetStats::Inc(_netstats.udp.in_datagrams);
+
 	Mutex::Scoped L(s->_lock);
 
 	s->_recvq.PushBack(buf);
@@ -75,7 +86,7 @@ void Udp::Receive(IOBuffer* buf)
 void Udp::Register(UdpCoreSocket* s)
 {
 	Mutex::Scoped L(_lock);
-	_socklist[s->_id] = s;
+	_socklist.Insert(s->_id, s);
 }
 
 
@@ -103,7 +114,23 @@ void Udp::Checksum(IOBuffer* buf) const
 {
 	Iph& iph = *(Iph*)(*buf + 0);
 	Udph& udph = *(Udph*)iph.GetTransport();
-	udph.SetCsum(iph);
+
+	// Payload may be in a chained buffer
+	udph.sum = 0;
+	const uint16_t csum = ~ipcksum(buf, (const uint8_t*)&udph, iph.SumPH());
+	udph.sum = csum ? Htons(csum) : ~0;
+}
+
+
+void UdpPresummed::Checksum(IOBuffer* buf) const
+{
+	Iph& iph = *(Iph*)(*buf + 0);
+	Udph& udph = *(Udph*)iph.GetTransport();
+
+	udph.sum = 0;
+	const uint16_t csum = ~ipcksum((const uint16_t*)&udph, sizeof udph,
+								   iph.SumPH() + _payload_sum);
+	udph.sum = csum ? Htons(csum) : ~0;
 }
 
 
@@ -112,7 +139,7 @@ void Udp::IcmpError(Icmph::Type type, uint code, in_addr_t sender, in_addr_t des
 {
 	Tuple t;
 
-	// First try finding a connected socket
+	// A connected socket, or else a non-connected one
 	t.saddr = source;
 	t.daddr = dest;
 	t.sport = udph.sport;
@@ -122,14 +149,8 @@ void Udp::IcmpError(Icmph::Type type, uint code, in_addr_t sender, in_addr_t des
 
 	Mutex::Scoped L(_lock);
 
-	if (!_socklist.Find(t, s)) {
-		// Then try non-connected
-		t.daddr = INADDR_ANY;
-		t.dport = 0;
-
-		if (!_socklist.Find(t, s))
-			return;
-	}
+	if (!_socklist.Demux(t, s))
+		return;
 
 	assert(s);
 
@@ -143,6 +164,7 @@ UdpCoreSocket::~UdpCoreSocket()
 	if (_cached_route)
         _cached_route->Release();
 
+	LeaveGroups();
 	_udp0.Deregister(this);
 }
 
@@ -207,12 +229,15 @@ bool UdpCoreSocket::GetPeerAddr(NetAddr& addr)
 
 uint UdpCoreSocket::GetRecvAvail()
 {
+	Mutex::Scoped L(_lock);
+
 	if (_recvq.Empty())  
         return 0;
 
-	Mutex::Scoped L(_lock);
+	Iph& iph = *(Iph*)(*_recvq.Front() + 0);
+	const Udph& udph = *(const Udph*)iph.GetTransport();
 
-	return _recvq.Front()->Size();
+	return Ntohs(udph.len) - sizeof (Udph);
 }
 
 
@@ -233,39 +258,170 @@ bool UdpCoreSocket::Send(const void* data, uint len)
 }
 
 
-bool UdpCoreSocket::SendTo(const void* data, uint len, const NetAddr& dest)
+IOBuffer* UdpCoreSocket::CopyIn(const void* data, uint len, uint16_t& sum)
 {
-	IOBuffer* buf = BufferPool::AllocTx();
-	if (!buf) {
+	enum { HEADROOM = IP_HEADROOM + sizeof (Udph) };
+
+	if (len > 0xffff - sizeof (Iph) - sizeof (Udph)) {
 		SetError(ERR_NO_SPACE);
+		return NULL;
+	}
+
+	// Single copy of the payload, summed on the way in; headers get
+	// prepended in front of it.  A payload too large for one buffer
+	// goes in a chain for IP to fragment, in pieces of even length
+	// so the sums add up.
+	const uint maxsize = BufferPool::GetMaxSize() & ~1;
+	const uint8_t* src = (const uint8_t*)data;
+	IOBuffer* head = NULL;
+	IOBuffer* tail = NULL;
+	uint headroom = HEADROOM;
+
+	sum = 0;
+	do {
+		const uint n = min(len, maxsize - headroom);
+
+		IOBuffer* buf = BufferPool::AllocTx(headroom + n);
+		if (!buf) {
+			if (head)
+				BufferPool::FreeBuffer(head);
+			NetStats::Inc(_netstats.udp.out_errors);
+			SetError(ERR_NO_SPACE);
+			return NULL;
+		}
+
+		buf->SetHeadroom(headroom);
+		buf->SetSize(n);
+		if (n)
+			sum = copy_and_csum(*buf + 0, src, n, sum);
+
+		if (tail)
+			tail->SetNext(buf);
+		else
+			head = buf;
+
+		tail = buf;
+		src += n;
+		len -= n;
+		headroom = 0;
+	} while (len);
+
+	return head;
+}
+
+
+bool UdpCoreSocket::SendTo(const void* data, uint len, const NetAddr& dest)
+{
+	uint16_t sum;
+	IOBuffer* buf = CopyIn(data, len, sum);
+	if (!buf)
 		return false;
+
+	return Output(buf, dest, UdpPresummed(sum), RouteCache(dest));
+}
+
+
+uint UdpCoreSocket::SendMany(const Datagram* dgrams, uint num)
+{
+	// Route for consecutive datagrams to the same unconnected
+	// destination
+	Ip::Route* rt = NULL;
+	in_addr_t rtdest = INADDR_ANY;
+
+	uint n;
+	for (n = 0; n < num; ++n) {
+		const Datagram& d = dgrams[n];
+		const NetAddr dest = _connected ? NetAddr(_id.daddr, Ntohs(_id.dport)) : d.addr;
+
+		uint16_t sum;
+		IOBuffer* buf = CopyIn(d.data, d.len, sum);
+		if (!buf)
+			break;
+
+		Ip::Route** cache = RouteCache(dest);
+		if (!cache) {
+			if (rt && dest.GetAddr4() != rtdest) {
+				rt->Release();
+				rt = NULL;
+			}
+			rtdest = dest.GetAddr4();
+			cache = &rt;
+		}
+
+		if (!Output(buf, dest, UdpPresummed(sum), cache))
+			break;
 	}
 
-	buf->SetHead(0);
+	if (rt)
+		rt->Release();
 
-	Iph& iph = *(Iph*)(*buf + 16);
-	Udph& udph = *(Udph*)iph.GetTransport();
+	return n;
+}
+
+
+bool UdpCoreSocket::Send(IOBuffer* payload)
+{
+	if (!_connected) {
+		BufferPool::FreeBuffer(payload);
+		SetError(ERR_NOT_CONNECTED);
+		return false;
+	}
+
+	return SendTo(payload, NetAddr(_id.daddr, Ntohs(_id.dport)));
+}
+
+
+bool UdpCoreSocket::SendTo(IOBuffer* payload, const NetAddr& dest)
+{
+	return Output(payload, dest, _udp0, RouteCache(dest));
+}
+
+
+bool UdpCoreSocket::Output(IOBuffer* payload, const NetAddr& dest, const Checksummer& tcsum,
+						   Ip::Route** rtcache)
+{
+	enum { HEADROOM = IP_HEADROOM + sizeof (Udph) };
+
+	const uint len = payload->ChainSize();
+
+	IOBuffer* buf = payload;
+	if (!payload->IsExclusive() || payload->GetHead() < HEADROOM) {
+		// Put headers in a buffer of their own
+		if (!(buf = BufferPool::AllocTx(HEADROOM))) {
+			NetStats::Inc(_netstats.udp.out_errors);
+			BufferPool::FreeBuffer(payload);
+			SetError(ERR_NO_SPACE);
+			return false;
+		}
+
+		buf->SetHeadroom(HEADROOM);
+		buf->SetNext(payload);
+	}
+
+	Udph& udph = *(Udph*)buf->Prepend(sizeof (Udph));
 	udph.sport = _id.sport;
 	udph.dport = Htons(dest.GetPort());
 	udph.len = Htons(len + sizeof (Udph));
-	buf->SetSize(16 + sizeof (Iph) + sizeof (Udph) + len);
-	memcpy(udph.GetPayload(), data, len);
 
+	Iph& iph = *(Iph*)buf->Prepend(sizeof (Iph));
+	iph.id = 0;					// Have Ip fill in header
+	iph.SetHLen(sizeof (Iph));
 	iph.proto = IPPROTO_UDP;
 	iph.source = INADDR_ANY /* _id.saddr */;
 
-	Ip::Route* rt = _connected ? _cached_route : NULL;
-	Ip::Route* r = _ip0.Send(buf, dest.GetAddr4(), _udp0, rt);
-	if (_connected && r != _cached_route) {
+	Ip::Route* r = _ip0.Send(buf, dest.GetAddr4(), tcsum, rtcache ? *rtcache : NULL);
+	if (rtcache && r != *rtcache) {
 		if (r) r->Retain();
-		_cached_route = r;
+		*rtcache = r;
 	}
 
 	if (!r) {
+		NetStats::Inc(_netstats.udp.out_errors);
 		SetError(ERR_NO_ROUTE);
 		return false;
 	}
 
+	NetStats::Inc(_netstats.udp.out_datagrams);
 	return true;
 }
 
@@ -277,38 +433,174 @@ bool UdpCoreSocket::Recv(void* data, uint& len)
 }
 
 
+// Copy up to len bytes of payload out of buffer chain, return amount
+static uint CopyOut(void* data, uint len, const IOBuffer* buf)
+{
+	uint8_t* dest = (uint8_t*)data;
+	for (const IOBuffer* b = buf; b && len; b = b->GetNext()) {
+		const uint n = min<uint>(len, b->Size());
+		memcpy(dest, *b + 0, n);
+		dest += n;
+		len -= n;
+	}
+
+	return dest - (uint8_t*)data;
+}
+
+
 bool UdpCoreSocket::RecvFrom(void* data, uint& len, NetAddr& sender)
 {
+	Mutex::Scoped L(_lock);
+
 	if (_recvq.Empty()) {
 		SetError(ERR_NO_DATA);
 		return false;
 	}
 
+	IOBuffer* buf = Dequeue(sender);
+	len = CopyOut(data, len, buf);
+
+	BufferPool::FreeBuffer(buf);
+
+	return true;
+}
+
+
+uint UdpCoreSocket::RecvMany(Datagram* dgrams, uint num)
+{
+	Mutex::Scoped L(_lock);
+
+	if (_recvq.Empty()) {
+		SetError(ERR_NO_DATA);
+		return 0;
+	}
+
+	// Copied out buffers are returned to the pool in groups
+	enum { BATCH = 8 };
+	IOBuffer* done[BATCH];
+	uint ndone = 0;
+
+	uint n;
+	for (n = 0; n < num && !_recvq.Empty(); ++n) {
+		Datagram& d = dgrams[n];
+		IOBuffer* buf = Dequeue(d.addr);
+		d.len = CopyOut(d.data, d.len, buf);
+
+		done[ndone++] = buf;
+		if (ndone == BATCH) {
+			BufferPool::FreeBuffers(done, ndone);
+			ndone = 0;
+		}
+	}
+
+	BufferPool::FreeBuffers(done, ndone);
+
+	return n;
+}
+
+
+uint UdpCoreSocket::Borrow(IOBuffer** bufs, NetAddr* senders, uint num)
+{
 	Mutex::Scoped L(_lock);
 
-	IOBuffer* buf = _recvq.PopFront();
-	buf->SetHead(16);
-	Iph& iph = *(Iph*)(*buf + 0);
-	Udph& udph = *(Udph*)iph.GetTransport();
-	const void* payload = udph.GetPayload();
-	len = min<uint>(len, Ntohs(udph.len) - sizeof (Udph));
-	memcpy(data, payload, len);
+	if (_recvq.Empty()) {
+		SetError(ERR_NO_DATA);
+		return 0;
+	}
 
-	sender = NetAddr(iph.source, Ntohs(udph.sport));
+	NetAddr tmp;
+	uint n;
+	for (n = 0; n < num && !_recvq.Empty(); ++n)
+		bufs[n] = Dequeue(senders ? senders[n] : tmp);
+
+	return n;
+}
+
+
+IOBuffer* UdpCoreSocket::Dequeue(NetAddr& sender)
+{
+	IOBuffer* buf = _recvq.Front();
+	_recvq.PopFront();
 
 	if (_recvq.Empty())
 		ClearEvent(CoreSocket::EVENT_READABLE);
 
-	BufferPool::FreeBuffer(buf);
+	// Queued with head at the IP header
+	Iph& iph = *(Iph*)(*buf + 0);
+	Udph& udph = *(Udph*)iph.GetTransport();
+	sender = NetAddr(iph.source, Ntohs(udph.sport));
 
-	return true;
+	const uint len = Ntohs(udph.len) - sizeof (Udph);
+	buf->SetHead(buf->GetHead() + (udph.GetPayload() - (uint8_t*)&iph));
+	if (!buf->GetNext())
+		buf->SetSize(len);
+
+	return buf;
 }
 
 
 bool UdpCoreSocket::Close()
 {
+	LeaveGroups();
 	_udp0.Deregister(this);
 	return true;
 }
 
+
+bool UdpCoreSocket::JoinGroup(const NetAddr& group)
+{
+	const in_addr_t addr = group.GetAddr4();
+	if (!IsMulticast(addr)) {
+		CoreSocket::SetError(ERR_BAD_OP);
+		return false;
+	}
+
+	if (!_igmp0.Join(addr)) {
+		CoreSocket::SetError(ERR_NO_SPACE);
+		return false;
+	}
+
+	Mutex::Scoped L(_lock);
+	_groups.PushBack(addr);
+	return true;
+}
+
+
+bool UdpCoreSocket::LeaveGroup(const NetAddr& group)
+{
+	const in_addr_t addr = group.GetAddr4();
+	{
+		Mutex::Scoped L(_lock);
+
+		uint i = 0;
+		while (i < _groups.Size() && _groups[i] != addr)
+			++i;
+
+		if (i == _groups.Size()) {
+			CoreSocket::SetError(ERR_BAD_OP);
+			return false;
+		}
+
+		_groups.Erase(i);
+	}
+
+	// Not under our lock, Igmp may send
+	_igmp0.Leave(addr);
+	return true;
+}
+
+
+void UdpCoreSocket::LeaveGroups()
+{
+	Vector<in_addr_t> groups;
+	{
+		Mutex::Scoped L(_lock);
+		groups = _groups;
+		_groups.Clear();
+	}
+
+	for (uint i = 0; i < groups.Size(); ++i)
+		_igmp0.Leave(groups[i]);
+}
+
 #endif // ENABLE_IP
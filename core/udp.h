@@ -8,7 +8,7 @@
 #include "core/netaddr.h"
 #include "core/ipconn.h"
 #include "core/socket.h"
-#include "core/hashmap.h"
+#include "core/tuplemap.h"
 
 
 struct __novtable Udph {
@@ -29,10 +29,7 @@ struct __novtable Udph {
 	bool ValidateCsum(const Iph& iph) const {
 		if (!sum) return true;
 
-		const int16_t tmp = exch<uint16_t>(sum, 0);
-		const bool equal = tmp == CSum(iph);
-		sum = tmp;
-		return equal;
+		return ipcksum((const uint16_t*)this, Ntohs(len), iph.SumPH()) == 0xffff;
 	}
 
 	uint8_t* GetPayload() { return (uint8_t*)this + sizeof (Udph); }
@@ -41,6 +38,14 @@ struct __novtable Udph {
 
 class UdpCoreSocket: public CoreSocket {
 	friend class Udp;
+public:
+	// Datagram for RecvMany() and SendMany()
+	struct Datagram {
+		void* data;				// Payload
+		uint len;				// Payload length; for receive, space at data
+		NetAddr addr;			// Sender, or destination
+	};
+
 protected:
 	Mutex _lock;
 
@@ -53,6 +58,9 @@ protected:
 	// Receive queue
 	Deque<IOBuffer*> _recvq;
 
+	// Multicast groups joined
+	Vector<in_addr_t> _groups;
+
 	// Flags
 	bool _connected:1;			// Connected UDP socket
 
@@ -67,9 +75,84 @@ public:
 	uint GetSendSpace();
 	bool Send(const void* data, uint len);
 	bool SendTo(const void* data, uint len, const NetAddr& dest);
+
+	// Send a payload buffer without copying it.  Takes over the
+	// caller's reference.  To send the same payload to several
+	// destinations, Retain() it once per extra send.  If ours is the
+	// only reference and there's enough headroom (IP_HEADROOM plus a
+	// UDP header) the headers are prepended in place, otherwise they
+	// go in a separate buffer chained in front of the payload.
+	// Payload buffers from BufferPool::AllocTx() should be sized for
+	// the headers too and set up with SetHeadroom() before being
+	// filled.
+	bool Send(IOBuffer* payload);
+	bool SendTo(IOBuffer* payload, const NetAddr& dest);
 	bool Recv(void* data, uint& len);
 	bool RecvFrom(void* data, uint& len, NetAddr& sender);
 	bool Close();
+
+	// Join or leave the multicast group addressed by group (the port
+	// is ignored), to receive what is sent to it on our port.  Sockets
+	// can share a group; the host stays a member until the last one
+	// leaves.  Groups still joined are left on Close().  Fails with
+	// ERR_BAD_OP if group isn't a multicast address, or on leaving,
+	// isn't joined, and with ERR_NO_SPACE if too many groups are in
+	// use (IGMP_GROUPS).
+	bool JoinGroup(const NetAddr& group);
+	bool LeaveGroup(const NetAddr& group);
+
+	// Batched versions of RecvFrom() and SendTo().  RecvMany() takes
+	// the socket lock once for the whole batch, truncates datagrams
+	// that don't fit like RecvFrom() does, and returns the number
+	// received (0 with ERR_NO_DATA if none were queued).  SendMany()
+	// ignores addr on a connected socket, reuses the route lookup
+	// for consecutive datagrams to the same destination, and returns
+	// the number sent; it stops at the first failure, leaving the
+	// error set.
+	uint RecvMany(Datagram* dgrams, uint num);
+	uint SendMany(const Datagram* dgrams, uint num);
+
+	// Zero copy receive.  Hands out up to num queued datagrams as
+	// buffers with head at the UDP payload and size set to its
+	// length, along with their senders (if senders is non-NULL).
+	// A datagram reassembled from fragments may be a buffer chain.
+	// The caller owns the buffers until it gives them back with
+	// Return(), or passes one on to Send(IOBuffer*) which finds
+	// room for new headers in front of the payload.
+	uint Borrow(IOBuffer** bufs, NetAddr* senders, uint num);
+	static void Return(IOBuffer* const* bufs, uint num) { BufferPool::FreeBuffers(bufs, num); }
+
+private:
+	// Leave all groups
+	void LeaveGroups();
+
+	// Take next datagram off _recvq, trimmed to its payload.
+	// Called with _lock held and _recvq non-empty.
+	IOBuffer* Dequeue(NetAddr& sender);
+
+	// Allocate buffer for and copy in a payload, returning its sum
+	IOBuffer* CopyIn(const void* data, uint len, uint16_t& sum);
+
+	// The cached route, if it applies to dest
+	Ip::Route** RouteCache(const NetAddr& dest) {
+		return _connected && dest.GetAddr4() == _id.daddr ? &_cached_route : NULL;
+	}
+
+	// Prepend headers and hand to IP.  If rtcache is non-NULL it
+	// supplies a route to try first and holds a reference to the
+	// route used on return.
+	bool Output(IOBuffer* payload, const NetAddr& dest, const Checksummer& tcsum,
+				Ip::Route** rtcache);
+};
+
+
+// Checksummer for a datagram whose payload was summed while it was
+// copied in (copy_and_csum); only the header is left to add.
+class UdpPresummed: public Checksummer {
+	uint16_t _payload_sum;
+public:
+	UdpPresummed(uint16_t payload_sum) : _payload_sum(payload_sum) { }
+	void Checksum(IOBuffer* buf) const;
 };
 
 
@@ -79,7 +162,7 @@ class Udp: public Checksummer {
 	Mutex _lock;
 	Ip& _ip;
 
-	HashMap<Tuple, UdpCoreSocket*> _socklist;
+	TupleMap<UdpCoreSocket*> _socklist;
 
 	uint16_t _portnum;
 
@@ -0,0 +1,484 @@
+// Copyright (c) 2018-2021 Jan Brittenson
+// See LICENSE for details.
+
+#ifdef ENABLE_IP
+
+#include "core/enetkit.h"
+#include "core/thread.h"
+#include "core/util.h"
+#include "core/capture.h"
+#include "core/ip.h"
+#include "core/icmp.h"
+#include "core/udp.h"
+#include "core/tcp.h"
+#include "devices/vether.h"
+
+
+const uint16_t Ethernet::_bcastaddr[3] = { 0xffff, 0xffff, 0xffff };
+
+
+// IP header of a frame, or NULL if it's not a well formed datagram
+static Iph* GetIph(IOBuffer* buf) {
+    const uint hlen = sizeof (Ethernet::Frame);
+    if (buf->Size() < hlen + sizeof (Iph) ||
+        ((const Ethernet::Frame*)(*buf + 0))->et != Htons(ETHERTYPE_IP))
+        return NULL;
+
+    Iph* iph = (Iph*)(*buf + hlen);
+    if (iph->GetVersion() != 4 || iph->GetHLen() < sizeof (Iph) ||
+        Ntohs(iph->len) < iph->GetHLen() || hlen + Ntohs(iph->len) > buf->Size())
+        return NULL;
+
+    return iph;
+}
+
+
+// Fill in the sums the stack left to the NIC.  A datagram in pieces
+// gets its IP header summed but nothing else, as on hardware; the
+// stack doesn't leave those to the NIC.
+static void InsertCsums(IOBuffer* buf, uint offload) {
+    Iph* iph = GetIph(buf);
+    if (!iph)
+        return;
+
+    if (offload & OFFLOAD_TX_IPCSUM)
+        iph->SetCsum();
+
+    if (!(offload & OFFLOAD_TX_CSUM) || iph->IsFragment())
+        return;
+
+    const uint len = Ntohs(iph->len) - iph->GetHLen();
+    uint8_t* th = iph->GetTransport();
+
+    switch (iph->proto) {
+    case IPPROTO_TCP:
+        if (len >= sizeof (Tcph))
+            ((Tcph*)th)->SetCsum(*iph, len);
+        break;
+    case IPPROTO_UDP:
+        if (len >= sizeof (Udph) && Ntohs(((Udph*)th)->len) <= len)
+            ((Udph*)th)->SetCsum(*iph);
+        break;
+    case IPPROTO_ICMP:
+        if (len >= sizeof (Icmph))
+            ((Icmph*)th)->SetCsum(len);
+        break;
+    }
+}
+
+
+// True if the IP header and TCP, UDP or ICMP sums check out.
+// Anything else is left to the stack to check, or drop.
+static bool CsumsGood(IOBuffer* buf) {
+    const Iph* iph = GetIph(buf);
+    if (!iph || !iph->ValidateCsum() || iph->IsFragment())
+        return false;
+
+    const uint len = Ntohs(iph->len) - iph->GetHLen();
+    const uint8_t* th = iph->GetTransport();
+
+    switch (iph->proto) {
+    case IPPROTO_TCP:
+        return len >= sizeof (Tcph) && ((const Tcph*)th)->ValidateCsum(*iph, len);
+    case IPPROTO_UDP: {
+        const Udph& udph = *(const Udph*)th;
+        return len >= sizeof udph && Ntohs(udph.len) >= sizeof udph &&
+            Ntohs(udph.len) <= len && udph.ValidateCsum(*iph);
+    }
+    case IPPROTO_ICMP:
+        return len >= sizeof (Icmph) && ipcksum((const uint16_t*)th, len) == 0xffff;
+    default:
+        return false;
+    }
+}
+
+
+Ethernet::Ethernet()
+    : _wire(NULL),
+      _eventob(NULL),
+      _rx_masked(false),
+      _offload(0),
+      _stats() {
+    memset(_macaddr, 0, sizeof _macaddr);
+    _mcast_hash[0] = _mcast_hash[1] = 0;
+}
+
+
+void Ethernet::Initialize(const uint8_t macaddr[6]) {
+    memcpy(_macaddr, macaddr, sizeof _macaddr);
+}
+
+
+bool Ethernet::GetLinkStatus() const {
+    return _wire && _wire->GetLink();
+}
+
+
+void Ethernet::FillForBcast(IOBuffer* buf, uint16_t et) {
+    const uint hlen = GetAddrLen();
+    buf->SetHead(2);
+
+    Frame* f = (Frame*)(*buf + 0);
+    memcpy(f->dst, GetBcastAddr(), hlen);
+    memcpy(f->src, GetMacAddr(), hlen);
+    f->et = Htons(et);
+}
+
+
+void Ethernet::SetMcastFilter(const uint8_t* macs, uint num) {
+    uint32_t hash[2] = { 0, 0 };
+    for (uint i = 0; i < num; ++i) {
+        const uint bit = EtherMcastHash(macs + 6 * i);
+        hash[bit >> 5] |= 1 << (bit & 31);
+    }
+
+    _mcast_hash[0] = hash[0];
+    _mcast_hash[1] = hash[1];
+}
+
+
+IOBuffer* Ethernet::Receive(uint16_t& et) {
+    if (!_wire)
+        return NULL;
+
+    IOBuffer* buf;
+    for (;;) {
+        buf = _wire->Deliver(*this);
+        if (!buf)
+            return NULL;
+
+        const uint8_t* dst = ((const Frame*)(*buf + 0))->dst;
+        if (!(dst[0] & 1) || !memcmp(dst, GetBcastAddr(), 6))
+            break;
+
+        const uint bit = EtherMcastHash(dst);
+        if (_mcast_hash[bit >> 5] & (1 << (bit & 31)))
+            break;
+
+        BufferPool::FreeBuffer(buf);
+    }
+
+    NetStats::Inc(_stats.rx_packets);
+    NetStats::Inc(_stats.rx_bytes, buf->Size());
+
+    if (_offload & OFFLOAD_RX_CSUM)
+        buf->SetCsumVerified(CsumsGood(buf));
+
+    const Frame* f = (const Frame*)(*buf + 0);
+    et = Ntohs(f->et);
+
+    return buf;
+}
+
+
+bool Ethernet::EnableRxInterrupt() {
+    return !_wire || _wire->EnableRx(*this);
+}
+
+
+bool Ethernet::Send(IOBuffer* buf) {
+    buf->SetHead(2);
+    _capture.Tap(buf, Capture::DIR_TX);
+
+    const uint len = buf->ChainSize();
+    if (!_wire || len < sizeof (Frame) || len > 1514) {
+        NetStats::Inc(_stats.tx_errors);
+        BufferPool::FreeBuffer(buf);
+        return false;
+    }
+
+    if (!_wire->Transmit(*this, buf)) {
+        NetStats::Inc(_stats.tx_errors);
+        return false;
+    }
+
+    NetStats::Inc(_stats.tx_packets);
+    NetStats::Inc(_stats.tx_bytes, len);
+    return true;
+}
+
+
+VirtualWire::VirtualWire(Ethernet& a, Ethernet& b)
+    : _thread(NULL),
+      _up(false) {
+
+    static const Params ideal = { 0, 0, 0, 0, 0 };
+
+    _link[A_TO_B].dest = &b;
+    _link[B_TO_A].dest = &a;
+
+    for (uint i = 0; i < 2; ++i) {
+        Link& link = _link[i];
+        link.params = ideal;
+        link.busy = Time(0);
+        memset(&link.stats, 0, sizeof link.stats);
+    }
+}
+
+
+VirtualWire::~VirtualWire() {
+    Flush();
+    _link[A_TO_B].dest->_wire = NULL;
+    _link[B_TO_A].dest->_wire = NULL;
+}
+
+
+void VirtualWire::SetParams(uint dir, const Params& params) {
+    assert_bounds(dir < 2);
+
+    Mutex::Scoped L(_lock);
+    _link[dir].params = params;
+}
+
+
+void VirtualWire::SetParams(const Params& params) {
+    SetParams(A_TO_B, params);
+    SetParams(B_TO_A, params);
+}
+
+
+void VirtualWire::Start() {
+    {
+        Mutex::Scoped L(_lock);
+        if (_thread)
+            return;
+
+        _link[A_TO_B].dest->_wire = this;
+        _link[B_TO_A].dest->_wire = this;
+        _up = true;
+    }
+
+    _thread = Thread::Create("vwire", Run, this);
+    assert(_thread);
+}
+
+
+void VirtualWire::SetLink(bool up) {
+    {
+        Mutex::Scoped L(_lock);
+        if (up == _up)
+            return;
+
+        _up = up;
+        if (!up)
+            Flush();
+    }
+
+    // Let both ends notice
+    for (uint i = 0; i < 2; ++i)
+        if (_link[i].dest->_eventob)
+            _link[i].dest->_eventob->Set();
+}
+
+
+bool VirtualWire::SetCapture(File* file, uint snaplen) {
+    Mutex::Scoped L(_lock);
+
+    if (!file) {
+        _pcap.Close();
+        return true;
+    }
+
+    return _pcap.Open(file, snaplen);
+}
+
+
+VirtualWire::Stats VirtualWire::GetStats(uint dir) const {
+    assert_bounds(dir < 2);
+
+    Mutex::Scoped L(_lock);
+    return _link[dir].stats;
+}
+
+
+// Called by src.  Consumes buf.
+bool VirtualWire::Transmit(Ethernet& src, IOBuffer* buf) {
+    Mutex::Scoped L(_lock);
+
+    if (!_up) {
+        BufferPool::FreeBuffer(buf);
+        return false;
+    }
+
+    const Time now = Time::Now();
+    Link& link = _link[_link[A_TO_B].dest == &src ? B_TO_A : A_TO_B];
+    const Params& p = link.params;
+    const uint len = buf->ChainSize();
+
+    ++link.stats.frames;
+
+    // Copy into a receive buffer, as the receiving NIC would.  The
+    // sender's offload fills in sums in the copy, so they're there on
+    // the wire and in the capture.
+    IOBuffer* rx = BufferPool::AllocRx();
+    if (rx) {
+        rx->SetHead(0);
+        rx->SetTail(len + 2);
+        rx->SetHead(2);
+
+        uint pos = 0;
+        for (const IOBuffer* b = buf; b; b = b->GetNext()) {
+            if (b->Size()) {
+                memcpy(*rx + pos, *b + 0, b->Size());
+                pos += b->Size();
+            }
+        }
+
+        if (src._offload & (OFFLOAD_TX_IPCSUM | OFFLOAD_TX_CSUM))
+            InsertCsums(rx, src._offload);
+    }
+
+    _pcap.Write(rx ? rx : buf, now);
+    BufferPool::FreeBuffer(buf);
+
+    // The sender is busy for the time it takes to serialize the
+    // frame, whether or not it arrives.  Count preamble, FCS and
+    // interframe gap like real Ethernet.
+    if (p.bandwidth) {
+        const uint64_t bits = (len + 24) * 8;
+        link.busy = max(link.busy, now) + Time::FromUsec(bits * 1000000 / p.bandwidth);
+    } else {
+        link.busy = now;
+    }
+
+    if (p.loss && Util::Random<uint16_t>() % 1000 < p.loss) {
+        ++link.stats.lost;
+        if (rx)
+            BufferPool::FreeBuffer(rx);
+        return true;
+    }
+
+    if (!rx) {
+        ++link.stats.nobufs;
+        NetStats::Inc(link.dest->_stats.rx_overrun);
+        return true;
+    }
+
+    uint delay = p.latency;
+    if (p.jitter)
+        delay += Util::Random<uint32_t>() % (p.jitter + 1);
+
+    // Hold back by at least a full latency, so frames sent after this
+    // one overtake it
+    if (p.reorder && Util::Random<uint16_t>() % 1000 < p.reorder) {
+        ++link.stats.reordered;
+        delay += max<uint>(p.latency, 1000);
+    }
+
+    Enqueue(link, rx, link.busy + Time::FromUsec(delay));
+    _wake.Set();
+
+    return true;
+}
+
+
+// * static
+void VirtualWire::Enqueue(Link& link, IOBuffer* buf, const Time& due) {
+    uint pos = link.inflight.Size();
+    while (pos && due < link.inflight[pos - 1].due)
+        --pos;
+
+    Pending& pending = link.inflight.Insert(pos);
+    pending.buf = buf;
+    pending.due = due;
+    pending.announced = false;
+}
+
+
+// Called by dest
+IOBuffer* VirtualWire::Deliver(Ethernet& dest) {
+    Mutex::Scoped L(_lock);
+
+    // B_TO_A first, as Transmit() picks it on a loopback
+    Link& link = _link[_link[B_TO_A].dest == &dest ? B_TO_A : A_TO_B];
+    if (link.inflight.Empty() || link.inflight.Front().due > Time::Now())
+        return NULL;
+
+    IOBuffer* buf = link.inflight.Front().buf;
+    link.inflight.PopFront();
+    return buf;
+}
+
+
+bool VirtualWire::EnableRx(Ethernet& dest) {
+    Mutex::Scoped L(_lock);
+
+    const Link& link = _link[_link[B_TO_A].dest == &dest ? B_TO_A : A_TO_B];
+    dest._rx_masked = !link.inflight.Empty() && link.inflight.Front().due <= Time::Now();
+    return !dest._rx_masked;
+}
+
+
+void VirtualWire::Flush() {
+    Mutex::Scoped L(_lock);
+
+    for (uint i = 0; i < 2; ++i) {
+        Link& link = _link[i];
+        while (!link.inflight.Empty()) {
+            BufferPool::FreeBuffer(link.inflight.Front().buf);
+            link.inflight.PopFront();
+        }
+    }
+}
+
+
+// * static
+void* VirtualWire::Run(void* arg) {
+    VirtualWire* wire = (VirtualWire*)arg;
+
+    // Threads start at priority 0.  The wire stands in for hardware,
+    // so it mustn't wait on threads that spin waiting for frames.
+    Thread::SetPriority(NET_THREAD_PRIORITY + 1);
+
+    for (;;)
+        wire->Service();
+
+    return NULL;
+}
+
+
+// Signal each end for frames that have arrived since last time, then
+// sleep until the next arrival or until a frame is sent.
+void VirtualWire::Service() {
+    Time next = Time::InfTim;
+    EventObject* signal[2] = { NULL, NULL };
+
+    const Time now = Time::Now();
+    {
+        Mutex::Scoped L(_lock);
+
+        for (uint i = 0; i < 2; ++i) {
+            Link& link = _link[i];
+
+            for (uint j = 0; j < link.inflight.Size(); ++j) {
+                Pending& pending = link.inflight[j];
+                if (pending.due > now) {
+                    next = min(next, pending.due);
+                    break;
+                }
+
+                // Frames arriving while the receiver polls are left
+                // for it to find
+                if (!pending.announced) {
+                    pending.announced = true;
+                    if (!link.dest->_rx_masked) {
+                        link.dest->_rx_masked = true;
+                        NetStats::Inc(link.dest->_stats.rx_interrupts);
+                        signal[i] = link.dest->_eventob;
+                    }
+                }
+            }
+        }
+    }
+
+    for (uint i = 0; i < 2; ++i)
+        if (signal[i])
+            signal[i]->Set();
+
+    if (next == Time::InfTim)
+        _wake.Wait();
+    else
+        _wake.Wait(next - now);
+}
+
+#endif // ENABLE_IP
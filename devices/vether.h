@@ -0,0 +1,230 @@
+// Copyright (c) 2018-2021 Jan Brittenson
+// See LICENSE for details.
+
+#ifndef __VETHER_H__
+#define __VETHER_H__
+
+#include <stdint.h>
+#include "core/network.h"
+#include "core/mutex.h"
+#include "core/netstats.h"
+#include "core/pcap.h"
+
+
+// Software Ethernet.  Two of these joined by a VirtualWire behave
+// like a pair of NICs on a cable, so the stack can be run and
+// measured without a PHY, against a stand-in peer such as WireHost.
+// A board selects it instead of its SoC driver by including this
+// header from board.h, so it has the same interface as the others.
+
+class VirtualWire;
+
+class Ethernet {
+    friend class VirtualWire;
+
+    VirtualWire* _wire;         // Wire we're attached to, or NULL
+    EventObject* _eventob;      // Signaled when frames arrive
+    bool _rx_masked;            // No signal until EnableRxInterrupt(); wire lock
+    uint8_t _macaddr[6];
+    static const uint16_t _bcastaddr[3]; // Broadcast address
+    uint32_t _mcast_hash[2];    // Multicast hash filter, as on the LPC EMAC
+    uint _offload;              // OFFLOAD_xxx modeled
+
+    NetStats::Link _stats;      // Counters
+
+public:
+    // Frame header
+    struct Frame {
+        uint8_t dst[6];
+        uint8_t src[6];
+        uint16_t et;
+    };
+
+    enum {
+        // Same layout as the hardware drivers: two bytes of pad,
+        // then the frame.  See Ip::GetIph().
+        MAX_FRAME_SIZE = 1532
+    };
+
+    Ethernet();
+
+    // Initialize
+    void Initialize(const uint8_t macaddr[6]);
+
+    // Link is up when attached to a wire that is up
+    bool GetLinkStatus() const;
+
+    // Get MAC address
+    const uint8_t* GetMacAddr() const { return _macaddr; }
+
+    // Return amount to prealloc for header, the same as the hardware
+    // drivers
+    uint GetPrealloc() const { return sizeof(Frame) + 2; }
+
+    // Address length
+    static const uint GetAddrLen() { return sizeof _macaddr; }
+
+    // Buffer pad
+    static const uint GetBufPad() { return 2; }
+
+    // BOOTP htype
+    static const uint8_t GetBootpType() { return 1; }
+
+    // Fill in a buffer for broadcast
+    void FillForBcast(IOBuffer* buf, uint16_t et);
+
+    // Get broadcast address
+    static const uint8_t* GetBcastAddr() { return (const uint8_t*)_bcastaddr; }
+
+    // Receive multicast for num MAC addresses at macs, 6 bytes each.
+    // Like a hardware hash filter this passes some others as well,
+    // so the stack's own check is exercised; 0 passes none.
+    void SetMcastFilter(const uint8_t* macs, uint num);
+
+    // Get next frame that has arrived or NULL if nothing there.  'et'
+    // gets set to the ethertype and the start of the buffer is at the
+    // station addresses.  Multicast frames the filter turns down are
+    // dropped uncounted, as a NIC would.
+    IOBuffer* Receive(uint16_t& et);
+
+    // As on the hardware drivers, the "RX interrupt" (the wire thread
+    // signaling frames that have arrived) turns itself off when taken
+    // and stays off until this finds nothing left to receive.  Returns
+    // false if there is.
+    bool EnableRxInterrupt();
+
+    // Nothing to restock or reclaim: frames are copied into receive
+    // buffers as they're sent, and transmit buffers freed right away.
+    void RestockRx() { }
+    void ReclaimTx() { }
+
+    // Send a frame.  Returns false if it was refused.  A frame lost
+    // on the wire still counts as sent.
+    bool Send(IOBuffer* buf);
+
+    // Return our max frame size for buffering.
+    uint GetBufSize() { return MAX_FRAME_SIZE; }
+
+    // Checksum offload capabilities, OFFLOAD_xxx.  None until set,
+    // so the stack sums in software as it would on the EMAC.  With
+    // them the wire fills in the sums of frames sent, and checks
+    // those of frames received, as a NIC would.
+    uint GetOffload() const { return _offload; }
+    void SetOffload(uint flags) { _offload = flags; }
+
+    // No PHY
+    bool MISRAtten() const { return false; }
+    void ServiceMISR() { }
+
+    // Set event object to signal arrivals on
+    void SetEventObject(EventObject* evob) { _eventob = evob; }
+
+    // Interface counters
+    NetStats::Link& GetStats() { return _stats; }
+
+private:
+    Ethernet(const Ethernet&);
+    Ethernet& operator=(const Ethernet&);
+};
+
+
+// Cable between two Ethernets, with a configurable model of latency,
+// jitter, loss, reordering and bandwidth per direction.  Frames are
+// copied into a receive buffer when sent and held until they're due;
+// a wire thread signals the receiving side's event object when they
+// arrive, much as an RX interrupt would.  Optionally writes every
+// frame sent, in either direction, to a pcap file.  Frames are
+// captured as they enter the wire, so lost frames are included.
+class VirtualWire {
+    friend class Ethernet;
+public:
+    struct Params {
+        uint latency;           // One way delay, usec
+        uint jitter;            // Added random delay, 0 to jitter usec
+        uint loss;              // Frames lost, per 1000
+        uint reorder;           // Frames held back behind later ones, per 1000
+        uint bandwidth;         // Bits per second, 0 for unlimited
+    };
+
+    // Directions
+    enum { A_TO_B = 0, B_TO_A = 1 };
+
+    // Counters, per direction
+    struct Stats {
+        uint32_t frames;        // Frames sent into the wire
+        uint32_t lost;          // Dropped by the loss model
+        uint32_t reordered;     // Held back by the reorder model
+        uint32_t nobufs;        // Dropped for lack of receive buffers
+    };
+
+private:
+    // Frame in flight
+    struct Pending {
+        IOBuffer* buf;
+        Time due;               // When it arrives
+        bool announced;         // Receiver has been signaled
+    };
+
+    // One direction
+    struct Link {
+        Ethernet* dest;         // Receiving end
+        Params params;
+        Deque<Pending> inflight; // Ordered by due time
+        Time busy;              // Sender busy serializing until
+        Stats stats;
+    };
+
+    mutable Mutex _lock;
+    EventObject _wake;          // Wakes the wire thread
+    Link _link[2];
+    Thread* _thread;
+    PcapWriter _pcap;
+    bool _up;
+
+public:
+    // Cable between a and b.  They're plugged in by Start().  With a
+    // and b the same, it's a loopback plug: frames come back to the
+    // sender, over B_TO_A.
+    VirtualWire(Ethernet& a, Ethernet& b);
+    ~VirtualWire();
+
+    // Set the model for one direction, or both
+    void SetParams(uint dir, const Params& params);
+    void SetParams(const Params& params);
+
+    // Plug in both ends and start the wire thread.  The link is up
+    // once this has been called.
+    void Start();
+
+    // Pull or plug the cable.  Frames in flight are lost when pulled.
+    void SetLink(bool up);
+    bool GetLink() const { return _up; }
+
+    // Capture to file, or stop capturing if NULL.  The wire doesn't
+    // own the file.
+    bool SetCapture(File* file, uint snaplen = PcapWriter::SNAPLEN_DEFAULT);
+
+    Stats GetStats(uint dir) const;
+
+private:
+    bool Transmit(Ethernet& src, IOBuffer* buf);
+    IOBuffer* Deliver(Ethernet& dest);
+
+    // Unmask dest's RX signal, unless a frame is waiting for it
+    bool EnableRx(Ethernet& dest);
+
+    // Wire thread
+    static void* Run(void* arg);
+    void Service();
+
+    // Queue frame on link in due time order
+    static void Enqueue(Link& link, IOBuffer* buf, const Time& due);
+
+    // Free everything in flight
+    void Flush();
+
+    VirtualWire(const VirtualWire&);
+    VirtualWire& operator=(const VirtualWire&);
+};
+
+#endif // __VETHER_H__
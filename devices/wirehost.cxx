@@ -0,0 +1,508 @@
+// Copyright (c) 2018-2021 Jan Brittenson
+// See LICENSE for details.
+
+#ifdef ENABLE_IP
+
+#include "core/enetkit.h"
+#include "core/thread.h"
+#include "core/dhcp.h"
+#include "core/dns.h"
+#include "devices/wirehost.h"
+
+
+static const uint8_t dhcp_magic[] = { 0x63, 0x82, 0x53, 0x63 };
+
+enum {
+    FRAME_LEN = sizeof (Ethernet::Frame),
+    DNS_HLEN = 12,                  // Fixed DNS header
+    DNS_MAX = 512                   // Max UDP DNS message
+};
+
+
+WireHost::WireHost(Ethernet& netif, in_addr_t addr, in_addr_t netmask, in_addr_t pool,
+                   const char* domain)
+    : _netif(netif),
+      _addr(addr),
+      _netmask(netmask),
+      _pool(pool),
+      _domain(domain),
+      _nhosts(0),
+      _thread(NULL),
+      _dns_ttl(DNS_TTL),
+      _proxy_arp(false),
+      _conflict(INADDR_ANY) {
+    memset(_lease, 0, sizeof _lease);
+    memset(&_stats, 0, sizeof _stats);
+}
+
+
+bool WireHost::AddHost(const char* name, in_addr_t addr) {
+    if (_nhosts >= MAX_HOSTS)
+        return false;
+
+    _host[_nhosts].name = name;
+    _host[_nhosts].addr = addr;
+    ++_nhosts;
+    return true;
+}
+
+
+void WireHost::Start(const uint8_t macaddr[6]) {
+    assert(!_thread);
+
+    _netif.Initialize(macaddr);
+    _netif.SetEventObject(&_event);
+
+    _thread = Thread::Create("wirehost", Run, this);
+    assert(_thread);
+}
+
+
+// * static
+void* WireHost::Run(void* arg) {
+    WireHost* host = (WireHost*)arg;
+
+    for (;;) {
+        host->_event.Wait();
+
+        IOBuffer* buf;
+        uint16_t et;
+        do {
+            while ((buf = host->_netif.Receive(et)))
+                host->Input(buf, et);
+        } while (!host->_netif.EnableRxInterrupt());
+    }
+
+    return NULL;
+}
+
+
+void WireHost::Input(IOBuffer* buf, uint16_t et) {
+    const Ethernet::Frame* f = (const Ethernet::Frame*)(*buf + 0);
+    if (memcmp(f->dst, _netif.GetMacAddr(), 6) && memcmp(f->dst, _netif.GetBcastAddr(), 6)) {
+        ++_stats.dropped;
+        BufferPool::FreeBuffer(buf);
+        return;
+    }
+
+    switch (et) {
+    case ETHERTYPE_ARP:
+        ArpInput(buf);
+        break;
+    case ETHERTYPE_IP:
+        UdpInput(buf);
+        break;
+    default:
+        ++_stats.dropped;
+        BufferPool::FreeBuffer(buf);
+    }
+}
+
+
+void WireHost::ArpInput(IOBuffer* buf) {
+    if (buf->Size() < FRAME_LEN + sizeof (Arph)) {
+        ++_stats.dropped;
+        BufferPool::FreeBuffer(buf);
+        return;
+    }
+
+    Ethernet::Frame* f = (Ethernet::Frame*)(*buf + 0);
+    Arph* arp = (Arph*)(*buf + FRAME_LEN);
+
+    in_addr_t dip, sip;
+    memcpy(&dip, arp->dip, 4);  // Not 32 bit aligned
+    memcpy(&sip, arp->sip, 4);
+
+    // Not to address probes or announcements, or they'd see a conflict
+    const bool proxy = _proxy_arp && sip != INADDR_ANY && dip != sip &&
+        (dip & _netmask) == (_addr & _netmask);
+    const bool conflict = sip == INADDR_ANY && dip != INADDR_ANY && dip == _conflict;
+    if (arp->fixed.op != Htons(ARPOP_REQ) || (dip != _addr && !proxy && !conflict)) {
+        ++_stats.dropped;
+        BufferPool::FreeBuffer(buf);
+        return;
+    }
+
+    arp->fixed.op = Htons(ARPOP_REP);
+    memcpy(arp->dea, arp->sea, 6);
+    memcpy(arp->dip, &sip, 4);
+    memcpy(arp->sea, _netif.GetMacAddr(), 6);
+    memcpy(arp->sip, &dip, 4);
+
+    memcpy(f->dst, arp->dea, 6);
+    memcpy(f->src, _netif.GetMacAddr(), 6);
+
+    buf->SetSize(FRAME_LEN + sizeof (Arph));
+
+    ++_stats.arp;
+    _netif.Send(buf);
+}
+
+
+void WireHost::UdpInput(IOBuffer* buf) {
+    if (buf->Size() < FRAME_LEN + sizeof (Iph) + sizeof (Udph))
+        goto drop;
+
+    {
+        Iph& iph = *(Iph*)(*buf + FRAME_LEN);
+        const uint len = Ntohs(iph.len);
+
+        if (iph.GetVersion() != 4 || iph.GetHLen() != sizeof (Iph) || !iph.ValidateCsum()
+            || iph.proto != IPPROTO_UDP || iph.IsFragment()
+            || len < sizeof (Iph) + sizeof (Udph) || len > buf->Size() - FRAME_LEN)
+            goto drop;
+
+        // Drop any link padding
+        buf->SetSize(FRAME_LEN + len);
+
+        const Udph& udph = *(const Udph*)iph.GetTransport();
+        const uint ulen = Ntohs(udph.len);
+        if (ulen < sizeof (Udph) || ulen > len - sizeof (Iph) || !udph.ValidateCsum(iph))
+            goto drop;
+
+        const uint16_t dport = Ntohs(udph.dport);
+
+        if (dport == Dhcp::SERVER_PORT) {
+            DhcpInput(buf);
+            return;
+        }
+
+        if (iph.dest != _addr)
+            goto drop;
+
+        if (dport == DNS_PORT) {
+            if (DnsInput(buf))
+                return;
+            goto drop;
+        }
+
+        if (dport == ECHO_PORT) {
+            ++_stats.echo;
+            Reply(buf, ulen - sizeof (Udph));
+            return;
+        }
+    }
+
+drop:
+    ++_stats.dropped;
+    BufferPool::FreeBuffer(buf);
+}
+
+
+void WireHost::Reply(IOBuffer* buf, uint len) {
+    Ethernet::Frame* f = (Ethernet::Frame*)(*buf + 0);
+    memcpy(f->dst, f->src, 6);
+    memcpy(f->src, _netif.GetMacAddr(), 6);
+
+    Iph& iph = *(Iph*)(*buf + FRAME_LEN);
+    iph.dest = iph.source;
+    iph.source = _addr;
+    iph.len = Htons(sizeof (Iph) + sizeof (Udph) + len);
+    iph.off = 0;
+    iph.ttl = 64;
+    iph.SetCsum();
+
+    Udph& udph = *(Udph*)iph.GetTransport();
+    udph.dport = exch(udph.sport, udph.dport);
+    udph.len = Htons(sizeof (Udph) + len);
+    udph.SetCsum(iph);
+
+    buf->SetSize(FRAME_LEN + sizeof (Iph) + sizeof (Udph) + len);
+
+    _netif.Send(buf);
+}
+
+
+in_addr_t WireHost::LeaseFor(const uint8_t mac[6]) {
+    int free = -1;
+
+    for (uint i = 0; i < MAX_LEASES; ++i) {
+        if (!_lease[i].used) {
+            if (free < 0)
+                free = i;
+        } else if (!memcmp(_lease[i].mac, mac, 6)) {
+            return Htonl(Ntohl(_pool) + i);
+        }
+    }
+
+    if (free < 0)
+        return INADDR_ANY;
+
+    _lease[free].used = true;
+    memcpy(_lease[free].mac, mac, 6);
+    return Htonl(Ntohl(_pool) + free);
+}
+
+
+void WireHost::DhcpInput(IOBuffer* buf) {
+    enum { OPTIONS = FRAME_LEN + offsetof(Dhcp::Packet, options) };
+
+    if (buf->Size() < OPTIONS + sizeof dhcp_magic) {
+        ++_stats.dropped;
+        BufferPool::FreeBuffer(buf);
+        return;
+    }
+
+    const Dhcp::Packet* req = (const Dhcp::Packet*)(*buf + FRAME_LEN);
+    const uint8_t* opt = req->options;
+    const uint optlen = buf->Size() - OPTIONS;
+
+    if (req->op != Dhcp::BOOTREQUEST || req->htype != 1 || req->hlen != 6
+        || memcmp(opt, dhcp_magic, sizeof dhcp_magic)) {
+        ++_stats.dropped;
+        BufferPool::FreeBuffer(buf);
+        return;
+    }
+
+    uint8_t type = Dhcp::DHCPINVALID;
+    in_addr_t reqaddr = req->ciaddr;
+    in_addr_t server = INADDR_ANY;
+
+    for (uint i = sizeof dhcp_magic; i < optlen; ) {
+        const uint8_t tag = opt[i++];
+        if (tag == Dhcp::TAG_PAD)
+            continue;
+        if (tag == Dhcp::TAG_END || i >= optlen)
+            break;
+
+        const uint len = opt[i++];
+        if (i + len > optlen)
+            break;
+
+        switch (tag) {
+        case Dhcp::TAG_DHCP_MSGTYPE:
+            if (len >= 1)
+                type = opt[i];
+            break;
+        case Dhcp::TAG_DHCP_REQ_IP:
+            if (len >= 4)
+                memcpy(&reqaddr, opt + i, 4);
+            break;
+        case Dhcp::TAG_DHCP_SERVER:
+            if (len >= 4)
+                memcpy(&server, opt + i, 4);
+            break;
+        default: ;
+        }
+        i += len;
+    }
+
+    // Requests selecting another server are none of our business
+    if (server != INADDR_ANY && server != _addr)
+        type = Dhcp::DHCPINVALID;
+
+    in_addr_t addr = INADDR_ANY;
+    uint8_t reply = Dhcp::DHCPINVALID;
+
+    switch (type) {
+    case Dhcp::DHCPDISCOVER:
+        addr = LeaseFor(req->chaddr);
+        if (addr != INADDR_ANY)
+            reply = Dhcp::DHCPOFFER;
+        break;
+    case Dhcp::DHCPREQUEST:
+        addr = LeaseFor(req->chaddr);
+        if (addr != INADDR_ANY && addr == reqaddr) {
+            reply = Dhcp::DHCPACK;
+        } else {
+            reply = Dhcp::DHCPNACK;
+            addr = INADDR_ANY;
+        }
+        break;
+    case Dhcp::DHCPRELEASE:
+        for (uint i = 0; i < MAX_LEASES; ++i)
+            if (_lease[i].used && !memcmp(_lease[i].mac, req->chaddr, 6))
+                _lease[i].used = false;
+        break;
+    default: ;
+    }
+
+    if (reply == Dhcp::DHCPINVALID) {
+        BufferPool::FreeBuffer(buf);
+        return;
+    }
+
+    // Replies are always a full BOOTP packet
+    IOBuffer* rbuf = BufferPool::AllocTx(2 + FRAME_LEN + sizeof (Dhcp::Packet));
+    if (!rbuf) {
+        ++_stats.dropped;
+        BufferPool::FreeBuffer(buf);
+        return;
+    }
+
+    rbuf->SetHeadroom(2);
+    rbuf->SetSize(FRAME_LEN + sizeof (Dhcp::Packet));
+    memset(*rbuf + 0, 0, rbuf->Size());
+
+    Ethernet::Frame* f = (Ethernet::Frame*)(*rbuf + 0);
+    memcpy(f->dst, req->chaddr, 6);
+    memcpy(f->src, _netif.GetMacAddr(), 6);
+    f->et = Htons(ETHERTYPE_IP);
+
+    Dhcp::Packet* pkt = (Dhcp::Packet*)(*rbuf + FRAME_LEN);
+    pkt->op = Dhcp::BOOTREPLY;
+    pkt->htype = 1;
+    pkt->hlen = 6;
+    pkt->xid = req->xid;
+    pkt->flags = req->flags;
+    pkt->yiaddr = addr;
+    pkt->siaddr = _addr;
+    pkt->giaddr = req->giaddr;
+    memcpy(pkt->chaddr, req->chaddr, sizeof pkt->chaddr);
+
+    BufferPool::FreeBuffer(buf);
+
+    uint8_t* p = pkt->options;
+    memcpy(p, dhcp_magic, sizeof dhcp_magic);
+    p += sizeof dhcp_magic;
+
+    *p++ = Dhcp::TAG_DHCP_MSGTYPE; *p++ = 1; *p++ = reply;
+    *p++ = Dhcp::TAG_DHCP_SERVER; *p++ = 4; memcpy(p, &_addr, 4); p += 4;
+
+    if (reply != Dhcp::DHCPNACK) {
+        const uint32_t lease = Htonl(LEASE_TIME);
+        *p++ = Dhcp::TAG_DHCP_LEASE; *p++ = 4; memcpy(p, &lease, 4); p += 4;
+        *p++ = Dhcp::TAG_SUBNET; *p++ = 4; memcpy(p, &_netmask, 4); p += 4;
+        *p++ = Dhcp::TAG_GW; *p++ = 4; memcpy(p, &_addr, 4); p += 4;
+        *p++ = Dhcp::TAG_NS; *p++ = 4; memcpy(p, &_addr, 4); p += 4;
+
+        const uint dlen = min<uint>(strlen(_domain), 64);
+        if (dlen) {
+            *p++ = Dhcp::TAG_DOMAIN; *p++ = dlen; memcpy(p, _domain, dlen); p += dlen;
+        }
+    }
+    *p++ = Dhcp::TAG_END;
+
+    Iph& iph = pkt->iph;
+    iph.SetHLen(sizeof (Iph));
+    iph.len = Htons(sizeof (Dhcp::Packet));
+    iph.ttl = 64;
+    iph.proto = IPPROTO_UDP;
+    iph.source = _addr;
+    iph.dest = 0xffffffff;
+    iph.SetCsum();
+
+    Udph& udph = pkt->udph;
+    udph.sport = Htons(Dhcp::SERVER_PORT);
+    udph.dport = Htons(Dhcp::CLIENT_PORT);
+    udph.len = Htons(sizeof (Dhcp::Packet) - sizeof (Iph));
+    udph.SetCsum(iph);
+
+    ++_stats.dhcp;
+    _netif.Send(rbuf);
+}
+
+
+const WireHost::Host* WireHost::FindHost(const char* name, const Host* prev) const {
+    for (uint i = prev ? prev - _host + 1 : 0; i < _nhosts; ++i)
+        if (!strcasecmp(_host[i].name, name))
+            return _host + i;
+
+    return NULL;
+}
+
+
+// Answer a single question, in place.  Returns false if buf wasn't
+// consumed.
+bool WireHost::DnsInput(IOBuffer* buf) {
+    Iph& iph = *(Iph*)(*buf + FRAME_LEN);
+    Udph& udph = *(Udph*)iph.GetTransport();
+    uint8_t* msg = udph.GetPayload();
+    const uint len = Ntohs(udph.len) - sizeof (Udph);
+
+    enum {
+        FLAG_QR = 0x80,             // Response
+        FLAG_OPCODE = 0x78,
+        FLAG_AA = 0x04,             // Authoritative
+        FLAG_RD = 0x01,             // Recursion desired
+        FLAG_RA = 0x80,             // Recursion available
+        RCODE_NXDOMAIN = 3,
+        RCODE_NOTIMP = 4
+    };
+
+    // Queries only, one question
+    if (len < DNS_HLEN + 5 || (msg[2] & FLAG_QR) || msg[4] || msg[5] != 1)
+        return false;
+
+    // Decode name
+    char name[256];
+    uint pos = DNS_HLEN;
+    uint nlen = 0;
+
+    for (;;) {
+        if (pos >= len)
+            return false;
+
+        const uint label = msg[pos++];
+        if (!label)
+            break;
+
+        // No compression in questions
+        if (label > 63 || pos + label > len || nlen + label + 1 >= sizeof name)
+            return false;
+
+        if (nlen)
+            name[nlen++] = '.';
+        memcpy(name + nlen, msg + pos, label);
+        nlen += label;
+        pos += label;
+    }
+    name[nlen] = 0;
+
+    if (pos + 4 > len)
+        return false;
+
+    const uint16_t qtype = (msg[pos] << 8) | msg[pos + 1];
+    const uint16_t qclass = (msg[pos + 2] << 8) | msg[pos + 3];
+    pos += 4;
+
+    const Host* host = FindHost(name);
+
+    uint rcode = 0;
+    if ((msg[2] & FLAG_OPCODE) != Dnsh::OPCODE_QUERY)
+        rcode = RCODE_NOTIMP;
+    else if (!host)
+        rcode = RCODE_NXDOMAIN;
+
+    // An A record for each time the name was added
+    uint answers = 0;
+    if (!rcode && qtype == Dnsh::TYPE_A && qclass == Dnsh::CLASS_IN)
+        for (const Host* h = host; h; h = FindHost(name, h))
+            ++answers;
+
+    // Reply is the header and question, plus the answers if any
+    msg[2] = FLAG_QR | FLAG_AA | (msg[2] & (FLAG_OPCODE | FLAG_RD));
+    msg[3] = FLAG_RA | rcode;
+    msg[6] = 0;
+    msg[7] = answers;
+    msg[8] = msg[9] = 0;            // Authority
+    msg[10] = msg[11] = 0;          // Additional
+
+    if (answers) {
+        const uint end = pos + 16 * answers;
+        if (end > DNS_MAX || FRAME_LEN + sizeof (Iph) + sizeof (Udph) + end > Ethernet::MAX_FRAME_SIZE - 2)
+            return false;
+
+        buf->SetSize(FRAME_LEN + sizeof (Iph) + sizeof (Udph) + end);
+
+        const uint32_t ttl = Htonl(_dns_ttl);
+
+        for (const Host* h = host; h; h = FindHost(name, h)) {
+            uint8_t* rr = msg + pos;
+            rr[0] = 0xc0;           // Pointer to the question name
+            rr[1] = DNS_HLEN;
+            rr[2] = 0; rr[3] = Dnsh::TYPE_A;
+            rr[4] = 0; rr[5] = Dnsh::CLASS_IN;
+            memcpy(rr + 6, &ttl, 4);
+            rr[10] = 0; rr[11] = 4;
+            memcpy(rr + 12, &h->addr, 4);
+            pos += 16;
+        }
+    }
+
+    ++_stats.dns;
+    Reply(buf, pos);
+    return true;
+}
+
+#endif // ENABLE_IP
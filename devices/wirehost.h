@@ -0,0 +1,118 @@
+// Copyright (c) 2018-2021 Jan Brittenson
+// See LICENSE for details.
+
+#ifndef __WIREHOST_H__
+#define __WIREHOST_H__
+
+#include "core/network.h"
+#include "core/ip.h"
+#include "core/udp.h"
+#include "devices/vether.h"
+
+
+// Stand-in for the rest of the network at the far end of a
+// VirtualWire.  It isn't a stack: it answers frames in place from its
+// own thread.  It serves
+//
+//   ARP     for its own address, or with SetProxyArp() for every
+//           address on its network; probes for the address given
+//           SetConflict()
+//   DHCP    leases from a small pool, handing out itself as router
+//           and name server
+//   DNS     A queries for the names added with AddHost(), with an
+//           A record for each time a name was added
+//   Echo    UDP port 7, for benchmarks
+//
+// All addresses are in network byte order.
+class WireHost {
+public:
+    enum {
+        MAX_LEASES = 8,
+        MAX_HOSTS = 8,
+        ECHO_PORT = 7,
+        DNS_TTL = 300,              // TTL of DNS answers, seconds
+        LEASE_TIME = 3600           // DHCP lease, seconds
+    };
+
+    struct Stats {
+        uint32_t arp;               // ARP requests answered
+        uint32_t dhcp;              // DHCP replies sent
+        uint32_t dns;               // DNS replies sent
+        uint32_t echo;              // Datagrams echoed
+        uint32_t dropped;           // Frames ignored
+    };
+
+private:
+    struct Lease {
+        uint8_t mac[6];
+        bool used;
+    };
+
+    struct Host {
+        const char* name;           // Fully qualified, without trailing dot
+        in_addr_t addr;
+    };
+
+    Ethernet& _netif;
+    EventObject _event;
+    in_addr_t _addr;                // Our address
+    in_addr_t _netmask;
+    in_addr_t _pool;                // First address handed out
+    const char* _domain;
+    Lease _lease[MAX_LEASES];
+    Host _host[MAX_HOSTS];
+    uint _nhosts;
+    Stats _stats;
+    Thread* _thread;
+    uint32_t _dns_ttl;
+    bool _proxy_arp;
+    in_addr_t _conflict;            // Probes answered for, or INADDR_ANY
+
+public:
+    WireHost(Ethernet& netif, in_addr_t addr, in_addr_t netmask, in_addr_t pool,
+             const char* domain);
+
+    // Add a name for DNS.  name must stay valid.
+    bool AddHost(const char* name, in_addr_t addr);
+
+    // TTL of DNS answers, seconds
+    void SetDnsTtl(uint32_t ttl) { _dns_ttl = ttl; }
+
+    // Answer ARP for the whole network, so a benchmark can talk to
+    // as many on-link peers as it likes.  What's then sent to them is
+    // dropped.
+    void SetProxyArp(bool on) { _proxy_arp = on; }
+
+    // Answer ARP probes for addr, as another host already using it
+    // would.  INADDR_ANY for none.
+    void SetConflict(in_addr_t addr) { _conflict = addr; }
+
+    // Start serving, from a thread of its own
+    void Start(const uint8_t macaddr[6]);
+
+    const Stats& GetStats() const { return _stats; }
+
+private:
+    static void* Run(void* arg);
+    void Input(IOBuffer* buf, uint16_t et);
+
+    void ArpInput(IOBuffer* buf);
+    void UdpInput(IOBuffer* buf);
+    void DhcpInput(IOBuffer* buf);
+    bool DnsInput(IOBuffer* buf);
+
+    // Turn a received datagram around with a payload of len bytes,
+    // already in place, and send it
+    void Reply(IOBuffer* buf, uint len);
+
+    // Address for client, or INADDR_ANY if the pool is exhausted
+    in_addr_t LeaseFor(const uint8_t mac[6]);
+
+    // Next host named name after prev, or the first if prev is NULL
+    const Host* FindHost(const char* name, const Host* prev = NULL) const;
+
+    WireHost(const WireHost&);
+    WireHost& operator=(const WireHost&);
+};
+
+#endif // __WIREHOST_H__
@@ -14,7 +14,7 @@
 
 typedef unsigned char uchar;
 typedef unsigned int uint;
-typedef unsigned int size_t;
+typedef __SIZE_TYPE__ size_t;
 
 typedef uint32_t in_addr_t;
 
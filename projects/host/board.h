@@ -0,0 +1,21 @@
+// Copyright (c) 2026 Jan Brittenson
+// See LICENSE for details.
+
+#ifndef __BOARD_H__
+#define __BOARD_H__
+
+// This file maps host resources to canonical names and provides
+// external decls.
+
+#include "devices/vether.h"
+#include "arch/host/console.h"
+#include "core/crc32.h"
+
+extern SysTimer _systimer;
+extern Console _stdout;
+
+#ifdef ENABLE_ENET
+extern Ethernet _eth0;
+#endif
+
+#endif // __BOARD_H__
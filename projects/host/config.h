@@ -0,0 +1,126 @@
+// Copyright (c) 2026 Jan Brittenson
+// See LICENSE for details.
+
+#ifndef _CONFIG_H_
+#define _CONFIG_H_
+
+#define _console _stdout
+#define _trace _stdout
+
+#define THREAD_DATA_SIZE  ((sizeof(Thread) + 15) & ~15) // sizeof (Thread), aligned
+
+// Literals are anywhere below the writable data
+#define TEXT_REGION_START ((uintptr_t)&__executable_start)
+#define TEXT_REGION_SIZE  ((uintptr_t)&__data_start - TEXT_REGION_START)
+
+// Main (default) internal RAM region, contains thread stacks
+#define IRAM_REGION_SIZE (16*1024*1024)
+#define IRAM_REGION_START ((uintptr_t)_iram_mem)
+
+#define MALLOC_REGION_SIZE (64*1024*1024)
+#define MALLOC_REGION_START ((uintptr_t)_malloc_mem)
+
+// Non-nested interrupt priorities, as on the targets
+enum {
+    IPL_QUANTUM  = 1,
+
+    IPL_SOFT     = 17,
+
+    IPL_MIN      = 31,
+    IPL_MAX      = 1,
+    IPL_NUM      = 32,
+
+    // Values to use
+    IPL_CSW      = IPL_SOFT+1, // Software context switch (PendSV)
+    IPL_SYSTIMER = IPL_SOFT,  // Scheduler
+    IPL_ENET     = IPL_SOFT,  // Ethernet
+};
+
+// Software priorities
+enum {
+    // Network service code, locks out ethernet interrupts where needed
+    IPL_NETWORK  = IPL_ENET,
+};
+
+
+// Enetcore configuration parameters
+
+#define VARIANT "Enetcore"
+
+#define USE_LITERALS			// Optimize dup/free of literals
+
+// ConnectedSocket timeout
+enum { SHUTDOWN_TIMEOUT = 10000 };
+
+
+// dlmalloc config - see dlmalloc.h
+#define USE_LOCKS 1
+#define MLOCK_T Mutex
+#define INITIAL_LOCK(l) ((void)0)
+#define ACQUIRE_LOCK(l) ((l)->Lock(), 0)
+#define RELEASE_LOCK(l) ((l)->Unlock(), 0)
+#define LOCK_INITIALIZER
+
+#define HAVE_MORECORE 1
+#define MORECORE(X)  _malloc_region.GetMem((X))
+#define HAVE_MMAP 0
+#define HAVE_MREMAP 0
+#define malloc_getpagesize _malloc_region.GetPageSize()
+#define DEFAULT_TRIM_THRESHOLD 16384 /* Trim is dirt cheap */
+#define MORECORE_CANNOT_TRIM 1		 // But even cheaper is not to do it at all
+#define INSECURE 0					 // Integrity checks
+#define MSPACES 0					 // No malloc spaces
+#define LACKS_ERRNO_H 1
+#define LACKS_STRING_H 1
+#define LACKS_UNISTD_H 1
+#define LACKS_SYS_MMAN_H 1
+#define LACKS_STDLIB_H 1
+#define LACKS_FCNTL_H 1
+#define LACKS_STDIO_H 1
+#define LACKS_SYS_TYPES_H 1
+#define LACKS_SBRK 1
+#define MALLOC_FAILURE_ACTION
+
+#ifdef DEBUG
+#define MALLOC_DEBUG				 // Extra debug checking
+#endif
+
+// HashTable default reservation, eviction depth (for cuckoo)
+// See hashtable.h for more info
+enum { HASHTABLE_DEFAULT_RESERVE = 64 };
+enum { HASHTABLE_EVICTION_DEPTH = 10 };
+
+// Host threads get at least HOST_STACK_MIN
+enum { MAIN_THREAD_STACK = 256*1024 };
+enum { INTR_THREAD_STACK = 1024 };	// Unused; handlers run on thread stacks
+
+enum { NET_THREAD_STACK = 2048 };	  // Network thread stack size
+enum { NET_THREAD_PRIORITY = 200 };	  // Network thread priority
+
+enum { THREAD_DEFAULT_STACK = 2048 }; // Default thread stack size
+enum { THREAD_DEFAULT_PRIORITY = 50 }; // Default thread priority
+
+// IOScheduler settings
+enum { IO_FUDGE = 10 };	  // I/O scheduler timing granularity, in msec
+enum { IO_STACK_SIZE = 2048 };	// Stack size for I/O threads
+
+// String
+#define STRING_FREELIST			// Enable freelisting of String objects
+
+// Interrupt priorities
+// Add or remove as needed, but PRIO_NORM is required even if it's the
+// only priority.
+enum {
+	PRIO_INTR = 0,				//  Highest - interrupt thread
+	PRIO_HIGH,
+	PRIO_NORM,
+	PRIO_LOW,
+	NUM_PRIO					// Lowest
+};
+
+// Various configuration checks
+static_assert((NET_THREAD_STACK & 3) == 0);
+static_assert((MAIN_THREAD_STACK & 3) == 0);
+static_assert((INTR_THREAD_STACK & 3) == 0);
+
+#endif // _CONFIG_H_
@@ -0,0 +1,87 @@
+// Copyright (c) 2026 Jan Brittenson
+// See LICENSE for details.
+
+#include "core/enetkit.h"
+#include "core/thread.h"
+#include "core/util.h"
+#include "core/platform.h"
+
+
+Thread* _main_thread;
+void* _main_thread_stack;
+void* _intr_thread_stack;
+
+alignas(16) uint8_t _malloc_mem[MALLOC_REGION_SIZE];
+alignas(16) uint8_t _iram_mem[IRAM_REGION_SIZE];
+
+Clock _clock;
+SysTimer _systimer;
+
+Console _stdout(1);
+
+#ifdef ENABLE_ENET
+Ethernet _eth0;
+
+// Network buffer memory
+enum { NETWORK_DATA_SIZE = 1024*1024 };
+
+alignas(16) static uint8_t _network_mem[NETWORK_DATA_SIZE];
+static Platform::Region _network_region(NETWORK_DATA_SIZE, _network_mem);
+
+uint NetworkDataSize() {
+    return NETWORK_DATA_SIZE - 128;
+}
+
+IOBuffer* AllocNetworkBuffer() { return new IOBuffer(); }
+uint8_t* AllocNetworkData(uint size, uint alignment) {
+    return (uint8_t*)_network_region.GetAlignedMem(size, alignment);
+}
+#endif
+
+
+// A fault ends the process, with the fault number in its exit status
+void fault0(uint num) {
+    console("fault %u", num);
+    HostExit(128 + num);
+}
+
+
+uint8_t* AllocThreadStack(uint size) {
+    return (uint8_t*)Platform::_iram_region.GetAlignedMem(Util::Align<size_t>(size, 16), 16);
+}
+
+Thread* AllocThreadContext() {
+    return new (Platform::_iram_region.GetAlignedMem(THREAD_DATA_SIZE, 16)) Thread();
+}
+
+
+// Hard system initialization.  Runs as the first static initializer.
+void hwinit0() {
+    _assert_stop = true;
+}
+
+
+// "Soft" system initialization.  Initializers have been run now.
+void hwinit() {
+	// Initialize main thread and set up stacks
+	Thread::Bootstrap();
+
+    _clock.Start();
+
+    // The same every run, so runs can be repeated
+    uint8_t seed[32];
+    for (uint i = 0; i < sizeof seed; ++i)
+        seed[i] = i;
+    Util::RandomSeed(seed, sizeof seed);
+
+    // Turn on proper assert handling
+    _assert_stop = false;
+
+	// Enable global interrupts by restoring to a non-disabled state :)
+    RestoreInterrupts(0);
+    SetIPL(0);
+
+    assert(IntEnabled());
+
+    _malloc_region.SetReserve(64);
+}
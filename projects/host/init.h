@@ -0,0 +1,31 @@
+// Copyright (c) 2026 Jan Brittenson
+// See LICENSE for details.
+
+#ifndef __INIT_H__
+#define __INIT_H__
+
+#include "params.h"
+#include "arch/host/host.h"
+#include "arch/host/systimer.h"
+
+// Memory, in place of what link.cmd lays out on a target
+extern uint8_t _malloc_mem[];
+extern uint8_t _iram_mem[];
+
+extern "C" {
+// Generated by the host linker
+extern uint8_t __executable_start;
+extern uint8_t __data_start;
+};
+
+extern Clock _clock;
+
+void fault0(uint num);
+
+[[__finline]] static inline void fault(uint num, bool captive = true) {
+    while (captive) {
+        fault0(num);
+    }
+}
+
+#endif // __INIT_H__
@@ -0,0 +1,18 @@
+// Copyright (c) 2026 Jan Brittenson
+// See LICENSE for details.
+
+#ifndef __PARAMS_H__
+#define __PARAMS_H__
+
+// Runs as a Linux process, for tests and benchmarks.  The network
+// runs over a VirtualWire.
+
+#define ENABLE_ENET
+#define ENABLE_IP
+#undef ENABLE_USB
+#undef ENABLE_SWO
+
+#undef ENABLE_WFI               // Idle spins; see arch/host/host.h
+#undef ENABLE_SCHEDSTATS        // Per-thread CPU time, switches and wake latency
+
+#endif // __PARAMS_H__
@@ -0,0 +1,35 @@
+// Copyright (c) 2026 Jan Brittenson
+// See LICENSE for details.
+
+// Takes the place of startup.s.  The C runtime has set up the process
+// and run the static initializers, hwinit0() first among them.  The
+// program is linked with --wrap=main, so it comes here instead of
+// main(), moves to the main thread's stack at the top of IRAM, as the
+// reset handler does, and runs hwinit() and the real main().  Its
+// return value is the exit status.
+
+#include "core/enetkit.h"
+
+void hwinit0();
+void hwinit();
+
+extern "C" int __real_main();
+
+
+[[gnu::constructor(101)]] static void Reset()
+{
+    hwinit0();
+}
+
+
+static void Start(void*)
+{
+    hwinit();
+    HostExit(__real_main());
+}
+
+
+extern "C" int __wrap_main()
+{
+    HostBoot((uint8_t*)IRAM_REGION_START + IRAM_REGION_SIZE, MAIN_THREAD_STACK, Start);
+}
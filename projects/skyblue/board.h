@@ -13,6 +13,7 @@
 #define ENABLE_PANEL
 
 #define ENABLE_WFI
+#undef ENABLE_SCHEDSTATS        // Per-thread CPU time, switches and wake latency
 
 enum { 
     FOSC = 12000000,            // Crystal = 12MHz
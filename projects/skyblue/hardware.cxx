@@ -136,8 +136,8 @@ Thread* AllocThreadContext() {
 // RXDESC = (4+4) * 4 = 32 bytes
 // TXDESC = (4+2) * 16 = 96
 // Set aside 128 bytes for descriptors
-uint NumNetworkBuffers(uint size) {
-    return (PRAM_REGION_SIZE - 128) / Util::Align(size, 4U);
+uint NetworkDataSize() {
+    return PRAM_REGION_SIZE - 128;
 }
 
 IOBuffer* AllocNetworkBuffer() { return new IOBuffer(); }
@@ -6,9 +6,11 @@
 
 #include <stdint.h>
 #include "network.h"
+#include "netstats.h"
 #include "bits.h"
 #include "compiler.h"
 #include "mutex.h"
+#include "spscring.h"
 #include "lpc_eintr.h"
 
 
@@ -22,15 +24,7 @@ class Ethernet {
     volatile uint32_t* _base;
     EventObject* _eventob;      // Used to signal events
 
-    // Counters
-    uint32_t _rx_overrun;
-    uint32_t _rx_error;
-    uint32_t _rx_packets;       // Packets received
-    uint32_t _tx_underrun;
-    uint32_t _tx_error;
-    uint32_t _tx_packets;       // Packets sent
-    uint32_t _rx_bytes;
-    uint32_t _tx_bytes;
+    NetStats::Link _stats;      // Counters
 
     volatile uint16_t _phy_status; // PHY status PHY_STAT_xxx
     volatile uint16_t _misr1;      // MISR1 register
@@ -42,6 +36,7 @@ class Ethernet {
 
     const uint8_t _irq;
     bool _misr_atten;           // MISR attention requested via interrupt
+    volatile bool _rx_masked;   // RX interrupt off while the network thread polls
 
     // Frame header
     struct Frame {
@@ -486,6 +481,15 @@ public:
         TX_DESC_NUM = 16
     };
 
+private:
+    // Completed transmit buffers, handed from the interrupt handler
+    // to the network thread so the handler stays out of BufferPool.
+    SpscRing<TX_DESC_NUM * 2, IOBuffer*> _txdone;
+
+    uint _rx_next;              // Next RX descriptor for Receive()
+
+public:
+
     Ethernet(uintptr_t base, uint8_t irq)
         : _base((volatile uint32_t*)base), 
           _irq(irq) {
@@ -531,17 +535,44 @@ public:
 	// Get broadcast address
 	static const uint8_t* GetBcastAddr() { return (const uint8_t*)_bcastaddr; }
 
+    // Receive multicast for num MAC addresses at macs, 6 bytes each.
+    // The hash filter passes some others as well; 0 passes none.
+    void SetMcastFilter(const uint8_t* macs, uint num);
+
     // Get next unreceived frame or NULL of nothing there.  'et'
     // gets set to the ethertype and the start of the buffer is
-    // advanced past the station addresses.
+    // advanced past the station addresses.  Network thread only.
     IOBuffer* Receive(uint16_t& et);
 
+    // Give fresh buffers to the RX descriptors Receive() has emptied.
+    // Receive() does this itself once half the ring is used; the
+    // network thread should call it after each batch of frames.
+    void RestockRx();
+
+    // Return completed transmit buffers to the pool.  Network thread
+    // only.
+    void ReclaimTx();
+
+    // The RX interrupt turns itself off when it signals the event
+    // object, leaving the network thread to poll Receive().  Once
+    // Receive() comes up empty, this turns it back on.  Returns false,
+    // leaving it off, if frames arrived in the meantime; receive
+    // those first.
+    bool EnableRxInterrupt();
+
     // Send a frame.  Returns false if there was nowhere to put it.
     bool Send(IOBuffer* buf);
     
     // Return our max frame size for buffering.
     uint GetBufSize() { return MAX_FRAME_SIZE; }
 
+    // Checksum offload capabilities, OFFLOAD_xxx.  The EMAC has no
+    // checksum engine.
+    uint GetOffload() const { return 0; }
+
+    // Interface counters
+    NetStats::Link& GetStats() { return _stats; }
+
     // Called on external interrupt from PHY, for things like link
     // status changes.  This will trigger an event notification with
     // MISRAtten() true; the service thread should call ServiceMISR();
@@ -616,9 +647,6 @@ private:
 
     // Create descriptor and status arrays
     void CreateDescriptors();
-
-    // Fill up RX descriptors
-    void RestockRx();
 };
 
 #endif // _LPC_ETHERNET_H_
@@ -6,6 +6,7 @@
 #include "enet_phy.h"
 #include "lpc_ethernet.h"
 #include "util.h"
+#include "capture.h"
 
 using namespace enet_phy;
 
@@ -21,15 +22,10 @@ void Ethernet::Reset() {
     _rxstatus = NULL;
     _eventob = NULL;
     _phy_status = 0;
+    _rx_masked = false;
+    _rx_next = 0;
 
-    _rx_overrun = 0;
-    _rx_error = 0;
-    _rx_packets = 0;
-    _tx_underrun = 0;
-    _tx_error = 0;
-    _tx_packets = 0;
-    _tx_bytes = 0;
-    _rx_bytes = 0;
+    memset(&_stats, 0, sizeof _stats);
 
     _base[REG_COMMAND] = COMMAND_REGRESET | COMMAND_TXRESET | COMMAND_RXRESET;
     _base[REG_MAC1] = MAC1_SOFTRESET;
@@ -133,6 +129,22 @@ void Ethernet::SetMacAddr() {
     _base[REG_SA2] = (uint16_t(_macaddr[4]) << 8) | _macaddr[5];
 }
 
+void Ethernet::SetMcastFilter(const uint8_t* macs, uint num) {
+    uint32_t hash[2] = { 0, 0 };
+    for (uint i = 0; i < num; ++i) {
+        const uint bit = EtherMcastHash(macs + 6 * i);
+        hash[bit >> 5] |= 1 << (bit & 31);
+    }
+
+    _base[REG_HASHFILTERL] = hash[0];
+    _base[REG_HASHFILTERH] = hash[1];
+
+    if (num)
+        _base[REG_RXFILTERCTRL] |= RXFILTERCTRL_AMHE;
+    else
+        _base[REG_RXFILTERCTRL] &= ~RXFILTERCTRL_AMHE;
+}
+
 void Ethernet::WritePHY(PhyReg reg, uint16_t value) {
     _base[REG_MCMD] = 0;
     _base[REG_MADR] = 1 * MADR_PHYADDR + uint32_t(reg) * MADR_REGADDR;
@@ -212,37 +224,37 @@ void Ethernet::CreateDescriptors() {
         _rxdesc[i].control = (RxDesc::CONTROL_Size * (buf->GetReserve() - 2 - 1))
             | RxDesc::CONTROL_Interrupt;
     }
+
+    _rx_next = 0;
 }
 
 IOBuffer* Ethernet::Receive(uint16_t& et) {
-    Thread::IPL G(IPL_ENET);
-
-    const uint i = _base[REG_RXCONSUMEINDEX];
+    // The RX descriptors form a single producer (DMA), single
+    // consumer (us) ring the interrupt handler never touches, so no
+    // IPL is needed.  Descriptors from the consume index up to
+    // _rx_next have been handed out and await RestockRx().
+    const uint i = _rx_next;
 
     // Empty: nothing to see here
     if (i == _base[REG_RXPRODUCEINDEX])
         return NULL;
 
-    RxDesc* r = _rxdesc + i;
-
-    // Use the length to indicate we've processed this buffer.
-    // Otherwise, if we fail to allocate a replacement buffer we'll
-    // end up receiving the same one over and over because we'll never
-    // advance the consumer.
-    if (!(r->control & 0x3ff) || !_rxbuffers[i])
-        return NULL;
+    IOBuffer* buf = exch<IOBuffer*>(_rxbuffers[i], NULL);
+    assert(buf);
 
-    const uint len = r->control & 0x3ff;
+    // RxSize is -1 encoded
+    const uint len = (_rxstatus[i].StatusInfo & 0x7ff) + 1;
 
-    r->control = 0;
+    _rx_next = (i + 1) % RX_DESC_NUM;
 
-    IOBuffer* buf = exch<IOBuffer*>(_rxbuffers[i], NULL);
     buf->SetHead(2);
     buf->SetTail(len + 2);
 
-    _rx_bytes += len;
+    ++_stats.rx_packets;
+    _stats.rx_bytes += len;
 
-    RestockRx();
+    if ((_rx_next + RX_DESC_NUM - _base[REG_RXCONSUMEINDEX]) % RX_DESC_NUM >= RX_DESC_NUM / 2)
+        RestockRx();
 
     // Extract ethertype
     const Frame* f = (const Frame*)(*buf + 0);
@@ -252,35 +264,62 @@ IOBuffer* Ethernet::Receive(uint16_t& et) {
 }
 
 void Ethernet::RestockRx() {
-    uint i;
-    do {
-        i = _base[REG_RXCONSUMEINDEX];
+    uint i = _base[REG_RXCONSUMEINDEX];
+    const uint want = (_rx_next + RX_DESC_NUM - i) % RX_DESC_NUM;
+    if (!want)
+        return;
 
-        RxDesc* r = _rxdesc + i;
+    IOBuffer* bufs[RX_DESC_NUM];
+    const uint n = BufferPool::AllocRx(bufs, want);
 
-        // Stop if not yet processed
-        if (r->control)
-            break;
+    for (uint k = 0; k < n; ++k) {
+        IOBuffer* buf = bufs[k];
+        buf->SetHead(2);
 
-        IOBuffer *buf;
+        _rxdesc[i].packet = (uint8_t*)(*buf + 0);
+        _rxdesc[i].control = (RxDesc::CONTROL_Size * (buf->GetReserve() - 2 - 1))
+            | RxDesc::CONTROL_Interrupt;
 
-        if ((buf = BufferPool::AllocRx())) {
-            buf->SetHead(2);
+        _rxbuffers[i] = buf;
 
-            _rxdesc[i].packet = (uint8_t*)(*buf + 0);
-            _rxdesc[i].control = (RxDesc::CONTROL_Size * (buf->GetReserve() - 2))
-                | RxDesc::CONTROL_Interrupt;
+        i = (i + 1) % RX_DESC_NUM;
+    }
 
-            _rxbuffers[i] = buf;
+    // Return them to the controller
+    _base[REG_RXCONSUMEINDEX] = i;
+}
 
-            _base[REG_RXCONSUMEINDEX] = (i + 1) % RX_DESC_NUM;
-        } else {
-            break;
-        }
-    } while (((i + 1) % RX_DESC_NUM) != _base[REG_RXPRODUCEINDEX]);
+bool Ethernet::EnableRxInterrupt() {
+    if (!_rx_masked)
+        return true;
+
+    Thread::IPL G(IPL_ENET);
+
+    // Frames received while polling left RXDONE set.  Clear it, then
+    // look again: one landing after this sets it anew and interrupts
+    // as soon as it's enabled.
+    _base[REG_INTCLEAR] = INTSTATUS_RXDONEINT;
+    if (_rx_next != _base[REG_RXPRODUCEINDEX])
+        return false;
+
+    _rx_masked = false;
+    _base[REG_INTENABLE] |= INTENABLE_RXDONEINTEN;
+    return true;
+}
+
+void Ethernet::ReclaimTx() {
+    IOBuffer* bufs[TX_DESC_NUM];
+    uint n;
+
+    while ((n = _txdone.PopFront(bufs, TX_DESC_NUM)))
+        BufferPool::FreeBuffers(bufs, n);
 }
 
 bool Ethernet::Send(IOBuffer* buf) {
+    // The frame starts past the pad
+    buf->SetHead(2);
+    _capture.Tap(buf, Capture::DIR_TX);
+
     Thread::IPL G(IPL_ENET);
 
     const uint current = _base[REG_TXPRODUCEINDEX];
@@ -292,7 +331,7 @@ bool Ethernet::Send(IOBuffer* buf) {
         return false;
     }
 
-    const uint len = buf->Size() - 2;
+    const uint len = buf->Size();
     if (len > 1514) {
         BufferPool::FreeBuffer(buf);
         return false;
@@ -309,14 +348,12 @@ bool Ethernet::Send(IOBuffer* buf) {
     if (t->packet && _txbuffers[next]) {
         t->packet = NULL;
         BufferPool::FreeBuffer(_txbuffers[next]);
-        ++_tx_packets;
-        _tx_bytes += t->control & 0x3ff;
+        ++_stats.tx_packets;
+        _stats.tx_bytes += t->control & 0x3ff;
     }
 
     _txbuffers[current] = buf;
 
-    buf->SetHead(2);
-
     t->packet  = (const uint8_t*)(*buf + 0);
     t->control = buf->Size() * TxDesc::CONTROL_Size + TXBITS;
 
@@ -363,27 +400,30 @@ void Ethernet::HandleInterrupt() {
 
         switch (i) {
         case INTSTATUS_RXOVERRUNINT:
-            ++_rx_overrun;
+            ++_stats.rx_overrun;
             break;
 
         case INTSTATUS_RXERRORINT:
-            ++_rx_error;
+            ++_stats.rx_errors;
             break;
 
         case INTSTATUS_RXFINISHEDINT:
             break;
 
         case INTSTATUS_RXDONEINT:
-            ++_rx_packets;
+            // No more of these until the thread has emptied the ring
+            _base[REG_INTENABLE] &= ~INTENABLE_RXDONEINTEN;
+            _rx_masked = true;
+            ++_stats.rx_interrupts;
             sig = true;
             break;
 
         case INTSTATUS_TXUNDERRUNINT:
-            ++_tx_underrun;
+            ++_stats.tx_underrun;
             break;
 
         case INTSTATUS_TXERRORINT:
-            ++_tx_error;
+            ++_stats.tx_errors;
             break;
 
         case INTSTATUS_TXFINISHEDINT:
@@ -394,15 +434,18 @@ void Ethernet::HandleInterrupt() {
 
             // Walk backwards to the producer and process sent packets
             while (i != _base[REG_TXPRODUCEINDEX] && _txdesc[i].packet != NULL) {
-                _tx_bytes += _txdesc[i].control & 0x3ff;
+                _stats.tx_bytes += _txdesc[i].control & 0x3ff;
 
+                // Leave it to the network thread, unless it's fallen
+                // so far behind the ring is full
                 IOBuffer* buf = _txbuffers[i];
-                BufferPool::FreeBuffer(buf);
+                if (!_txdone.PushBack(buf))
+                    BufferPool::FreeBuffer(buf);
 
                 _txdesc[i].packet = NULL;
                 _txbuffers[i] = NULL;
 
-                ++_tx_packets;
+                ++_stats.tx_packets;
 
                 i = (i - 1) % TX_DESC_NUM;
                 sig = true;
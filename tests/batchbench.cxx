@@ -0,0 +1,199 @@
+// Copyright (c) 2018-2021 Jan Brittenson
+// See LICENSE for details.
+
+// UDP batch API benchmark, used for dev.  Sends bursts of datagrams
+// to ourselves over a loopback VirtualWire on eth0, timing SendTo()
+// against SendMany(), and once a burst has arrived, times draining
+// it with RecvFrom(), RecvMany() and Borrow().  Reports datagrams per
+// second for each, at 64 and 1400 byte payloads.  Like tcpbench it
+// needs a board with devices/vether.h, as projects/host has.  The
+// exit status is nonzero if a datagram goes missing or arrives
+// damaged.
+
+#include "enetkit.h"
+#include "network.h"
+#include "ip.h"
+#include "udp.h"
+#include "thread.h"
+#include "netstats.h"
+#include "devices/vether.h"
+
+
+#define ADDR(a,b,c,d) Htonl(((a) << 24) | ((b) << 16) | ((c) << 8) | (d))
+
+enum {
+	BURST = 256,				// Datagrams per burst
+	BATCH = 32,					// Datagrams per batch call
+	ROUNDS = 100,				// Bursts per measurement
+	PORT = 6000
+};
+
+static const uint sizes[] = { 64, 1400 };
+
+// How each side moves a burst
+enum { SEND_ONE, SEND_MANY };
+enum { RECV_ONE, RECV_MANY, RECV_BORROW, NUM_RECV };
+
+static const char* const send_name[] = { "SendTo", "SendMany" };
+static const char* const recv_name[] = { "RecvFrom", "RecvMany", "Borrow" };
+
+VirtualWire _wire(_eth0, _eth0);
+
+static const in_addr_t _addr = ADDR(10,0,0,2);
+
+static uint8_t _payload[1400];
+static uint8_t _rxdata[BATCH][1400 + 1];
+static uint _errors;
+
+
+// Send a burst of len byte datagrams to the receiver.  Returns usec
+// taken.
+static uint32_t SendBurst(UdpCoreSocket* s, uint len, uint how)
+{
+	const NetAddr dest(_addr, PORT);
+	const Time start = Time::Now();
+
+	if (how == SEND_ONE) {
+		for (uint i = 0; i < BURST; ++i)
+			_errors += !s->SendTo(_payload, len, dest);
+	} else {
+		UdpCoreSocket::Datagram d[BATCH];
+		for (uint i = 0; i < BATCH; ++i) {
+			d[i].data = _payload;
+			d[i].len = len;
+			d[i].addr = dest;
+		}
+		for (uint i = 0; i < BURST; i += BATCH)
+			_errors += BATCH - s->SendMany(d, BATCH);
+	}
+
+	return (Time::Now() - start).GetUsec();
+}
+
+
+// Wait for the net thread to queue a burst
+static bool Arrived(uint32_t before)
+{
+	for (uint i = 0; i < 1000; ++i) {
+		if (_netstats.udp.in_datagrams - before >= BURST)
+			return true;
+		Thread::Delay(1000);
+	}
+	return false;
+}
+
+
+// Check a received payload by its ends, to keep the check out of the
+// measurement
+static void Check(const void* data, uint len, uint want)
+{
+	const uint8_t* p = (const uint8_t*)data;
+	if (len != want || p[0] != _payload[0] || p[len - 1] != _payload[len - 1])
+		++_errors;
+}
+
+
+// Drain a queued burst.  Returns usec taken.
+static uint32_t RecvBurst(UdpCoreSocket* s, uint len, uint how)
+{
+	const Time start = Time::Now();
+	uint got = 0;
+
+	while (got < BURST) {
+		if (how == RECV_ONE) {
+			uint n = sizeof _rxdata[0];
+			NetAddr from;
+			if (!s->RecvFrom(_rxdata[0], n, from))
+				break;
+			Check(_rxdata[0], n, len);
+			++got;
+		} else if (how == RECV_MANY) {
+			UdpCoreSocket::Datagram d[BATCH];
+			for (uint i = 0; i < BATCH; ++i) {
+				d[i].data = _rxdata[i];
+				d[i].len = sizeof _rxdata[i];
+			}
+			const uint n = s->RecvMany(d, BATCH);
+			if (!n)
+				break;
+			for (uint i = 0; i < n; ++i)
+				Check(d[i].data, d[i].len, len);
+			got += n;
+		} else {
+			IOBuffer* bufs[BATCH];
+			const uint n = s->Borrow(bufs, NULL, BATCH);
+			if (!n)
+				break;
+			for (uint i = 0; i < n; ++i)
+				Check(*bufs[i] + 0, bufs[i]->Size(), len);
+			UdpCoreSocket::Return(bufs, n);
+			got += n;
+		}
+	}
+
+	const uint32_t usec = (Time::Now() - start).GetUsec();
+	_errors += BURST - got;
+	return usec;
+}
+
+
+static uint Rate(uint64_t usec)
+{
+	return usec ? uint(uint64_t(ROUNDS) * BURST * 1000000 / usec) : 0;
+}
+
+
+int	main ()
+{
+	_wire.Start();
+
+	Thread::Create("net", NetThread, NULL, NET_THREAD_STACK);
+	Thread::Delay(100000);
+
+	_ip0.AddInterface(_eth0, _addr, ADDR(255,255,255,0));
+
+	for (uint i = 0; i < sizeof _payload; ++i)
+		_payload[i] = i * 13;
+
+	UdpCoreSocket* tx = _udp0.Create();
+	UdpCoreSocket* rx = _udp0.Create();
+	assert(tx && rx);
+	if (!rx->Bind(NetAddr(INADDR_ANY, PORT))) {
+		console("batchbench: can't bind %u", PORT);
+		return 1;
+	}
+
+	for (uint i = 0; i < sizeof sizes / sizeof sizes[0]; ++i) {
+		const uint len = sizes[i];
+
+		// Each receive API drains bursts sent both ways
+		uint64_t send_usec[2] = { 0, 0 };
+		uint64_t recv_usec[NUM_RECV] = { 0, 0, 0 };
+
+		for (uint round = 0; round < ROUNDS * 2; ++round) {
+			const uint send_how = round % 2;
+			for (uint how = 0; how < NUM_RECV; ++how) {
+				const uint32_t before = _netstats.udp.in_datagrams;
+				send_usec[send_how] += SendBurst(tx, len, send_how);
+
+				if (!Arrived(before)) {
+					console("batchbench: %u bytes: burst lost", len);
+					return 1;
+				}
+				recv_usec[how] += RecvBurst(rx, len, how);
+			}
+		}
+
+		// Each send measurement covered NUM_RECV times ROUNDS bursts
+		for (uint how = 0; how < 2; ++how)
+			console("batchbench: %u bytes: %s %u datagrams/sec",
+					len, send_name[how], Rate(send_usec[how] / NUM_RECV));
+		for (uint how = 0; how < NUM_RECV; ++how)
+			console("batchbench: %u bytes: %s %u datagrams/sec",
+					len, recv_name[how], Rate(recv_usec[how] / 2));
+	}
+
+	console("batchbench: %u errors", _errors);
+
+	return _errors ? 1 : 0;
+}
@@ -0,0 +1,184 @@
+// Copyright (c) 2018-2021 Jan Brittenson
+// See LICENSE for details.
+
+// UDP transmit buffer benchmark, used for dev.  Sends the same
+// payload to several destinations, once by SendTo() from memory,
+// which copies it into a new buffer per datagram, and once as a
+// shared payload buffer passed to SendTo(IOBuffer*), which is filled
+// once and gets its headers in a buffer of its own.  The copying path
+// is what every send did before payloads could be shared.  Reports
+// the time per datagram and the payload bytes copied per datagram.
+//
+// The wire drops everything we send once ARP is resolved, so only the
+// stack's transmit path is measured.  Before that, a shared payload
+// is sent to the WireHost echo port twice and both echoes are
+// checked.  Needs a board with devices/vether.h, as projects/host
+// has.  The exit status is nonzero if a send fails or an echo is
+// wrong.
+
+#include "enetkit.h"
+#include "network.h"
+#include "ip.h"
+#include "udp.h"
+#include "thread.h"
+#include "devices/vether.h"
+#include "devices/wirehost.h"
+
+
+static const uint8_t host_mac[6] = { 0x02, 0, 0, 0, 0, 1 };
+
+#define ADDR(a,b,c,d) Htonl(((a) << 24) | ((b) << 16) | ((c) << 8) | (d))
+
+enum {
+	DATAGRAMS = 10000,			// Datagrams per run
+	HEADROOM = IP_HEADROOM + sizeof (Udph),
+	PORT = 9					// First destination port; WireHost drops them
+};
+
+static const uint sizes[] = { 64, 512, 1472 };
+static const uint fanouts[] = { 1, 4, 16 };
+
+Ethernet _wire1;
+VirtualWire _wire(_eth0, _wire1);
+WireHost _host(_wire1, ADDR(10,0,0,1), ADDR(255,255,255,0), ADDR(10,0,0,100), "bench");
+
+static const in_addr_t _peer = ADDR(10,0,0,1);
+
+static uint8_t _payload[1472];
+static uint _errors;
+
+
+// Shared payload buffer holding len bytes of _payload
+static IOBuffer* MakePayload(uint len)
+{
+	IOBuffer* buf = BufferPool::AllocTx(HEADROOM + len);
+	if (!buf)
+		return NULL;
+
+	buf->SetHeadroom(HEADROOM);
+	buf->SetTail(HEADROOM + len);
+	memcpy(*buf + 0, _payload, len);
+	return buf;
+}
+
+
+// Send DATAGRAMS datagrams of len bytes, fanout destinations per
+// payload.  Returns usec taken and sets copied to the payload bytes
+// copied.
+static uint32_t Run(UdpCoreSocket* s, uint len, uint fanout, bool shared, uint64_t& copied)
+{
+	copied = 0;
+	const Time start = Time::Now();
+
+	for (uint sent = 0; sent < DATAGRAMS; sent += fanout) {
+		if (!shared) {
+			for (uint i = 0; i < fanout; ++i) {
+				_errors += !s->SendTo(_payload, len, NetAddr(_peer, PORT + i));
+				copied += len;
+			}
+			continue;
+		}
+
+		IOBuffer* payload = MakePayload(len);
+		if (!payload) {
+			++_errors;
+			continue;
+		}
+		copied += len;
+
+		for (uint i = 1; i < fanout; ++i)
+			payload->Retain();
+
+		for (uint i = 0; i < fanout; ++i)
+			_errors += !s->SendTo(payload, NetAddr(_peer, PORT + i));
+	}
+
+	return (Time::Now() - start).GetUsec();
+}
+
+
+// Send one shared payload to the echo port twice, and check both
+// echoes
+static bool Echo(UdpCoreSocket* s)
+{
+	enum { LEN = 1000 };
+
+	IOBuffer* payload = MakePayload(LEN);
+	if (!payload)
+		return false;
+
+	payload->Retain();
+	const NetAddr echo(_peer, WireHost::ECHO_PORT);
+	if (!s->SendTo(payload, echo) || !s->SendTo(payload, echo))
+		return false;
+
+	uint8_t buf[LEN + 1];
+	for (uint got = 0; got < 2; ) {
+		uint n = sizeof buf;
+		NetAddr from;
+		if (s->RecvFrom(buf, n, from)) {
+			if (n != LEN || memcmp(buf, _payload, LEN))
+				return false;
+			++got;
+			continue;
+		}
+		if (!s->Wait(Time::FromSec(1)))
+			return false;
+	}
+
+	return true;
+}
+
+
+int	main ()
+{
+	_wire.Start();
+	_host.Start(host_mac);
+
+	Thread::Create("net", NetThread, NULL, NET_THREAD_STACK);
+
+	// Static address; then let the net thread set up the buffer pool
+	_ip0.AddInterface(_eth0, ADDR(10,0,0,2), ADDR(255,255,255,0));
+	Thread::Delay(100000);
+
+	for (uint i = 0; i < sizeof _payload; ++i)
+		_payload[i] = i * 7;
+
+	UdpCoreSocket* s = _udp0.Create();
+	assert(s);
+	s->SetEventMask(CoreSocket::EVENT_READABLE);
+	s->Bind(NetAddr(INADDR_ANY, 5000));
+
+	// This also resolves ARP for the peer
+	if (!Echo(s)) {
+		console("bufbench: shared payload echo failed");
+		return 1;
+	}
+
+	// From now on the wire drops what we send
+	static const VirtualWire::Params sink = { 0, 0, 1000, 0, 0 };
+	_wire.SetParams(VirtualWire::A_TO_B, sink);
+
+	for (uint i = 0; i < sizeof sizes / sizeof sizes[0]; ++i) {
+		for (uint j = 0; j < sizeof fanouts / sizeof fanouts[0]; ++j) {
+			const uint len = sizes[i];
+			const uint fanout = fanouts[j];
+
+			uint64_t copied, shared_copied;
+			const uint32_t usec = Run(s, len, fanout, false, copied);
+			const uint32_t shared_usec = Run(s, len, fanout, true, shared_copied);
+
+			console("bufbench: %u bytes to %u: copy %u nsec, %u bytes copied; "
+					"shared %u nsec, %u bytes copied",
+					len, fanout,
+					uint(uint64_t(usec) * 1000 / DATAGRAMS), uint(copied / DATAGRAMS),
+					uint(uint64_t(shared_usec) * 1000 / DATAGRAMS),
+					uint(shared_copied / DATAGRAMS));
+		}
+	}
+
+	const VirtualWire::Stats tx = _wire.GetStats(VirtualWire::A_TO_B);
+	console("bufbench: %u frames sent, %u errors", tx.frames, _errors);
+
+	return _errors ? 1 : 0;
+}
@@ -0,0 +1,185 @@
+// Copyright (c) 2018-2021 Jan Brittenson
+// See LICENSE for details.
+
+// Internet checksum test and benchmark, used for dev.  Checks
+// ipcksum() and copy_and_csum() against a reference that sums a
+// halfword at a time, like the old C version, for every length up to
+// MAX_LEN at every alignment, and ipcksum_update() against a full
+// header recompute for every value of a halfword.  Then times them.
+// Results go to the console, and the exit status is nonzero on any
+// mismatch.
+
+#include "enetkit.h"
+#include "ip.h"
+#include "thread.h"
+
+
+enum {
+	MAX_LEN = 1600,				// Longest block checked
+	BENCH_BYTES = 16*1024*1024	// Bytes summed per timed run
+};
+
+static const uint sizes[] = { 20, 64, 512, 1472 };
+
+static uint8_t _src[MAX_LEN + 8];
+static uint8_t _dst[MAX_LEN + 16];
+static uint _errors;
+
+
+// Reference: RFC 1071, one network order halfword at a time
+static uint16_t RefCksum(const uint8_t* p, uint len, uint32_t sum)
+{
+	for (; len >= 2; len -= 2, p += 2)
+		sum += (p[0] << 8) | p[1];
+
+	if (len)
+		sum += p[0] << 8;
+
+	while (sum > 0xffff)
+		sum = (sum & 0xffff) + (sum >> 16);
+
+	return sum;
+}
+
+
+static void Fill(uint pattern)
+{
+	for (uint i = 0; i < sizeof _src; ++i)
+		_src[i] = pattern == 0 ? 0 : pattern == 1 ? 0xff : Util::Random<uint8_t>();
+}
+
+
+// Every length at every alignment, for a few running sums
+static void CheckBlocks()
+{
+	static const uint32_t sums[] = { 0, 0xffff, 0x12345 };
+
+	for (uint pattern = 0; pattern < 3; ++pattern) {
+		Fill(pattern);
+
+		for (uint off = 0; off < 4; ++off) {
+			for (uint len = 0; len <= MAX_LEN; ++len) {
+				for (uint i = 0; i < sizeof sums / sizeof sums[0]; ++i) {
+					const uint8_t* p = _src + off;
+					const uint16_t ref = RefCksum(p, len, sums[i]);
+
+					if (ipcksum((const uint16_t*)p, len, sums[i]) != ref) {
+						if (!_errors++)
+							console("cksumbench: ipcksum differs: offset %u, len %u, sum %x",
+									off, len, sums[i]);
+					}
+
+					// Odd destination alignment, and guard bytes around it
+					memset(_dst, 0x5a, sizeof _dst);
+					uint8_t* d = _dst + 8 + (off ^ 1);
+					const uint16_t csum = copy_and_csum(d, p, len, sums[i]);
+
+					bool ok = csum == ref && !memcmp(d, p, len);
+					for (uint8_t* g = _dst; g < _dst + sizeof _dst; ++g)
+						if (g < d || g >= d + len)
+							ok &= *g == 0x5a;
+
+					if (!ok && !_errors++)
+						console("cksumbench: copy_and_csum differs: offset %u, len %u, sum %x",
+								off, len, sums[i]);
+				}
+			}
+		}
+	}
+}
+
+
+// Header checksum field, recomputed
+static uint16_t HeaderCsum(const uint8_t* h, uint len)
+{
+	return Htons(~RefCksum(h, len, 0));
+}
+
+
+// Every value of the halfword at pos, then of a word's low half
+static void CheckUpdates()
+{
+	uint8_t h[20];
+	for (uint i = 0; i < sizeof h; ++i)
+		h[i] = Util::Random<uint8_t>();
+
+	for (uint pos = 0; pos < sizeof h; pos += 6) {
+		for (uint v = 0; v < 65536; ++v) {
+			uint16_t oldval, newval = Htons(v);
+			memcpy(&oldval, h + pos, 2);
+
+			const uint16_t csum = HeaderCsum(h, sizeof h);
+			memcpy(h + pos, &newval, 2);
+
+			if (ipcksum_update(csum, oldval, newval) != HeaderCsum(h, sizeof h)) {
+				if (!_errors++)
+					console("cksumbench: ipcksum_update differs: pos %u, %x -> %x",
+							pos, Ntohs(oldval), v);
+			}
+		}
+	}
+
+	for (uint v = 0; v < 65536; ++v) {
+		uint32_t oldval, newval = Util::Random<uint32_t>();
+		memcpy(&oldval, h + 12, 4);
+
+		const uint16_t csum = HeaderCsum(h, sizeof h);
+		memcpy(h + 12, &newval, 4);
+
+		if (ipcksum_update32(csum, oldval, newval) != HeaderCsum(h, sizeof h)) {
+			if (!_errors++)
+				console("cksumbench: ipcksum_update32 differs: %x -> %x",
+						Ntohl(oldval), Ntohl(newval));
+		}
+	}
+}
+
+
+// Nsec per len byte block for each way of summing it
+static void Bench(uint len)
+{
+	const uint n = BENCH_BYTES / len;
+	uint32_t sink = 0;
+
+	Time start = Time::Now();
+	for (uint i = 0; i < n; ++i)
+		sink += RefCksum(_src, len, 0);
+	const uint64_t ref = (Time::Now() - start).GetUsec();
+
+	start = Time::Now();
+	for (uint i = 0; i < n; ++i)
+		sink += ipcksum((const uint16_t*)_src, len, 0);
+	const uint64_t fast = (Time::Now() - start).GetUsec();
+
+	start = Time::Now();
+	for (uint i = 0; i < n; ++i) {
+		memcpy(_dst, _src, len);
+		sink += ipcksum((const uint16_t*)_dst, len, 0);
+	}
+	const uint64_t copy_then = (Time::Now() - start).GetUsec();
+
+	start = Time::Now();
+	for (uint i = 0; i < n; ++i)
+		sink += copy_and_csum(_dst, _src, len, 0);
+	const uint64_t fused = (Time::Now() - start).GetUsec();
+
+	console("cksumbench: %u bytes: reference %u nsec, ipcksum %u nsec, "
+			"copy then sum %u nsec, copy_and_csum %u nsec (%u)",
+			len, uint(ref * 1000 / n), uint(fast * 1000 / n),
+			uint(copy_then * 1000 / n), uint(fused * 1000 / n), sink & 1);
+}
+
+
+int	main ()
+{
+	CheckBlocks();
+	CheckUpdates();
+
+	console("cksumbench: %u mismatches", _errors);
+
+	Fill(2);
+	for (uint i = 0; i < sizeof sizes / sizeof sizes[0]; ++i)
+		Bench(sizes[i]);
+
+	return _errors ? 1 : 0;
+}
@@ -0,0 +1,343 @@
+// Copyright (c) 2018-2021 Jan Brittenson
+// See LICENSE for details.
+
+// Checksum offload test, used for dev.  Runs eth0 with the offload
+// modeled by devices/vether.h and without it, against a peer at the
+// far end of a VirtualWire that answers ARP and checks every sum of
+// every datagram it sees.  The stack sends datagrams to the peer, one
+// of them large enough to go out in fragments, which the NIC can't
+// sum; the peer sends the stack datagrams with good and bad sums,
+// echo requests, and a SYN to a closed port.  Checks that what went
+// over the wire was summed right either way, that bad sums are still
+// caught, and that Ip::GetCsumStats() counts each datagram where it
+// was summed or verified.  Like tcpbench it needs a board with
+// devices/vether.h, as projects/host has.  Results go to the console,
+// and the exit status is nonzero on any error.
+
+#include "enetkit.h"
+#include "network.h"
+#include "ip.h"
+#include "icmp.h"
+#include "udp.h"
+#include "tcp.h"
+#include "thread.h"
+#include "devices/vether.h"
+
+
+static const uint8_t peer_mac[6] = { 0x02, 0, 0, 0, 0, 1 };
+
+#define ADDR(a,b,c,d) Htonl(((a) << 24) | ((b) << 16) | ((c) << 8) | (d))
+
+enum {
+	N = 8,						// Of each kind, per round
+	PORT = 6000,
+	CLOSED_PORT = 9,
+	SMALL = 64,					// Datagram payloads
+	LARGE = 3000,				// Sent in fragments
+	FRAME_LEN = sizeof (Ethernet::Frame),
+	OFFLOAD_ALL = OFFLOAD_TX_IPCSUM | OFFLOAD_TX_CSUM | OFFLOAD_RX_CSUM
+};
+
+Ethernet _wire1;
+VirtualWire _wire(_eth0, _wire1);
+
+static const in_addr_t _addr = ADDR(10,0,0,2);
+static const in_addr_t _peer = ADDR(10,0,0,1);
+
+static EventObject _peer_event;
+static uint _errors;
+
+// Seen by the peer
+static struct {
+	uint udp;					// Datagrams, whole
+	uint frags;					// Fragments
+	uint echo;					// Echo replies
+	uint rst;					// Resets
+} _seen;
+
+
+static void Error(const char* what)
+{
+	console("csumtest: %s", what);
+	++_errors;
+}
+
+
+// Answer an ARP request for the peer
+static void ArpReply(IOBuffer* buf)
+{
+	Ethernet::Frame* f = (Ethernet::Frame*)(*buf + 0);
+	Arph* arp = (Arph*)(*buf + FRAME_LEN);
+
+	in_addr_t dip, sip;
+	memcpy(&dip, arp->dip, 4);
+	memcpy(&sip, arp->sip, 4);
+
+	if (buf->Size() < FRAME_LEN + sizeof (Arph) || arp->fixed.op != Htons(ARPOP_REQ) ||
+		dip != _peer) {
+		BufferPool::FreeBuffer(buf);
+		return;
+	}
+
+	arp->fixed.op = Htons(ARPOP_REP);
+	memcpy(arp->dea, arp->sea, 6);
+	memcpy(arp->dip, &sip, 4);
+	memcpy(arp->sea, peer_mac, 6);
+	memcpy(arp->sip, &dip, 4);
+
+	memcpy(f->dst, arp->dea, 6);
+	memcpy(f->src, peer_mac, 6);
+	buf->SetSize(FRAME_LEN + sizeof (Arph));
+
+	_wire1.Send(buf);
+}
+
+
+// Check the sums of a datagram from the stack, as it came off the wire
+static void Check(IOBuffer* buf)
+{
+	Iph& iph = *(Iph*)(*buf + FRAME_LEN);
+	if (buf->Size() < FRAME_LEN + sizeof iph || Ntohs(iph.len) > buf->Size() - FRAME_LEN ||
+		!iph.ValidateCsum()) {
+		Error("bad IP header on the wire");
+		return;
+	}
+
+	// Summed in software before being cut up; checked by reassembly
+	if (iph.IsFragment()) {
+		++_seen.frags;
+		return;
+	}
+
+	const uint len = Ntohs(iph.len) - iph.GetHLen();
+	const uint8_t* th = iph.GetTransport();
+
+	switch (iph.proto) {
+	case IPPROTO_UDP: {
+		// DHCP leaves out its sum, but ours are all summed
+		const Udph& udph = *(const Udph*)th;
+		if (!udph.ValidateCsum(iph))
+			Error("bad UDP sum on the wire");
+		if (udph.dport == Htons(PORT)) {
+			if (!udph.sum)
+				Error("no UDP sum on the wire");
+			++_seen.udp;
+		}
+		break;
+	}
+	case IPPROTO_ICMP:
+		if (ipcksum((const uint16_t*)th, len) != 0xffff)
+			Error("bad ICMP sum on the wire");
+		_seen.echo += ((const Icmph*)th)->type == Icmph::ICMP_ECHO_REPLY;
+		break;
+	case IPPROTO_TCP:
+		if (!((const Tcph*)th)->ValidateCsum(iph, len))
+			Error("bad TCP sum on the wire");
+		_seen.rst += (((const Tcph*)th)->flags & Tcph::FLAG_RST) != 0;
+		break;
+	}
+}
+
+
+// Take what eth0 sent, until deadline or until there's nothing left
+static void Poll(const Time& deadline)
+{
+	while (Time::Now() < deadline) {
+		IOBuffer* buf;
+		uint16_t et;
+		while ((buf = _wire1.Receive(et))) {
+			if (et == ETHERTYPE_ARP) {
+				ArpReply(buf);
+				continue;
+			}
+			if (et == ETHERTYPE_IP)
+				Check(buf);
+			BufferPool::FreeBuffer(buf);
+		}
+		if (_wire1.EnableRxInterrupt())
+			_peer_event.Wait(deadline - Time::Now());
+	}
+}
+
+
+// Send the stack a datagram of proto: a UDP datagram to PORT, with a
+// good or a bad sum, an echo request, or a SYN to CLOSED_PORT
+static void Send(uint proto, uint n, bool good = true)
+{
+	const uint tlen = proto == IPPROTO_TCP ? sizeof (Tcph) : max(sizeof (Udph), sizeof (Icmph)) + SMALL;
+	const uint len = FRAME_LEN + sizeof (Iph) + tlen;
+
+	IOBuffer* buf = BufferPool::AllocTx(2 + len);
+	if (!buf) {
+		Error("no buffers");
+		return;
+	}
+
+	buf->SetHeadroom(2);
+	buf->SetSize(len);
+	memset(*buf + 0, 0, len);
+
+	Ethernet::Frame* f = (Ethernet::Frame*)(*buf + 0);
+	memcpy(f->dst, _eth0.GetMacAddr(), 6);
+	memcpy(f->src, peer_mac, 6);
+	f->et = Htons(uint16_t(ETHERTYPE_IP));
+
+	Iph& iph = *(Iph*)(*buf + FRAME_LEN);
+	iph.SetHLen(sizeof iph);
+	iph.len = Htons(sizeof iph + tlen);
+	iph.id = Htons(n + 1);
+	iph.ttl = 64;
+	iph.proto = proto;
+	iph.source = _peer;
+	iph.dest = _addr;
+	iph.SetCsum();
+
+	uint8_t* th = iph.GetTransport();
+	switch (proto) {
+	case IPPROTO_UDP: {
+		Udph& udph = *(Udph*)th;
+		udph.sport = Htons(PORT);
+		udph.dport = Htons(PORT);
+		udph.len = Htons(tlen);
+		udph.SetCsum(iph);
+		if (!good)
+			udph.sum ^= Htons(0x0101);
+		break;
+	}
+	case IPPROTO_ICMP: {
+		Icmph& icmph = *(Icmph*)th;
+		icmph.type = Icmph::ICMP_ECHO_REQ;
+		icmph.rest[0] = Htons(1);
+		icmph.rest[1] = Htons(n);
+		icmph.SetCsum(tlen);
+		break;
+	}
+	case IPPROTO_TCP: {
+		Tcph& tcph = *(Tcph*)th;
+		tcph.sport = Htons(PORT);
+		tcph.dport = Htons(CLOSED_PORT);
+		tcph.seq = Htonl(n * 1000);
+		tcph.SetHLen(sizeof tcph);
+		tcph.flags = Tcph::FLAG_SYN;
+		tcph.win = Htons(1024);
+		tcph.SetCsum(iph, tlen);
+		break;
+	}
+	}
+
+	if (!_wire1.Send(buf))
+		Error("peer send failed");
+}
+
+
+static void Expect(const char* what, uint32_t got, uint32_t n)
+{
+	if (got != n) {
+		console("csumtest: %s %u, not %u", what, got, n);
+		++_errors;
+	}
+}
+
+
+// One round each way, with offload or without
+static void Run(bool offload)
+{
+	_eth0.SetOffload(offload ? OFFLOAD_ALL : 0);
+
+	static uint8_t data[LARGE];
+	const Ip::CsumStats before = _ip0.GetCsumStats();
+	memset(&_seen, 0, sizeof _seen);
+
+	UdpCoreSocket* s = _udp0.Create();
+	assert(s);
+	if (!s->Bind(NetAddr(INADDR_ANY, PORT))) {
+		Error("can't bind");
+		return;
+	}
+
+	// Out: N small datagrams and a large one
+	for (uint i = 0; i < N; ++i)
+		if (!s->SendTo(data, SMALL, NetAddr(_peer, PORT)))
+			Error("send failed");
+	if (!s->SendTo(data, LARGE, NetAddr(_peer, PORT)))
+		Error("send failed");
+
+	Poll(Time::Now() + Time::FromMsec(100));
+
+	// In: good and bad datagrams, echo requests and a SYN
+	for (uint i = 0; i < N; ++i) {
+		Send(IPPROTO_UDP, i);
+		Send(IPPROTO_UDP, i, false);
+		Send(IPPROTO_ICMP, i);
+	}
+	Send(IPPROTO_TCP, 0);
+
+	Poll(Time::Now() + Time::FromMsec(100));
+
+	uint got = 0;
+	uint8_t buf[SMALL];
+	uint len = sizeof buf;
+	NetAddr from;
+	while (s->RecvFrom(buf, len, from)) {
+		++got;
+		len = sizeof buf;
+	}
+	s->Close();
+
+	const Ip::CsumStats& after = _ip0.GetCsumStats();
+	const uint32_t tx_sw = after.tx_sw - before.tx_sw;
+	const uint32_t tx_offload = after.tx_offload - before.tx_offload;
+	const uint32_t rx_sw = after.rx_sw - before.rx_sw;
+	const uint32_t rx_offload = after.rx_offload - before.rx_offload;
+
+	console("csumtest: offload %s: tx %u sw %u offload, rx %u sw %u offload; "
+			"seen %u datagrams, %u fragments, %u echo replies, %u resets; %u received",
+			offload ? "on" : "off", tx_sw, tx_offload, rx_sw, rx_offload,
+			_seen.udp, _seen.frags, _seen.echo, _seen.rst, got);
+
+	Expect("datagrams seen", _seen.udp, N);
+	Expect("fragments seen", _seen.frags, (LARGE + sizeof (Udph) + 1479) / 1480);
+	Expect("echo replies seen", _seen.echo, N);
+	Expect("resets seen", _seen.rst, 1);
+	Expect("datagrams received", got, N);
+
+	// What's sent as a whole is left to the NIC, except the large
+	// datagram; the bad datagrams are the ones the NIC leaves to us
+	const uint32_t out = 2 * N + 1;
+	const uint32_t in = 3 * N + 1;
+	Expect("tx_sw", tx_sw, offload ? 1 : out + 1);
+	Expect("tx_offload", tx_offload, offload ? out : 0);
+	Expect("rx_sw", rx_sw, offload ? N : in);
+	Expect("rx_offload", rx_offload, offload ? in - N : 0);
+}
+
+
+int	main ()
+{
+	_wire1.Initialize(peer_mac);
+	_wire1.SetEventObject(&_peer_event);
+	_wire.Start();
+
+	Thread::Create("net", NetThread, NULL, NET_THREAD_STACK);
+	Thread::Delay(100000);
+
+	_ip0.AddInterface(_eth0, _addr, ADDR(255,255,255,0));
+
+	// Every echo request gets its reply
+	_ip0.SetRateLimit(Ip::LIMIT_ICMP, 0, ICMP_BURST);
+	_ip0.SetRateLimit(Ip::LIMIT_ICMP_HOST, 0, ICMP_HOST_BURST);
+
+	// Resolve the peer first, or what's past ARP's pending queue is lost
+	UdpCoreSocket* s = _udp0.Create();
+	assert(s);
+	s->SendTo("", 1, NetAddr(_peer, PORT + 1));
+	s->Close();
+	Poll(Time::Now() + Time::FromMsec(100));
+
+	Run(true);
+	Run(false);
+
+	console("csumtest: %u errors", _errors);
+
+	return _errors ? 1 : 0;
+}
@@ -0,0 +1,126 @@
+// Copyright (c) 2018-2021 Jan Brittenson
+// See LICENSE for details.
+
+// Socket demux benchmark, used for dev.  Times the lookups a
+// transport does per datagram against 1k bound sockets, plus a few
+// connected ones, with the old HashMap and with TupleMap, best of
+// RUNS each.  Results go to the console, and the exit status is
+// nonzero if TupleMap is the slower.
+
+#include "enetkit.h"
+#include "ipconn.h"
+#include "hashmap.h"
+#include "tuplemap.h"
+#include "thread.h"
+
+
+enum {
+	BOUND = 1000,				// Bound, non-connected sockets
+	CONNECTED = 16,				// Connected sockets
+	LOOKUPS = 100000,			// Datagrams demuxed per run
+	RUNS = 5
+};
+
+#define ADDR(a,b,c,d) Htonl(((a) << 24) | ((b) << 16) | ((c) << 8) | (d))
+
+static const in_addr_t peer = ADDR(10,0,0,1);
+
+static Tuple Bound(uint i)
+{
+	Tuple t;
+	t.sport = Htons(1024 + i);
+	return t;
+}
+
+static Tuple Connected(uint i)
+{
+	Tuple t;
+	t.daddr = peer;
+	t.sport = Htons(1024 + i);
+	t.dport = Htons(5000);
+	return t;
+}
+
+// Arriving datagram for socket i: from the peer, to port 1024+i
+static Tuple Arriving(uint i)
+{
+	Tuple t;
+	t.daddr = peer;
+	t.sport = Htons(1024 + i);
+	t.dport = Htons(i < CONNECTED ? 5000 : 6000);
+	return t;
+}
+
+
+// Returns usec taken
+static uint64_t Report(const char* what, const Time& start, uint found)
+{
+	const uint64_t usec = (Time::Now() - start).GetUsec();
+	console("demuxbench: %s: %u lookups in %u usec, %u nsec each, %u found",
+			what, LOOKUPS, uint(usec), uint(usec * 1000 / LOOKUPS), found);
+	return usec;
+}
+
+
+static uint64_t BenchHashMap()
+{
+	HashMap<Tuple, void*> map;
+	for (uint i = 0; i < BOUND; ++i)
+		map[Bound(i)] = &map;
+	for (uint i = 0; i < CONNECTED; ++i)
+		map[Connected(i)] = &map;
+
+	uint found = 0;
+	const Time start = Time::Now();
+	for (uint n = 0; n < LOOKUPS; ++n) {
+		Tuple t = Arriving(n % BOUND);
+		void* s;
+		if (!map.Find(t, s)) {
+			t.daddr = 0;
+			t.dport = 0;
+			if (!map.Find(t, s))
+				continue;
+		}
+		++found;
+	}
+	return Report("HashMap", start, found);
+}
+
+
+static uint64_t BenchTupleMap()
+{
+	TupleMap<void*> map;
+	for (uint i = 0; i < BOUND; ++i)
+		map.Insert(Bound(i), &map);
+	for (uint i = 0; i < CONNECTED; ++i)
+		map.Insert(Connected(i), &map);
+
+	uint found = 0;
+	const Time start = Time::Now();
+	for (uint n = 0; n < LOOKUPS; ++n) {
+		void* s;
+		if (map.Demux(Arriving(n % BOUND), s))
+			++found;
+	}
+	return Report("TupleMap", start, found);
+}
+
+
+int	main ()
+{
+	uint64_t hashmap = ~0ULL;
+	uint64_t tuplemap = ~0ULL;
+	for (uint i = 0; i < RUNS; ++i) {
+		hashmap = min(hashmap, BenchHashMap());
+		tuplemap = min(tuplemap, BenchTupleMap());
+	}
+
+	console("demuxbench: best HashMap %u usec, TupleMap %u usec", uint(hashmap), uint(tuplemap));
+
+	if (tuplemap > hashmap) {
+		console("demuxbench: TupleMap slower than HashMap");
+		return 1;
+	}
+
+	return 0;
+}
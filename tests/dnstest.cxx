@@ -0,0 +1,285 @@
+// Copyright (c) 2018-2021 Jan Brittenson
+// See LICENSE for details.
+
+// DNS resolver test and benchmark, used for dev.  Resolves names
+// against the WireHost at the far end of a VirtualWire, checking that
+// answers are cached, all of a name's addresses are returned and
+// handed out in turn, failures are cached, answers expire with their
+// TTL, the least recently used name is evicted first, threads asking
+// for the same name share one query, and threads asking for different
+// names have theirs outstanding at once.  Then times cached lookups
+// against round trips to the server.  Needs a board with
+// devices/vether.h, as projects/host has.  Results go to the console,
+// and the exit status is nonzero on any error.
+
+#include "enetkit.h"
+#include "network.h"
+#include "ip.h"
+#include "udp.h"
+#include "dns.h"
+#include "thread.h"
+#include "devices/vether.h"
+#include "devices/wirehost.h"
+
+
+static const uint8_t host_mac[6] = { 0x02, 0, 0, 0, 0, 1 };
+
+#define ADDR(a,b,c,d) Htonl(((a) << 24) | ((b) << 16) | ((c) << 8) | (d))
+
+enum {
+	LATENCY = 20,				// Msec each way while threads resolve
+	THREADS = 8,				// Threads resolving the same name
+	HITS = 100000,				// Cached lookups timed
+	MISSES = 100				// Round trips timed
+};
+
+static const char* const names[] = { "alpha", "beta", "gamma", "delta" };
+static const char* const fqdns[] = { "alpha.bench", "beta.bench", "gamma.bench", "delta.bench" };
+static const uint NAMES = sizeof names / sizeof names[0];
+
+Ethernet _wire1;
+VirtualWire _wire(_eth0, _wire1);
+WireHost _host(_wire1, ADDR(10,0,0,1), ADDR(255,255,255,0), ADDR(10,0,0,100), "bench");
+
+static uint _errors;
+
+// Per thread name and result
+static struct {
+	const char* name;
+	in_addr_t addr;
+	bool done;
+} _job[THREADS];
+
+
+static in_addr_t NameAddr(uint i)
+{
+	return ADDR(10,0,1,1 + i);
+}
+
+
+static in_addr_t PoolAddr(uint i)
+{
+	return ADDR(10,0,2,1 + i);
+}
+
+
+static void Error(const char* what)
+{
+	console("dnstest: %s", what);
+	++_errors;
+}
+
+
+// Resolve name, expecting addr, and count the queries it took
+static void Expect(const char* name, in_addr_t addr, uint queries)
+{
+	const uint before = _host.GetStats().dns;
+
+	in_addr_t got;
+	if (!_dns0.GetAddrByName(STR(name), got) || got != addr ||
+		_host.GetStats().dns - before != queries) {
+		console("dnstest: %s: wrong answer or %u queries, not %u", name,
+				_host.GetStats().dns - before, queries);
+		++_errors;
+	}
+}
+
+
+// Resolve a name that doesn't exist, counting queries
+static void ExpectNone(const char* name, uint queries)
+{
+	const uint before = _host.GetStats().dns;
+
+	in_addr_t got;
+	if (_dns0.GetAddrByName(STR(name), got) || _host.GetStats().dns - before != queries) {
+		console("dnstest: %s: resolved or %u queries, not %u", name,
+				_host.GetStats().dns - before, queries);
+		++_errors;
+	}
+}
+
+
+static void* Resolver(void* arg)
+{
+	const uint i = (uintptr_t)arg;
+
+	if (!_dns0.GetAddrByName(STR(_job[i].name), _job[i].addr))
+		_job[i].addr = INADDR_ANY;
+	_job[i].done = true;
+	return NULL;
+}
+
+
+// Resolve on n threads at once.  Returns msec until all were done.
+static uint Resolve(uint n)
+{
+	for (uint i = 0; i < n; ++i)
+		_job[i].done = false;
+
+	const Time start = Time::Now();
+
+	for (uint i = 0; i < n; ++i)
+		Thread::Create("resolver", Resolver, (void*)(uintptr_t)i);
+
+	for (uint i = 0; i < n; ++i)
+		while (!_job[i].done && Time::Now() - start < Time::FromSec(10))
+			Thread::Delay(1000);
+
+	return (Time::Now() - start).GetMsec();
+}
+
+
+static void SetLatency(uint msec)
+{
+	const VirtualWire::Params p = { msec * 1000, 0, 0, 0, 0 };
+	_wire.SetParams(p);
+}
+
+
+static void Check()
+{
+	Dns::Stats st;
+
+	// Miss, then hit
+	Expect("alpha", NameAddr(0), 1);
+	Expect("alpha", NameAddr(0), 0);
+	Expect("alpha.bench", NameAddr(0), 0);
+
+	// All of them, in turn
+	in_addr_t a[DNS_MAX_ADDRS];
+	if (_dns0.GetAddrsByName(STR("pool"), a, DNS_MAX_ADDRS) != 3)
+		Error("not all addresses returned");
+
+	for (uint i = 0; i < 3; ++i) {
+		if (_dns0.GetAddrsByName(STR("pool"), a, 1) != 1 || a[0] != PoolAddr(i))
+			Error("addresses not handed out in turn");
+	}
+
+	// Negative
+	st = _dns0.GetStats();
+	ExpectNone("nosuch", 1);
+	ExpectNone("nosuch", 0);
+	if (_dns0.GetStats().neg_hits != st.neg_hits + 1)
+		Error("negative hit not counted");
+
+	// TTL
+	_host.SetDnsTtl(1);
+	Expect("beta", NameAddr(1), 1);
+	Expect("beta", NameAddr(1), 0);
+	Thread::Delay(1500000);
+	Expect("beta", NameAddr(1), 1);
+	_host.SetDnsTtl(WireHost::DNS_TTL);
+
+	// LRU: alpha, then enough failures to fill the cache, then alpha
+	// again, so the next one evicts the first failure instead
+	_dns0.Flush();
+	Expect("alpha", NameAddr(0), 1);
+
+	char none[DNS_CACHE_SIZE][8];
+	for (uint i = 0; i < DNS_CACHE_SIZE; ++i) {
+		char* p = none[i];
+		memcpy(p, "none", 4);
+		p += 4;
+		if (i >= 10)
+			*p++ = '0' + i / 10;
+		*p++ = '0' + i % 10;
+		*p = 0;
+	}
+
+	for (uint i = 0; i < DNS_CACHE_SIZE - 1; ++i)
+		ExpectNone(none[i], 1);
+
+	Expect("alpha", NameAddr(0), 0);
+	ExpectNone(none[DNS_CACHE_SIZE - 1], 1);
+	Expect("alpha", NameAddr(0), 0);
+	ExpectNone(none[1], 0);
+	ExpectNone(none[0], 1);
+
+	// Threads asking for one name share a query
+	_dns0.Flush();
+	SetLatency(LATENCY);
+
+	st = _dns0.GetStats();
+	uint before = _host.GetStats().dns;
+
+	for (uint i = 0; i < THREADS; ++i)
+		_job[i].name = "gamma";
+	Resolve(THREADS);
+
+	for (uint i = 0; i < THREADS; ++i)
+		if (!_job[i].done || _job[i].addr != NameAddr(2))
+			Error("thread got wrong answer");
+	if (_host.GetStats().dns - before != 1 || _dns0.GetStats().coalesced - st.coalesced != THREADS - 1)
+		Error("lookups not coalesced");
+
+	// Threads asking for different names don't wait for each other
+	_dns0.Flush();
+	before = _host.GetStats().dns;
+
+	for (uint i = 0; i < NAMES; ++i)
+		_job[i].name = names[i];
+	const uint msec = Resolve(NAMES);
+
+	for (uint i = 0; i < NAMES; ++i)
+		if (!_job[i].done || _job[i].addr != NameAddr(i))
+			Error("thread got wrong answer");
+	if (_host.GetStats().dns - before != NAMES)
+		Error("wrong number of queries");
+
+	// One at a time would take NAMES round trips
+	if (msec >= (NAMES - 1) * 2 * LATENCY)
+		Error("queries not outstanding at once");
+
+	SetLatency(0);
+}
+
+
+int	main ()
+{
+	for (uint i = 0; i < NAMES; ++i)
+		_host.AddHost(fqdns[i], NameAddr(i));
+	for (uint i = 0; i < 3; ++i)
+		_host.AddHost("pool.bench", PoolAddr(i));
+
+	_wire.Start();
+	_host.Start(host_mac);
+
+	Thread::Create("net", NetThread, NULL, NET_THREAD_STACK);
+
+	// DHCP sets the name server and domain
+	for (uint i = 0; i < 100 && _dns0.GetDomain().Empty(); ++i)
+		Thread::Delay(100000);
+	Thread::Delay(100000);
+
+	if (_dns0.GetDomain().Empty()) {
+		console("dnstest: no DHCP lease");
+		return 1;
+	}
+
+	Check();
+	console("dnstest: %u errors", _errors);
+
+	// Cached
+	in_addr_t addr;
+	Time start = Time::Now();
+	for (uint i = 0; i < HITS; ++i)
+		_errors += !_dns0.GetAddrByName(STR("alpha"), addr);
+	const uint hit = (Time::Now() - start).GetUsec() * 1000 / HITS;
+
+	// Round trips
+	start = Time::Now();
+	for (uint i = 0; i < MISSES; ++i) {
+		_dns0.Flush();
+		_errors += !_dns0.GetAddrByName(STR("alpha"), addr);
+	}
+	const uint miss = (Time::Now() - start).GetUsec() / MISSES;
+
+	console("dnstest: cached lookup %u nsec, round trip %u usec", hit, miss);
+
+	const Dns::Stats st = _dns0.GetStats();
+	console("dnstest: %u hits, %u negative, %u queries, %u coalesced, %u timeouts",
+			st.hits, st.neg_hits, st.queries, st.coalesced, st.timeouts);
+	console("dnstest: %u errors", _errors);
+
+	return _errors ? 1 : 0;
+}
@@ -0,0 +1,249 @@
+// Copyright (c) 2018-2021 Jan Brittenson
+// See LICENSE for details.
+
+// ICMP and ARP flood benchmark, used for dev.  Floods eth0 from the
+// far end of a VirtualWire with echo requests and datagrams to a
+// closed port, from SOURCES hosts on the local network, none of which
+// answers ARP, the way a scan or a broadcast storm would.  Each frame
+// asks for an echo reply or a port unreachable, and an ARP request
+// for its sender.  The flood is run with the ICMP and ARP rate limits
+// and without them, and CPU time is measured as what's left over for
+// a thread spinning at priority 0, against no flood at all and a
+// flood of frames the network thread drops on sight.  What that last
+// one doesn't account for is the stack's own.  Checks that with the
+// limits no more was sent than their rates and bursts allow.  Like
+// tcpbench it needs a board with devices/vether.h, as projects/host
+// has.  Results go to the console, and the exit status is nonzero on
+// any error.
+
+#include "enetkit.h"
+#include "network.h"
+#include "ip.h"
+#include "icmp.h"
+#include "udp.h"
+#include "thread.h"
+#include "netstats.h"
+#include "devices/vether.h"
+
+
+static const uint8_t peer_mac[6] = { 0x02, 0, 0, 0, 0, 1 };
+
+#define ADDR(a,b,c,d) Htonl(((a) << 24) | ((b) << 16) | ((c) << 8) | (d))
+
+enum {
+	SOURCES = 200,				// Hosts flooding
+	TICK = 1000,				// Usec between bursts
+	PER_TICK = 20,				// Frames per burst
+	SECS = 2,					// Per flood
+	PAYLOAD = 32,
+	CLOSED_PORT = 9,
+	ETHERTYPE_JUNK = 0x88b5,	// Local experimental
+	FRAME_LEN = sizeof (Ethernet::Frame)
+};
+
+enum Kind {
+	IDLE,						// Nothing sent
+	JUNK,						// Dropped by the network thread
+	FLOOD						// Echo requests and datagrams to CLOSED_PORT
+};
+
+Ethernet _wire1;
+VirtualWire _wire(_eth0, _wire1);
+
+static const in_addr_t _addr = ADDR(10,0,0,2);
+
+static EventObject _peer_event;
+static volatile uint64_t _spins;
+static uint _errors;
+
+
+static void* Spinner(void*)
+{
+	for (;;)
+		++_spins;
+
+	return NULL;
+}
+
+
+// Sender n, on the local network
+static in_addr_t Source(uint n)
+{
+	return ADDR(10,0,0,10 + n % SOURCES);
+}
+
+
+// Frame n of a flood: even ones are echo requests, odd ones datagrams
+static bool Send(Kind kind, uint n)
+{
+	const uint len = FRAME_LEN + sizeof (Iph) + max(sizeof (Icmph), sizeof (Udph)) + PAYLOAD;
+
+	IOBuffer* buf = BufferPool::AllocTx(2 + len);
+	if (!buf)
+		return false;
+
+	buf->SetHeadroom(2);
+	buf->SetSize(len);
+	memset(*buf + 0, 0, len);
+
+	Ethernet::Frame* f = (Ethernet::Frame*)(*buf + 0);
+	memcpy(f->dst, _eth0.GetMacAddr(), 6);
+	memcpy(f->src, peer_mac, 6);
+	f->et = Htons(kind == JUNK ? ETHERTYPE_JUNK : uint16_t(ETHERTYPE_IP));
+
+	Iph& iph = *(Iph*)(*buf + FRAME_LEN);
+	iph.SetHLen(sizeof iph);
+	iph.ttl = 64;
+	iph.source = Source(n);
+	iph.dest = _addr;
+
+	if (n & 1) {
+		Udph& udph = *(Udph*)iph.GetTransport();
+		udph.sport = Htons(1024 + n % SOURCES);
+		udph.dport = Htons(CLOSED_PORT);
+		udph.len = Htons(sizeof udph + PAYLOAD);
+		iph.proto = IPPROTO_UDP;
+		iph.len = Htons(sizeof iph + sizeof udph + PAYLOAD);
+	} else {
+		Icmph& icmph = *(Icmph*)iph.GetTransport();
+		icmph.type = Icmph::ICMP_ECHO_REQ;
+		icmph.rest[0] = Htons(1);
+		icmph.rest[1] = Htons(n);
+		icmph.SetCsum(sizeof icmph + PAYLOAD);
+		iph.proto = IPPROTO_ICMP;
+		iph.len = Htons(sizeof iph + sizeof icmph + PAYLOAD);
+	}
+	iph.SetCsum();
+
+	return _wire1.Send(buf);
+}
+
+
+// Throw away what eth0 sent back
+static void Drain()
+{
+	IOBuffer* buf;
+	uint16_t et;
+	do {
+		while ((buf = _wire1.Receive(et)))
+			BufferPool::FreeBuffer(buf);
+	} while (!_wire1.EnableRxInterrupt());
+}
+
+
+// Flood for SECS.  Returns spins per msec left over, and frames sent
+// and usec taken.
+static uint64_t Flood(Kind kind, uint& frames, uint64_t& usec)
+{
+	frames = 0;
+
+	const uint64_t spins = _spins;
+	const Time start = Time::Now();
+
+	for (uint tick = 0; tick < SECS * 1000000 / TICK; ++tick) {
+		if (kind != IDLE) {
+			for (uint i = 0; i < PER_TICK; ++i, ++frames)
+				if (!Send(kind, frames))
+					++_errors;
+		}
+		Drain();
+		Thread::Delay(TICK);
+	}
+
+	usec = (Time::Now() - start).GetUsec();
+
+	return (_spins - spins) * 1000 / usec;
+}
+
+
+// Set all limits to their defaults, or off
+static void SetLimits(bool on)
+{
+	_ip0.SetRateLimit(Ip::LIMIT_ICMP, on ? ICMP_RATE : 0, ICMP_BURST);
+	_ip0.SetRateLimit(Ip::LIMIT_ICMP_HOST, on ? ICMP_HOST_RATE : 0, ICMP_HOST_BURST);
+	_ip0.SetRateLimit(Ip::LIMIT_ARP, on ? ARP_RATE : 0, ARP_BURST);
+}
+
+
+// At most what rate and burst allow over usec
+static void ExpectAtMost(const char* what, uint32_t n, uint rate, uint burst, uint64_t usec)
+{
+	const uint64_t most = rate * usec / 1000000 + burst + 1;
+	if (n > most) {
+		console("floodbench: %u %s, more than %u", n, what, (uint)most);
+		++_errors;
+	}
+}
+
+
+// Run a flood, and report CPU per mille as taken from idle
+static uint Run(const char* name, Kind kind, uint64_t idle, bool limits)
+{
+	SetLimits(limits);
+
+	const NetStats::Counters before = _netstats;
+	uint frames;
+	uint64_t usec;
+	const uint64_t spins = Flood(kind, frames, usec);
+	const NetStats::Counters after = _netstats;
+
+	const uint busy = spins < idle ? (idle - spins) * 1000 / idle : 0;
+	const uint32_t icmp = after.icmp.out_msgs - before.icmp.out_msgs;
+	const uint32_t arp = after.arp.out_requests - before.arp.out_requests;
+	const uint32_t icmp_throttled = after.icmp.out_throttled - before.icmp.out_throttled;
+	const uint32_t arp_throttled = after.arp.out_throttled - before.arp.out_throttled;
+
+	console("floodbench: %s: %u frames/sec, CPU %u.%u%%, ICMP %u sent %u throttled, "
+			"ARP %u sent %u throttled", name, (uint)(frames * 1000000ULL / usec),
+			busy / 10, busy % 10, icmp, icmp_throttled, arp, arp_throttled);
+
+	if (kind == FLOOD) {
+		if (limits) {
+			ExpectAtMost("ICMP sent", icmp, ICMP_RATE, ICMP_BURST, usec);
+			ExpectAtMost("ARP requests sent", arp, ARP_RATE, ARP_BURST, usec);
+			if (!icmp_throttled || !arp_throttled) {
+				console("floodbench: flood not throttled");
+				++_errors;
+			}
+		} else if (icmp_throttled || arp_throttled) {
+			console("floodbench: throttled without limits");
+			++_errors;
+		}
+	}
+
+	return busy;
+}
+
+
+int	main ()
+{
+	_wire1.Initialize(peer_mac);
+	_wire1.SetEventObject(&_peer_event);
+	_wire.Start();
+
+	Thread::Create("net", NetThread, NULL, NET_THREAD_STACK);
+	Thread::Delay(100000);
+
+	_ip0.AddInterface(_eth0, _addr, ADDR(255,255,255,0));
+
+	// Threads start at priority 0, below everything else
+	Thread::Create("spin", Spinner, NULL);
+
+	uint frames;
+	uint64_t usec;
+	const uint64_t idle = Flood(IDLE, frames, usec);
+
+	const uint junk = Run("junk", JUNK, idle, true);
+	const uint limited = Run("limited", FLOOD, idle, true);
+	const uint unlimited = Run("unlimited", FLOOD, idle, false);
+
+	// Less the cost of receiving the frames at all
+	const uint stack_limited = limited > junk ? limited - junk : 0;
+	const uint stack_unlimited = unlimited > junk ? unlimited - junk : 0;
+	console("floodbench: stack CPU %u.%u%% limited, %u.%u%% unlimited",
+			stack_limited / 10, stack_limited % 10, stack_unlimited / 10, stack_unlimited % 10);
+
+	console("floodbench: %u errors", _errors);
+
+	return _errors ? 1 : 0;
+}
@@ -0,0 +1,145 @@
+// Copyright (c) 2018-2021 Jan Brittenson
+// See LICENSE for details.
+
+// IP fragmentation and reassembly test, used for dev.  Sends UDP
+// datagrams too large for one frame to ourselves over a loopback
+// VirtualWire on eth0, one at a time, and checks that each comes out
+// of reassembly whole.  First on an ideal wire, then one that
+// reorders frames, where everything must arrive, then one that also
+// loses frames, where a datagram missing a fragment must not arrive
+// at all, let alone damaged.  Like tcpbench it needs a board with
+// devices/vether.h, as projects/host has.  Results go to the console,
+// and the exit status is nonzero on any error.
+
+#include "enetkit.h"
+#include "network.h"
+#include "ip.h"
+#include "udp.h"
+#include "thread.h"
+#include "netstats.h"
+#include "devices/vether.h"
+
+
+#define ADDR(a,b,c,d) Htonl(((a) << 24) | ((b) << 16) | ((c) << 8) | (d))
+
+enum {
+	COUNT = 100,				// Datagrams per size and wire
+	MAX_SIZE = 8000,
+	WAIT = 50,					// Msec a datagram gets to arrive
+	PORT = 6000
+};
+
+static const uint sizes[] = { 1000, 3000, MAX_SIZE };
+
+static const struct {
+	const char* name;
+	VirtualWire::Params params;
+	bool lossy;
+} wires[] = {
+	{ "ideal", { 0, 0, 0, 0, 0 }, false },
+	{ "reordering", { 1000, 500, 0, 300, 0 }, false },
+	{ "lossy", { 1000, 500, 20, 300, 0 }, true }
+};
+
+VirtualWire _wire(_eth0, _eth0);
+
+static const in_addr_t _addr = ADDR(10,0,0,2);
+
+static uint8_t _txdata[MAX_SIZE];
+static uint8_t _rxdata[MAX_SIZE + 1];
+static uint _errors;
+
+
+// Datagram seq: its number, then bytes that depend on it
+static void Fill(uint seq, uint len)
+{
+	memcpy(_txdata, &seq, sizeof seq);
+	for (uint i = sizeof seq; i < len; ++i)
+		_txdata[i] = seq * 7 + i;
+}
+
+
+// Wait for a datagram.  Returns false if none arrives in time.
+static bool Receive(UdpCoreSocket* s, uint& len)
+{
+	NetAddr from;
+	for (uint i = 0; i < WAIT; ++i) {
+		len = sizeof _rxdata;
+		if (s->RecvFrom(_rxdata, len, from))
+			return true;
+		Thread::Delay(1000);
+	}
+	return false;
+}
+
+
+static void Run(UdpCoreSocket* tx, UdpCoreSocket* rx, uint w, uint len)
+{
+	const uint32_t reasm = _netstats.ip.reasm_oks;
+	uint received = 0;
+	uint damaged = 0;
+
+	for (uint seq = 0; seq < COUNT; ++seq) {
+		Fill(seq, len);
+		if (!tx->SendTo(_txdata, len, NetAddr(_addr, PORT))) {
+			++_errors;
+			continue;
+		}
+
+		uint got;
+		if (!Receive(rx, got))
+			continue;
+
+		++received;
+		if (got != len || memcmp(_rxdata, _txdata, len))
+			++damaged;
+	}
+
+	const uint32_t reassembled = _netstats.ip.reasm_oks - reasm;
+
+	console("fragtest: %s: %u bytes: %u sent, %u received, %u damaged, %u reassembled",
+			wires[w].name, len, COUNT, received, damaged, reassembled);
+
+	// Nothing lost without loss, but a datagram or two can get
+	// through a lossy wire whole too
+	if (damaged || (!wires[w].lossy && received != COUNT) || !received)
+		++_errors;
+
+	// Only what doesn't fit in a frame goes through reassembly
+	if (reassembled != (len + sizeof (Udph) > IP_MTU - sizeof (Iph) ? received : 0))
+		++_errors;
+}
+
+
+int	main ()
+{
+	_wire.Start();
+
+	Thread::Create("net", NetThread, NULL, NET_THREAD_STACK);
+	Thread::Delay(100000);
+
+	_ip0.AddInterface(_eth0, _addr, ADDR(255,255,255,0));
+
+	UdpCoreSocket* tx = _udp0.Create();
+	UdpCoreSocket* rx = _udp0.Create();
+	assert(tx && rx);
+	if (!rx->Bind(NetAddr(INADDR_ANY, PORT))) {
+		console("fragtest: can't bind %u", PORT);
+		return 1;
+	}
+
+	for (uint w = 0; w < sizeof wires / sizeof wires[0]; ++w) {
+		_wire.SetParams(VirtualWire::A_TO_B, wires[w].params);
+		_wire.SetParams(VirtualWire::B_TO_A, wires[w].params);
+
+		for (uint i = 0; i < sizeof sizes / sizeof sizes[0]; ++i)
+			Run(tx, rx, w, sizes[i]);
+	}
+
+	const VirtualWire::Stats ws = _wire.GetStats(VirtualWire::B_TO_A);
+	console("fragtest: %u fragments sent, %u reordered, %u lost, %u reassembly failures",
+			_netstats.ip.frag_creates, ws.reordered, ws.lost, _netstats.ip.reasm_fails);
+	console("fragtest: %u errors", _errors);
+
+	return _errors ? 1 : 0;
+}
@@ -0,0 +1,650 @@
+// Copyright (c) 2018-2021 Jan Brittenson
+// See LICENSE for details.
+
+// IGMP and multicast test, used for dev.  A process has one stack, so
+// the other hosts are raw peers at the far end of a VirtualWire that
+// share it like a hub with a querier: every frame one of them sends
+// is seen by eth0 and the other peers, and every frame eth0 sends by
+// all of them.  Each peer keeps a table of groups joined, reports
+// the way an IGMPv2 host does, and has a multicast hash filter of its
+// own, as a NIC would.  Checks that eth0 reports the
+// groups it joins, holds back its reports when a peer reports first,
+// sends a leave only when it reported last and only for the last
+// socket to leave, that group frames are dropped by the hash filter
+// or by the stack's own check behind it as they should be, and that
+// datagrams to a group reach its members and no one else.  Like
+// tcpbench it needs a board with devices/vether.h, as projects/host
+// has.  Results go to the console, and the exit status is nonzero on
+// any error.
+
+#include "enetkit.h"
+#include "network.h"
+#include "ip.h"
+#include "udp.h"
+#include "igmp.h"
+#include "thread.h"
+#include "netstats.h"
+#include "devices/vether.h"
+
+
+#define ADDR(a,b,c,d) Htonl(((a) << 24) | ((b) << 16) | ((c) << 8) | (d))
+
+enum {
+	N = 16,						// Datagrams per group sent
+	PEERS = 2,
+	PEER_GROUPS = 4,			// Groups a peer can be in
+	MAXRESP = 10,				// Of queries, 1/10 s
+	PORT = 6000,
+	PAYLOAD = 32,
+	FRAME_LEN = sizeof (Ethernet::Frame)
+};
+
+static const uint8_t querier_mac[6] = { 0x02, 0, 0, 0, 0, 1 };
+
+static const in_addr_t _querier = ADDR(10,0,0,1);
+static const in_addr_t _addr = ADDR(10,0,0,2);
+
+static const in_addr_t ALL_HOSTS = ADDR(224,0,0,1);
+static const in_addr_t ALL_ROUTERS = ADDR(224,0,0,2);
+
+// Groups.  G5 has the same MAC address as G1; G3 and G4 are found by
+// FindGroup().
+static const in_addr_t G1 = ADDR(239,1,1,1);
+static const in_addr_t G2 = ADDR(239,1,1,2);
+static const in_addr_t G5 = ADDR(239,129,1,1);
+
+Ethernet _wire1;
+VirtualWire _wire(_eth0, _wire1);
+
+static EventObject _peer_event;
+static uint16_t _id;
+static uint _errors;
+
+// IGMP messages from eth0 seen on the wire
+static struct {
+	uint reports;
+	uint leaves;
+	in_addr_t group;			// Of the last one
+} _seen;
+
+
+static void Error(const char* what)
+{
+	console("igmptest: %s", what);
+	++_errors;
+}
+
+
+static void Expect(const char* what, uint32_t got, uint32_t n)
+{
+	if (got != n) {
+		console("igmptest: %s %u, not %u", what, got, n);
+		++_errors;
+	}
+}
+
+
+static void Emit(const uint8_t* mac, in_addr_t source, in_addr_t dest, uint proto,
+				 const void* data, uint len, const class Peer* from);
+
+
+// A host sharing the far end of the wire
+class Peer {
+public:
+	const char* _name;
+	uint8_t _mac[6];
+	in_addr_t _addr;
+	in_addr_t _group[PEER_GROUPS]; // INADDR_ANY if free
+	uint32_t _hash[2];			// Multicast filter
+
+	// Group frames dropped, by the filter, by the group check behind
+	// it, and by IP; datagrams delivered, for each group
+	uint _hash_drops;
+	uint _soft_drops;
+	uint _ip_drops;
+	uint _delivered[PEER_GROUPS];
+
+	Peer(const char* name, uint n, in_addr_t addr)
+		: _name(name),
+		  _addr(addr) {
+		memcpy(_mac, querier_mac, 6);
+		_mac[5] = 0x10 + n;
+		for (uint i = 0; i < PEER_GROUPS; ++i)
+			_group[i] = INADDR_ANY;
+		UpdateFilter();
+		ClearStats();
+	}
+
+	void ClearStats() {
+		_hash_drops = _soft_drops = _ip_drops = 0;
+		memset(_delivered, 0, sizeof _delivered);
+	}
+
+	// Slot of group, or -1
+	int Find(in_addr_t group) const {
+		for (uint i = 0; i < PEER_GROUPS; ++i)
+			if (_group[i] == group)
+				return i;
+		return -1;
+	}
+
+	uint Delivered(in_addr_t group) const {
+		const int i = Find(group);
+		return i >= 0 ? _delivered[i] : 0;
+	}
+
+	void Join(in_addr_t group) {
+		const int i = Find(INADDR_ANY);
+		assert(i >= 0);
+		_group[i] = group;
+		UpdateFilter();
+		Report(group);
+	}
+
+	void Report(in_addr_t group) { SendIgmp(Igmph::IGMP_V2_REPORT, group, group); }
+
+	// Datagram n to group
+	void Send(in_addr_t group, uint n) {
+		uint8_t data[sizeof (Udph) + PAYLOAD];
+		memset(data, 0, sizeof data);
+
+		Udph& udph = *(Udph*)data;
+		udph.sport = Htons(PORT);
+		udph.dport = Htons(PORT);
+		udph.len = Htons(sizeof data);
+		data[sizeof udph] = n;
+
+		Emit(_mac, _addr, group, IPPROTO_UDP, data, sizeof data, this);
+	}
+
+	// Frame seen on the wire
+	void Receive(const uint8_t* frame, uint len) {
+		const Ethernet::Frame* f = (const Ethernet::Frame*)frame;
+		if (len < FRAME_LEN + sizeof (Iph) || !(f->dst[0] & 1) ||
+			!memcmp(f->dst, Ethernet::GetBcastAddr(), 6))
+			return;
+
+		const uint bit = EtherMcastHash(f->dst);
+		if (!(_hash[bit >> 5] & (1 << (bit & 31)))) {
+			++_hash_drops;
+			return;
+		}
+
+		uint8_t mac[6];
+		bool known = false;
+		for (uint i = 0; !known && i < PEER_GROUPS; ++i) {
+			if (_group[i] != INADDR_ANY) {
+				Igmp::GetGroupMac(_group[i], mac);
+				known = !memcmp(mac, f->dst, 6);
+			}
+		}
+		Igmp::GetGroupMac(ALL_HOSTS, mac);
+		if (!known && memcmp(mac, f->dst, 6)) {
+			++_soft_drops;
+			return;
+		}
+
+		const Iph& iph = *(const Iph*)(frame + FRAME_LEN);
+		const int i = Find(iph.dest);
+		if (i < 0 && iph.dest != ALL_HOSTS) {
+			++_ip_drops;
+			return;
+		}
+
+		if (i >= 0 && iph.proto == IPPROTO_UDP)
+			++_delivered[i];
+	}
+
+private:
+	void UpdateFilter() {
+		uint8_t mac[6];
+		_hash[0] = _hash[1] = 0;
+		for (int i = -1; i < PEER_GROUPS; ++i) {
+			const in_addr_t group = i < 0 ? ALL_HOSTS : _group[i];
+			if (group != INADDR_ANY) {
+				Igmp::GetGroupMac(group, mac);
+				const uint bit = EtherMcastHash(mac);
+				_hash[bit >> 5] |= 1 << (bit & 31);
+			}
+		}
+	}
+
+	void SendIgmp(Igmph::Type type, in_addr_t group, in_addr_t dest) {
+		Igmph msg;
+		msg.type = type;
+		msg.maxresp = 0;
+		msg.sum = 0;
+		msg.group = group;
+		msg.sum = Htons(~ipcksum((const uint16_t*)&msg, sizeof msg));
+
+		Emit(_mac, _addr, dest, IPPROTO_IGMP, &msg, sizeof msg, this);
+	}
+};
+
+static Peer _peer[PEERS] = {
+	Peer("A", 0, ADDR(10,0,0,3)),
+	Peer("B", 1, ADDR(10,0,0,4))
+};
+
+static Peer& A = _peer[0];
+static Peer& B = _peer[1];
+
+
+// Send an IP datagram from source to group dest onto the wire, where
+// eth0 and every peer but from sees it
+static void Emit(const uint8_t* mac, in_addr_t source, in_addr_t dest, uint proto,
+				 const void* data, uint len, const Peer* from)
+{
+	const uint flen = FRAME_LEN + sizeof (Iph) + len;
+
+	IOBuffer* buf = BufferPool::AllocTx(2 + flen);
+	if (!buf) {
+		Error("no buffers");
+		return;
+	}
+
+	buf->SetHeadroom(2);
+	buf->SetSize(flen);
+	memset(*buf + 0, 0, flen);
+
+	Ethernet::Frame* f = (Ethernet::Frame*)(*buf + 0);
+	Igmp::GetGroupMac(dest, f->dst);
+	memcpy(f->src, mac, 6);
+	f->et = Htons(uint16_t(ETHERTYPE_IP));
+
+	Iph& iph = *(Iph*)(*buf + FRAME_LEN);
+	iph.SetHLen(sizeof iph);
+	iph.len = Htons(sizeof iph + len);
+	iph.id = Htons(++_id);
+	iph.ttl = 1;
+	iph.proto = proto;
+	iph.source = source;
+	iph.dest = dest;
+	iph.SetCsum();
+
+	memcpy(iph.GetTransport(), data, len);
+	if (proto == IPPROTO_UDP)
+		((Udph*)iph.GetTransport())->SetCsum(iph);
+
+	for (uint i = 0; i < PEERS; ++i)
+		if (&_peer[i] != from)
+			_peer[i].Receive(*buf + 0, flen);
+
+	if (!_wire1.Send(buf))
+		Error("peer send failed");
+}
+
+
+// Query from the querier, for a group or with INADDR_ANY all of them
+static void Query(in_addr_t group)
+{
+	Igmph msg;
+	msg.type = Igmph::IGMP_QUERY;
+	msg.maxresp = MAXRESP;
+	msg.sum = 0;
+	msg.group = group;
+	msg.sum = Htons(~ipcksum((const uint16_t*)&msg, sizeof msg));
+
+	Emit(querier_mac, _querier, group != INADDR_ANY ? group : ALL_HOSTS, IPPROTO_IGMP,
+		 &msg, sizeof msg, NULL);
+}
+
+
+// Check a frame eth0 sent to a group, and note IGMP messages
+static void Check(const uint8_t* frame, uint len)
+{
+	const Ethernet::Frame* f = (const Ethernet::Frame*)frame;
+	const Iph& iph = *(const Iph*)(frame + FRAME_LEN);
+	if (len < FRAME_LEN + sizeof iph || f->et != Htons(uint16_t(ETHERTYPE_IP)) ||
+		!IsMulticast(iph.dest))
+		return;
+
+	uint8_t mac[6];
+	Igmp::GetGroupMac(iph.dest, mac);
+	if (memcmp(f->dst, mac, 6))
+		Error("group datagram not to the group's MAC address");
+	if (iph.ttl != 1)
+		Error("group datagram TTL not 1");
+
+	if (iph.proto != IPPROTO_IGMP)
+		return;
+
+	const Igmph& msg = *(const Igmph*)iph.GetTransport();
+	if (ipcksum((const uint16_t*)&msg, sizeof msg) != 0xffff)
+		Error("bad IGMP sum on the wire");
+
+	switch (msg.type) {
+	case Igmph::IGMP_V2_REPORT:
+		if (iph.dest != msg.group)
+			Error("report not to its group");
+		++_seen.reports;
+		break;
+	case Igmph::IGMP_LEAVE:
+		if (iph.dest != ALL_ROUTERS)
+			Error("leave not to all routers");
+		++_seen.leaves;
+		break;
+	default:
+		Error("unexpected IGMP message");
+	}
+	_seen.group = msg.group;
+}
+
+
+// Pass what eth0 sent to the peers, until deadline
+static void Poll(const Time& deadline)
+{
+	while (Time::Now() < deadline) {
+		IOBuffer* buf;
+		uint16_t et;
+		while ((buf = _wire1.Receive(et))) {
+			Check(*buf + 0, buf->Size());
+			for (uint i = 0; i < PEERS; ++i)
+				_peer[i].Receive(*buf + 0, buf->Size());
+			BufferPool::FreeBuffer(buf);
+		}
+		if (_wire1.EnableRxInterrupt())
+			_peer_event.Wait(deadline - Time::Now());
+	}
+}
+
+
+static void Poll(uint msec)
+{
+	Poll(Time::Now() + Time::FromMsec(msec));
+}
+
+
+// The wire's end, as a router's port would, takes in all multicast:
+// give its filter a MAC address for every bit of the hash
+static void AllMulticast()
+{
+	uint8_t macs[64 * 6];
+	uint64_t bits = 0;
+	uint num = 0;
+	for (uint i = 0; num < 64; ++i) {
+		uint8_t* mac = macs + 6 * num;
+		Igmp::GetGroupMac(ADDR(239,3,i >> 8,i & 255), mac);
+		const uint bit = EtherMcastHash(mac);
+		if (!(bits & (1ULL << bit))) {
+			bits |= 1ULL << bit;
+			++num;
+		}
+	}
+	_wire1.SetMcastFilter(macs, num);
+}
+
+
+// A group whose MAC address eth0's filter hashes to the same bit as
+// G1's, or with collide false, to neither G1's nor all-hosts'
+static in_addr_t FindGroup(bool collide)
+{
+	uint8_t mac[6];
+	Igmp::GetGroupMac(G1, mac);
+	const uint g1 = EtherMcastHash(mac);
+	Igmp::GetGroupMac(ALL_HOSTS, mac);
+	const uint all = EtherMcastHash(mac);
+
+	for (uint i = 0; ; ++i) {
+		const in_addr_t group = ADDR(239,2,i >> 8,i & 255);
+		Igmp::GetGroupMac(group, mac);
+		const uint bit = EtherMcastHash(mac);
+		if (collide ? bit == g1 : bit != g1 && bit != all)
+			return group;
+	}
+}
+
+
+static UdpCoreSocket* Open(uint port = PORT)
+{
+	UdpCoreSocket* s = _udp0.Create();
+	assert(s);
+	if (!s->Bind(NetAddr(INADDR_ANY, port)))
+		Error("can't bind");
+	return s;
+}
+
+
+// Datagrams waiting on s
+static uint Drain(UdpCoreSocket* s)
+{
+	uint n = 0;
+	uint8_t buf[PAYLOAD];
+	uint len = sizeof buf;
+	NetAddr from;
+	while (s->RecvFrom(buf, len, from)) {
+		++n;
+		len = sizeof buf;
+	}
+	return n;
+}
+
+
+static void Join(UdpCoreSocket* s, in_addr_t group)
+{
+	if (!s->JoinGroup(NetAddr(group, 0)))
+		Error("can't join");
+}
+
+
+static void Leave(UdpCoreSocket* s, in_addr_t group)
+{
+	if (!s->LeaveGroup(NetAddr(group, 0)))
+		Error("can't leave");
+}
+
+
+// eth0 joins G1 and reports it; A joins after and reports too, which
+// stands in for eth0's second unsolicited report
+static void TestJoin(UdpCoreSocket* s)
+{
+	const NetStats::Igmp before = _netstats.igmp;
+	memset(&_seen, 0, sizeof _seen);
+
+	Join(s, G1);
+	Poll(200);
+	const uint reports = _seen.reports;
+	const in_addr_t group = _seen.group;
+
+	A.Join(G1);
+	B.Join(G2);
+	Poll(200);
+
+	const NetStats::Igmp& after = _netstats.igmp;
+	console("igmptest: join: %u reports seen, %u sent, %u heard", reports,
+			after.out_reports - before.out_reports, after.in_reports - before.in_reports);
+
+	Expect("join reports seen", reports, 1);
+	Expect("join reports sent", after.out_reports - before.out_reports, 1);
+	if (group != G1)
+		Error("join report not for the group");
+
+	// B's report is to a group eth0 isn't in
+	Expect("join reports heard", after.in_reports - before.in_reports, 1);
+}
+
+
+// A general query that A answers at once: eth0 holds back its report
+// for G1.  Then one for G1 alone that no one else answers: eth0
+// reports it within the max response time.
+static void TestSuppression()
+{
+	const NetStats::Igmp before = _netstats.igmp;
+	memset(&_seen, 0, sizeof _seen);
+
+	// Above the wire and the network thread, so eth0 takes the query
+	// and A's report in one pass, before its report can come due
+	Thread::SetPriority(NET_THREAD_PRIORITY + 2);
+	Query(INADDR_ANY);
+	A.Report(G1);
+	B.Report(G2);
+	Thread::SetPriority(THREAD_DEFAULT_PRIORITY);
+
+	Poll(MAXRESP * 100 + 300);
+	const uint suppressed = _seen.reports;
+
+	const Time start = Time::Now();
+	Query(G1);
+	while (!_seen.reports && Time::Now() < start + Time::FromMsec(MAXRESP * 100 + 300))
+		Poll(10);
+	const uint msec = (Time::Now() - start).GetMsec();
+
+	const NetStats::Igmp& after = _netstats.igmp;
+	console("igmptest: suppression: %u reports seen after A's, %u after a group query "
+			"in %u ms; %u queries, %u reports heard", suppressed, _seen.reports, msec,
+			after.in_queries - before.in_queries, after.in_reports - before.in_reports);
+
+	Expect("reports after A's", suppressed, 0);
+	Expect("reports to a group query", _seen.reports, 1);
+	if (msec > MAXRESP * 100 + 100)
+		Error("report to a group query late");
+	Expect("queries heard", after.in_queries - before.in_queries, 2);
+	Expect("reports heard", after.in_reports - before.in_reports, 1);
+}
+
+
+// eth0 reported G1 last: two sockets in it, and only the second to
+// leave sends a leave.  Then A reports after eth0 joins again, and
+// eth0 leaves without one.
+static void TestLeave(UdpCoreSocket* s1)
+{
+	const NetStats::Igmp before = _netstats.igmp;
+	memset(&_seen, 0, sizeof _seen);
+
+	UdpCoreSocket* s2 = Open(PORT + 1);
+	Join(s2, G1);
+	Leave(s1, G1);
+	Poll(200);
+	const uint first = _seen.leaves;
+
+	Leave(s2, G1);
+	Poll(200);
+	const uint last = _seen.leaves;
+	if (_seen.group != G1)
+		Error("leave not for the group");
+	s2->Close();
+
+	Join(s1, G1);
+	Poll(200);
+	A.Report(G1);
+	Poll(200);
+	Leave(s1, G1);
+	Poll(200);
+
+	const NetStats::Igmp& after = _netstats.igmp;
+	console("igmptest: leave: %u leaves seen for the first socket, %u for the last, "
+			"%u after A's report; %u sent", first, last - first, _seen.leaves - last,
+			after.out_leaves - before.out_leaves);
+
+	Expect("leaves for the first socket", first, 0);
+	Expect("leaves for the last socket", last - first, 1);
+	Expect("leaves after A's report", _seen.leaves - last, 0);
+	Expect("leaves sent", after.out_leaves - before.out_leaves, 1);
+}
+
+
+// N datagrams from B to group: what eth0's driver took in, what the
+// network thread dropped, what IP dropped, and what s got
+static void Filter(const char* name, UdpCoreSocket* s, in_addr_t group, uint32_t packets,
+				   uint32_t filtered, uint32_t addr_errors, uint delivered)
+{
+	const NetStats::Link before = _eth0.GetStats();
+	const uint32_t errors = _netstats.ip.in_addr_errors;
+
+	for (uint i = 0; i < N; ++i)
+		B.Send(group, i);
+	Poll(100);
+
+	const NetStats::Link& after = _eth0.GetStats();
+	const uint got = Drain(s);
+	const NetAddr addr(group, 0);
+	console("igmptest: filter: %s %a: %u rx_packets, %u rx_filtered, %u in_addr_errors, "
+			"%u received", name, &addr, after.rx_packets - before.rx_packets,
+			after.rx_filtered - before.rx_filtered, _netstats.ip.in_addr_errors - errors, got);
+
+	Expect("rx_packets", after.rx_packets - before.rx_packets, packets);
+	Expect("rx_filtered", after.rx_filtered - before.rx_filtered, filtered);
+	Expect("in_addr_errors", _netstats.ip.in_addr_errors - errors, addr_errors);
+	Expect("received", got, delivered);
+}
+
+
+// With eth0 in G1: G1 is taken; G3 hashes like G1 and is dropped by
+// the network thread; G4 is dropped by the hash filter; G5 has G1's
+// MAC address and is dropped by IP
+static void TestFilter(UdpCoreSocket* s)
+{
+	Join(s, G1);
+	Poll(200);
+	A.Report(G1);
+	Poll(200);
+
+	Filter("joined", s, G1, N, 0, 0, N);
+	Filter("hash collision", s, FindGroup(true), N, N, 0, 0);
+	Filter("hashed out", s, FindGroup(false), 0, 0, 0, 0);
+	Filter("same MAC", s, G5, N, 0, N, 0);
+}
+
+
+// eth0 in G1 with A, B in G2.  eth0 and B send to G1, and eth0 and A
+// to G2: each member gets what the others sent its group, and nothing
+// else.
+static void TestDelivery(UdpCoreSocket* s)
+{
+	for (uint i = 0; i < PEERS; ++i)
+		_peer[i].ClearStats();
+
+	static uint8_t data[PAYLOAD];
+	for (uint i = 0; i < N; ++i) {
+		if (!s->SendTo(data, sizeof data, NetAddr(G1, PORT)) ||
+			!s->SendTo(data, sizeof data, NetAddr(G2, PORT)))
+			Error("send failed");
+		B.Send(G1, i);
+		A.Send(G2, i);
+		Poll(5);
+	}
+	Poll(100);
+
+	const uint got = Drain(s);
+	for (uint i = 0; i < PEERS; ++i) {
+		const Peer& p = _peer[i];
+		console("igmptest: delivery: %s: %u of G1, %u of G2; dropped %u by hash, "
+				"%u by group, %u by IP", p._name, p.Delivered(G1), p.Delivered(G2),
+				p._hash_drops, p._soft_drops, p._ip_drops);
+	}
+	console("igmptest: delivery: eth0: %u received", got);
+
+	Expect("A's datagrams of G1", A.Delivered(G1), 2 * N);
+	Expect("B's datagrams of G2", B.Delivered(G2), 2 * N);
+	Expect("A's drops", A._hash_drops + A._soft_drops + A._ip_drops, N);
+	Expect("B's drops", B._hash_drops + B._soft_drops + B._ip_drops, N);
+	Expect("eth0's datagrams of G1", got, N);
+}
+
+
+int	main ()
+{
+	_wire1.Initialize(querier_mac);
+	_wire1.SetEventObject(&_peer_event);
+	AllMulticast();
+	_wire.Start();
+
+	Thread::Create("net", NetThread, NULL, NET_THREAD_STACK);
+	Thread::Delay(100000);
+
+	_ip0.AddInterface(_eth0, _addr, ADDR(255,255,255,0));
+
+	UdpCoreSocket* s = Open();
+
+	TestJoin(s);
+	TestSuppression();
+	TestLeave(s);
+	TestFilter(s);
+	TestDelivery(s);
+
+	s->Close();
+
+	console("igmptest: %u errors", _errors);
+
+	return _errors ? 1 : 0;
+}
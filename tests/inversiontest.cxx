@@ -0,0 +1,98 @@
+// Copyright (c) 2018-2021 Jan Brittenson
+// See LICENSE for details.
+
+// Priority inversion test, used for dev.  The classic three threads:
+// low takes a mutex and works for a while holding it, high then wants
+// it, and medium meanwhile spins for much longer.  Without priority
+// inheritance high waits for medium as well; with it, only for what
+// low had left.  Results go to the console, and the exit status is
+// nonzero if high waited for medium.
+
+#include "enetkit.h"
+#include "thread.h"
+#include "mutex.h"
+
+
+enum {
+	LOW = 10,
+	MEDIUM = 20,
+	HIGH = 30,
+	PRIO = 100,					// Main's priority
+	HOLD = 20,					// Msec low works holding the mutex
+	SPIN = 200					// Msec medium spins
+};
+
+static Mutex _mtx;
+static EventObject _start(0, EventObject::MANUAL_RESET);
+static Time _asked, _got;
+
+
+static void Busy(uint msec)
+{
+	const Time end = Time::Now() + Time::FromMsec(msec);
+	while (Time::Now() < end)
+		;
+}
+
+
+static void* Low(void*)
+{
+	Thread::SetPriority(LOW);
+
+	Mutex::Scoped L(_mtx);
+	Busy(HOLD);
+	return NULL;
+}
+
+
+static void* Medium(void*)
+{
+	Thread::SetPriority(MEDIUM);
+
+	_start.Wait();
+	Busy(SPIN);
+	return NULL;
+}
+
+
+static void* High(void*)
+{
+	Thread::SetPriority(HIGH);
+
+	_start.Wait();
+	Thread::Delay(1000);		// Let medium get going
+
+	_asked = Time::Now();
+	_mtx.Lock();
+	_got = Time::Now();
+	_mtx.Unlock();
+	return NULL;
+}
+
+
+int	main ()
+{
+	Thread::SetPriority(PRIO);
+
+	// New threads start at priority 0, so they need a turn each to
+	// set theirs.  Medium and high go wait for the start, then low
+	// takes the mutex.
+	Thread::Create("medium", Medium, NULL);
+	Thread::Create("high", High, NULL);
+	Thread::Delay(1000);
+
+	Thread::Create("low", Low, NULL);
+	Thread::Delay(1000);
+
+	_start.Set();
+
+	Thread::Delay((HOLD + SPIN) * 1000 * 2);
+
+	const Thread::PiStats& pi = Thread::GetPiStats();
+	console("inversiontest: high waited %u usec; low held for %u msec, medium spun for %u msec",
+			uint((_got - _asked).GetUsec()), HOLD, SPIN);
+	console("inversiontest: %u boosts, %u chained", pi.boosts, pi.chained);
+
+	// Without inheritance high would have waited out medium as well
+	return (_got - _asked).GetUsec() < SPIN * 1000 ? 0 : 1;
+}
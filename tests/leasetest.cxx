@@ -0,0 +1,205 @@
+// Copyright (c) 2018-2021 Jan Brittenson
+// See LICENSE for details.
+
+// DHCP saved lease test, used for dev.  Boots DHCP against the
+// WireHost at the far end of a VirtualWire, with a lease store kept
+// in memory: first with nothing saved, then from the lease that boot
+// saved (INIT-REBOOT), then from a lease for an address the server
+// turns down with a NAK, and last from a saved address another host
+// answers the ARP probe for.  The last two must fall back to
+// DHCPDISCOVER and end up with a lease from the server.  Reports the
+// time from boot to the first datagram echoed by the WireHost and to
+// the lease, for each.  Needs a board with devices/vether.h, as
+// projects/host has.  Results go to the console, and the exit status
+// is nonzero on any error.
+
+#include "enetkit.h"
+#include "network.h"
+#include "ip.h"
+#include "udp.h"
+#include "dhcp.h"
+#include "thread.h"
+#include "netstats.h"
+#include "devices/vether.h"
+#include "devices/wirehost.h"
+
+
+static const uint8_t host_mac[6] = { 0x02, 0, 0, 0, 0, 1 };
+
+#define ADDR(a,b,c,d) Htonl(((a) << 24) | ((b) << 16) | ((c) << 8) | (d))
+
+enum {
+	TIMEOUT = 10,				// Sec for a boot to settle
+	ECHO_MSEC = 5,				// Between echo requests
+	PORT = 6000
+};
+
+static const in_addr_t _pool = ADDR(10,0,0,100);
+
+Ethernet _wire1;
+VirtualWire _wire(_eth0, _wire1);
+WireHost _host(_wire1, ADDR(10,0,0,1), ADDR(255,255,255,0), _pool, "bench");
+
+static uint _errors;
+
+
+// Lease store in RAM, as in battery backed SRAM
+class MemLeaseStore: public LeaseStore {
+public:
+	Dhcp::SavedLease _lease;
+	bool _valid;
+
+	MemLeaseStore() : _valid(false) { }
+
+	bool Load(void* buf, uint len) {
+		if (!_valid || len > sizeof _lease)
+			return false;
+		memcpy(buf, &_lease, len);
+		return true;
+	}
+
+	bool Save(const void* buf, uint len) {
+		if (len > sizeof _lease)
+			return false;
+		memcpy(&_lease, buf, len);
+		_valid = true;
+		return true;
+	}
+};
+
+static MemLeaseStore _store;
+
+
+static void Error(const char* what)
+{
+	console("leasetest: %s", what);
+	++_errors;
+}
+
+
+// Lease DHCP has settled on, or INADDR_ANY
+static in_addr_t Leased()
+{
+	Mutex::Scoped L(_dhcp0._lock);
+	return _dhcp0._state == Dhcp::STATE_CONFIGURED ? _dhcp0._lease : INADDR_ANY;
+}
+
+
+// Echo datagrams off the WireHost from start until one comes back,
+// and wait for a lease.  With discover set the lease must come from a
+// DHCPDISCOVER sent since the counters were at before.  Returns false
+// on timeout.
+static bool Settle(const char* name, const Time& start, const NetStats::Dhcp& before,
+				   bool discover)
+{
+	const Time deadline = start + Time::FromSec(TIMEOUT);
+
+	UdpCoreSocket* s = _udp0.Create();
+	assert(s);
+	if (!s->Bind(NetAddr(INADDR_ANY, PORT))) {
+		Error("can't bind");
+		return false;
+	}
+
+	Time echoed, leased;
+	in_addr_t lease = INADDR_ANY;
+	while ((echoed == Time() || leased == Time()) && Time::Now() < deadline) {
+		if (echoed == Time()) {
+			static const uint8_t ping[] = { 'p', 'i', 'n', 'g' };
+			s->SendTo(ping, sizeof ping, NetAddr(ADDR(10,0,0,1), WireHost::ECHO_PORT));
+
+			uint8_t buf[sizeof ping];
+			uint len = sizeof buf;
+			NetAddr from;
+			if (s->RecvFrom(buf, len, from))
+				echoed = Time::Now();
+		}
+
+		if (leased == Time() && (lease = Leased()) != INADDR_ANY &&
+			(!discover || _netstats.dhcp.out_discovers != before.out_discovers))
+			leased = Time::Now();
+
+		Thread::Delay(ECHO_MSEC * 1000);
+	}
+
+	s->Close();
+
+	const NetStats::Dhcp& after = _netstats.dhcp;
+	const NetAddr addr(lease, 0);
+	console("leasetest: %s: first packet %u ms, lease %a in %u ms; %u discovers, "
+			"%u requests, %u acks, %u naks", name,
+			echoed != Time() ? (uint)(echoed - start).GetMsec() : 0, &addr,
+			leased != Time() ? (uint)(leased - start).GetMsec() : 0,
+			after.out_discovers - before.out_discovers, after.out_requests - before.out_requests,
+			after.in_acks - before.in_acks, after.in_naks - before.in_naks);
+
+	if (echoed == Time() || leased == Time()) {
+		console("leasetest: %s: timed out", name);
+		++_errors;
+		return false;
+	}
+
+	if (lease != _pool)
+		Error("lease not from the server");
+
+	if (!_store._valid || _store._lease.addr != lease ||
+		Dhcp::LeaseCrc(_store._lease) != _store._lease.crc)
+		Error("lease not saved");
+
+	return true;
+}
+
+
+// Reboot DHCP, as when the link comes back, and wait for it to settle
+static bool Reboot(const char* name, bool discover)
+{
+	const NetStats::Dhcp before = _netstats.dhcp;
+	const Time start = Time::Now();
+	_dhcp0.Reset();
+
+	if (!Settle(name, start, before, discover))
+		return false;
+
+	const NetStats::Dhcp& after = _netstats.dhcp;
+	if ((after.out_discovers != before.out_discovers) != discover) {
+		console("leasetest: %s: %s", name, discover ? "no DHCPDISCOVER" : "DHCPDISCOVER sent");
+		++_errors;
+	}
+
+	return true;
+}
+
+
+int	main ()
+{
+	_dhcp0.SetLeaseStore(&_store);
+
+	_wire.Start();
+	_host.Start(host_mac);
+
+	// Nothing saved
+	const NetStats::Dhcp before = _netstats.dhcp;
+	Thread::Create("net", NetThread, NULL, NET_THREAD_STACK);
+	if (!Settle("no lease", Time::Now(), before, true))
+		return 1;
+
+	// Saved by the first boot, and confirmed by the server
+	Reboot("saved lease", false);
+
+	// A lease the server never gave: NAK, then DHCPDISCOVER
+	_store._lease.addr = ADDR(10,0,0,105);
+	_store._lease.crc = Dhcp::LeaseCrc(_store._lease);
+	const uint32_t naks = _netstats.dhcp.in_naks;
+	Reboot("NAK", true);
+	if (_netstats.dhcp.in_naks == naks)
+		Error("no NAK");
+
+	// Someone else answers the probe for it: DHCPDISCOVER once it's over
+	_host.SetConflict(_pool);
+	Reboot("probe conflict", true);
+	_host.SetConflict(INADDR_ANY);
+
+	console("leasetest: %u errors", _errors);
+
+	return _errors ? 1 : 0;
+}
@@ -0,0 +1,145 @@
+// Copyright (c) 2018-2021 Jan Brittenson
+// See LICENSE for details.
+
+// Wait queue test and lock handoff benchmark, used for dev.  Checks
+// that an EventObject wakes its waiters one at a time, highest
+// priority and then earliest first, and that a CondVar broadcast
+// wakes all of them in the same order.  Then times how long it takes
+// a higher priority thread blocked on a Mutex to get it after the
+// holder unlocks.  Results go to the console, and the exit status
+// is nonzero on errors.
+
+#include "enetkit.h"
+#include "thread.h"
+#include "mutex.h"
+
+
+enum {
+	ROUNDS = 1000,				// Mutex handoffs timed
+	PRIO = 100					// Main's priority
+};
+
+struct Waiter {
+	uint id;
+	uint8_t prio;
+};
+
+// Started in this order; should wake as 1, 2, 3, 0
+static const Waiter _waiter[] = { { 0, 10 }, { 1, 30 }, { 2, 30 }, { 3, 20 } };
+static const uint _expect[] = { 1, 2, 3, 0 };
+
+enum { WAITERS = sizeof _waiter / sizeof _waiter[0] };
+
+static EventObject _ev;
+static Mutex _mtx;
+static CondVar _cv;
+
+static uint _order[WAITERS * 2];
+static uint _woken;
+
+
+static void* WaitTest(void* arg)
+{
+	const Waiter& w = *(const Waiter*)arg;
+
+	Thread::SetPriority(w.prio);
+
+	_ev.Wait();
+	_order[_woken++] = w.id;
+
+	{
+		Mutex::Scoped L(_mtx);
+		_cv.Wait(_mtx);
+	}
+	_order[_woken++] = w.id;
+
+	for (;;)
+		Thread::Sleep(Time::InfTim);
+}
+
+
+static uint TestWake()
+{
+	for (uint i = 0; i < WAITERS; ++i)
+		Thread::Create("waiter", WaitTest, (void*)&_waiter[i]);
+
+	// Let them all get to waiting
+	Thread::Delay(10000);
+
+	for (uint i = 0; i < WAITERS; ++i) {
+		_ev.Set();
+		Thread::Delay(1000);
+	}
+
+	Thread::Delay(10000);
+	_cv.Broadcast();
+	Thread::Delay(10000);
+
+	uint errors = 0;
+	for (uint i = 0; i < WAITERS * 2; ++i) {
+		if (i >= _woken || _order[i] != _expect[i % WAITERS]) {
+			console("lockbench: wake %u: got %d, expected %u", i, i < _woken ? int(_order[i]) : -1,
+					_expect[i % WAITERS]);
+			++errors;
+		}
+	}
+
+	console("lockbench: %u woken, %u errors", _woken, errors);
+	return errors;
+}
+
+
+static Mutex _handoff;
+static EventObject _go;
+static Time _unlocked;
+static uint64_t _total, _worst;
+
+
+// Blocks on the mutex, and measures from the unlock to getting it
+static void* Contender(void*)
+{
+	Thread::SetPriority(PRIO + 1);
+
+	for (;;) {
+		_go.Wait();
+
+		_handoff.Lock();
+		const uint64_t usec = (Time::Now() - _unlocked).GetUsec();
+		_handoff.Unlock();
+
+		_total += usec;
+		_worst = max(_worst, usec);
+	}
+}
+
+
+static void BenchHandoff()
+{
+	Thread::Create("contender", Contender, NULL);
+
+	Thread::Delay(10000);
+
+	for (uint n = 0; n < ROUNDS; ++n) {
+		_handoff.Lock();
+
+		// Contender preempts, and blocks on the mutex
+		_go.Set();
+
+		_unlocked = Time::Now();
+		_handoff.Unlock();
+	}
+
+	console("lockbench: %u handoffs, %u usec avg, %u usec max", ROUNDS,
+			uint(_total / ROUNDS), uint(_worst));
+}
+
+
+int	main ()
+{
+	Thread::SetPriority(PRIO);
+
+	const uint errors = TestWake();
+	BenchHandoff();
+
+	return errors ? 1 : 0;
+}
@@ -0,0 +1,225 @@
+// Copyright (c) 2018-2021 Jan Brittenson
+// See LICENSE for details.
+
+// Receive polling benchmark, used for dev.  Sends eth0 datagrams from
+// the far end of a VirtualWire, in bursts larger than NET_RX_BUDGET,
+// at a steady rate, and in a trickle, once with the network thread
+// polling after busy passes and once with polling off.  Reports the
+// driver's rx_interrupts against rx_packets for each, which is what
+// polling is meant to bring down under load and leave alone without
+// it.  Like tcpbench it needs a board with devices/vether.h, as
+// projects/host has.  Results go to the console, and the exit status
+// is nonzero if frames are lost or polling takes more interrupts than
+// none under bursts.
+
+#include "enetkit.h"
+#include "network.h"
+#include "ip.h"
+#include "udp.h"
+#include "thread.h"
+#include "netstats.h"
+#include "devices/vether.h"
+
+
+static const uint8_t peer_mac[6] = { 0x02, 0, 0, 0, 0, 1 };
+
+#define ADDR(a,b,c,d) Htonl(((a) << 24) | ((b) << 16) | ((c) << 8) | (d))
+
+// Wire model.  Bursts arrive all at once, as from a switch port that
+// has queued them, rather than spread out by the wire's bit rate.
+// They're sent as one, too; see Run().
+static const VirtualWire::Params wire_params = {
+	100,						// latency, usec
+	0,							// jitter, usec
+	0,							// loss, per 1000
+	0,							// reorder, per 1000
+	0							// bandwidth, bit/s
+};
+
+// Load patterns
+struct Load {
+	const char* name;
+	uint frames;				// Per send
+	uint usec;					// Between sends
+	uint sends;
+};
+
+static const Load loads[] = {
+	{ "bursts", 64, 5000, 200 },
+	{ "steady", 1, 250, 4000 },
+	{ "trickle", 1, 10000, 100 }
+};
+
+enum {
+	PORT = 6000,
+	PAYLOAD = 64,
+	FRAME_LEN = sizeof (Ethernet::Frame)
+};
+
+Ethernet _wire1;
+VirtualWire _wire(_eth0, _wire1);
+
+static const in_addr_t _addr = ADDR(10,0,0,2);
+static const in_addr_t _peer = ADDR(10,0,0,1);
+
+static EventObject _peer_event;
+static volatile uint _received;
+static uint _errors;
+
+
+// Reads datagrams as they come
+static void* Sink(void* arg)
+{
+	UdpCoreSocket* s = (UdpCoreSocket*)arg;
+	uint8_t buf[PAYLOAD];
+
+	// Above main, so it keeps up with the wire
+	Thread::SetPriority(NET_THREAD_PRIORITY - 1);
+
+	for (;;) {
+		uint len = sizeof buf;
+		NetAddr from;
+		if (s->RecvFrom(buf, len, from))
+			++_received;
+		else
+			s->Wait(Time::FromSec(1));
+	}
+
+	return NULL;
+}
+
+
+// Datagram n to the sink
+static bool Send(uint n)
+{
+	const uint len = FRAME_LEN + sizeof (Iph) + sizeof (Udph) + PAYLOAD;
+
+	IOBuffer* buf = BufferPool::AllocTx(2 + len);
+	if (!buf)
+		return false;
+
+	buf->SetHeadroom(2);
+	buf->SetSize(len);
+	memset(*buf + 0, 0, len);
+
+	Ethernet::Frame* f = (Ethernet::Frame*)(*buf + 0);
+	memcpy(f->dst, _eth0.GetMacAddr(), 6);
+	memcpy(f->src, peer_mac, 6);
+	f->et = Htons(uint16_t(ETHERTYPE_IP));
+
+	Iph& iph = *(Iph*)(*buf + FRAME_LEN);
+	iph.SetHLen(sizeof iph);
+	iph.len = Htons(sizeof iph + sizeof (Udph) + PAYLOAD);
+	iph.id = Htons(n);
+	iph.ttl = 64;
+	iph.proto = IPPROTO_UDP;
+	iph.source = _peer;
+	iph.dest = _addr;
+	iph.SetCsum();
+
+	Udph& udph = *(Udph*)iph.GetTransport();
+	udph.sport = Htons(PORT);
+	udph.dport = Htons(PORT);
+	udph.len = Htons(sizeof udph + PAYLOAD);
+	udph.SetCsum(iph);
+
+	return _wire1.Send(buf);
+}
+
+
+// Throw away what eth0 sent back
+static void Drain()
+{
+	IOBuffer* buf;
+	uint16_t et;
+	do {
+		while ((buf = _wire1.Receive(et)))
+			BufferPool::FreeBuffer(buf);
+	} while (!_wire1.EnableRxInterrupt());
+}
+
+
+static void Run(const Load& load, bool poll)
+{
+	_net_rx_poll_hold = poll ? NET_RX_POLL_HOLD : 0;
+
+	const NetStats::Link before = _eth0.GetStats();
+	const uint received = _received;
+	uint sent = 0;
+
+	Time next = Time::Now();
+	for (uint i = 0; i < load.sends; ++i) {
+		// Above the wire and the network thread, or they take each
+		// frame of a burst as it's sent, where the build is slow
+		Thread::SetPriority(NET_THREAD_PRIORITY + 2);
+		for (uint j = 0; j < load.frames; ++j, ++sent)
+			if (!Send(sent))
+				++_errors;
+		Thread::SetPriority(THREAD_DEFAULT_PRIORITY);
+		Drain();
+
+		next += Time::FromUsec(load.usec);
+		const Time now = Time::Now();
+		if (next > now)
+			Thread::Delay((next - now).GetUsec());
+	}
+
+	// Let the last ones in
+	Thread::Delay(100000);
+
+	const NetStats::Link& after = _eth0.GetStats();
+	const uint32_t packets = after.rx_packets - before.rx_packets;
+	const uint32_t interrupts = after.rx_interrupts - before.rx_interrupts;
+
+	console("pollbench: %s, polling %s: %u frames, %u rx_packets, %u rx_interrupts, "
+			"%u.%02u frames per interrupt, %u received", load.name, poll ? "on" : "off",
+			sent, packets, interrupts, interrupts ? packets / interrupts : 0,
+			interrupts ? packets * 100 / interrupts % 100 : 0, _received - received);
+
+	if (packets != sent || _received - received != sent) {
+		console("pollbench: %s: frames lost", load.name);
+		++_errors;
+	}
+}
+
+
+int	main ()
+{
+	_wire1.Initialize(peer_mac);
+	_wire1.SetEventObject(&_peer_event);
+	_wire.SetParams(wire_params);
+	_wire.Start();
+
+	Thread::Create("net", NetThread, NULL, NET_THREAD_STACK);
+	Thread::Delay(100000);
+
+	_ip0.AddInterface(_eth0, _addr, ADDR(255,255,255,0));
+
+	UdpCoreSocket* s = _udp0.Create();
+	assert(s);
+	s->SetEventMask(CoreSocket::EVENT_READABLE);
+	if (!s->Bind(NetAddr(INADDR_ANY, PORT))) {
+		console("pollbench: can't bind %u", PORT);
+		return 1;
+	}
+
+	Thread::Create("sink", Sink, s);
+
+	for (uint i = 0; i < sizeof loads / sizeof loads[0]; ++i) {
+		const uint32_t before = _eth0.GetStats().rx_interrupts;
+		Run(loads[i], true);
+		const uint32_t on = _eth0.GetStats().rx_interrupts - before;
+		Run(loads[i], false);
+		const uint32_t off = _eth0.GetStats().rx_interrupts - before - on;
+
+		// Bursts are what polling is for
+		if (loads[i].frames > NET_RX_BUDGET && on > off) {
+			console("pollbench: %s: %u interrupts polling, %u not", loads[i].name, on, off);
+			++_errors;
+		}
+	}
+
+	console("pollbench: %u errors", _errors);
+
+	return _errors ? 1 : 0;
+}
@@ -0,0 +1,203 @@
+// Copyright (c) 2018-2021 Jan Brittenson
+// See LICENSE for details.
+
+// Buffer pool benchmark, used for dev.  Times BufferPool allocs and
+// frees the way the network thread makes them: single small buffers,
+// as for ACKs and ARP, and receive buffers in bulk, as a driver
+// restocks its ring.  Each is timed through the network thread's
+// cache and through the pool, as any other thread would get them.
+// The network thread isn't started; setting _net_thread stands in
+// for it.  Then a stress run shares buffers between the cached side
+// and a thread that uses the pool, with references taken and dropped
+// on both sides, and checks that every buffer comes back.  That
+// thread wakes from a timer every so often, above the cached side, so
+// it cuts in wherever the timer interrupt finds it.  Results go to the console, and the exit status
+// is nonzero on any error.
+
+#include "enetkit.h"
+#include "network.h"
+#include "thread.h"
+#include "ring.h"
+#include "devices/vether.h"
+
+
+enum {
+	OPS = 1000000,				// Buffers per timed run
+	BULK = 16,					// Receive buffers per restock
+	STRESS_SECS = 2,
+	HANDOFF = 64,				// Buffers in flight to the other thread
+	OTHER_OPS = 50				// Per wakeup of the other thread
+};
+
+static Ring<HANDOFF, IOBuffer*> _handoff;
+static volatile bool _stop;
+static volatile uint _stress_ops;
+static uint _errors;
+
+
+static void Error(const char* what)
+{
+	console("poolbench: %s", what);
+	++_errors;
+}
+
+
+// Small buffers, one at a time
+static void Small()
+{
+	for (uint i = 0; i < OPS; ++i) {
+		IOBuffer* buf = BufferPool::AllocTx(64);
+		if (!buf) {
+			Error("AllocTx failed");
+			return;
+		}
+		BufferPool::FreeBuffer(buf);
+	}
+}
+
+
+// Receive buffers, BULK at a time
+static void Bulk()
+{
+	IOBuffer* bufs[BULK];
+	for (uint i = 0; i < OPS / BULK; ++i) {
+		const uint n = BufferPool::AllocRx(bufs, BULK);
+		if (n != BULK)
+			Error("AllocRx failed");
+		BufferPool::FreeBuffers(bufs, n);
+	}
+}
+
+
+static void Run(const char* name, void (*func)(), bool cache)
+{
+	_net_thread = cache ? Thread::GetCurThread() : NULL;
+
+	const Time start = Time::Now();
+	func();
+	const uint64_t usec = (Time::Now() - start).GetUsec();
+
+	_net_thread = NULL;
+
+	console("poolbench: %s, %s: %u nsec per buffer", name, cache ? "cached" : "pool",
+			uint(usec * 1000 / OPS));
+}
+
+
+// Other side of the stress run: drops the references handed to it,
+// and allocates and frees through the pool on its own
+static void* Other(void*)
+{
+	Thread::SetPriority(THREAD_DEFAULT_PRIORITY + 1);
+
+	uint n = 0;
+	while (!_stop) {
+		if (n % OTHER_OPS == 0)
+			Thread::Delay(500);
+
+		IOBuffer* buf = NULL;
+		{
+			Thread::IPL G(IPL_NETWORK);
+			if (!_handoff.Empty())
+				buf = _handoff.PopFront();
+		}
+		if (buf)
+			BufferPool::FreeBuffer(buf);
+
+		IOBuffer* own = BufferPool::AllocTx(++n % 2 ? 64 : 1024);
+		if (own) {
+			if (n % 3 == 0) {
+				own->Retain();
+				BufferPool::FreeBuffer(own);
+			}
+			BufferPool::FreeBuffer(own);
+		}
+		++_stress_ops;
+	}
+
+	return NULL;
+}
+
+
+// The cached side allocates, hands a second reference to every other
+// buffer to Other(), and drops its own
+static void Stress()
+{
+	_net_thread = Thread::GetCurThread();
+	Thread::Create("other", Other, NULL);
+
+	// Threads start at priority 0; let it raise itself
+	Thread::Delay(1000);
+
+	const Time end = Time::Now() + Time::FromSec(STRESS_SECS);
+	uint ops = 0;
+	IOBuffer* bufs[BULK];
+	while (Time::Now() < end) {
+		for (uint i = 0; i < 100; ++i, ++ops) {
+			IOBuffer* buf = BufferPool::AllocTx(i % 4 ? 64 : 300);
+			if (!buf)
+				continue;
+
+			if (i & 1) {
+				Thread::IPL G(IPL_NETWORK);
+				if (_handoff.Headroom()) {
+					buf->Retain();
+					_handoff.PushBack(buf);
+				}
+			}
+			BufferPool::FreeBuffer(buf);
+
+			if (i % 10 == 0)
+				BufferPool::FreeBuffers(bufs, BufferPool::AllocRx(bufs, BULK));
+		}
+	}
+
+	_stop = true;
+	Thread::Delay(10000);
+
+	// Drop what's left in flight
+	while (!_handoff.Empty())
+		BufferPool::FreeBuffer(_handoff.PopFront());
+
+	_net_thread = NULL;
+
+	console("poolbench: stress: %u ops cached, %u on the other thread", ops, _stress_ops);
+}
+
+
+int	main ()
+{
+	BufferPool::Initialize(NetworkDataSize(), _eth0.GetBufSize());
+
+	Run("small", Small, false);
+	Run("small", Small, true);
+	Run("bulk", Bulk, false);
+	Run("bulk", Bulk, true);
+
+	Stress();
+
+	for (uint cls = 0; cls < BufferPool::NUM_CLASSES; ++cls) {
+		const BufferPool::ClassStats st = BufferPool::GetStats(cls);
+		console("poolbench: class %u: size %u total %u inuse %u high %u failed %u", cls,
+				st.size, st.total, st.inuse, st.high, st.failed);
+		if (st.inuse)
+			Error("buffers not returned");
+	}
+
+	// All of them, cached or not, can still be had
+	_net_thread = Thread::GetCurThread();
+	const uint cls = BufferPool::NUM_CLASSES - 1;
+	const uint total = BufferPool::GetStats(cls).total;
+	IOBuffer** bufs = new IOBuffer*[total];
+	uint n = 0;
+	while (n < total && (bufs[n] = BufferPool::AllocRx()))
+		++n;
+	if (n != total)
+		Error("receive buffers lost");
+	BufferPool::FreeBuffers(bufs, n);
+	delete[] bufs;
+
+	console("poolbench: %u errors", _errors);
+
+	return _errors ? 1 : 0;
+}
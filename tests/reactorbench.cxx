@@ -0,0 +1,305 @@
+// Copyright (c) 2018-2021 Jan Brittenson
+// See LICENSE for details.
+
+// Reactor test and benchmark, used for dev.  Binds SOCKETS UDP
+// sockets on a loopback VirtualWire on eth0 and adds them to one
+// Reactor.  First checks that events on a socket are merged until
+// reported, that a socket already readable when added is reported,
+// that Modify() and Remove() drop undelivered events, that Wait()
+// hands out ready sockets in order a batch at a time and times out,
+// that a Reactor destroyed with sources watched lets go of them, and
+// that a ReactorEvent set by another thread wakes it.  Then times
+// Wait() with a few sockets ready out of more and more registered,
+// against scanning every socket for events.  Wait() cost should stay
+// flat as sockets are added.  Like tcpbench it needs a board with
+// devices/vether.h, as projects/host has.  The exit status is nonzero
+// on any error.
+
+#include "enetkit.h"
+#include "network.h"
+#include "ip.h"
+#include "udp.h"
+#include "thread.h"
+#include "reactor.h"
+#include "netstats.h"
+#include "devices/vether.h"
+
+
+#define ADDR(a,b,c,d) Htonl(((a) << 24) | ((b) << 16) | ((c) << 8) | (d))
+
+enum {
+	SOCKETS = 512,				// Sockets bound
+	PORT = 7000,				// Port of socket 0
+	BATCH = 64,					// Ready sockets taken per Wait()
+	ROUNDS = 100000				// Rounds per measurement
+};
+
+static const uint registered[] = { 16, 128, 512 };
+static const uint ready[] = { 1, 16 };
+
+VirtualWire _wire(_eth0, _eth0);
+
+static const in_addr_t _addr = ADDR(10,0,0,2);
+
+static UdpCoreSocket* _tx;
+static UdpCoreSocket* _sock[SOCKETS];
+static Reactor _reactor;
+static ReactorEvent _wakeup;
+static uint _errors;
+
+
+static void* Cookie(uint i)
+{
+	return (void*)(uintptr_t)i;
+}
+
+
+static void Error(const char* what)
+{
+	console("reactorbench: %s", what);
+	++_errors;
+}
+
+
+// Send n datagrams to socket i, and wait for the net thread to queue
+// them
+static void Send(uint i, uint n = 1)
+{
+	static const uint8_t data[16] = { 0 };
+	const uint32_t before = _netstats.udp.in_datagrams;
+
+	for (uint j = 0; j < n; ++j)
+		_errors += !_tx->SendTo(data, sizeof data, NetAddr(_addr, PORT + i));
+
+	for (uint j = 0; j < 1000 && _netstats.udp.in_datagrams - before < n; ++j)
+		Thread::Delay(1000);
+}
+
+
+static void Drain(uint i)
+{
+	uint8_t data[64];
+	uint len = sizeof data;
+	NetAddr from;
+
+	while (_sock[i]->RecvFrom(data, len, from))
+		len = sizeof data;
+}
+
+
+// Take what's ready, waiting msec at most
+static uint Take(Reactor::Ready* r, uint num, uint msec = 10)
+{
+	return _reactor.Wait(r, num, Time::Now() + Time::FromMsec(msec));
+}
+
+
+// Ready list holds exactly socket i
+static bool Only(uint i)
+{
+	Reactor::Ready r[BATCH];
+	const uint n = Take(r, BATCH);
+
+	return n == 1 && r[0].source == _sock[i] && r[0].cookie == Cookie(i) &&
+		r[0].events == CoreSocket::EVENT_READABLE;
+}
+
+
+static void* Waker(void*)
+{
+	Thread::Delay(20000);
+	_wakeup.Set(1);
+	return NULL;
+}
+
+
+static void Check()
+{
+	Reactor::Ready r[BATCH];
+
+	// Datagrams to one socket merge into one report
+	Send(5, 3);
+	if (!Only(5))
+		Error("events not merged");
+	Drain(5);
+	if (Take(r, BATCH))
+		Error("reported twice");
+
+	// Events before Add() are reported by it
+	_reactor.Remove(_sock[7]);
+	Send(7);
+	if (Take(r, BATCH))
+		Error("removed socket reported");
+	_reactor.Add(_sock[7], CoreSocket::EVENT_READABLE, Cookie(7));
+	if (!Only(7))
+		Error("readable socket not reported when added");
+	Drain(7);
+
+	// No interest drops pending events
+	Send(9);
+	_reactor.Modify(_sock[9], 0);
+	if (Take(r, BATCH))
+		Error("event reported with no interest");
+	_reactor.Modify(_sock[9], CoreSocket::EVENT_READABLE);
+	Drain(9);
+	Send(9);
+	if (!Only(9))
+		Error("event lost after Modify()");
+	Drain(9);
+
+	// A batch at a time, in order
+	for (uint i = 0; i < 10; ++i)
+		Send(20 + i);
+	for (uint i = 0; i < 10; i += 4) {
+		const uint n = Take(r, 4);
+		if (n != min<uint>(4, 10 - i)) {
+			Error("wrong batch size");
+			break;
+		}
+		for (uint j = 0; j < n; ++j)
+			if (r[j].cookie != Cookie(20 + i + j))
+				Error("out of order");
+	}
+	for (uint i = 0; i < 10; ++i)
+		Drain(20 + i);
+
+	// Times out
+	const Time start = Time::Now();
+	if (Take(r, BATCH, 20) || Time::Now() - start < Time::FromMsec(20))
+		Error("timeout");
+
+	// A Reactor destroyed with sources watched, one of them ready,
+	// lets go of them
+	{
+		ReactorEvent ready, idle;
+		Reactor* gone = new Reactor;
+		gone->Add(&ready, 1);
+		gone->Add(&idle, 1);
+		ready.Set(1);
+		delete gone;
+
+		ready.Set(1);
+		idle.Set(1);
+		if (!_reactor.Add(&ready, 1, Cookie(SOCKETS)) || !_reactor.Add(&idle, 1, Cookie(SOCKETS)))
+			Error("source still watched by destroyed reactor");
+		if (Take(r, BATCH) != 2)
+			Error("source not reported after destroyed reactor");
+
+		// Removed by their destructors
+	}
+	if (Take(r, BATCH))
+		Error("destroyed source reported");
+
+	// Woken from another thread
+	_reactor.Add(&_wakeup, 1, Cookie(SOCKETS));
+	Thread::Create("waker", Waker, NULL);
+	const uint n = Take(r, BATCH, 1000);
+	if (n != 1 || r[0].source != &_wakeup || r[0].cookie != Cookie(SOCKETS) || r[0].events != 1)
+		Error("ReactorEvent not reported");
+	_reactor.Remove(&_wakeup);
+}
+
+
+// Nsec per round of k sockets out of those registered becoming
+// readable and being found with Wait(), then cleared as a drained
+// socket would be.  Readiness is posted the way Udp does it, without
+// the datagrams, to time only the Reactor.
+static uint TimeWait(uint registered, uint k)
+{
+	Reactor::Ready r[BATCH];
+	uint found = 0;
+	const Time start = Time::Now();
+
+	for (uint round = 0; round < ROUNDS; ++round) {
+		for (uint i = 0; i < k; ++i)
+			_sock[(round * 7 + i * 31) % registered]->AddEvent(CoreSocket::EVENT_READABLE);
+
+		const uint n = _reactor.Wait(r, BATCH, Time::Now());
+		for (uint i = 0; i < n; ++i)
+			_sock[(uintptr_t)r[i].cookie]->ClearEvent(CoreSocket::EVENT_READABLE);
+		found += n;
+	}
+
+	const uint64_t usec = (Time::Now() - start).GetUsec();
+	if (found != ROUNDS * k)
+		++_errors;
+
+	return usec * 1000 / ROUNDS;
+}
+
+
+// The same, found by looking at every registered socket, the way to
+// do without a Reactor
+static uint TimeScan(uint registered, uint k)
+{
+	uint found = 0;
+	const Time start = Time::Now();
+
+	for (uint round = 0; round < ROUNDS; ++round) {
+		for (uint i = 0; i < k; ++i)
+			_sock[(round * 7 + i * 31) % registered]->AddEvent(CoreSocket::EVENT_READABLE);
+
+		for (uint i = 0; i < registered; ++i) {
+			if (_sock[i]->GetEvent() & CoreSocket::EVENT_READABLE) {
+				_sock[i]->ClearEvent(CoreSocket::EVENT_READABLE);
+				++found;
+			}
+		}
+	}
+
+	const uint64_t usec = (Time::Now() - start).GetUsec();
+	if (found != ROUNDS * k)
+		++_errors;
+
+	return usec * 1000 / ROUNDS;
+}
+
+
+int	main ()
+{
+	_wire.Start();
+
+	Thread::Create("net", NetThread, NULL, NET_THREAD_STACK);
+	Thread::Delay(100000);
+
+	_ip0.AddInterface(_eth0, _addr, ADDR(255,255,255,0));
+
+	_tx = _udp0.Create();
+	assert(_tx);
+
+	for (uint i = 0; i < SOCKETS; ++i) {
+		_sock[i] = _udp0.Create();
+		assert(_sock[i]);
+		if (!_sock[i]->Bind(NetAddr(INADDR_ANY, PORT + i))) {
+			console("reactorbench: can't bind %u", PORT + i);
+			return 1;
+		}
+		_reactor.Add(_sock[i], CoreSocket::EVENT_READABLE, Cookie(i));
+	}
+
+	Check();
+	console("reactorbench: %u errors", _errors);
+
+	for (uint i = 0; i < sizeof registered / sizeof registered[0]; ++i) {
+		const uint n = registered[i];
+
+		// Scan with nothing watched, then watch only the first n
+		for (uint j = 0; j < SOCKETS; ++j)
+			_reactor.Remove(_sock[j]);
+
+		uint scan[sizeof ready / sizeof ready[0]];
+		for (uint j = 0; j < sizeof ready / sizeof ready[0]; ++j)
+			scan[j] = TimeScan(n, ready[j]);
+
+		for (uint j = 0; j < n; ++j)
+			_reactor.Add(_sock[j], CoreSocket::EVENT_READABLE, Cookie(j));
+
+		for (uint j = 0; j < sizeof ready / sizeof ready[0]; ++j)
+			console("reactorbench: %u registered, %u ready: Wait %u nsec, scan %u nsec",
+					n, ready[j], TimeWait(n, ready[j]), scan[j]);
+	}
+
+	console("reactorbench: %u errors", _errors);
+
+	return _errors ? 1 : 0;
+}
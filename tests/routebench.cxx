@@ -0,0 +1,159 @@
+// Copyright (c) 2018-2021 Jan Brittenson
+// See LICENSE for details.
+
+// Route lookup benchmark, used for dev.  Talks to 10, 100 and then
+// 1000 on-link peers, which the WireHost answers ARP for, so Ip holds
+// a host route per peer.  Then times lookups with GetPathMtu(), for
+// peers and for on-link addresses without a host route, which fall
+// through to the interface route, and times SendTo() to the peers in
+// turn.  Lookup cost should stay flat as peers are added.  Needs a
+// board with devices/vether.h, as projects/host has.  The exit status
+// is nonzero if a send fails or a peer isn't resolved.
+
+#include "enetkit.h"
+#include "network.h"
+#include "ip.h"
+#include "udp.h"
+#include "thread.h"
+#include "devices/vether.h"
+#include "devices/wirehost.h"
+
+
+static const uint8_t host_mac[6] = { 0x02, 0, 0, 0, 0, 1 };
+
+#define ADDR(a,b,c,d) Htonl(((a) << 24) | ((b) << 16) | ((c) << 8) | (d))
+
+enum {
+	LOOKUPS = 100000,			// Lookups per run
+	SENDS = 10000,				// Datagrams per run
+	BATCH = 50,					// New peers between pauses
+	PORT = 9					// WireHost drops these
+};
+
+static const uint peers[] = { 10, 100, 1000 };
+
+Ethernet _wire1;
+VirtualWire _wire(_eth0, _wire1);
+WireHost _host(_wire1, ADDR(10,0,0,1), ADDR(255,255,0,0), ADDR(10,0,0,100), "bench");
+
+static uint _errors;
+
+
+// Address of peer i
+static in_addr_t Peer(uint i)
+{
+	return ADDR(10, 0, 1 + i / 250, 1 + i % 250);
+}
+
+
+// On-link address i with no host route
+static in_addr_t Stranger(uint i)
+{
+	return ADDR(10, 0, 200, 1 + i % 250);
+}
+
+
+// Talk to peers from up to n, pausing now and then for ARP.  A ping
+// only goes out once its peer is resolved, and the WireHost drops it,
+// so returns true once it has dropped them all.  Ip retries an ARP
+// request that goes unanswered after a second.
+static bool AddPeers(UdpCoreSocket* s, uint from, uint n)
+{
+	static const uint8_t ping[16] = { 0 };
+	const uint dropped = _host.GetStats().dropped;
+
+	for (uint i = from; i < n; ++i) {
+		_errors += !s->SendTo(ping, sizeof ping, NetAddr(Peer(i), PORT));
+		if (i % BATCH == BATCH - 1)
+			Thread::Delay(10000);
+	}
+
+	for (uint i = 0; i < 50 && _host.GetStats().dropped - dropped < n - from; ++i)
+		Thread::Delay(100000);
+
+	return _host.GetStats().dropped - dropped >= n - from;
+}
+
+
+// Nsec per GetPathMtu() lookup of addr(0) through addr(n-1), in
+// scattered order
+static uint Lookups(in_addr_t (*addr)(uint), uint n)
+{
+	uint sum = 0;
+	const Time start = Time::Now();
+
+	for (uint i = 0; i < LOOKUPS; ++i)
+		sum += _ip0.GetPathMtu(addr(i * 7919 % n));
+
+	const uint64_t usec = (Time::Now() - start).GetUsec();
+	if (sum != LOOKUPS * IP_MTU)
+		++_errors;
+
+	return usec * 1000 / LOOKUPS;
+}
+
+
+// Nsec per datagram sent to peers 0 through n-1 in turn
+static uint Sends(UdpCoreSocket* s, uint n)
+{
+	static const uint8_t data[16] = { 0 };
+	const Time start = Time::Now();
+
+	for (uint i = 0; i < SENDS; ++i)
+		_errors += !s->SendTo(data, sizeof data, NetAddr(Peer(i * 7919 % n), PORT));
+
+	return (Time::Now() - start).GetUsec() * 1000 / SENDS;
+}
+
+
+int	main ()
+{
+	_wire.Start();
+	_host.SetProxyArp(true);
+	_host.Start(host_mac);
+
+	Thread::Create("net", NetThread, NULL, NET_THREAD_STACK);
+
+	// Static address; then let the net thread set up the buffer pool
+	_ip0.AddInterface(_eth0, ADDR(10,0,0,2), ADDR(255,255,0,0));
+	Thread::Delay(100000);
+
+	// Room for every peer, resolved without throttling
+	_ip0.SetHostRouteLimit(1024);
+	_ip0.SetRateLimit(Ip::LIMIT_ARP, 10000, 1000);
+
+	UdpCoreSocket* s = _udp0.Create();
+	assert(s);
+	s->Bind(NetAddr(INADDR_ANY, 5000));
+
+	static const VirtualWire::Params ideal = { 0, 0, 0, 0, 0 };
+	static const VirtualWire::Params sink = { 0, 0, 1000, 0, 0 };
+
+	uint have = 0;
+	for (uint i = 0; i < sizeof peers / sizeof peers[0]; ++i) {
+		const uint n = peers[i];
+
+		_wire.SetParams(VirtualWire::A_TO_B, ideal);
+		const bool resolved = AddPeers(s, have, n);
+		have = n;
+
+		if (!resolved) {
+			console("routebench: %u peers not all resolved", n);
+			return 1;
+		}
+
+		// Measure the stack, not the wire
+		_wire.SetParams(VirtualWire::A_TO_B, sink);
+
+		const uint hit = Lookups(Peer, n);
+		const uint miss = Lookups(Stranger, 250);
+		const uint send = Sends(s, n);
+
+		console("routebench: %u host routes: lookup %u nsec, on-link miss %u nsec, "
+				"send %u nsec", n, hit, miss, send);
+	}
+
+	console("routebench: %u errors", _errors);
+
+	return _errors ? 1 : 0;
+}
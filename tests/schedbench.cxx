@@ -0,0 +1,70 @@
+// Copyright (c) 2018-2021 Jan Brittenson
+// See LICENSE for details.
+
+// Scheduler benchmark, used for dev.  Times scheduling decisions
+// (Thread::Rotate) with 4, 16 and 64 threads besides main, half of
+// them runnable below main's priority and half in timed sleeps.
+// Build it against the old and new scheduler to compare.  Results go
+// to the console.
+
+#include "enetkit.h"
+#include "thread.h"
+
+
+enum {
+	STACK = 512,				// Stack per thread
+	DECISIONS = 10000,			// Rotate() calls per run
+	PRIO = 250					// Main's priority while timing
+};
+
+static const uint _counts[] = { 4, 16, 64 };
+
+
+// Runnable at priority 0
+static void* Spinner(void*)
+{
+	for (;;)
+		;
+}
+
+
+// In timed wait, nearly always
+static void* Sleeper(void*)
+{
+	for (;;)
+		Thread::Sleep(Time::Now() + Time::FromSec(3600));
+}
+
+
+static void Bench(uint threads)
+{
+	const Time start = Time::Now();
+	for (uint n = 0; n < DECISIONS; ++n)
+		Thread::Rotate(false);
+
+	const uint64_t usec = (Time::Now() - start).GetUsec();
+	console("schedbench: %u threads: %u decisions in %u usec, %u nsec each",
+			threads, DECISIONS, uint(usec), uint(usec * 1000 / DECISIONS));
+}
+
+
+int	main ()
+{
+	Thread::SetPriority(PRIO);
+
+	uint threads = 0;
+	for (uint i = 0; i < sizeof _counts / sizeof _counts[0]; ++i) {
+		while (threads < _counts[i]) {
+			Thread::Create("bench", (threads & 1) ? Sleeper : Spinner, NULL, STACK);
+			++threads;
+		}
+
+		// The spinners round robin, so give them all a quantum for
+		// the sleepers to get to their sleep
+		Thread::Delay(2000000);
+
+		Bench(threads);
+	}
+
+	return 0;
+}
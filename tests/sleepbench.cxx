@@ -0,0 +1,90 @@
+// Copyright (c) 2018-2021 Jan Brittenson
+// See LICENSE for details.
+
+// Timed wait test and benchmark, used for dev.  Starts many sleepers
+// with random deadlines, checks they wake in deadline order, and
+// reports how late they woke and how long starting them took.
+// Results go to the console, and the exit status is nonzero on
+// errors.
+
+#include "enetkit.h"
+#include "thread.h"
+#include "util.h"
+
+
+enum {
+	SLEEPERS = 64,
+	STACK = 512,
+	SPREAD = 500,				// Deadlines within this many msec
+	PRIO = 100					// Sleepers preempt main
+};
+
+struct Sleeper {
+	Time deadline;
+	Time woke;
+	uint seq;					// Order woken, from 1
+};
+
+static Sleeper _sleeper[SLEEPERS];
+static uint _woken;
+
+
+static void* SleepUntil(void* arg)
+{
+	Sleeper& s = *(Sleeper*)arg;
+
+	Thread::SetPriority(PRIO);
+	Thread::Sleep(s.deadline);
+
+	s.woke = Time::Now();
+	s.seq = ++_woken;
+
+	for (;;)
+		Thread::Sleep(Time::InfTim);
+}
+
+
+int	main ()
+{
+	const Time base = Time::Now() + Time::FromMsec(100);
+	const Time start = Time::Now();
+
+	for (uint i = 0; i < SLEEPERS; ++i) {
+		_sleeper[i].deadline = base + Time::FromUsec(Util::Random<uint32_t>() % (SPREAD * 1000));
+		Thread::Create("sleeper", SleepUntil, &_sleeper[i], STACK);
+	}
+
+	console("sleepbench: %u sleepers started in %u usec", SLEEPERS,
+			uint((Time::Now() - start).GetUsec()));
+
+	Thread::Sleep(base + Time::FromMsec(SPREAD + 100));
+
+	// In order of waking, deadlines should never go back
+	Sleeper* order[SLEEPERS] = { };
+	for (uint i = 0; i < SLEEPERS; ++i)
+		if (_sleeper[i].seq)
+			order[_sleeper[i].seq - 1] = &_sleeper[i];
+
+	uint errors = 0;
+	uint64_t total = 0, worst = 0;
+	for (uint i = 0; i < SLEEPERS; ++i) {
+		if (!order[i]) {
+			console("sleepbench: wake %u missing", i + 1);
+			++errors;
+			continue;
+		}
+		if (i && order[i - 1] && order[i]->deadline < order[i - 1]->deadline) {
+			console("sleepbench: wake %u out of order", i + 1);
+			++errors;
+		}
+
+		const uint64_t late = (order[i]->woke - order[i]->deadline).GetUsec();
+		total += late;
+		worst = max(worst, late);
+	}
+
+	console("sleepbench: %u woken, %u errors, late %u usec avg, %u usec max",
+			_woken, errors, uint(total / SLEEPERS), uint(worst));
+
+	return errors ? 1 : 0;
+}
@@ -0,0 +1,164 @@
+// Copyright (c) 2018-2021 Jan Brittenson
+// See LICENSE for details.
+
+// SpscRing stress test and benchmark, used for dev.  One side of the
+// ring runs on an OS thread of its own (HostStartThread()), the other
+// on the main thread, so they really run at the same time.  The
+// stress runs push a counting sequence with a random mix of single
+// and bulk pushes and pops, first with the OS thread producing, then
+// consuming, and check that it comes out whole and in order.  The
+// benchmark times transfers at a few bulk sizes.  Host only.  Results
+// go to the console, and the exit status is nonzero on any error.
+
+#include "enetkit.h"
+#include "spscring.h"
+#include "thread.h"
+
+
+enum {
+	RING_SIZE = 1024,
+	STRESS = 2000000,			// Items per stress run
+	BENCH = 4000000,			// Items per timed run
+	MAX_BULK = 24				// Largest bulk push or pop
+};
+
+static const uint bulks[] = { 1, 4, 16 };
+
+static SpscRing<RING_SIZE, uint32_t> _ring;
+
+// The OS thread side's settings and result
+static uint _count;
+static uint _bulk;				// 0 for a random mix
+static uint _errors;
+
+
+// Small LCG, one per side; the kernel's random source isn't for the
+// OS thread
+static inline uint Next(uint32_t& seed)
+{
+	seed = seed * 1664525 + 1013904223;
+	return seed >> 16;
+}
+
+
+// Items per call: bulk, or for a mix 1 (single item API) to MAX_BULK
+static inline uint Amount(uint bulk, uint32_t& seed)
+{
+	return bulk ? bulk : Next(seed) % (MAX_BULK + 1);
+}
+
+
+// Push 0 through count-1.  Amount 0 uses the single item API.
+static void Produce(uint count, uint bulk, uint32_t seed)
+{
+	uint32_t v[MAX_BULK];
+	uint32_t next = 0;
+
+	while (next < count) {
+		const uint n = min<uint>(Amount(bulk, seed), count - next);
+		uint pushed;
+		if (!n) {
+			pushed = _ring.PushBack(next);
+		} else {
+			for (uint i = 0; i < n; ++i)
+				v[i] = next + i;
+			pushed = _ring.PushBack(v, n);
+		}
+
+		// Full; the consumer may be waiting for the CPU
+		if (!pushed)
+			HostYield();
+		next += pushed;
+	}
+}
+
+
+// Pop count items, checking they're 0 through count-1.  Returns the
+// number of errors.
+static uint Consume(uint count, uint bulk, uint32_t seed)
+{
+	uint32_t v[MAX_BULK];
+	uint32_t next = 0;
+	uint errors = 0;
+
+	while (next < count) {
+		const uint n = min<uint>(Amount(bulk, seed), count - next);
+		uint got;
+		if (!n) {
+			if (!_ring.Empty() && _ring.Front() != next)
+				++errors;
+
+			got = _ring.PopFront(v[0]);
+		} else {
+			got = _ring.PopFront(v, n);
+		}
+
+		if (!got)
+			HostYield();
+		for (uint i = 0; i < got; ++i)
+			errors += v[i] != next++;
+	}
+
+	return errors;
+}
+
+
+static void Producer(void*)
+{
+	Produce(_count, _bulk, 1);
+}
+
+
+static void Consumer(void*)
+{
+	_errors = Consume(_count, _bulk, 2);
+}
+
+
+// Run one side on an OS thread and the other here.  Returns usec
+// taken and adds to errors.
+static uint32_t Run(bool os_produces, uint count, uint bulk, uint& errors)
+{
+	_count = count;
+	_bulk = bulk;
+	_errors = 0;
+
+	const Time start = Time::Now();
+
+	HostThread* t = HostStartThread(os_produces ? Producer : Consumer, NULL);
+	if (!t) {
+		++errors;
+		return 0;
+	}
+
+	if (os_produces)
+		errors += Consume(count, bulk, 3);
+	else
+		Produce(count, bulk, 4);
+
+	HostJoinThread(t);
+	errors += _errors;
+
+	if (!_ring.Empty())
+		++errors;
+
+	return (Time::Now() - start).GetUsec();
+}
+
+
+int	main ()
+{
+	uint errors = 0;
+
+	Run(true, STRESS, 0, errors);
+	Run(false, STRESS, 0, errors);
+	console("spscbench: %u items each way, %u errors", STRESS, errors);
+
+	for (uint i = 0; i < sizeof bulks / sizeof bulks[0]; ++i) {
+		const uint32_t usec = Run(true, BENCH, bulks[i], errors);
+		console("spscbench: bulk %u: %u items in %u msec, %u nsec each",
+				bulks[i], BENCH, usec / 1000, usec ? uint(uint64_t(usec) * 1000 / BENCH) : 0);
+	}
+
+	return errors ? 1 : 0;
+}
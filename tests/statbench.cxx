@@ -0,0 +1,176 @@
+// Copyright (c) 2018-2021 Jan Brittenson
+// See LICENSE for details.
+
+// Network counter overhead benchmark, used for dev.  Times
+// NetStats::Inc() against a plain increment, then sends datagrams to
+// ourselves over a loopback VirtualWire on eth0 and counts how many
+// counters each one bumps, from snapshots taken before and after.
+// Together they give the share of the time per datagram spent
+// counting.  Also checks that the snapshot adds up: every datagram
+// counted once going out and once coming in, at each layer.  Like
+// tcpbench it needs a board with devices/vether.h, as projects/host
+// has.  Results go to the console, and the exit status is nonzero if
+// the counts are off.
+
+#include "enetkit.h"
+#include "network.h"
+#include "ip.h"
+#include "udp.h"
+#include "thread.h"
+#include "netstats.h"
+#include "devices/vether.h"
+
+
+#define ADDR(a,b,c,d) Htonl(((a) << 24) | ((b) << 16) | ((c) << 8) | (d))
+
+enum {
+	INCS = 10000000,			// Increments timed
+	BURST = 64,					// Datagrams sent before draining
+	ROUNDS = 300,				// Bursts timed
+	PORT = 6000
+};
+
+VirtualWire _wire(_eth0, _eth0);
+
+static const in_addr_t _addr = ADDR(10,0,0,2);
+
+static uint32_t _counter;
+static volatile uint32_t _plain;
+static uint _errors;
+
+
+// Counters bumped between two snapshots.  The byte counts go up by
+// more than one per bump, so they're left out.
+static uint32_t Bumps(const NetStats::Snapshot& a, const NetStats::Snapshot& b)
+{
+	uint32_t n = 0;
+
+	const uint32_t* p = (const uint32_t*)&a.counters;
+	const uint32_t* q = (const uint32_t*)&b.counters;
+	for (uint i = 0; i < sizeof a.counters / sizeof (uint32_t); ++i)
+		n += q[i] - p[i];
+
+	n += b.link.rx_packets - a.link.rx_packets;
+	n += b.link.rx_interrupts - a.link.rx_interrupts;
+	n += b.link.tx_packets - a.link.tx_packets;
+
+	return n;
+}
+
+
+// Nsec per increment, atomic and plain
+static void TimeInc(uint& atomic, uint& plain)
+{
+	Time start = Time::Now();
+	for (uint i = 0; i < INCS; ++i)
+		NetStats::Inc(_counter);
+	atomic = (Time::Now() - start).GetUsec() * 1000 / (INCS / 1000);
+
+	start = Time::Now();
+	for (uint i = 0; i < INCS; ++i)
+		++_plain;
+	plain = (Time::Now() - start).GetUsec() * 1000 / (INCS / 1000);
+
+	if (_counter != INCS || _plain != INCS)
+		++_errors;
+}
+
+
+// Send and receive a burst.  Returns false if it doesn't all arrive.
+// Polls without sleeping: the wire and net threads run above main,
+// so the time taken is theirs and ours, not time spent idle.
+static bool Burst(UdpCoreSocket* tx, UdpCoreSocket* rx)
+{
+	static const uint8_t data[64] = { 0 };
+	const NetAddr dest(_addr, PORT);
+
+	for (uint i = 0; i < BURST; ++i)
+		_errors += !tx->SendTo(data, sizeof data, dest);
+
+	const Time deadline = Time::Now() + Time::FromSec(1);
+	uint got = 0;
+	while (got < BURST && Time::Now() < deadline) {
+		uint8_t buf[sizeof data];
+		uint len = sizeof buf;
+		NetAddr from;
+		got += rx->RecvFrom(buf, len, from);
+	}
+
+	return got == BURST;
+}
+
+
+static void Expect(const char* what, uint32_t before, uint32_t after, uint32_t n)
+{
+	if (after - before != n) {
+		console("statbench: %s went up by %u, not %u", what, after - before, n);
+		++_errors;
+	}
+}
+
+
+int	main ()
+{
+	_wire.Start();
+
+	Thread::Create("net", NetThread, NULL, NET_THREAD_STACK);
+	Thread::Delay(100000);
+
+	_ip0.AddInterface(_eth0, _addr, ADDR(255,255,255,0));
+
+	UdpCoreSocket* tx = _udp0.Create();
+	UdpCoreSocket* rx = _udp0.Create();
+	assert(tx && rx);
+	if (!rx->Bind(NetAddr(INADDR_ANY, PORT))) {
+		console("statbench: can't bind %u", PORT);
+		return 1;
+	}
+
+	uint atomic, plain;
+	TimeInc(atomic, plain);
+	console("statbench: increment: NetStats::Inc() %u psec, plain %u psec", atomic, plain);
+
+	// Once for ARP and the like, before measuring
+	if (!Burst(tx, rx)) {
+		console("statbench: burst lost");
+		return 1;
+	}
+
+	NetStats::Snapshot before, after;
+	NetStats::GetSnapshot(before);
+
+	const Time start = Time::Now();
+	for (uint i = 0; i < ROUNDS; ++i) {
+		if (!Burst(tx, rx)) {
+			console("statbench: burst lost");
+			return 1;
+		}
+	}
+	const uint64_t usec = (Time::Now() - start).GetUsec();
+
+	NetStats::GetSnapshot(after);
+
+	const uint n = ROUNDS * BURST;
+	Expect("udp.out_datagrams", before.counters.udp.out_datagrams, after.counters.udp.out_datagrams, n);
+	Expect("udp.in_datagrams", before.counters.udp.in_datagrams, after.counters.udp.in_datagrams, n);
+	Expect("ip.out_requests", before.counters.ip.out_requests, after.counters.ip.out_requests, n);
+	Expect("ip.in_delivers", before.counters.ip.in_delivers, after.counters.ip.in_delivers, n);
+	Expect("eth0.tx_packets", before.link.tx_packets, after.link.tx_packets, n);
+	Expect("eth0.rx_packets", before.link.rx_packets, after.link.rx_packets, n);
+
+	Vector<uchar> text;
+	NetStats::Format(text, after);
+	if (text.Empty())
+		++_errors;
+
+	// Time per datagram, and the share of it spent counting
+	const uint bumps = Bumps(before, after);
+	const uint nsec = usec * 1000 / n;
+	const uint count_nsec = uint64_t(bumps) * atomic / n / 1000;
+	console("statbench: %u nsec per datagram, %u counter bumps (%u.%u per datagram), "
+			"%u nsec of it counting", nsec, bumps, bumps / n, bumps * 10 / n % 10, count_nsec);
+
+	console("statbench: %u errors", _errors);
+
+	return _errors ? 1 : 0;
+}
@@ -0,0 +1,220 @@
+// Copyright (c) 2018-2021 Jan Brittenson
+// See LICENSE for details.
+
+// TCP goodput benchmark, used for dev.  Sends a stream to itself over
+// a loopback VirtualWire on eth0, once per loss rate, and reports the
+// goodput and what it took in retransmits.  The loss model drops
+// frames in both directions, ACKs included.  Like udpbench it needs a
+// board with devices/vether.h in place of its SoC Ethernet driver, as
+// projects/host has.  Results go to the console, and the exit status
+// is nonzero if a transfer fails or arrives damaged, or if no loss
+// was ever recovered from by fast retransmit.
+
+#include "enetkit.h"
+#include "network.h"
+#include "ip.h"
+#include "tcp.h"
+#include "thread.h"
+#include "netstats.h"
+#include "devices/vether.h"
+
+
+// Wire model; loss is set per run
+static const VirtualWire::Params wire_params = {
+	500,						// latency, usec
+	0,							// jitter, usec
+	0,							// loss, per 1000
+	0,							// reorder, per 1000
+	100000000					// bandwidth, bit/s
+};
+
+// Loss rates, per 1000
+static const uint losses[] = { 0, 5, 10, 20, 50 };
+
+#define ADDR(a,b,c,d) Htonl(((a) << 24) | ((b) << 16) | ((c) << 8) | (d))
+
+enum {
+	BYTES = 1024*1024,			// Stream length per run
+	PORT = 5001,
+	TIMEOUT = 60				// Seconds a run may take
+};
+
+VirtualWire _wire(_eth0, _eth0);
+
+static const in_addr_t _addr = ADDR(10,0,0,2);
+
+// Set by the sink at the end of each stream
+static EventObject _done;
+static uint _received;
+static bool _damaged;
+static uint _fast_retrans;
+static Time _end;
+
+
+// Stream bytes are their offset, mod 251, so a slip shows
+static inline uint8_t Pattern(uint pos)
+{
+	return pos % 251;
+}
+
+
+// Accepts one connection at a time and reads it to EOF
+static void* Sink(void* arg)
+{
+	TcpCoreSocket* ls = (TcpCoreSocket*)arg;
+	uint8_t buf[1024];
+
+	for (;;) {
+		NetAddr from;
+		CoreSocket* s;
+		while (!(s = ls->Accept(from)))
+			ls->Wait(Time::FromSec(1));
+
+		s->SetEventMask(CoreSocket::EVENT_READABLE | CoreSocket::EVENT_CLOSE |
+						CoreSocket::EVENT_ERROR);
+
+		uint pos = 0;
+		bool damaged = false;
+		for (;;) {
+			uint n = sizeof buf;
+			if (!s->Recv(buf, n)) {
+				if (s->GetError() != ERR_NO_DATA)
+					break;
+				s->Wait(Time::FromSec(1));
+				continue;
+			}
+			if (!n)
+				break;			// EOF
+
+			for (uint i = 0; i < n; ++i)
+				damaged |= buf[i] != Pattern(pos + i);
+			pos += n;
+		}
+
+		_end = Time::Now();
+		_received = pos;
+		_damaged = damaged;
+		s->Close();
+		_done.Set();
+	}
+
+	return NULL;
+}
+
+
+// Stream BYTES to the sink, sized by the send space
+static bool Source(TcpCoreSocket* s, const Time& deadline)
+{
+	uint8_t buf[1024];
+	uint pos = 0;
+
+	while (pos < BYTES) {
+		if (Time::Now() > deadline)
+			return false;
+
+		const uint space = s->GetSendSpace();
+		if (!space) {
+			if (s->GetState() != TcpCoreSocket::STATE_ESTABLISHED &&
+				s->GetState() != TcpCoreSocket::STATE_CLOSE_WAIT)
+				return false;
+
+			s->Wait(Time::FromMsec(100));
+			continue;
+		}
+
+		const uint n = min<uint>(min<uint>(space, sizeof buf), BYTES - pos);
+		for (uint i = 0; i < n; ++i)
+			buf[i] = Pattern(pos + i);
+
+		if (!s->Send(buf, n))
+			return false;
+		pos += n;
+	}
+
+	return true;
+}
+
+
+static bool Run(uint loss)
+{
+	VirtualWire::Params p = wire_params;
+	p.loss = loss;
+	_wire.SetParams(p);
+
+	const NetStats::Tcp before = _netstats.tcp;
+	const VirtualWire::Stats wire_before = _wire.GetStats(VirtualWire::B_TO_A);
+
+	TcpCoreSocket* s = _tcp0.Create();
+	assert(s);
+	s->SetEventMask(CoreSocket::EVENT_CONNECT | CoreSocket::EVENT_WRITEABLE |
+					CoreSocket::EVENT_ERROR | CoreSocket::EVENT_CLOSE);
+
+	const Time start = Time::Now();
+	const Time deadline = start + Time::FromSec(TIMEOUT);
+
+	_received = 0;
+	_damaged = false;
+
+	bool ok = s->Connect(NetAddr(_addr, PORT));
+	while (ok && s->GetState() == TcpCoreSocket::STATE_SYN_SENT && Time::Now() < deadline)
+		s->Wait(Time::FromMsec(100));
+
+	ok = ok && Source(s, deadline);
+	s->Close();
+
+	// The sink sees EOF once everything has been acked
+	ok = ok && _done.Wait(deadline - Time::Now());
+	ok = ok && _received == BYTES && !_damaged;
+
+	const NetStats::Tcp& after = _netstats.tcp;
+	const VirtualWire::Stats wire_after = _wire.GetStats(VirtualWire::B_TO_A);
+	const uint64_t usec = ok ? (_end - start).GetUsec() : 0;
+
+	console("tcpbench: loss %u/1000: %u bytes in %u msec, %u kbit/s%s",
+			loss, _received, uint(usec / 1000), usec ? uint(uint64_t(BYTES) * 8000 / usec) : 0,
+			ok ? "" : ", FAILED");
+	console("tcpbench: loss %u/1000: %u segs, %u retransmitted, %u fast retransmits, "
+			"%u timeouts; %u frames, %u lost",
+			loss, after.out_segs - before.out_segs, after.retrans_segs - before.retrans_segs,
+			after.fast_retrans - before.fast_retrans, after.timeouts - before.timeouts,
+			wire_after.frames - wire_before.frames, wire_after.lost - wire_before.lost);
+
+	_fast_retrans += after.fast_retrans - before.fast_retrans;
+
+	return ok;
+}
+
+
+int	main ()
+{
+	_wire.Start();
+
+	Thread::Create("net", NetThread, NULL, NET_THREAD_STACK);
+	Thread::Delay(100000);
+
+	_ip0.AddInterface(_eth0, _addr, ADDR(255,255,255,0));
+
+	TcpCoreSocket* ls = _tcp0.Create();
+	assert(ls);
+	ls->SetEventMask(CoreSocket::EVENT_READABLE);
+	if (!ls->Bind(NetAddr(INADDR_ANY, PORT)) || !ls->Listen(4)) {
+		console("tcpbench: can't listen on %u", PORT);
+		return 1;
+	}
+
+	Thread::Create("sink", Sink, ls);
+
+	uint failed = 0;
+	for (uint i = 0; i < sizeof losses / sizeof losses[0]; ++i)
+		if (!Run(losses[i]))
+			++failed;
+
+	// The buffers leave room for enough in flight to draw three
+	// duplicate ACKs, so not every loss should need a timeout
+	if (!_fast_retrans) {
+		console("tcpbench: no fast retransmits");
+		++failed;
+	}
+
+	return failed ? 1 : 0;
+}
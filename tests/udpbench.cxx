@@ -0,0 +1,147 @@
+// Copyright (c) 2018-2021 Jan Brittenson
+// See LICENSE for details.
+
+// UDP latency and throughput benchmark, used for dev.  Runs the stack
+// over a VirtualWire against a WireHost echoing datagrams, so it
+// needs a board that includes devices/vether.h in place of its SoC
+// Ethernet driver and adds vether.cxx and wirehost.cxx to its
+// HARDWARE_SRCS, as projects/host does.  Results go to the console.
+
+#include "enetkit.h"
+#include "network.h"
+#include "ip.h"
+#include "udp.h"
+#include "thread.h"
+#include "netstats.h"
+#include "devices/vether.h"
+#include "devices/wirehost.h"
+
+
+// Wire model; adjust to taste
+static const VirtualWire::Params wire_params = {
+	100,						// latency, usec
+	0,							// jitter, usec
+	0,							// loss, per 1000
+	0,							// reorder, per 1000
+	100000000					// bandwidth, bit/s
+};
+
+static const uint8_t host_mac[6] = { 0x02, 0, 0, 0, 0, 1 };
+
+#define ADDR(a,b,c,d) Htonl(((a) << 24) | ((b) << 16) | ((c) << 8) | (d))
+
+enum {
+	PINGS = 200,				// Round trips per size
+	BULK = 2000,				// Datagrams per size for throughput
+	WINDOW = 8					// Datagrams in flight during bulk phase
+};
+
+static const uint sizes[] = { 16, 512, 1472 };
+
+Ethernet _wire1;
+VirtualWire _wire(_eth0, _wire1);
+WireHost _host(_wire1, ADDR(10,0,0,1), ADDR(255,255,255,0), ADDR(10,0,0,100), "bench");
+
+static uint8_t _payload[1472];
+
+
+// Round trip times for len byte datagrams
+static void Latency(UdpCoreSocket* s, uint len)
+{
+	uint32_t min_rtt = ~0U, max_rtt = 0;
+	uint64_t total = 0;
+	uint lost = 0;
+
+	for (uint i = 0; i < PINGS; ++i) {
+		const Time start = Time::Now();
+		s->Send(_payload, len);
+
+		uint n = sizeof _payload;
+		while (!s->Recv(_payload, n)) {
+			if (!s->Wait(Time::FromMsec(100)))
+				break;
+			n = sizeof _payload;
+		}
+
+		if (n != len) {
+			++lost;
+			continue;
+		}
+
+		const uint32_t rtt = (Time::Now() - start).GetUsec();
+		min_rtt = min(min_rtt, rtt);
+		max_rtt = max(max_rtt, rtt);
+		total += rtt;
+	}
+
+	const uint got = PINGS - lost;
+	console("udpbench: %u bytes: rtt min %u avg %u max %u usec, %u lost",
+			len, got ? min_rtt : 0, got ? uint(total / got) : 0, max_rtt, lost);
+}
+
+
+// Echoed payload per second, keeping WINDOW datagrams in flight
+static void Throughput(UdpCoreSocket* s, uint len)
+{
+	uint sent = 0, received = 0;
+	const Time start = Time::Now();
+
+	while (sent < BULK) {
+		while (sent < BULK && sent - received < WINDOW && s->Send(_payload, len))
+			++sent;
+
+		uint n = sizeof _payload;
+		if (s->Recv(_payload, n)) {
+			++received;
+			continue;
+		}
+
+		// Treat a datagram as lost after a quiet period
+		if (!s->Wait(Time::FromMsec(100)))
+			++received;
+	}
+
+	// Drain stragglers
+	uint n = sizeof _payload;
+	while (s->Wait(Time::FromMsec(100)))
+		while (s->Recv(_payload, n))
+			n = sizeof _payload;
+
+	const uint64_t usec = (Time::Now() - start).GetUsec();
+	const uint64_t bytes = uint64_t(BULK) * len;
+
+	console("udpbench: %u bytes: %u datagrams in %u msec, %u kbit/s",
+			len, BULK, uint(usec / 1000), usec ? uint(bytes * 8000 / usec) : 0);
+}
+
+
+int	main ()
+{
+	_wire.SetParams(wire_params);
+	_wire.Start();
+	_host.Start(host_mac);
+
+	Thread::Create("net", NetThread, NULL, NET_THREAD_STACK);
+
+	// Static address, to keep DHCP out of the measurement
+	_ip0.AddInterface(_eth0, ADDR(10,0,0,2), ADDR(255,255,255,0));
+
+	UdpCoreSocket* s = _udp0.Create();
+	assert(s);
+	s->SetEventMask(CoreSocket::EVENT_READABLE);
+	s->Connect(NetAddr(ADDR(10,0,0,1), WireHost::ECHO_PORT));
+
+	for (uint i = 0; i < sizeof sizes / sizeof sizes[0]; ++i) {
+		Latency(s, sizes[i]);
+		Throughput(s, sizes[i]);
+	}
+
+	const VirtualWire::Stats tx = _wire.GetStats(VirtualWire::A_TO_B);
+	const VirtualWire::Stats rx = _wire.GetStats(VirtualWire::B_TO_A);
+	console("udpbench: wire: %u/%u frames, %u/%u lost, %u/%u no buffers",
+			tx.frames, rx.frames, tx.lost, rx.lost, tx.nobufs, rx.nobufs);
+
+	NetStats::Dump();
+
+	return 0;
+}